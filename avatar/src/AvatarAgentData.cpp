@@ -0,0 +1,117 @@
+//
+//  AvatarAgentData.cpp
+//  avatar
+//
+//  Copyright (c) 2013 High Fidelity, Inc. All rights reserved.
+//
+
+#include <cstring>
+#include "AvatarAgentData.h"
+
+AvatarAgentData::AvatarAgentData() {
+    hasState = false;
+    pthread_mutex_init(&dataMutex, NULL);
+}
+
+AvatarAgentData::~AvatarAgentData() {
+    for (std::map<uint16_t, AvatarStateSender *>::iterator sender = avatarSenders.begin(); sender != avatarSenders.end(); sender++) {
+        delete sender->second;
+    }
+    
+    pthread_mutex_destroy(&dataMutex);
+}
+
+AvatarAgentData::AvatarAgentData(const AvatarAgentData &otherAgentData) {
+    // the streams start over, the receivers will take the first update against nothing
+    state = otherAgentData.state;
+    hasState = otherAgentData.hasState;
+    pthread_mutex_init(&dataMutex, NULL);
+}
+
+AvatarAgentData* AvatarAgentData::clone() const {
+    return new AvatarAgentData(*this);
+}
+
+void AvatarAgentData::parseData(void *data, int size) {
+    // the client's own state, as a delta or whole from clients that don't send deltas
+    unsigned char *packet = (unsigned char *)data;
+    AvatarState newState;
+    
+    if (packet[0] == AVATAR_UPDATE_PACKET_HEADER) {
+        if (!stateReceiver.decodeUpdate(packet, size, &newState)) {
+            return;
+        }
+    } else if (!decodeAvatarState(packet, size, &newState)) {
+        return;
+    }
+    
+    pthread_mutex_lock(&dataMutex);
+    state = newState;
+    hasState = true;
+    pthread_mutex_unlock(&dataMutex);
+}
+
+int AvatarAgentData::getReplyData(unsigned char *reply) {
+    return stateReceiver.encodeAcknowledgement(reply);
+}
+
+bool AvatarAgentData::getState(AvatarState *state) {
+    pthread_mutex_lock(&dataMutex);
+    bool hadState = hasState;
+    *state = this->state;
+    pthread_mutex_unlock(&dataMutex);
+    
+    return hadState;
+}
+
+int AvatarAgentData::encodeUpdateForAvatar(uint16_t agentId, unsigned char *packet,
+                                           const AvatarState *avatarState, float distance) {
+    // under the lock, so an ack for this avatar arriving on the receive thread waits for the update to be written
+    pthread_mutex_lock(&dataMutex);
+    
+    AvatarStateSender *&sender = avatarSenders[agentId];
+    
+    if (sender == NULL) {
+        sender = new AvatarStateSender();
+    }
+    
+    int updateBytes = sender->encodeUpdate(packet, avatarState, distance);
+    pthread_mutex_unlock(&dataMutex);
+    
+    return updateBytes;
+}
+
+void AvatarAgentData::acknowledgeAvatar(uint16_t agentId, const unsigned char *packet, int size) {
+    pthread_mutex_lock(&dataMutex);
+    
+    std::map<uint16_t, AvatarStateSender *>::iterator sender = avatarSenders.find(agentId);
+    
+    if (sender != avatarSenders.end()) {
+        sender->second->acknowledge(packet, size);
+    }
+    
+    pthread_mutex_unlock(&dataMutex);
+}
+
+void AvatarAgentData::pruneAvatarSenders(const std::vector<uint16_t> &agentIds) {
+    pthread_mutex_lock(&dataMutex);
+    
+    // both are in id order, so walk them together
+    std::vector<uint16_t>::const_iterator agentId = agentIds.begin();
+    std::map<uint16_t, AvatarStateSender *>::iterator sender = avatarSenders.begin();
+    
+    while (sender != avatarSenders.end()) {
+        while (agentId != agentIds.end() && *agentId < sender->first) {
+            agentId++;
+        }
+        
+        if (agentId == agentIds.end() || *agentId != sender->first) {
+            delete sender->second;
+            avatarSenders.erase(sender++);
+        } else {
+            sender++;
+        }
+    }
+    
+    pthread_mutex_unlock(&dataMutex);
+}
@@ -0,0 +1,51 @@
+//
+//  AvatarAgentData.h
+//  avatar
+//
+//  Copyright (c) 2013 High Fidelity, Inc. All rights reserved.
+//
+
+#ifndef __avatar__AvatarAgentData__
+#define __avatar__AvatarAgentData__
+
+#include <iostream>
+#include <map>
+#include <vector>
+#include <pthread.h>
+#include <AgentData.h>
+#include <AvatarReplication.h>
+
+// what the relay knows about one client, the state it last sent us
+// and where each of the other avatars stands in the stream of them we send it
+class AvatarAgentData : public AgentData {
+public:
+    AvatarAgentData();
+    ~AvatarAgentData();
+    AvatarAgentData(const AvatarAgentData &otherAgentData);
+    
+    void parseData(void *data, int size);
+    int getReplyData(unsigned char *reply);
+    AvatarAgentData* clone() const;
+    
+    // false until the client has sent us its state
+    bool getState(AvatarState *state);
+    
+    // the next update in the stream of the avatar with this agent id to this client, made on first use
+    // returns its bytes, 0 if none is due
+    int encodeUpdateForAvatar(uint16_t agentId, unsigned char *packet, const AvatarState *avatarState, float distance);
+    
+    // an ack from this client for the avatar with this agent id
+    void acknowledgeAvatar(uint16_t agentId, const unsigned char *packet, int size);
+    
+    // drops the streams of avatars that aren't in agentIds, which must be sorted
+    void pruneAvatarSenders(const std::vector<uint16_t> &agentIds);
+private:
+    AvatarStateReceiver stateReceiver;
+    AvatarState state;
+    bool hasState;
+    
+    std::map<uint16_t, AvatarStateSender *> avatarSenders;
+    pthread_mutex_t dataMutex;
+};
+
+#endif /* defined(__avatar__AvatarAgentData__) */
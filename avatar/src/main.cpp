@@ -0,0 +1,298 @@
+//
+//  main.cpp
+//  avatar
+//
+//  Copyright (c) 2013 High Fidelity, Inc. All rights reserved.
+//
+
+#include <iostream>
+#include <math.h>
+#include <string.h>
+#include <stdio.h>
+#include <pthread.h>
+#include <signal.h>
+#include <vector>
+#include <algorithm>
+#include <AgentList.h>
+#include <SharedUtil.h>
+#include <EventLoop.h>
+#include <TickScheduler.h>
+#include <AvatarReplication.h>
+#include "AvatarAgentData.h"
+
+#ifdef _WIN32
+#include "Syssocket.h"
+#include "Systime.h"
+#else
+#include <sys/time.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#endif
+
+// each client sends its state to the relay once, the relay sends each client the other avatars
+// a delta against what it last acked, less often the further they are from it, packed several to a datagram
+const int AVATAR_RELAY_LISTEN_PORT = 40107;
+
+const int AVATAR_RELAY_INTERVAL_USECS = 1000000 / 60;
+
+// an avatar's latest state is all anyone wants, a late round just lets the ones it missed go
+const TickCatchUp AVATAR_RELAY_CATCH_UP = TICK_CATCH_UP_SKIP;
+const int AVATAR_RELAY_REPORT_TICKS = 300;
+
+// clients answer pings so we know which of their sockets to send to
+const int AVATAR_RELAY_PING_INTERVAL_USECS = 1000000;
+
+AgentList agentList('A', AVATAR_RELAY_LISTEN_PORT);
+EventLoop eventLoop;
+
+UDPDatagram *receivedDatagrams;
+
+void attachAvatarAgentDataToAgent(Agent *newAgent) {
+    if (newAgent->getLinkedData() == NULL) {
+        newAgent->setLinkedData(new AvatarAgentData());
+    }
+}
+
+void queueRelayDatagram(UDPDatagram *relayDatagrams, int *numRelayDatagrams, Agent *agent, int *sentBytes) {
+    UDPDatagram *relayDatagram = &relayDatagrams[*numRelayDatagrams];
+    
+    memcpy(&relayDatagram->address, agent->getActiveSocket(), sizeof(sockaddr_in));
+    *sentBytes += relayDatagram->byteLength;
+    
+    if (++*numRelayDatagrams == MAX_BATCH_DATAGRAMS) {
+        agentList.getAgentSocket().sendBatch(relayDatagrams, *numRelayDatagrams);
+        *numRelayDatagrams = 0;
+    }
+}
+
+void *relayAvatarsToClients(void *args) {
+    TickScheduler relayTicks("Avatar relay", AVATAR_RELAY_INTERVAL_USECS * (int64_t) 1000, AVATAR_RELAY_CATCH_UP);
+    int ticksSinceReport = 0;
+    
+    UDPDatagram *relayDatagrams = new UDPDatagram[MAX_BATCH_DATAGRAMS];
+    int numRelayDatagrams = 0;
+    
+    unsigned char updatePacket[MAX_AVATAR_UPDATE_PACKET_BYTES];
+    
+    std::vector<Agent *> avatars;
+    std::vector<AvatarState> avatarStates;
+    std::vector<uint16_t> avatarIds;
+    
+    int reportUpdates = 0;
+    int reportSkippedUpdates = 0;
+    int reportOutOfInterest = 0;
+    int reportDatagrams = 0;
+    int reportSentBytes = 0;
+    int reportListeners = 0;
+    
+    unsigned int readEpoch;
+    
+    while (!eventLoop.isStopped()) {
+        relayTicks.waitForNextTick();
+        
+        const AgentSnapshot *agents = agentList.beginSnapshotRead(&readEpoch);
+        
+        // take each avatar's state once for the round
+        avatars.clear();
+        avatarStates.clear();
+        avatarIds.clear();
+        
+        for (AgentSnapshot::const_iterator agent = agents->begin(); agent != agents->end(); agent++) {
+            AvatarState state;
+            
+            if ((*agent)->getType() == 'I' && (*agent)->getLinkedData() != NULL
+                && ((AvatarAgentData *)(*agent)->getLinkedData())->getState(&state)) {
+                avatars.push_back(*agent);
+                avatarStates.push_back(state);
+                avatarIds.push_back((*agent)->getAgentId());
+            }
+        }
+        
+        std::sort(avatarIds.begin(), avatarIds.end());
+        
+        for (int r = 0; r < avatars.size(); r++) {
+            Agent *listener = avatars[r];
+            
+            if (listener->getActiveSocket() == NULL) {
+                // hasn't answered a ping yet, we don't know where to send
+                continue;
+            }
+            
+            AvatarAgentData *listenerData = (AvatarAgentData *)listener->getLinkedData();
+            
+            // streams of avatars that have left go with them
+            listenerData->pruneAvatarSenders(avatarIds);
+            
+            UDPDatagram *relayDatagram = &relayDatagrams[numRelayDatagrams];
+            relayDatagram->data[0] = RELAYED_DATA_PACKET_HEADER;
+            relayDatagram->byteLength = 1;
+            
+            reportListeners++;
+            
+            for (int s = 0; s < avatars.size(); s++) {
+                if (s == r) {
+                    continue;
+                }
+                
+                float distance = sqrtf(powf(avatarStates[s].position[0] - avatarStates[r].position[0], 2)
+                                       + powf(avatarStates[s].position[1] - avatarStates[r].position[1], 2)
+                                       + powf(avatarStates[s].position[2] - avatarStates[r].position[2], 2));
+                
+                if (distance > AVATAR_INTEREST_RADIUS) {
+                    // the listener keeps it from the domain server's list, it just doesn't hear from it
+                    reportOutOfInterest++;
+                    continue;
+                }
+                
+                uint16_t avatarId = avatars[s]->getAgentId();
+                int updateBytes = listenerData->encodeUpdateForAvatar(avatarId, updatePacket, &avatarStates[s], distance);
+                
+                if (updateBytes == 0) {
+                    // too far away for an update this round, or nothing has changed
+                    reportSkippedUpdates++;
+                    continue;
+                }
+                
+                if (relayDatagram->byteLength + RELAYED_DATA_ENTRY_HEADER_BYTES + updateBytes > MAX_PACKET_SIZE) {
+                    queueRelayDatagram(relayDatagrams, &numRelayDatagrams, listener, &reportSentBytes);
+                    reportDatagrams++;
+                    
+                    relayDatagram = &relayDatagrams[numRelayDatagrams];
+                    relayDatagram->data[0] = RELAYED_DATA_PACKET_HEADER;
+                    relayDatagram->byteLength = 1;
+                }
+                
+                relayDatagram->byteLength += packRelayedData(relayDatagram->data + relayDatagram->byteLength,
+                                                             avatarId, updatePacket, updateBytes);
+                reportUpdates++;
+            }
+            
+            if (relayDatagram->byteLength > 1) {
+                queueRelayDatagram(relayDatagrams, &numRelayDatagrams, listener, &reportSentBytes);
+                reportDatagrams++;
+            }
+        }
+        
+        agentList.endSnapshotRead(readEpoch);
+        
+        if (numRelayDatagrams > 0) {
+            agentList.getAgentSocket().sendBatch(relayDatagrams, numRelayDatagrams);
+            numRelayDatagrams = 0;
+        }
+        
+        if (++ticksSinceReport == AVATAR_RELAY_REPORT_TICKS) {
+            float reportSecs = AVATAR_RELAY_REPORT_TICKS * AVATAR_RELAY_INTERVAL_USECS / 1000000.0f;
+            
+            printf("Relayed %d updates to %.1f listeners a round in %d datagrams, %.1f updates a datagram, "
+                   "%d skipped for distance or no change, %d out of interest, %.0f bytes/s out.\n",
+                   reportUpdates, reportListeners / (float) AVATAR_RELAY_REPORT_TICKS, reportDatagrams,
+                   reportDatagrams > 0 ? reportUpdates / (float) reportDatagrams : 0, reportSkippedUpdates,
+                   reportOutOfInterest, reportSentBytes / reportSecs);
+            relayTicks.printReport();
+            
+            ticksSinceReport = 0;
+            reportUpdates = 0;
+            reportSkippedUpdates = 0;
+            reportOutOfInterest = 0;
+            reportDatagrams = 0;
+            reportSentBytes = 0;
+            reportListeners = 0;
+        }
+    }
+    
+    delete[] relayDatagrams;
+    
+    pthread_exit(0);
+}
+
+// acks from a client for the avatars we relayed it, packed the way we packed the updates
+void acknowledgeRelayedAvatars(sockaddr *senderAddress, unsigned char *packetData, int dataBytes) {
+    unsigned int readEpoch;
+    agentList.beginSnapshotRead(&readEpoch);
+    
+    Agent *listener = agentList.agentForHandle(agentList.handleOfMatchingAgent(senderAddress));
+    
+    if (listener != NULL && listener->getLinkedData() != NULL) {
+        AvatarAgentData *listenerData = (AvatarAgentData *)listener->getLinkedData();
+        listener->setLastRecvTimeUsecs(usecTimestampNow());
+        
+        unsigned char *readPtr = packetData + 1;
+        unsigned char *endPtr = packetData + dataBytes;
+        
+        while (readPtr + RELAYED_DATA_ENTRY_HEADER_BYTES <= endPtr) {
+            uint16_t avatarId;
+            readPtr += unpackAgentId(readPtr, &avatarId);
+            int entryBytes = *readPtr++;
+            
+            if (readPtr + entryBytes > endPtr) {
+                break;
+            }
+            
+            listenerData->acknowledgeAvatar(avatarId, readPtr, entryBytes);
+            readPtr += entryBytes;
+        }
+    }
+    
+    agentList.endSnapshotRead(readEpoch);
+}
+
+// handle avatar state, acks and agent list traffic sent to us
+void receiveAvatarData(void *args) {
+    int numReceived = agentList.getAgentSocket().receiveBatch(receivedDatagrams, MAX_BATCH_DATAGRAMS);
+    
+    for (int d = 0; d < numReceived; d++) {
+        sockaddr *senderAddress = (sockaddr *) &receivedDatagrams[d].address;
+        unsigned char *packetData = receivedDatagrams[d].data;
+        
+        if (packetData[0] == RELAYED_DATA_PACKET_HEADER) {
+            acknowledgeRelayedAvatars(senderAddress, packetData, receivedDatagrams[d].byteLength);
+        } else {
+            // the client's own state comes through here, its ack goes straight back
+            agentList.processAgentData(senderAddress, packetData, receivedDatagrams[d].byteLength);
+        }
+    }
+}
+
+void pingClients(void *args) {
+    agentList.pingAgents();
+}
+
+void stopAvatarRelay(int signal) {
+    eventLoop.stop();
+}
+
+int main(int argc, const char * argv[])
+{
+    setvbuf(stdout, NULL, _IOLBF, 0);
+    
+    // Handle Local Domain testing with the --local command line
+    const char* local = "--local";
+    
+    if (cmdOptionExists(argc, argv, local)) {
+        printf("Local Domain MODE!\n");
+        int ip = getLocalAddress();
+        sprintf(DOMAIN_IP,"%d.%d.%d.%d", (ip & 0xFF), ((ip >> 8) & 0xFF),((ip >> 16) & 0xFF), ((ip >> 24) & 0xFF));
+    }
+    
+    agentList.linkedDataCreateCallback = &attachAvatarAgentDataToAgent;
+    agentList.addSilentAgentRemovalTimer(eventLoop);
+    agentList.addDomainServerCheckInTimer(eventLoop);
+    eventLoop.addTimer(AVATAR_RELAY_PING_INTERVAL_USECS, pingClients, NULL);
+    
+    pthread_t relayThread;
+    pthread_create(&relayThread, NULL, relayAvatarsToClients, NULL);
+    
+    receivedDatagrams = new UDPDatagram[MAX_BATCH_DATAGRAMS];
+    eventLoop.addSocket(agentList.getAgentSocket(), receiveAvatarData, NULL);
+    
+    signal(SIGINT, stopAvatarRelay);
+    signal(SIGTERM, stopAvatarRelay);
+    
+    eventLoop.run();
+    
+    pthread_join(relayThread, NULL);
+    
+    delete[] receivedDatagrams;
+    
+    return 0;
+}
@@ -0,0 +1,338 @@
+//
+//  main.cpp
+//  bench
+//
+//  Copyright (c) 2013 High Fidelity, Inc. All rights reserved.
+//
+
+#include <cstdlib>
+#include <cstring>
+#include <cstdio>
+#include <cmath>
+#include <iostream>
+#include <vector>
+#include <algorithm>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <SharedUtil.h>
+#include <UDPSocket.h>
+#include <AgentList.h>
+#include <AvatarState.h>
+#include <MessageFragments.h>
+
+const char BENCHMARK_AVATAR_STATE_OPTION[] = "--benchmarkAvatarState";
+
+void benchmarkAvatarState() {
+    // the head state packets the voxel server reads positions out of, in the binary and the old text form
+    const int BENCHMARK_AVATAR_STATES = 1000000;
+    
+    AvatarState state = { { 4.25f, 1.5f, 7.125f }, -12.5f, 173.25f, 3.0f, 812.0f, 640.0f, { 4.5f, 1.25f, 7.0f } };
+    AvatarState decodedState;
+    unsigned char packet[MAX_AVATAR_STATE_TEXT_BYTES];
+    float decodedPosition[3];
+    
+    for (int form = 0; form < 2; form++) {
+        bool binary = form == 0;
+        int packetBytes = 0;
+        
+        double startUsecs = usecTimestampNow();
+        
+        for (int i = 0; i < BENCHMARK_AVATAR_STATES; i++) {
+            state.position[0] = i * 0.001f;
+            packetBytes = binary ? encodeAvatarState(packet, &state) : encodeAvatarStateText((char *)packet, &state);
+        }
+        
+        double encodeUsecs = usecTimestampNow() - startUsecs;
+        startUsecs = usecTimestampNow();
+        
+        for (int i = 0; i < BENCHMARK_AVATAR_STATES; i++) {
+            decodeAvatarState(packet, packetBytes, &decodedState);
+        }
+        
+        double decodeUsecs = usecTimestampNow() - startUsecs;
+        startUsecs = usecTimestampNow();
+        
+        for (int i = 0; i < BENCHMARK_AVATAR_STATES; i++) {
+            decodeAvatarPosition(packet, packetBytes, decodedPosition);
+        }
+        
+        double positionUsecs = usecTimestampNow() - startUsecs;
+        
+        printf("%-6s %3d bytes, encode %6.1f ns, decode %6.1f ns, position only %6.1f ns, yaw %.3f decoded as %.3f\n",
+               binary ? "binary" : "text",
+               packetBytes,
+               encodeUsecs * 1000 / BENCHMARK_AVATAR_STATES,
+               decodeUsecs * 1000 / BENCHMARK_AVATAR_STATES,
+               positionUsecs * 1000 / BENCHMARK_AVATAR_STATES,
+               state.yaw, decodedState.yaw);
+    }
+}
+
+const char BENCHMARK_AGENT_LOOKUP_OPTION[] = "--benchmarkAgentLookup";
+
+void benchmarkAgentLookup() {
+    // finding the agent a packet came from, through the socket index and by scanning the agents
+    // for a matching active socket the way indexOfMatchingAgent used to, at a few list sizes
+    const int NUM_LIST_SIZES = 4;
+    const int LIST_SIZES[NUM_LIST_SIZES] = { 10, 100, 1000, 10000 };
+    const int BENCHMARK_LOOKUPS = 1000000;
+    
+    // scans cost the list size each, so they get fewer lookups as it grows
+    const int BENCHMARK_SCANNED_AGENTS = 100000000;
+    
+    for (int s = 0; s < NUM_LIST_SIZES; s++) {
+        int numAgents = LIST_SIZES[s];
+        AgentList agentList('B', 0);
+        std::vector<sockaddr_in> agentAddresses(numAgents);
+        
+        // the list announces every agent it adds
+        std::streambuf *coutBuffer = std::cout.rdbuf(NULL);
+        
+        for (int i = 0; i < numAgents; i++) {
+            agentAddresses[i].sin_family = AF_INET;
+            agentAddresses[i].sin_addr.s_addr = htonl(INADDR_LOOPBACK + (i >> 8));
+            agentAddresses[i].sin_port = htons(40000 + (i & 0xFF));
+            
+            agentList.addOrUpdateAgent((sockaddr *) &agentAddresses[i], (sockaddr *) &agentAddresses[i], 'I');
+        }
+        
+        std::cout.rdbuf(coutBuffer);
+        
+        // senders in an order the cache can't follow, the same for both
+        std::vector<int> senders(BENCHMARK_LOOKUPS);
+        
+        for (int l = 0; l < BENCHMARK_LOOKUPS; l++) {
+            senders[l] = randIntInRange(0, numAgents - 1);
+        }
+        
+        int found = 0;
+        double startUsecs = usecTimestampNow();
+        
+        for (int l = 0; l < BENCHMARK_LOOKUPS; l++) {
+            if (agentList.handleOfMatchingAgent((sockaddr *) &agentAddresses[senders[l]]) != NULL_AGENT_HANDLE) {
+                found++;
+            }
+        }
+        
+        double indexedUsecs = usecTimestampNow() - startUsecs;
+        
+        int scannedLookups = std::min(BENCHMARK_LOOKUPS, BENCHMARK_SCANNED_AGENTS / numAgents);
+        int scanFound = 0;
+        unsigned int readEpoch;
+        const AgentSnapshot *agents = agentList.beginSnapshotRead(&readEpoch);
+        
+        startUsecs = usecTimestampNow();
+        
+        for (int l = 0; l < scannedLookups; l++) {
+            sockaddr *senderAddress = (sockaddr *) &agentAddresses[senders[l]];
+            
+            for (AgentSnapshot::const_iterator agent = agents->begin(); agent != agents->end(); agent++) {
+                if ((*agent)->getActiveSocket() != NULL && socketMatch((*agent)->getActiveSocket(), senderAddress)) {
+                    scanFound++;
+                    break;
+                }
+            }
+        }
+        
+        double scannedUsecs = usecTimestampNow() - startUsecs;
+        agentList.endSnapshotRead(readEpoch);
+        
+        printf("%5d agents, indexed %8.1f ns a lookup, scanned %10.1f ns a lookup, found %d of %d and %d of %d\n",
+               numAgents,
+               indexedUsecs * 1000 / BENCHMARK_LOOKUPS,
+               scannedUsecs * 1000 / scannedLookups,
+               found, BENCHMARK_LOOKUPS, scanFound, scannedLookups);
+    }
+}
+
+const char BENCHMARK_SOCKET_BATCH_OPTION[] = "--benchmarkSocketBatch";
+
+void benchmarkSocketBatch() {
+    // datagrams through loopback from one socket to another, a call each and a batch of calls at a time,
+    // in bursts of a batch so the receiving socket's buffer never overflows
+    const int BENCHMARK_DATAGRAMS = 256000;
+    const int NUM_DATAGRAM_SIZES = 2;
+    const int DATAGRAM_SIZES[NUM_DATAGRAM_SIZES] = { 100, 1024 };
+    
+    UDPSocket sendingSocket(0);
+    UDPSocket receivingSocket(0);
+    
+    sockaddr_in receivingAddress;
+    socklen_t addressSize = sizeof(receivingAddress);
+    getsockname(receivingSocket.getHandle(), (sockaddr *) &receivingAddress, &addressSize);
+    receivingAddress.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    
+    UDPDatagram *datagrams = new UDPDatagram[MAX_BATCH_DATAGRAMS];
+    unsigned char receivedData[MAX_BUFFER_LENGTH_BYTES];
+    
+    for (int d = 0; d < MAX_BATCH_DATAGRAMS; d++) {
+        datagrams[d].address = receivingAddress;
+        memset(datagrams[d].data, d, MAX_BUFFER_LENGTH_BYTES);
+    }
+    
+    for (int s = 0; s < NUM_DATAGRAM_SIZES; s++) {
+        for (int batched = 0; batched < 2; batched++) {
+            int received = 0;
+            double startUsecs = usecTimestampNow();
+            
+            for (int burst = 0; burst < BENCHMARK_DATAGRAMS / MAX_BATCH_DATAGRAMS; burst++) {
+                if (batched) {
+                    for (int d = 0; d < MAX_BATCH_DATAGRAMS; d++) {
+                        datagrams[d].byteLength = DATAGRAM_SIZES[s];
+                    }
+                    
+                    sendingSocket.sendBatch(datagrams, MAX_BATCH_DATAGRAMS);
+                    
+                    for (int inBurst = 0, numReceived = 1; inBurst < MAX_BATCH_DATAGRAMS && numReceived > 0; ) {
+                        numReceived = receivingSocket.receiveBatch(datagrams, MAX_BATCH_DATAGRAMS - inBurst);
+                        inBurst += numReceived;
+                        received += numReceived;
+                    }
+                    
+                    // the receive wrote the senders over the destinations
+                    for (int d = 0; d < MAX_BATCH_DATAGRAMS; d++) {
+                        datagrams[d].address = receivingAddress;
+                    }
+                } else {
+                    for (int d = 0; d < MAX_BATCH_DATAGRAMS; d++) {
+                        sendingSocket.send((sockaddr *) &receivingAddress, datagrams[d].data, DATAGRAM_SIZES[s]);
+                    }
+                    
+                    ssize_t receivedBytes;
+                    
+                    for (int d = 0; d < MAX_BATCH_DATAGRAMS && receivingSocket.receive(receivedData, &receivedBytes); d++) {
+                        received++;
+                    }
+                }
+            }
+            
+            double elapsedUsecs = usecTimestampNow() - startUsecs;
+            
+            printf("%4d byte datagrams %-8s %10.0f packets/s, %d of %d arrived\n",
+                   DATAGRAM_SIZES[s], batched ? "batched" : "one each",
+                   received / (elapsedUsecs / 1000000), received, BENCHMARK_DATAGRAMS);
+        }
+    }
+    
+    delete[] datagrams;
+}
+
+const char BENCHMARK_MESSAGE_FRAGMENTS_OPTION[] = "--benchmarkMessageFragments";
+
+void benchmarkMessageFragments() {
+    // messages sent through loopback with sendMessage, then a share of their fragments dropped and the rest
+    // shuffled before they go into the reassembler the agent list uses, there is no resending so a message
+    // only completes if every one of its fragments made it
+    const int BENCHMARK_MESSAGES = 1000;
+    const int BENCHMARK_MESSAGE_BYTES = 64 * 1024;
+    const int NUM_LOSS_RATES = 3;
+    const float LOSS_RATES[NUM_LOSS_RATES] = { 0.0f, 0.01f, 0.05f };
+    
+    UDPSocket sendingSocket(0);
+    UDPSocket receivingSocket(0);
+    
+    sockaddr_in receivingAddress;
+    socklen_t addressSize = sizeof(receivingAddress);
+    getsockname(receivingSocket.getHandle(), (sockaddr *) &receivingAddress, &addressSize);
+    receivingAddress.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    
+    int numFragments = (BENCHMARK_MESSAGE_BYTES + MESSAGE_FRAGMENT_PAYLOAD_BYTES - 1) / MESSAGE_FRAGMENT_PAYLOAD_BYTES;
+    
+    UDPDatagram *datagrams = new UDPDatagram[numFragments];
+    std::vector<int> arrivalOrder;
+    std::vector<unsigned char> message(BENCHMARK_MESSAGE_BYTES);
+    std::vector<unsigned char> reassembled;
+    
+    for (int l = 0; l < NUM_LOSS_RATES; l++) {
+        for (int reordered = 0; reordered < 2; reordered++) {
+            MessageReassembler reassembler(AGENT_REASSEMBLY_MAX_MESSAGES, AGENT_REASSEMBLY_MAX_BYTES, AGENT_REASSEMBLY_TIMEOUT_USECS);
+            
+            int intact = 0;
+            int sentFragments = 0;
+            int receivedFragments = 0;
+            double startUsecs = usecTimestampNow();
+            
+            for (int m = 0; m < BENCHMARK_MESSAGES; m++) {
+                // each message is different so one put back together from the wrong fragments would show
+                memset(&message[0], m, BENCHMARK_MESSAGE_BYTES);
+                memcpy(&message[0], &m, sizeof(m));
+                
+                sentFragments += sendMessage(sendingSocket, (sockaddr *) &receivingAddress, &message[0], BENCHMARK_MESSAGE_BYTES);
+                
+                int numReceived = 0;
+                
+                for (int received = 1; numReceived < numFragments && received > 0; numReceived += received) {
+                    received = receivingSocket.receiveBatch(datagrams + numReceived, numFragments - numReceived);
+                }
+                
+                receivedFragments += numReceived;
+                arrivalOrder.clear();
+                
+                for (int d = 0; d < numReceived; d++) {
+                    if (randFloat() >= LOSS_RATES[l]) {
+                        arrivalOrder.push_back(d);
+                    }
+                }
+                
+                if (reordered) {
+                    std::random_shuffle(arrivalOrder.begin(), arrivalOrder.end());
+                }
+                
+                for (int a = 0; a < arrivalOrder.size(); a++) {
+                    UDPDatagram *fragment = &datagrams[arrivalOrder[a]];
+                    
+                    if (reassembler.addFragment((sockaddr *) &fragment->address, fragment->data, fragment->byteLength,
+                                                reassembled) > 0
+                        && reassembled == message) {
+                        intact++;
+                    }
+                }
+            }
+            
+            double elapsedUsecs = usecTimestampNow() - startUsecs;
+            float expectedShare = powf(1 - LOSS_RATES[l], numFragments);
+            
+            printf("%2.0f%% lost %-9s %7.1f MB/s, %4d of %d messages intact (%.0f expected), "
+                   "%d of %d fragments arrived, %d given up on\n",
+                   LOSS_RATES[l] * 100, reordered ? "reordered" : "in order",
+                   intact * (BENCHMARK_MESSAGE_BYTES / (1024.0 * 1024.0)) / (elapsedUsecs / 1000000),
+                   intact, BENCHMARK_MESSAGES, expectedShare * BENCHMARK_MESSAGES,
+                   receivedFragments, sentFragments,
+                   reassembler.getEvictedMessages() + reassembler.getTimedOutMessages());
+        }
+    }
+    
+    delete[] datagrams;
+}
+
+int main(int argc, const char * argv[])
+{
+    setvbuf(stdout, NULL, _IOLBF, 0);
+    
+    if (cmdOptionExists(argc, argv, BENCHMARK_AVATAR_STATE_OPTION)) {
+        benchmarkAvatarState();
+        return 0;
+    }
+    
+    if (cmdOptionExists(argc, argv, BENCHMARK_AGENT_LOOKUP_OPTION)) {
+        benchmarkAgentLookup();
+        return 0;
+    }
+    
+    if (cmdOptionExists(argc, argv, BENCHMARK_SOCKET_BATCH_OPTION)) {
+        benchmarkSocketBatch();
+        return 0;
+    }
+    
+    if (cmdOptionExists(argc, argv, BENCHMARK_MESSAGE_FRAGMENTS_OPTION)) {
+        benchmarkMessageFragments();
+        return 0;
+    }
+    
+    printf("Usage: bench benchmark\n");
+    printf("  %s\n", BENCHMARK_AVATAR_STATE_OPTION);
+    printf("  %s\n", BENCHMARK_AGENT_LOOKUP_OPTION);
+    printf("  %s\n", BENCHMARK_SOCKET_BATCH_OPTION);
+    printf("  %s\n", BENCHMARK_MESSAGE_FRAGMENTS_OPTION);
+    return 1;
+}
@@ -11,7 +11,8 @@
 //  The connection is stateless... the domain server will set you inactive if it does not hear from
 //  you in LOGOFF_CHECK_INTERVAL milliseconds, meaning your info will not be sent to other users.
 //
-//  Each packet from an agent has as first character the type of server:
+//  Each packet from an agent has as first character the type of server, followed by its local socket
+//  and the version of the agent list it last applied, so the reply only has to carry what changed since:
 //
 //  I - Interactive Agent
 //  M - Audio Mixer
@@ -24,8 +25,13 @@
 #include <stdlib.h>
 #include <fcntl.h>
 #include <map>
+#include <deque>
+#include <vector>
+#include <algorithm>
+#include <signal.h>
 #include "AgentList.h"
 #include "SharedUtil.h"
+#include "EventLoop.h"
 
 #ifdef _WIN32
 #include "Syssocket.h"
@@ -39,7 +45,6 @@
 
 
 const int DOMAIN_LISTEN_PORT = 40102;
-unsigned char packetData[MAX_PACKET_SIZE];
 
 const int LOGOFF_CHECK_INTERVAL = 5000;
 
@@ -47,16 +52,404 @@ const int LOGOFF_CHECK_INTERVAL = 5000;
 
 int lastActiveCount = 0;
 AgentList agentList('D', DOMAIN_LISTEN_PORT);
+EventLoop eventLoop;
 
-unsigned char * addAgentToBroadcastPacket(unsigned char *currentPosition, Agent *agentToAdd) {
-    *currentPosition++ = agentToAdd->getType();
+bool useLocal;
+in_addr_t serverLocalAddress;
+
+// check-ins are read in batches and each gets its list written straight into a reply datagram
+UDPDatagram *receivedDatagrams;
+UDPDatagram *replyDatagrams;
+
+// the list every agent is sent, packed once when it changes so replies are just copies
+// solo agents only have their newest listed
+struct ListedAgent {
+    unsigned char entry[AGENT_LIST_ENTRY_BYTES];
+};
+
+// one add or remove, the changes that make up a version share it
+struct AgentListChange {
+    uint32_t version;
+    uint16_t agentId;
+    bool added;
+    unsigned char entry[AGENT_LIST_ENTRY_BYTES];
+};
+
+// enough to bring agents a few check-ins behind up to date, past that they get the whole list
+const int MAX_AGENT_LIST_CHANGES = 1024;
+
+const int AGENT_LIST_ENTRIES_PER_PACKET = (MAX_PACKET_SIZE - AGENT_LIST_HEADER_BYTES) / AGENT_LIST_ENTRY_BYTES;
+
+const int CHECK_IN_REPORT_INTERVAL_USECS = 10 * 1000000;
+
+std::map<uint16_t, ListedAgent> listedAgents;
+std::deque<AgentListChange> listChanges;
+
+// starts somewhere new each run so an agent can't mistake a version from before a restart for the same list
+uint32_t listVersion;
+
+// agents with this version or later can be sent the changes since, the ones before it have been dropped
+uint32_t oldestChangesVersion;
+
+struct CheckIn {
+    sockaddr_in publicAddress;
+    sockaddr_in localAddress;
+    char agentType;
+    bool hasVersion;
+    uint32_t knownVersion;
+    AgentHandle agentHandle;
+};
+
+CheckIn checkIns[MAX_BATCH_DATAGRAMS];
+
+int reportChangeReplies = 0;
+int reportHeartbeatReplies = 0;
+int reportFullListReplies = 0;
+int reportReplyPackets = 0;
+long reportReplyBytes = 0;
+
+// versions wrap, so compare them by distance
+inline bool versionIsBefore(uint32_t version, uint32_t otherVersion) {
+    return (int32_t) (version - otherVersion) < 0;
+}
+
+void logListChange(uint32_t version, uint16_t agentId, bool added, unsigned char *entry) {
+    AgentListChange change;
+    change.version = version;
+    change.agentId = agentId;
+    change.added = added;
+    
+    if (added) {
+        memcpy(change.entry, entry, AGENT_LIST_ENTRY_BYTES);
+    }
+    
+    listChanges.push_back(change);
+    
+    if (listChanges.size() > MAX_AGENT_LIST_CHANGES) {
+        oldestChangesVersion = listChanges.front().version;
+        listChanges.pop_front();
+    }
+}
+
+// repacks the list after a batch of check-ins and logs what changed under a new version
+void updateListedAgents() {
+    std::map<uint16_t, ListedAgent> nowListed;
+    Agent *newestSoloAgents[256] = {};
+    
+    unsigned int readEpoch;
+    const AgentSnapshot *agents = agentList.beginSnapshotRead(&readEpoch);
+    
+    for (AgentSnapshot::const_iterator agentPointer = agents->begin(); agentPointer != agents->end(); agentPointer++) {
+        Agent *agent = *agentPointer;
+        
+        if (strchr(SOLO_AGENT_TYPES_STRING, (int) agent->getType()) == NULL) {
+            // this is an agent of which there can be multiple, just list them
+            packAgentListEntry(nowListed[agent->getAgentId()].entry, agent);
+        } else {
+            // solo agent, we only list the newest
+            Agent *&newestSoloAgent = newestSoloAgents[(unsigned char) agent->getType()];
+            
+            if (newestSoloAgent == NULL || newestSoloAgent->getFirstRecvTimeUsecs() < agent->getFirstRecvTimeUsecs()) {
+                newestSoloAgent = agent;
+            }
+        }
+    }
+    
+    for (int type = 0; type < 256; type++) {
+        if (newestSoloAgents[type] != NULL) {
+            packAgentListEntry(nowListed[newestSoloAgents[type]->getAgentId()].entry, newestSoloAgents[type]);
+        }
+    }
+    
+    agentList.endSnapshotRead(readEpoch);
+    
+    uint32_t nextVersion = listVersion + 1;
+    
+    if (nextVersion == NO_AGENT_LIST_VERSION) {
+        nextVersion++;
+    }
+    
+    bool listChanged = false;
+    
+    for (std::map<uint16_t, ListedAgent>::iterator listed = listedAgents.begin(); listed != listedAgents.end(); listed++) {
+        if (nowListed.find(listed->first) == nowListed.end()) {
+            logListChange(nextVersion, listed->first, false, NULL);
+            listChanged = true;
+        }
+    }
+    
+    for (std::map<uint16_t, ListedAgent>::iterator listed = nowListed.begin(); listed != nowListed.end(); listed++) {
+        std::map<uint16_t, ListedAgent>::iterator wasListed = listedAgents.find(listed->first);
+        
+        if (wasListed == listedAgents.end() || memcmp(wasListed->second.entry, listed->second.entry, AGENT_LIST_ENTRY_BYTES) != 0) {
+            logListChange(nextVersion, listed->first, true, listed->second.entry);
+            listChanged = true;
+        }
+    }
+    
+    if (listChanged) {
+        listVersion = nextVersion;
+        listedAgents.swap(nowListed);
+    }
+}
+
+// the next free reply datagram, sending the batch first if it's full
+UDPDatagram *nextReplyDatagram(int *numReplyDatagrams) {
+    if (*numReplyDatagrams == MAX_BATCH_DATAGRAMS) {
+        agentList.getAgentSocket().sendBatch(replyDatagrams, *numReplyDatagrams);
+        *numReplyDatagrams = 0;
+    }
+    
+    return &replyDatagrams[*numReplyDatagrams];
+}
+
+void queueReplyDatagram(int *numReplyDatagrams, sockaddr_in *address, int byteLength) {
+    replyDatagrams[*numReplyDatagrams].address = *address;
+    replyDatagrams[*numReplyDatagrams].byteLength = byteLength;
+    (*numReplyDatagrams)++;
+    
+    reportReplyPackets++;
+    reportReplyBytes += byteLength;
+}
+
+// the changes since knownVersion in one packet, false if we no longer have them all or they don't fit
+bool writeListChanges(UDPDatagram *replyDatagram, uint32_t knownVersion, uint16_t agentId) {
+    if (knownVersion == NO_AGENT_LIST_VERSION || versionIsBefore(knownVersion, oldestChangesVersion)
+        || versionIsBefore(listVersion, knownVersion)) {
+        return false;
+    }
+    
+    unsigned char *packetPtr = replyDatagram->data;
+    *packetPtr++ = AGENT_LIST_CHANGES_PACKET_HEADER;
+    
+    memcpy(packetPtr, &knownVersion, sizeof(knownVersion));
+    packetPtr += sizeof(knownVersion);
+    memcpy(packetPtr, &listVersion, sizeof(listVersion));
+    packetPtr += sizeof(listVersion);
+    packetPtr += packAgentId(packetPtr, agentId);
+    
+    // the changes are in version order, so the ones the agent is missing are at the end
+    std::deque<AgentListChange>::iterator change = listChanges.end();
+    
+    while (change != listChanges.begin() && versionIsBefore(knownVersion, (change - 1)->version)) {
+        change--;
+    }
+    
+    for (; change != listChanges.end(); change++) {
+        if (packetPtr + 1 + AGENT_LIST_ENTRY_BYTES > replyDatagram->data + MAX_PACKET_SIZE) {
+            return false;
+        }
+        
+        if (change->added) {
+            *packetPtr++ = AGENT_LIST_ADDED;
+            memcpy(packetPtr, change->entry, AGENT_LIST_ENTRY_BYTES);
+            packetPtr += AGENT_LIST_ENTRY_BYTES;
+        } else {
+            *packetPtr++ = AGENT_LIST_REMOVED;
+            packetPtr += packAgentId(packetPtr, change->agentId);
+        }
+    }
+    
+    replyDatagram->byteLength = packetPtr - replyDatagram->data;
+    return true;
+}
+
+// a list too long for MAX_AGENT_LIST_PACKETS goes whole as one packet, sent in fragments
+void sendFullListMessage(sockaddr_in *address, uint16_t agentId) {
+    std::vector<unsigned char> message(AGENT_LIST_HEADER_BYTES + listedAgents.size() * AGENT_LIST_ENTRY_BYTES);
+    unsigned char *packetPtr = &message[0];
+    
+    *packetPtr++ = AGENT_LIST_PACKET_HEADER;
+    memcpy(packetPtr, &listVersion, sizeof(listVersion));
+    packetPtr += sizeof(listVersion);
+    packetPtr += packAgentId(packetPtr, agentId);
+    *packetPtr++ = 0;
+    *packetPtr++ = 1;
+    
+    for (std::map<uint16_t, ListedAgent>::iterator listed = listedAgents.begin(); listed != listedAgents.end(); listed++) {
+        memcpy(packetPtr, listed->second.entry, AGENT_LIST_ENTRY_BYTES);
+        packetPtr += AGENT_LIST_ENTRY_BYTES;
+    }
     
-    currentPosition += packAgentId(currentPosition, agentToAdd->getAgentId());
-    currentPosition += packSocket(currentPosition, agentToAdd->getPublicSocket());
-    currentPosition += packSocket(currentPosition, agentToAdd->getLocalSocket());
+    int sentDatagrams = sendMessage(agentList.getAgentSocket(), (sockaddr *)address, &message[0], message.size());
     
-    // return the new unsigned char * for broadcast packet
-    return currentPosition;
+    if (sentDatagrams == 0) {
+        printf("Agent list of %d agents is too big to send, even in fragments.\n", (int) listedAgents.size());
+        return;
+    }
+    
+    reportReplyPackets += sentDatagrams;
+    reportReplyBytes += message.size();
+}
+
+// the whole list, in as many packets as it takes
+void queueFullList(int *numReplyDatagrams, sockaddr_in *address, uint16_t agentId) {
+    int packetCount = std::max(1, (int) (listedAgents.size() + AGENT_LIST_ENTRIES_PER_PACKET - 1) / AGENT_LIST_ENTRIES_PER_PACKET);
+    
+    if (packetCount > MAX_AGENT_LIST_PACKETS) {
+        sendFullListMessage(address, agentId);
+        return;
+    }
+    
+    std::map<uint16_t, ListedAgent>::iterator listed = listedAgents.begin();
+    
+    for (int packetIndex = 0; packetIndex < packetCount; packetIndex++) {
+        UDPDatagram *replyDatagram = nextReplyDatagram(numReplyDatagrams);
+        unsigned char *packetPtr = replyDatagram->data;
+        
+        *packetPtr++ = AGENT_LIST_PACKET_HEADER;
+        memcpy(packetPtr, &listVersion, sizeof(listVersion));
+        packetPtr += sizeof(listVersion);
+        packetPtr += packAgentId(packetPtr, agentId);
+        *packetPtr++ = packetIndex;
+        *packetPtr++ = packetCount;
+        
+        for (int i = 0; i < AGENT_LIST_ENTRIES_PER_PACKET && listed != listedAgents.end(); i++, listed++) {
+            memcpy(packetPtr, listed->second.entry, AGENT_LIST_ENTRY_BYTES);
+            packetPtr += AGENT_LIST_ENTRY_BYTES;
+        }
+        
+        queueReplyDatagram(numReplyDatagrams, address, packetPtr - replyDatagram->data);
+    }
+}
+
+// what older agents get, the list without them in the one packet, cut off when it's full
+void queueOldList(int *numReplyDatagrams, sockaddr_in *address, uint16_t agentId) {
+    UDPDatagram *replyDatagram = nextReplyDatagram(numReplyDatagrams);
+    unsigned char *packetPtr = replyDatagram->data;
+    *packetPtr++ = 'D';
+    
+    for (std::map<uint16_t, ListedAgent>::iterator listed = listedAgents.begin(); listed != listedAgents.end(); listed++) {
+        if (packetPtr + AGENT_LIST_ENTRY_BYTES > replyDatagram->data + MAX_PACKET_SIZE) {
+            break;
+        }
+        
+        if (DEBUG_TO_SELF || listed->first != agentId) {
+            memcpy(packetPtr, listed->second.entry, AGENT_LIST_ENTRY_BYTES);
+            packetPtr += AGENT_LIST_ENTRY_BYTES;
+        }
+    }
+    
+    if (packetPtr - replyDatagram->data > 1) {
+        queueReplyDatagram(numReplyDatagrams, address, packetPtr - replyDatagram->data);
+    }
+}
+
+void processCheckIns(void *args) {
+    unsigned int readEpoch;
+    
+    int numCheckIns = 0;
+    int numReplyDatagrams = 0;
+    int numReceived = agentList.getAgentSocket().receiveBatch(receivedDatagrams, MAX_BATCH_DATAGRAMS);
+    
+    for (int d = 0; d < numReceived; d++) {
+        if (receivedDatagrams[d].byteLength < 1 + 6) {
+            continue;
+        }
+        
+        CheckIn *checkIn = &checkIns[numCheckIns++];
+        unsigned char *packetData = receivedDatagrams[d].data;
+        
+        checkIn->publicAddress = receivedDatagrams[d].address;
+        checkIn->localAddress.sin_family = AF_INET;
+        checkIn->agentType = packetData[0];
+        unpackSocket(&packetData[1], (sockaddr *)&checkIn->localAddress);
+        
+        checkIn->hasVersion = receivedDatagrams[d].byteLength >= CHECK_IN_PACKET_BYTES;
+        checkIn->knownVersion = NO_AGENT_LIST_VERSION;
+        
+        if (checkIn->hasVersion) {
+            memcpy(&checkIn->knownVersion, &packetData[1 + 6], sizeof(checkIn->knownVersion));
+        }
+        
+        // check the agent public address
+        // if it matches our local address we're on the same box
+        // so hardcode the EC2 public address for now
+        if (checkIn->publicAddress.sin_addr.s_addr == serverLocalAddress) {
+        	// If we're not running "local" then we do replace the IP
+        	// with the EC2 IP. Otherwise, we use our normal public IP
+        	if (!useLocal) {
+	                checkIn->publicAddress.sin_addr.s_addr = 895283510; // local IP in this format...
+	            }
+        }
+        
+        checkIn->agentHandle = NULL_AGENT_HANDLE;
+        agentList.addOrUpdateAgent((sockaddr *)&checkIn->publicAddress,
+                                   (sockaddr *)&checkIn->localAddress,
+                                   checkIn->agentType,
+                                   &checkIn->agentHandle);
+    }
+    
+    if (numCheckIns == 0) {
+        return;
+    }
+    
+    // the list is the same for everyone, so it's brought up to date once for the batch
+    updateListedAgents();
+    
+    // so an agent found by its handle can't be freed while we use it
+    agentList.beginSnapshotRead(&readEpoch);
+    
+    for (int c = 0; c < numCheckIns; c++) {
+        CheckIn *checkIn = &checkIns[c];
+        uint16_t agentId = UNKNOWN_AGENT_ID;
+        
+        // stale if the agent has been removed since it checked in
+        Agent *agent = agentList.agentForHandle(checkIn->agentHandle);
+        
+        if (agent != NULL) {
+            // this is the agent, just update last receive to now
+            agent->setLastRecvTimeUsecs(usecTimestampNow());
+            agentId = DEBUG_TO_SELF ? UNKNOWN_AGENT_ID : agent->getAgentId();
+        }
+        
+        if (!checkIn->hasVersion) {
+            queueOldList(&numReplyDatagrams, &checkIn->publicAddress, agentId);
+            continue;
+        }
+        
+        UDPDatagram *replyDatagram = nextReplyDatagram(&numReplyDatagrams);
+        
+        if (writeListChanges(replyDatagram, checkIn->knownVersion, agentId)) {
+            if (checkIn->knownVersion == listVersion) {
+                reportHeartbeatReplies++;
+            } else {
+                reportChangeReplies++;
+            }
+            
+            queueReplyDatagram(&numReplyDatagrams, &checkIn->publicAddress, replyDatagram->byteLength);
+        } else {
+            reportFullListReplies++;
+            queueFullList(&numReplyDatagrams, &checkIn->publicAddress, agentId);
+        }
+    }
+    
+    agentList.endSnapshotRead(readEpoch);
+    
+    if (numReplyDatagrams > 0) {
+        agentList.getAgentSocket().sendBatch(replyDatagrams, numReplyDatagrams);
+    }
+}
+
+void printCheckInReport(void *args) {
+    if (reportReplyPackets == 0) {
+        return;
+    }
+    
+    printf("List version %u with %d agents, answered check-ins with %d changes, %d already up to date and %d whole lists, "
+           "%d packets and %.0f bytes/s out.\n",
+           listVersion, (int) listedAgents.size(), reportChangeReplies, reportHeartbeatReplies, reportFullListReplies,
+           reportReplyPackets, reportReplyBytes / (CHECK_IN_REPORT_INTERVAL_USECS / 1000000.0));
+    
+    reportChangeReplies = 0;
+    reportHeartbeatReplies = 0;
+    reportFullListReplies = 0;
+    reportReplyPackets = 0;
+    reportReplyBytes = 0;
+}
+
+void stopDomainServer(int signal) {
+    eventLoop.stop();
 }
 
 int main(int argc, const char * argv[])
@@ -65,7 +458,7 @@ int main(int argc, const char * argv[])
 	// with the EC2 IP. Otherwise, we will replace the IP like we used to
 	// this allows developers to run a local domain without recompiling the
 	// domain server
-	bool useLocal = cmdOptionExists(argc, argv, "--local");
+	useLocal = cmdOptionExists(argc, argv, "--local");
 	if (useLocal) {
 		printf("NOTE: Running in Local Mode!\n");
 	} else {
@@ -78,86 +471,31 @@ int main(int argc, const char * argv[])
 
     setvbuf(stdout, NULL, _IOLBF, 0);
     
-    ssize_t receivedBytes = 0;
-    char agentType;
+    serverLocalAddress = getLocalAddress();
     
-    unsigned char *broadcastPacket = new unsigned char[MAX_PACKET_SIZE];
-    *broadcastPacket = 'D';
+    receivedDatagrams = new UDPDatagram[MAX_BATCH_DATAGRAMS];
+    replyDatagrams = new UDPDatagram[MAX_BATCH_DATAGRAMS];
     
-    unsigned char *currentBufferPos;
-    unsigned char *startPointer;
-    int packetBytesWithoutLeadingChar;
+    listVersion = (uint32_t) usecTimestampNow();
     
-    sockaddr_in agentPublicAddress, agentLocalAddress;
-    agentLocalAddress.sin_family = AF_INET;
+    if (listVersion == NO_AGENT_LIST_VERSION) {
+        listVersion++;
+    }
     
-    in_addr_t serverLocalAddress = getLocalAddress();
+    oldestChangesVersion = listVersion;
     
-    agentList.startSilentAgentRemovalThread();
+    agentList.addSilentAgentRemovalTimer(eventLoop);
+    eventLoop.addTimer(CHECK_IN_REPORT_INTERVAL_USECS, printCheckInReport, NULL);
+    eventLoop.addSocket(agentList.getAgentSocket(), processCheckIns, NULL);
+    
+    signal(SIGINT, stopDomainServer);
+    signal(SIGTERM, stopDomainServer);
+    
+    eventLoop.run();
+    
+    delete[] receivedDatagrams;
+    delete[] replyDatagrams;
     
-    while (true) {
-        if (agentList.getAgentSocket().receive((sockaddr *)&agentPublicAddress, packetData, &receivedBytes)) {
-            std::map<char, Agent *> newestSoloAgents;
-            
-            agentType = packetData[0];
-            unpackSocket(&packetData[1], (sockaddr *)&agentLocalAddress);
-            
-            // check the agent public address
-            // if it matches our local address we're on the same box
-            // so hardcode the EC2 public address for now
-            if (agentPublicAddress.sin_addr.s_addr == serverLocalAddress) {
-            	// If we're not running "local" then we do replace the IP
-            	// with the EC2 IP. Otherwise, we use our normal public IP
-            	if (!useLocal) {
-	                agentPublicAddress.sin_addr.s_addr = 895283510; // local IP in this format...
-	            }
-            }
-            
-            if (agentList.addOrUpdateAgent((sockaddr *)&agentPublicAddress,
-                                           (sockaddr *)&agentLocalAddress,
-                                           agentType,
-                                           agentList.getLastAgentId())) {
-                
-                agentList.increaseAgentId();
-            
-            }
-            
-            currentBufferPos = broadcastPacket + 1;
-            startPointer = currentBufferPos;
-            
-            for(std::vector<Agent>::iterator agent = agentList.getAgents().begin(); agent != agentList.getAgents().end(); agent++) {
-                
-                if (DEBUG_TO_SELF || !agent->matches((sockaddr *)&agentPublicAddress, (sockaddr *)&agentLocalAddress, agentType)) {
-                    if (strchr(SOLO_AGENT_TYPES_STRING, (int) agent->getType()) == NULL) {
-                        // this is an agent of which there can be multiple, just add them to the packet
-                        currentBufferPos = addAgentToBroadcastPacket(currentBufferPos, &(*agent));
-                    } else {
-                        // solo agent, we need to only send newest
-                        if (newestSoloAgents[agent->getType()] == NULL ||
-                            newestSoloAgents[agent->getType()]->getFirstRecvTimeUsecs() < agent->getFirstRecvTimeUsecs()) {
-                            // we have to set the newer solo agent to add it to the broadcast later
-                            newestSoloAgents[agent->getType()] = &(*agent);
-                        }
-                    }
-                } else {
-                    // this is the agent, just update last receive to now
-                    agent->setLastRecvTimeUsecs(usecTimestampNow());
-                }
-            }
-            
-            for (std::map<char, Agent *>::iterator agentIterator = newestSoloAgents.begin();
-                 agentIterator != newestSoloAgents.end();
-                 agentIterator++) {
-                // this is the newest alive solo agent, add them to the packet
-                currentBufferPos = addAgentToBroadcastPacket(currentBufferPos, agentIterator->second);
-            }
-            
-            if ((packetBytesWithoutLeadingChar = (currentBufferPos - startPointer))) {
-                agentList.getAgentSocket().send((sockaddr *)&agentPublicAddress, broadcastPacket, packetBytesWithoutLeadingChar + 1);
-            }
-        }
-    }
-
     return 0;
 }
 
@@ -17,9 +17,13 @@
 #include <arpa/inet.h>
 #include <string.h>
 #include <sstream>
+#include <math.h>
 #include "UDPSocket.h"
 #include "UDPSocket.cpp"
 #include <SharedUtil.h>
+#include <AudioRingBuffer.h>
+#include <AudioCodec.h>
+#include <TickScheduler.h>
 
 char EC2_WEST_AUDIO_SERVER[] = "54.241.92.53";
 const int AUDIO_UDP_LISTEN_PORT = 55443;
@@ -33,9 +37,19 @@ bool loopAudio = true;
 float sleepIntervalMin = 1.00;
 float sleepIntervalMax = 2.00;
 float positionInUniverse[] = {0, 0, 0, 0};
-unsigned char attenuationModifier = 255;
 char *sourceAudioFile;
-const char *allowedParameters = ":rb::t::c::a::f:";
+char *audioServerAddress = EC2_WEST_AUDIO_SERVER;
+int numLoadStreams = 0;
+int numSilentStreams = 0;
+const AudioCodec *codec = NULL;
+float lossPercent = 0;
+float reorderPercent = 0;
+const char *allowedParameters = ":rb::t::c::f:d:n:q:e:l:o:";
+
+const float LOAD_TEST_TONE_HZ = 440.0;
+const int LOAD_TEST_TONE_AMPLITUDE = 8000;
+const float LOAD_TEST_STREAM_SPACING = 0.5;
+const int LOAD_TEST_REPORT_USECS = 1000000;
 
 char *charBuffer;
 int16_t *buffer;
@@ -43,6 +57,9 @@ long length;
 
 UDPSocket *streamSocket;
 
+// carries on from one play of the file to the next, so the mixer doesn't take the restart for late frames
+uint16_t streamSequence = 0;
+
 void usage(void)
 {
     std::cout << "High Fidelity - Interface audio injector" << std::endl;
@@ -50,8 +67,13 @@ void usage(void)
     std::cout << "   -b FLOAT                       Min. number of seconds to sleep. Only valid in random sleep mode. Default 1.0" << std::endl;
     std::cout << "   -t FLOAT                       Max. number of seconds to sleep. Only valid in random sleep mode. Default 2.0" << std::endl;
     std::cout << "   -c FLOAT,FLOAT,FLOAT,FLOAT     X,Y,Z,YAW position in universe where audio will be originating from and direction. Defaults to 0,0,0,0" << std::endl;
-    std::cout << "   -a 0-255                       Attenuation curve modifier, defaults to 255" << std::endl;
     std::cout << "   -f FILENAME                    Name of audio source file. Required - RAW format, 22050hz 16bit signed mono" << std::endl;
+    std::cout << "   -d ADDRESS                     IP of the audio mixer to stream to. Defaults to " << EC2_WEST_AUDIO_SERVER << std::endl;
+    std::cout << "   -n COUNT                       Load test, stream to the mixer as COUNT separate clients. Uses a test tone if no -f" << std::endl;
+    std::cout << "   -e CODEC                       Compress the audio with CODEC (pcm, mulaw or adpcm). Defaults to raw samples" << std::endl;
+    std::cout << "   -q COUNT                       Make COUNT of the load test streams listeners that only send silent frames" << std::endl;
+    std::cout << "   -l PERCENT                     Drop PERCENT of the load test packets instead of sending them" << std::endl;
+    std::cout << "   -o PERCENT                     Hold back PERCENT of the load test packets and send them after the next one" << std::endl;
 };
 
 bool processParameters(int parameterCount, char* parameterData[])
@@ -91,9 +113,35 @@ bool processParameters(int parameterCount, char* parameterData[])
                  
                 break;
             }
-            case 'a':
-                attenuationModifier = atoi(optarg);
-                std::cout << "[DEBUG] Attenuation modifier: " << optarg << std::endl;
+            case 'd':
+                audioServerAddress = optarg;
+                std::cout << "[DEBUG] Audio mixer address: " << audioServerAddress << std::endl;
+                break;
+            case 'n':
+                numLoadStreams = atoi(optarg);
+                std::cout << "[DEBUG] Load test with " << numLoadStreams << " streams" << std::endl;
+                break;
+            case 'e':
+                codec = audioCodecNamed(optarg);
+                
+                if (!codec) {
+                    std::cout << "[FATAL] Unknown audio codec " << optarg << std::endl;
+                    return false;
+                }
+                
+                std::cout << "[DEBUG] Compressing audio with " << codec->name << std::endl;
+                break;
+            case 'q':
+                numSilentStreams = atoi(optarg);
+                std::cout << "[DEBUG] " << numSilentStreams << " load test streams will be silent" << std::endl;
+                break;
+            case 'l':
+                lossPercent = atof(optarg);
+                std::cout << "[DEBUG] Dropping " << lossPercent << "% of load test packets" << std::endl;
+                break;
+            case 'o':
+                reorderPercent = atof(optarg);
+                std::cout << "[DEBUG] Reordering " << reorderPercent << "% of load test packets" << std::endl;
                 break;
             default:
                 usage();
@@ -114,42 +162,245 @@ void loadFile(void) {
     sourceFile.read((char *)buffer, length);
 }
 
+// the frame as a compressed packet, returns how long the packet is
+int buildCompressedPacket(unsigned char *packet, uint16_t sequence, float *positionAndBearing, int16_t *samples) {
+    packet[0] = COMPRESSED_AUDIO_PACKET_HEADER;
+    packet[1] = codec->id;
+    memcpy(packet + COMPRESSED_AUDIO_HEADER_BYTES, &sequence, sizeof(sequence));
+    memcpy(packet + COMPRESSED_AUDIO_HEADER_BYTES + AUDIO_SEQUENCE_BYTES, positionAndBearing, AUDIO_POSITION_BEARING_BYTES);
+    
+    unsigned char *audioStart = packet + COMPRESSED_AUDIO_HEADER_BYTES + AUDIO_SEQUENCE_BYTES + AUDIO_POSITION_BEARING_BYTES;
+    return (audioStart - packet) + encodeFrame(codec, audioStart, samples, BUFFER_LENGTH_SAMPLES);
+}
+
 void stream(void)
 {
-    timeval startTime;
+    // frames go out at the rate they play, a late one is made up for by sending the next straight after
+    TickScheduler frameTicks("Stream", BUFFER_SEND_INTERVAL_USECS * 1000, TICK_CATCH_UP_BURST);
     
-    int leadingBytes = 1 + (sizeof(float) * 4);
+    int leadingBytes = 1 + AUDIO_SEQUENCE_BYTES + (sizeof(float) * 4);
     unsigned char dataPacket[BUFFER_LENGTH_BYTES + leadingBytes];
     
     dataPacket[0] = 'I';
-    unsigned char *currentPacketPtr = dataPacket + 1;
+    unsigned char *currentPacketPtr = dataPacket + 1 + AUDIO_SEQUENCE_BYTES;
     
     for (int p = 0; p < 4; p++) {
         memcpy(currentPacketPtr, &positionInUniverse[p], sizeof(float));
         currentPacketPtr += sizeof(float);
     }
     
-    *currentPacketPtr = attenuationModifier;
-    currentPacketPtr++;
-    
     for (int i = 0; i < length; i += BUFFER_LENGTH_SAMPLES) {
-        gettimeofday(&startTime, NULL);
-        memcpy(currentPacketPtr, &buffer[i], BUFFER_LENGTH_BYTES);
-        streamSocket->send(EC2_WEST_AUDIO_SERVER, AUDIO_UDP_LISTEN_PORT, dataPacket, sizeof(dataPacket));
-        double usecToSleep = usecTimestamp(&startTime) + BUFFER_SEND_INTERVAL_USECS - usecTimestampNow();
-        usleep(usecToSleep);
+        frameTicks.waitForNextTick();
+        
+        if (codec) {
+            unsigned char compressedPacket[MAX_BUFFER_LENGTH_BYTES];
+            int packetLength = buildCompressedPacket(compressedPacket, streamSequence++, positionInUniverse, &buffer[i]);
+            streamSocket->send(audioServerAddress, AUDIO_UDP_LISTEN_PORT, compressedPacket, packetLength);
+        } else {
+            memcpy(dataPacket + 1, &streamSequence, sizeof(streamSequence));
+            streamSequence++;
+            
+            memcpy(currentPacketPtr, &buffer[i], BUFFER_LENGTH_BYTES);
+            streamSocket->send(audioServerAddress, AUDIO_UDP_LISTEN_PORT, dataPacket, sizeof(dataPacket));
+        }
     }
 };
 
+void generateTone(void) {
+    // one second of a sine tone, used by the load test when no source file is given
+    length = SAMPLE_RATE * sizeof(int16_t);
+    buffer = new int16_t[length / 2];
+    
+    for (int i = 0; i < length / 2; i++) {
+        buffer[i] = LOAD_TEST_TONE_AMPLITUDE * sinf(2 * M_PI * LOAD_TEST_TONE_HZ * i / SAMPLE_RATE);
+    }
+}
+
+void streamLoadTest(void)
+{
+    // every simulated client gets its own socket so the mixer sees it as a separate agent
+    UDPSocket **loadSockets = new UDPSocket*[numLoadStreams];
+    
+    for (int s = 0; s < numLoadStreams; s++) {
+        loadSockets[s] = new UDPSocket(0);
+        loadSockets[s]->setBlocking(false);
+    }
+    
+    int leadingBytes = 1 + AUDIO_SEQUENCE_BYTES + (sizeof(float) * 4);
+    unsigned char dataPacket[BUFFER_LENGTH_BYTES + leadingBytes];
+    dataPacket[0] = 'I';
+    
+    unsigned char compressedPacket[MAX_BUFFER_LENGTH_BYTES];
+    unsigned char silentPacket[SILENT_AUDIO_PACKET_BYTES];
+    silentPacket[0] = SILENT_AUDIO_PACKET_HEADER;
+    
+    // a packet held back to be reordered goes out after the stream's next one
+    unsigned char (*heldPackets)[MAX_BUFFER_LENGTH_BYTES] = new unsigned char[numLoadStreams][MAX_BUFFER_LENGTH_BYTES];
+    int *heldPacketLengths = new int[numLoadStreams];
+    
+    // the sequence of the last mix each stream got back, to count the ones that went missing
+    int *lastMixSequences = new int[numLoadStreams];
+    
+    for (int s = 0; s < numLoadStreams; s++) {
+        heldPacketLengths[s] = 0;
+        lastMixSequences[s] = -1;
+    }
+    
+    UDPDatagram *mixDatagrams = new UDPDatagram[MAX_BATCH_DATAGRAMS];
+    
+    timeval lastReport;
+    gettimeofday(&lastReport, NULL);
+    
+    int sentPackets = 0;
+    int droppedPackets = 0;
+    int reorderedPackets = 0;
+    int receivedMixes = 0;
+    long receivedMixBytes = 0;
+    int missingMixes = 0;
+    int mixGaps = 0;
+    int lateMixes = 0;
+    
+    TickScheduler frameTicks("Load test", BUFFER_SEND_INTERVAL_USECS * 1000, TICK_CATCH_UP_BURST);
+    
+    while (true) {
+        frameTicks.waitForNextTick();
+        int64_t frame = frameTicks.getTickNumber();
+        
+        int sample = (frame * BUFFER_LENGTH_SAMPLES) % (length / 2 - BUFFER_LENGTH_SAMPLES);
+        memcpy(dataPacket + leadingBytes, &buffer[sample], BUFFER_LENGTH_BYTES);
+        
+        // every stream sends one frame a frame, so they can all share the frame number as the sequence
+        uint16_t sequence = frame;
+        memcpy(dataPacket + 1, &sequence, sizeof(sequence));
+        memcpy(silentPacket + 1, &sequence, sizeof(sequence));
+        
+        for (int s = 0; s < numLoadStreams; s++) {
+            // spread the streams out in a line so they aren't all mixed at full volume
+            float streamPosition[4];
+            memcpy(streamPosition, positionInUniverse, sizeof(streamPosition));
+            streamPosition[0] += s * LOAD_TEST_STREAM_SPACING;
+            memcpy(dataPacket + 1 + AUDIO_SEQUENCE_BYTES, streamPosition, sizeof(streamPosition));
+            memcpy(silentPacket + 1 + AUDIO_SEQUENCE_BYTES, streamPosition, sizeof(streamPosition));
+            
+            // the last numSilentStreams streams are listening, not talking
+            bool silent = s >= numLoadStreams - numSilentStreams;
+            
+            unsigned char *packet = dataPacket;
+            int packetLength = sizeof(dataPacket);
+            
+            if (silent) {
+                packet = silentPacket;
+                packetLength = sizeof(silentPacket);
+            } else if (codec) {
+                packet = compressedPacket;
+                packetLength = buildCompressedPacket(compressedPacket, sequence, streamPosition, &buffer[sample]);
+            }
+            
+            if (randFloat() * 100 < lossPercent) {
+                droppedPackets++;
+            } else if (heldPacketLengths[s] == 0 && randFloat() * 100 < reorderPercent) {
+                memcpy(heldPackets[s], packet, packetLength);
+                heldPacketLengths[s] = packetLength;
+                reorderedPackets++;
+            } else {
+                if (loadSockets[s]->send(audioServerAddress, AUDIO_UDP_LISTEN_PORT, packet, packetLength) > 0) {
+                    sentPackets++;
+                }
+                
+                if (heldPacketLengths[s] > 0
+                    && loadSockets[s]->send(audioServerAddress, AUDIO_UDP_LISTEN_PORT, heldPackets[s], heldPacketLengths[s]) > 0) {
+                    sentPackets++;
+                }
+                
+                heldPacketLengths[s] = 0;
+            }
+            
+            // drain whatever the mixer has sent back to this client
+            int numMixes;
+            while ((numMixes = loadSockets[s]->receiveBatch(mixDatagrams, MAX_BATCH_DATAGRAMS)) > 0) {
+                receivedMixes += numMixes;
+                
+                for (int m = 0; m < numMixes; m++) {
+                    receivedMixBytes += mixDatagrams[m].byteLength;
+                    
+                    if (mixDatagrams[m].byteLength < COMPRESSED_AUDIO_HEADER_BYTES + AUDIO_SEQUENCE_BYTES) {
+                        continue;
+                    }
+                    
+                    uint16_t mixSequence;
+                    memcpy(&mixSequence, mixDatagrams[m].data + COMPRESSED_AUDIO_HEADER_BYTES, sizeof(mixSequence));
+                    
+                    if (lastMixSequences[s] >= 0) {
+                        int16_t mixesAhead = mixSequence - lastMixSequences[s];
+                        
+                        if (mixesAhead <= 0) {
+                            lateMixes++;
+                            continue;
+                        } else if (mixesAhead > 1) {
+                            missingMixes += mixesAhead - 1;
+                            mixGaps++;
+                        }
+                    }
+                    
+                    lastMixSequences[s] = mixSequence;
+                }
+            }
+        }
+        
+        double usecsSinceReport = usecTimestampNow() - usecTimestamp(&lastReport);
+        
+        if (usecsSinceReport >= LOAD_TEST_REPORT_USECS) {
+            // the mixer sends each client one mix per frame, anything short of that it couldn't keep up with
+            float expectedMixes = numLoadStreams * (usecsSinceReport / BUFFER_SEND_INTERVAL_USECS);
+            
+            printf("[LOAD] %d streams (%d silent), sent %.0f packets/s, received %.0f mixes/s (%.1f%% of expected) in %.0f KB/s\n",
+                   numLoadStreams,
+                   std::min(numSilentStreams, numLoadStreams),
+                   sentPackets * 1000000.0 / usecsSinceReport,
+                   receivedMixes * 1000000.0 / usecsSinceReport,
+                   100 * receivedMixes / expectedMixes,
+                   receivedMixBytes * 1000 / usecsSinceReport);
+            
+            if (lossPercent > 0 || reorderPercent > 0 || missingMixes > 0 || lateMixes > 0) {
+                printf("[LOAD] dropped %d and reordered %d packets, %d mixes missing in %d gaps and %d out of order\n",
+                       droppedPackets, reorderedPackets, missingMixes, mixGaps, lateMixes);
+            }
+            
+            sentPackets = 0;
+            droppedPackets = 0;
+            reorderedPackets = 0;
+            receivedMixes = 0;
+            receivedMixBytes = 0;
+            missingMixes = 0;
+            mixGaps = 0;
+            lateMixes = 0;
+            gettimeofday(&lastReport, NULL);
+            
+            frameTicks.printReport();
+        }
+    }
+}
+
 int main(int argc, char* argv[])
 {
+    setvbuf(stdout, NULL, _IOLBF, 0);
 
     srand(time(0));
     int AUDIO_UDP_SEND_PORT = 1500 + (rand() % (int)(1500 - 2000 + 1));
     
-    UDPSocket *streamSocket = new UDPSocket(AUDIO_UDP_SEND_PORT);
+    streamSocket = new UDPSocket(AUDIO_UDP_SEND_PORT);
     
     if (processParameters(argc, argv)) {
+        if (numLoadStreams > 0) {
+            if (sourceAudioFile) {
+                loadFile();
+            } else {
+                generateTone();
+            }
+            
+            streamLoadTest();
+        }
+        
         if (sourceAudioFile) {
             loadFile();
         } else {
@@ -37,6 +37,9 @@ const int RING_BUFFER_SAMPLES = RING_BUFFER_FRAMES * BUFFER_LENGTH_SAMPLES;
 const int PHASE_DELAY_AT_90 = 20;
 const float AMPLITUDE_RATIO_AT_90 = 0.5;
 
+// input quieter than this goes to the mixer as a silent frame, when that's turned on
+const float SILENT_INPUT_LOUDNESS = 10;
+
 const int MIN_FLANGE_EFFECT_THRESHOLD = 600;
 const int MAX_FLANGE_EFFECT_THRESHOLD = 1500;
 const float FLANGE_BASE_RATE = 4;
@@ -144,14 +147,32 @@ int audioCallback (const void *inputBuffer,
             audioMixerSocket.sin_addr.s_addr = data->mixerAddress;
             audioMixerSocket.sin_port = data->mixerPort;
             
-            int leadingBytes = 1 + (sizeof(float) * 4);
+            int leadingBytes = 1 + AUDIO_SEQUENCE_BYTES + (sizeof(float) * 4);
+            
+            // we need the amount of bytes in the buffer + 1 for type + 2 for the sequence + 16 for position and yaw
+            // + 1 for the codec id when the input is compressed
+            unsigned char dataPacket[BUFFER_LENGTH_BYTES + leadingBytes + 1];
             
-            // we need the amount of bytes in the buffer + 1 for type + 12 for 3 floats for position
-            unsigned char dataPacket[BUFFER_LENGTH_BYTES + leadingBytes];
+            // a silent frame is just the header, the mixer knows to fill in the zeros
+            bool silentFrame = data->sendSilentFrames && loudness < SILENT_INPUT_LOUDNESS;
+            bool compressedFrame = !silentFrame && data->codec != NULL;
             
-            dataPacket[0] = 'I';
             unsigned char *currentPacketPtr = dataPacket + 1;
             
+            if (silentFrame) {
+                dataPacket[0] = SILENT_AUDIO_PACKET_HEADER;
+            } else if (compressedFrame) {
+                dataPacket[0] = COMPRESSED_AUDIO_PACKET_HEADER;
+                dataPacket[1] = data->codec->id;
+                currentPacketPtr = dataPacket + COMPRESSED_AUDIO_HEADER_BYTES;
+            } else {
+                dataPacket[0] = 'I';
+            }
+            
+            memcpy(currentPacketPtr, &data->outgoingSequence, sizeof(data->outgoingSequence));
+            currentPacketPtr += AUDIO_SEQUENCE_BYTES;
+            data->outgoingSequence++;
+            
             // memcpy the three float positions
             for (int p = 0; p < 3; p++) {
                 memcpy(currentPacketPtr, &data->linkedHead->getPos()[p], sizeof(float));
@@ -205,10 +226,18 @@ int audioCallback (const void *inputBuffer,
 //            
             
             
-            // copy the audio data to the last BUFFER_LENGTH_BYTES bytes of the data packet
-            memcpy(currentPacketPtr, inputLeft, BUFFER_LENGTH_BYTES);
-            
-            data->audioSocket->send((sockaddr *)&audioMixerSocket, dataPacket, BUFFER_LENGTH_BYTES + leadingBytes);
+            if (silentFrame) {
+                data->audioSocket->send((sockaddr *)&audioMixerSocket, dataPacket, SILENT_AUDIO_PACKET_BYTES);
+            } else if (compressedFrame) {
+                currentPacketPtr += encodeFrame(data->codec, currentPacketPtr, inputLeft, BUFFER_LENGTH_SAMPLES);
+                
+                data->audioSocket->send((sockaddr *)&audioMixerSocket, dataPacket, currentPacketPtr - dataPacket);
+            } else {
+                // copy the audio data to the last BUFFER_LENGTH_BYTES bytes of the data packet
+                memcpy(currentPacketPtr, inputLeft, BUFFER_LENGTH_BYTES);
+                
+                data->audioSocket->send((sockaddr *)&audioMixerSocket, dataPacket, BUFFER_LENGTH_BYTES + leadingBytes);
+            }
         }
     }
     
@@ -225,15 +254,18 @@ int audioCallback (const void *inputBuffer,
     
     if (ringBuffer->getEndOfLastWrite() != NULL) {
         
-        if (!ringBuffer->isStarted() && ringBuffer->diffLastWriteNextOutput() < PACKET_LENGTH_SAMPLES + JITTER_BUFFER_SAMPLES) {
-            printf("Held back, buffer has %d of %d samples required.\n", ringBuffer->diffLastWriteNextOutput(), PACKET_LENGTH_SAMPLES + JITTER_BUFFER_SAMPLES);
-        } else if (ringBuffer->diffLastWriteNextOutput() < PACKET_LENGTH_SAMPLES) {
+        if (!ringBuffer->isStarted() && ringBuffer->diffLastWriteNextOutput() < PACKET_LENGTH_SAMPLES + ringBuffer->getJitterBufferSamples()) {
+            printf("Held back, buffer has %d of %d samples required.\n", ringBuffer->diffLastWriteNextOutput(), PACKET_LENGTH_SAMPLES + ringBuffer->getJitterBufferSamples());
+        } else if (ringBuffer->diffLastWriteNextOutput() < PACKET_LENGTH_SAMPLES
+                   && !(ringBuffer->isStarted() && ringBuffer->concealNextFrame())) {
             ringBuffer->setStarted(false);
             
             starve_counter++;
             packetsReceivedThisPlayback = 0;
 
-            printf("Starved #%d\n", starve_counter);
+            printf("Starved #%d, %d overruns, %d frames dropped, %d concealed and %d late\n", starve_counter,
+                   ringBuffer->getOverruns(), ringBuffer->getDroppedFrames(),
+                   ringBuffer->getConcealedFrames(), ringBuffer->getLateFrames());
             data->wasStarved = 10;      //   Frames to render the indication that the system was starved.
         } else {
             if (!ringBuffer->isStarted()) {
@@ -263,21 +295,6 @@ int audioCallback (const void *inputBuffer,
                 }
             }
             
-            // check if we have more than we need to play out
-//            int thresholdFrames = ceilf((PACKET_LENGTH_SAMPLES + JITTER_BUFFER_SAMPLES) / (float)PACKET_LENGTH_SAMPLES);
-//            int thresholdSamples = thresholdFrames * PACKET_LENGTH_SAMPLES;
-//            
-//            if (ringBuffer->diffLastWriteNextOutput() > thresholdSamples) {
-//                // we need to push the next output forwards
-//                int samplesToPush = ringBuffer->diffLastWriteNextOutput() - thresholdSamples;
-//                
-//                if (ringBuffer->getNextOutput() + samplesToPush > ringBuffer->getBuffer()) {
-//                    ringBuffer->setNextOutput(ringBuffer->getBuffer() + (samplesToPush - (ringBuffer->getBuffer() + RING_BUFFER_SAMPLES - ringBuffer->getNextOutput())));
-//                } else {
-//                    ringBuffer->setNextOutput(ringBuffer->getNextOutput() + samplesToPush);
-//                }
-//            }
-            
             for (int s = 0; s < PACKET_LENGTH_SAMPLES_PER_CHANNEL; s++) {
                 
                 int leftSample = ringBuffer->getNextOutput()[s];
@@ -320,11 +337,8 @@ int audioCallback (const void *inputBuffer,
                 outputRight[s] = rightSample;
             }
             
-            ringBuffer->setNextOutput(ringBuffer->getNextOutput() + PACKET_LENGTH_SAMPLES);
-            
-            if (ringBuffer->getNextOutput() == ringBuffer->getBuffer() + RING_BUFFER_SAMPLES) {
-                ringBuffer->setNextOutput(ringBuffer->getBuffer());
-            }
+            // an adaptive buffer that has run deeper than it needs to drops a frame here
+            ringBuffer->advanceToNextFrame();
         }
     }
     
@@ -406,7 +420,7 @@ void *receiveAudioViaUDP(void *args) {
             }
             if (packetsReceivedThisPlayback == 1) gettimeofday(&firstPlaybackTimer, NULL);
 
-            ringBuffer->parseData(receivedData, PACKET_LENGTH_BYTES);
+            ringBuffer->parseData(receivedData, receivedBytes);
 
             previousReceiveTime = currentReceiveTime;
         }
@@ -419,6 +433,18 @@ void Audio::setMixerLoopbackFlag(bool newMixerLoopbackFlag) {
     audioData->mixerLoopbackFlag = newMixerLoopbackFlag;
 }
 
+void Audio::setSendSilentFrames(bool newSendSilentFrames) {
+    audioData->sendSilentFrames = newSendSilentFrames;
+}
+
+void Audio::setAdaptiveJitter() {
+    audioData->ringBuffer->setAdaptiveJitter(AUDIO_CALLBACK_MSECS * 1000);
+}
+
+void Audio::setCodec(const AudioCodec *newCodec) {
+    audioData->codec = newCodec;
+}
+
 bool Audio::getMixerLoopbackFlag() {
     return audioData->mixerLoopbackFlag;
 }
@@ -466,6 +492,8 @@ Audio::Audio(Oscilloscope *s, Head *linkedHead)
     // setup a UDPSocket
     audioData->audioSocket = new UDPSocket(AUDIO_UDP_LISTEN_PORT);
     audioData->ringBuffer = new AudioRingBuffer(RING_BUFFER_SAMPLES, PACKET_LENGTH_SAMPLES);
+    audioData->ringBuffer->setJitterBufferSamples(JITTER_BUFFER_SAMPLES);
+    audioData->ringBuffer->setNumChannels(NUM_AUDIO_CHANNELS);
     
     AudioRecThreadStruct threadArgs;
     threadArgs.sharedAudioData = audioData;
@@ -592,10 +620,12 @@ void Audio::render(int screenWidth, int screenHeight)
         sprintf(out,"%3.1f\n", audioData->measuredJitter);
         drawtext(startX + jitterPels - 5, topY-10, 0.08, 0, 1, 0, out, 0,1,1);
         
-        sprintf(out, "%3.1fms\n", JITTER_BUFFER_LENGTH_MSECS);
+        int jitterBufferSamples = audioData->ringBuffer->getJitterBufferSamples();
+        
+        sprintf(out, "%3.1fms\n", jitterBufferSamples / (float) (NUM_AUDIO_CHANNELS * SAMPLE_RATE / 1000.0));
         drawtext(startX - 10, bottomY + 20, 0.1, 0, 1, 0, out, 1, 0, 0);
         
-        sprintf(out, "%hd samples\n", JITTER_BUFFER_SAMPLES);
+        sprintf(out, "%d samples\n", jitterBufferSamples);
         drawtext(startX - 10, bottomY + 35, 0.1, 0, 1, 0, out, 1, 0, 0);
     }
 }
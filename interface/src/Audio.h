@@ -27,6 +27,14 @@ public:
     bool getMixerLoopbackFlag();
     void setMixerLoopbackFlag(bool newMixerLoopbackFlag);
     
+    void setSendSilentFrames(bool newSendSilentFrames);
+    
+    // sizes the jitter buffer from measured arrival jitter instead of the fixed 12ms
+    void setAdaptiveJitter();
+    
+    // compresses input with the codec, the mixer answers in kind, NULL sends raw samples
+    void setCodec(const AudioCodec *newCodec);
+    
     void getInputLoudness(float * lastLoudness, float * averageLoudness);
     void updateMixerParams(in_addr_t mixerAddress, in_port_t mixerPort);
     
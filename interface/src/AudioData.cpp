@@ -20,6 +20,9 @@ AudioData::AudioData() {
     jitterBuffer = 0;
     
     mixerLoopbackFlag = false;
+    sendSilentFrames = false;
+    codec = NULL;
+    outgoingSequence = 0;
 }
 
 
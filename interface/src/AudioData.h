@@ -13,6 +13,7 @@
 #include <stdint.h>
 #include <glm/glm.hpp>
 #include "AudioRingBuffer.h"
+#include "AudioCodec.h"
 #include "UDPSocket.h"
 #include "Head.h"
 
@@ -40,6 +41,9 @@ class AudioData {
         float averagedInputLoudness;
     
         bool mixerLoopbackFlag;
+        bool sendSilentFrames;
+        const AudioCodec *codec;
+        uint16_t outgoingSequence;
         bool playWalkSound;
 };
 
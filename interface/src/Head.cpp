@@ -13,6 +13,7 @@
 #include <fstream>
 #include <sstream>
 #include <SharedUtil.h>
+#include <AvatarState.h>
 #include "Head.h"
 
 using namespace std;
@@ -512,28 +513,55 @@ void Head::render(int faceToFace, int isMine)
 
 //  Transmit data to agents requesting it 
 
-int Head::getBroadcastData(char* data)
+void Head::getAvatarState(AvatarState *state)
 {
-    // Copy data for transmission to the buffer, return length of data
-    sprintf(data, "H%f,%f,%f,%f,%f,%f,%f,%f,%f,%f,%f",
-            getRenderPitch() + Pitch, -getRenderYaw() + 180 -Yaw, Roll,
-            position.x + leanSideways, position.y, position.z + leanForward,
-            loudness, averageLoudness,
-            hand->getPos().x, hand->getPos().y, hand->getPos().z);
-    return strlen(data);
+    // the state we send to other agents
+    state->pitch = getRenderPitch() + Pitch;
+    state->yaw = -getRenderYaw() + 180 - Yaw;
+    state->roll = Roll;
+    state->position[0] = position.x + leanSideways;
+    state->position[1] = position.y;
+    state->position[2] = position.z + leanForward;
+    state->loudness = loudness;
+    state->averageLoudness = averageLoudness;
+    state->handPosition[0] = hand->getPos().x;
+    state->handPosition[1] = hand->getPos().y;
+    state->handPosition[2] = hand->getPos().z;
 }
 
 void Head::parseData(void *data, int size) {
-    // parse head data for this agent
-    glm::vec3 handPos(0,0,0);
-    sscanf((char *)data, "H%f,%f,%f,%f,%f,%f,%f,%f,%f,%f,%f",
-           &Pitch, &Yaw, &Roll,
-           &position.x, &position.y, &position.z,
-           &loudness, &averageLoudness,
-           &handPos.x, &handPos.y, &handPos.z);
+    // parse head data for this agent, as a delta, whole in the binary form or in the text form older clients send
+    AvatarState state;
+    unsigned char *packet = (unsigned char *)data;
+    
+    if (packet[0] == AVATAR_ACK_PACKET_HEADER) {
+        stateSender.acknowledge(packet, size);
+        return;
+    }
+    
+    if (packet[0] == AVATAR_UPDATE_PACKET_HEADER) {
+        if (!stateReceiver.decodeUpdate(packet, size, &state)) {
+            return;
+        }
+    } else if (!decodeAvatarState(packet, size, &state)) {
+        return;
+    }
+    
+    Pitch = state.pitch;
+    Yaw = state.yaw;
+    Roll = state.roll;
+    position = glm::vec3(state.position[0], state.position[1], state.position[2]);
+    loudness = state.loudness;
+    averageLoudness = state.averageLoudness;
+    
+    glm::vec3 handPos(state.handPosition[0], state.handPosition[1], state.handPosition[2]);
     if (glm::length(handPos) > 0.0) hand->setPos(handPos);
 }
 
+int Head::getReplyData(unsigned char *reply) {
+    return stateReceiver.encodeAcknowledgement(reply);
+}
+
 void Head::SetNewHeadTarget(float pitch, float yaw)
 {
     PitchTarget = pitch;
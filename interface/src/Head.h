@@ -11,6 +11,7 @@
 
 #include <iostream>
 #include "AgentData.h"
+#include "AvatarReplication.h"
 #include "Field.h"
 #include "world.h"
 #include "Head.h"
@@ -63,8 +64,9 @@ class Head : public AgentData {
         void simulate(float);
         
         //  Send and receive network data
-        int getBroadcastData(char * data);
+        void getAvatarState(AvatarState *state);
         void parseData(void *data, int size);
+        int getReplyData(unsigned char *reply);
         
         float getLoudness() {return loudness;};
         float getAverageLoudness() {return averageLoudness;};
@@ -86,7 +88,11 @@ class Head : public AgentData {
     
         Hand * hand;
     
+        //  Our own state on its way to this agent
+        AvatarStateSender stateSender;
+    
     private:
+        AvatarStateReceiver stateReceiver;
         float noise;
         float Pitch;
         float Yaw;
@@ -100,19 +100,26 @@ void VoxelSystem::loadVoxelsFile(const char* fileName, bool wantColorRandomizer)
 //              mechanism to tell the system to redraw it's arrays after voxels are done
 //              being added. This is a concept mostly only understood by VoxelSystem.
 // Complaints:  Brad :)
-void VoxelSystem::createSphere(float r,float xc, float yc, float zc, float s, bool solid, bool wantColorRandomizer) {
+void VoxelSystem::createSphere(float r,float xc, float yc, float zc, float s, bool solid, bool wantColorRandomizer,
+                               std::vector<unsigned char> *insertData) {
 
-    tree->createSphere(r,xc,yc,zc,s,solid,wantColorRandomizer);
+    tree->createSphere(r,xc,yc,zc,s,solid,wantColorRandomizer,insertData);
     setupNewVoxelsForDrawing();
 }
 
 
 void VoxelSystem::parseData(void *data, int size) {
-    // output the bits received from the voxel server
-    unsigned char *voxelData = (unsigned char *) data + 1;
+    // note the packet for the voxel server's receipts and skip past its header
+    int headerBytes = streamReceiver.packetReceived((unsigned char *) data, size);
+    
+    if (headerBytes == 0) {
+        return;
+    }
+    
+    unsigned char *voxelData = (unsigned char *) data + headerBytes;
     
     // ask the VoxelTree to read the bitstream into the tree
-    tree->readBitstreamToTree(voxelData, size - 1);
+    tree->readBitstreamToTree(voxelData, size - headerBytes);
     
     setupNewVoxelsForDrawing();
 }
@@ -15,6 +15,8 @@
 #include <UDPSocket.h>
 #include <AgentData.h>
 #include <VoxelTree.h>
+#include <VoxelStream.h>
+#include <SharedUtil.h>
 #include "Head.h"
 #include "Util.h"
 #include "world.h"
@@ -36,7 +38,11 @@ public:
     int getVoxelsRendered() {return voxelsRendered;};
     void setViewerHead(Head *newViewerHead);
     void loadVoxelsFile(const char* fileName,bool wantColorRandomizer);
-	void createSphere(float r,float xc, float yc, float zc, float s, bool solid, bool wantColorRandomizer);
+	void createSphere(float r,float xc, float yc, float zc, float s, bool solid, bool wantColorRandomizer,
+                      std::vector<unsigned char> *insertData = NULL);
+    
+    // what we tell the voxel server we've had of what it sent, so it knows how fast to send
+    int encodeReceipt(unsigned char *packet) { return streamReceiver.encodeReceipt(packet, usecTimestampNow()); };
 private:
     int voxelsRendered;
     Head *viewerHead;
@@ -53,6 +59,7 @@ private:
     GLuint vboIndicesID;
     GLuint vboNormalsID;
     pthread_mutex_t bufferWriteLock;
+    VoxelStreamReceiver streamReceiver;
     
     int treeToArrays(VoxelNode *currentNode, float nodePosition[3]);
     void setupNewVoxelsForDrawing();
@@ -54,6 +54,7 @@
 #include "UDPSocket.h"
 #include "SerialInterface.h"
 #include <SharedUtil.h>
+#include <OctalCode.h>
 #include "Shader.h"
 
 using namespace std;
@@ -510,10 +511,51 @@ void simulateHead(float frametime)
     #endif
 
     //  Send my streaming head data to agents that are nearby and need to see it!
-    const int MAX_BROADCAST_STRING = 200;
-    char broadcast_string[MAX_BROADCAST_STRING];
-    int broadcast_bytes = myHead.getBroadcastData(broadcast_string);
-    agentList.broadcastToAgents(broadcast_string, broadcast_bytes);
+    //  each gets a delta against what it last acked, less often the further away it is
+    //  with an avatar relay around it gets our one stream and passes it on to the other interfaces
+    AvatarState myState;
+    myHead.getAvatarState(&myState);
+    
+    unsigned char updatePacket[MAX_AVATAR_UPDATE_PACKET_BYTES];
+    unsigned int readEpoch;
+    const AgentSnapshot *agents = agentList.beginSnapshotRead(&readEpoch);
+    
+    bool haveAvatarRelay = false;
+    
+    for (AgentSnapshot::const_iterator agent = agents->begin(); agent != agents->end(); agent++) {
+        if ((*agent)->getType() == 'A' && (*agent)->getActiveSocket() != NULL && (*agent)->getLinkedData() != NULL) {
+            haveAvatarRelay = true;
+        }
+    }
+    
+    for (AgentSnapshot::const_iterator agent = agents->begin(); agent != agents->end(); agent++) {
+        if ((*agent)->getActiveSocket() == NULL || (*agent)->getLinkedData() == NULL
+            || ((*agent)->getType() != 'V' && (*agent)->getType() != (haveAvatarRelay ? 'A' : 'I'))) {
+            continue;
+        }
+        
+        Head *agentHead = (Head *)(*agent)->getLinkedData();
+        
+        // the voxel server culls by our position and the relay by everyone's, so they hear from us at the full rate
+        float distance = (*agent)->getType() == 'I' ? glm::length(agentHead->getPos() - myHead.getPos()) : 0;
+        int updateBytes = agentHead->stateSender.encodeUpdate(updatePacket, &myState, distance);
+        
+        if (updateBytes > 0) {
+            agentList.getAgentSocket().send((*agent)->getActiveSocket(), updatePacket, updateBytes);
+        }
+        
+        if ((*agent)->getType() == 'V') {
+            // the voxel server paces what it sends us by how much of it arrives
+            unsigned char receiptPacket[VOXEL_RECEIPT_PACKET_BYTES];
+            int receiptBytes = voxels.encodeReceipt(receiptPacket);
+            
+            if (receiptBytes > 0) {
+                agentList.getAgentSocket().send((*agent)->getActiveSocket(), receiptPacket, receiptBytes);
+            }
+        }
+    }
+    
+    agentList.endSnapshotRead(readEpoch);
 }
 
 int render_test_spot = WIDTH/2;
@@ -608,9 +650,12 @@ void display(void)
         if (display_field) field.render();
             
         //  Render heads of other agents
-        for(std::vector<Agent>::iterator agent = agentList.getAgents().begin(); agent != agentList.getAgents().end(); agent++) {
-            if (agent->getLinkedData() != NULL) {
-                Head *agentHead = (Head *)agent->getLinkedData();
+        unsigned int readEpoch;
+        const AgentSnapshot *agents = agentList.beginSnapshotRead(&readEpoch);
+        
+        for(AgentSnapshot::const_iterator agent = agents->begin(); agent != agents->end(); agent++) {
+            if ((*agent)->getLinkedData() != NULL) {
+                Head *agentHead = (Head *)(*agent)->getLinkedData();
                 glPushMatrix();
                 glm::vec3 pos = agentHead->getPos();
                 glTranslatef(-pos.x, -pos.y, -pos.z);
@@ -618,6 +663,8 @@ void display(void)
                 glPopMatrix();
             }
         }
+        
+        agentList.endSnapshotRead(readEpoch);
 
 
 
@@ -704,9 +751,11 @@ void display(void)
     if (stats_on) display_stats();
     
     //  Draw number of nearby people always
-    char agents[100];
-    sprintf(agents, "Agents nearby: %ld\n", agentList.getAgents().size());
-    drawtext(WIDTH-200,20, 0.10, 0, 1.0, 0, agents, 1, 1, 0);
+    char agentsNearby[100];
+    unsigned int readEpoch;
+    sprintf(agentsNearby, "Agents nearby: %ld\n", agentList.beginSnapshotRead(&readEpoch)->size());
+    agentList.endSnapshotRead(readEpoch);
+    drawtext(WIDTH-200,20, 0.10, 0, 1.0, 0, agentsNearby, 1, 1, 0);
     
     glPopMatrix();
 
@@ -735,6 +784,45 @@ void testPointToVoxel()
 	}
 }
 
+// inserts go to the voxel servers as messages of at most this many bytes, so losing a fragment only loses part of them
+const int VOXEL_INSERT_MESSAGE_BYTES = 64 * MESSAGE_FRAGMENT_PAYLOAD_BYTES;
+
+unsigned short int voxelInsertNumber = 0;
+
+// sends voxels, each its code and color, to every voxel server as 'I' inserts, split between voxels
+void sendVoxelInsert(const std::vector<unsigned char> &insertData) {
+    std::vector<unsigned char> message;
+    unsigned int readEpoch;
+    const AgentSnapshot *agents = agentList.beginSnapshotRead(&readEpoch);
+    
+    int atByte = 0;
+    
+    while (atByte < insertData.size()) {
+        message.assign(1, 'I');
+        message.insert(message.end(), (unsigned char *) &voxelInsertNumber, (unsigned char *) &voxelInsertNumber + sizeof(voxelInsertNumber));
+        voxelInsertNumber++;
+        
+        while (atByte < insertData.size()) {
+            int voxelDataSize = bytesRequiredForCodeLength(insertData[atByte]) + 3;
+            
+            if (message.size() > 3 && message.size() + voxelDataSize > VOXEL_INSERT_MESSAGE_BYTES) {
+                break;
+            }
+            
+            message.insert(message.end(), insertData.begin() + atByte, insertData.begin() + atByte + voxelDataSize);
+            atByte += voxelDataSize;
+        }
+        
+        for (AgentSnapshot::const_iterator agent = agents->begin(); agent != agents->end(); agent++) {
+            if ((*agent)->getType() == 'V' && (*agent)->getActiveSocket() != NULL) {
+                sendMessage(agentList.getAgentSocket(), (*agent)->getActiveSocket(), &message[0], message.size());
+            }
+        }
+    }
+    
+    agentList.endSnapshotRead(readEpoch);
+}
+
 void addRandomSphere(bool wantColorRandomizer)
 {
 	float r = randFloatInRange(0.05,0.1);
@@ -750,7 +838,11 @@ void addRandomSphere(bool wantColorRandomizer)
 	printf("yc=%f\n",yc);
 	printf("zc=%f\n",zc);
 
-	voxels.createSphere(r,xc,yc,zc,s,solid,wantColorRandomizer);
+	std::vector<unsigned char> sphereVoxels;
+	voxels.createSphere(r,xc,yc,zc,s,solid,wantColorRandomizer,&sphereVoxels);
+	
+	// and have the voxel servers add it for everyone else
+	sendVoxelInsert(sphereVoxels);
 }
 
 
@@ -1020,6 +1112,27 @@ int main(int argc, const char * argv[])
 		sprintf(DOMAIN_IP,"%d.%d.%d.%d", (ip & 0xFF), ((ip >> 8) & 0xFF),((ip >> 16) & 0xFF), ((ip >> 24) & 0xFF));
     }
 
+    #ifndef NO_AUDIO
+    // send quiet input to the mixer as silent frames, needs a mixer that understands them
+    if (cmdOptionExists(argc, argv, "--silentFrames")) {
+        audio.setSendSilentFrames(true);
+    }
+    
+    if (cmdOptionExists(argc, argv, "--adaptiveJitter")) {
+        audio.setAdaptiveJitter();
+    }
+    
+    const char *audioCodecName = getCmdOption(argc, argv, "--audioCodec");
+    
+    if (audioCodecName) {
+        if (audioCodecNamed(audioCodecName)) {
+            audio.setCodec(audioCodecNamed(audioCodecName));
+        } else {
+            printf("Unknown audio codec %s, sending raw samples.\n", audioCodecName);
+        }
+    }
+    #endif
+
     // the callback for our instance of AgentList is attachNewHeadToAgent
     agentList.linkedDataCreateCallback = &attachNewHeadToAgent;
     
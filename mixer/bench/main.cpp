@@ -0,0 +1,207 @@
+//
+//  main.cpp
+//  mixer-bench
+//
+//  Copyright (c) 2013 High Fidelity, Inc. All rights reserved.
+//
+
+#include <math.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <limits>
+#include <SharedUtil.h>
+#include <UDPSocket.h>
+#include <AudioCodec.h>
+#include "MixKernel.h"
+#include "PanningTable.h"
+
+const char BENCHMARK_MIX_KERNELS_OPTION[] = "--benchmarkMixKernels";
+const int BENCHMARK_SOURCE_FRAMES = 200000;
+
+const char BENCHMARK_PANNING_OPTION[] = "--benchmarkPanning";
+const int BENCHMARK_PANNED_PAIRS = 2000000;
+
+PanningTable panningTable;
+
+const char BENCHMARK_AUDIO_CODECS_OPTION[] = "--benchmarkAudioCodecs";
+
+void benchmarkMixKernels() {
+    // one source frame is what sendBuffer does for each listener/source pair
+    const int BENCHMARK_DELAY_SAMPLES = PHASE_DELAY_AT_90 / 2;
+    
+    int16_t *sourceSamples = new int16_t[BUFFER_LENGTH_SAMPLES_PER_CHANNEL + BENCHMARK_DELAY_SAMPLES];
+    int32_t mixAccumulator[BUFFER_LENGTH_SAMPLES_PER_CHANNEL * 2];
+    int16_t clientMix[BUFFER_LENGTH_SAMPLES_PER_CHANNEL * 2];
+    
+    for (int i = 0; i < BUFFER_LENGTH_SAMPLES_PER_CHANNEL + BENCHMARK_DELAY_SAMPLES; i++) {
+        sourceSamples[i] = randIntInRange(std::numeric_limits<int16_t>::min(), std::numeric_limits<int16_t>::max());
+    }
+    
+    const MixKernel *kernels[MAX_MIX_KERNELS];
+    int numKernels = availableMixKernels(kernels);
+    
+    for (int k = 0; k < numKernels; k++) {
+        memset(mixAccumulator, 0, sizeof(mixAccumulator));
+        double startUsecs = usecTimestampNow();
+        
+        for (int f = 0; f < BENCHMARK_SOURCE_FRAMES; f++) {
+            int16_t *frameSamples = sourceSamples + BENCHMARK_DELAY_SAMPLES;
+            
+            kernels[k]->accumulate(mixAccumulator, frameSamples, BUFFER_LENGTH_SAMPLES_PER_CHANNEL, 0.75f);
+            kernels[k]->accumulateAttenuated(mixAccumulator + BUFFER_LENGTH_SAMPLES_PER_CHANNEL, sourceSamples,
+                                             BENCHMARK_DELAY_SAMPLES, 0.75f, 0.6f);
+            kernels[k]->accumulateAttenuated(mixAccumulator + BUFFER_LENGTH_SAMPLES_PER_CHANNEL + BENCHMARK_DELAY_SAMPLES,
+                                             frameSamples, BUFFER_LENGTH_SAMPLES_PER_CHANNEL - BENCHMARK_DELAY_SAMPLES,
+                                             0.75f, 0.6f);
+            
+            if (f % 64 == 63) {
+                kernels[k]->saturate(clientMix, mixAccumulator, BUFFER_LENGTH_SAMPLES_PER_CHANNEL * 2);
+                memset(mixAccumulator, 0, sizeof(mixAccumulator));
+            }
+        }
+        
+        double elapsedUsecs = usecTimestampNow() - startUsecs;
+        
+        printf("%-8s %12.0f source frames/s, matches scalar: %s\n",
+               kernels[k]->name,
+               BENCHMARK_SOURCE_FRAMES / (elapsedUsecs / 1000000),
+               mixKernelMatchesScalar(kernels[k]) ? "yes" : "NO");
+    }
+    
+    delete[] sourceSamples;
+}
+
+void benchmarkPanning() {
+    // random pairs within earshot, the same ones for both paths
+    const int BENCHMARK_POSITIONS = 1024;
+    const float BENCHMARK_WORLD_SIZE = 100;
+    
+    float (*positions)[3] = new float[BENCHMARK_POSITIONS][3];
+    
+    for (int i = 0; i < BENCHMARK_POSITIONS; i++) {
+        for (int j = 0; j < 3; j++) {
+            positions[i][j] = randFloat() * BENCHMARK_WORLD_SIZE;
+        }
+    }
+    
+    SourcePanning panning, exactPanning;
+    float maxCoeffError = 0;
+    int maxDelayError = 0;
+    
+    for (int e = 0; e < 2; e++) {
+        panningTable.setExact(e == 1);
+        
+        double startUsecs = usecTimestampNow();
+        float coeffSum = 0;
+        
+        for (int p = 0; p < BENCHMARK_PANNED_PAIRS; p++) {
+            ListenerPose listener;
+            poseListener(&listener, positions[p % BENCHMARK_POSITIONS], (p % 360) - 180);
+            
+            panningTable.panSource(&listener, positions[(p * 7 + 1) % BENCHMARK_POSITIONS], &panning);
+            coeffSum += panning.distanceCoeff;
+        }
+        
+        double elapsedUsecs = usecTimestampNow() - startUsecs;
+        
+        printf("%-6s %12.0f coefficients/s (checksum %f)\n",
+               panningTable.isExact() ? "exact" : "table",
+               BENCHMARK_PANNED_PAIRS / (elapsedUsecs / 1000000),
+               coeffSum);
+    }
+    
+    // how far the tables stray from the exact path over the same pairs
+    for (int p = 0; p < BENCHMARK_POSITIONS * 16; p++) {
+        ListenerPose listener;
+        poseListener(&listener, positions[p % BENCHMARK_POSITIONS], (p % 360) - 180);
+        float *sourcePosition = positions[(p * 7 + 1) % BENCHMARK_POSITIONS];
+        
+        panningTable.setExact(false);
+        panningTable.panSource(&listener, sourcePosition, &panning);
+        panningTable.setExact(true);
+        panningTable.panSource(&listener, sourcePosition, &exactPanning);
+        
+        maxCoeffError = std::max(maxCoeffError, fabsf(panning.distanceCoeff - exactPanning.distanceCoeff));
+        maxDelayError = std::max(maxDelayError, abs(panning.numSamplesDelay - exactPanning.numSamplesDelay));
+    }
+    
+    printf("Largest table error: %f coefficient, %d samples delay\n", maxCoeffError, maxDelayError);
+    
+    panningTable.setExact(false);
+    delete[] positions;
+}
+
+void benchmarkAudioCodecs() {
+    // a mix's worth of a tone over noise, coded a channel at a time like the mixer does
+    const int BENCHMARK_CODED_FRAMES = 20000;
+    const int MIX_SAMPLES = BUFFER_LENGTH_SAMPLES_PER_CHANNEL * 2;
+    
+    int16_t mix[MIX_SAMPLES], decodedMix[MIX_SAMPLES];
+    unsigned char encodedMix[MAX_BUFFER_LENGTH_BYTES];
+    
+    for (int i = 0; i < MIX_SAMPLES; i++) {
+        mix[i] = 6000 * sinf(2 * M_PI * 440 * i / SAMPLE_RATE) + randIntInRange(-300, 300);
+    }
+    
+    for (int c = 0; c < NUM_AUDIO_CODECS; c++) {
+        const AudioCodec *codec = AUDIO_CODECS[c];
+        int encodedBytes = 0;
+        
+        double startUsecs = usecTimestampNow();
+        
+        for (int f = 0; f < BENCHMARK_CODED_FRAMES; f++) {
+            encodedBytes = encodeFrame(codec, encodedMix, mix, MIX_SAMPLES);
+        }
+        
+        double encodeUsecs = usecTimestampNow() - startUsecs;
+        startUsecs = usecTimestampNow();
+        
+        for (int f = 0; f < BENCHMARK_CODED_FRAMES; f++) {
+            decodeFrame(codec, decodedMix, encodedMix, MIX_SAMPLES);
+        }
+        
+        double decodeUsecs = usecTimestampNow() - startUsecs;
+        
+        double signalPower = 0, errorPower = 0;
+        
+        for (int i = 0; i < MIX_SAMPLES; i++) {
+            signalPower += (double) mix[i] * mix[i];
+            errorPower += (double) (mix[i] - decodedMix[i]) * (mix[i] - decodedMix[i]);
+        }
+        
+        printf("%-6s %5d bytes/mix (%4.1fx), encode %7.1f Msamples/s, decode %7.1f Msamples/s, SNR %5.1f dB\n",
+               codec->name,
+               encodedBytes + COMPRESSED_AUDIO_HEADER_BYTES,
+               BUFFER_LENGTH_BYTES / (float) (encodedBytes + COMPRESSED_AUDIO_HEADER_BYTES),
+               BENCHMARK_CODED_FRAMES * MIX_SAMPLES / encodeUsecs,
+               BENCHMARK_CODED_FRAMES * MIX_SAMPLES / decodeUsecs,
+               errorPower > 0 ? 10 * log10(signalPower / errorPower) : INFINITY);
+    }
+}
+
+int main(int argc, const char * argv[])
+{
+    setvbuf(stdout, NULL, _IOLBF, 0);
+    
+    if (cmdOptionExists(argc, argv, BENCHMARK_MIX_KERNELS_OPTION)) {
+        benchmarkMixKernels();
+        return 0;
+    }
+    
+    if (cmdOptionExists(argc, argv, BENCHMARK_PANNING_OPTION)) {
+        benchmarkPanning();
+        return 0;
+    }
+    
+    if (cmdOptionExists(argc, argv, BENCHMARK_AUDIO_CODECS_OPTION)) {
+        benchmarkAudioCodecs();
+        return 0;
+    }
+    
+    printf("Usage: mixer-bench benchmark\n");
+    printf("  %s\n", BENCHMARK_MIX_KERNELS_OPTION);
+    printf("  %s\n", BENCHMARK_PANNING_OPTION);
+    printf("  %s\n", BENCHMARK_AUDIO_CODECS_OPTION);
+    return 1;
+}
@@ -0,0 +1,137 @@
+//
+//  AudioSourceGrid.cpp
+//  mixer
+//
+//  Copyright (c) 2013 High Fidelity, Inc. All rights reserved.
+//
+
+#include <cmath>
+#include <algorithm>
+#include "AudioSourceGrid.h"
+
+// cell coordinates are packed into 21 bits each for the key
+const int MAX_CELL_COORDINATE = (1 << 20) - 1;
+
+AudioSourceGrid::AudioSourceGrid() {
+    cellSize = 1;
+    numCells = 0;
+}
+
+void AudioSourceGrid::reset(float newCellSize) {
+    cellSize = newCellSize;
+    numCells = 0;
+    cellIndices.clear();
+}
+
+void AudioSourceGrid::cellCoordinates(float *position, int *coordinates) {
+    for (int i = 0; i < 3; i++) {
+        float coordinate = floorf(position[i] / cellSize);
+        coordinates[i] = std::max(-MAX_CELL_COORDINATE, std::min(MAX_CELL_COORDINATE, (int) coordinate));
+    }
+}
+
+uint64_t AudioSourceGrid::cellKey(int *coordinates) {
+    return ((uint64_t) (coordinates[0] & 0x1FFFFF) << 42)
+        | ((uint64_t) (coordinates[1] & 0x1FFFFF) << 21)
+        | (uint64_t) (coordinates[2] & 0x1FFFFF);
+}
+
+void AudioSourceGrid::addSource(int sourceIndex, float *position) {
+    int coordinates[3];
+    cellCoordinates(position, coordinates);
+    
+    uint64_t key = cellKey(coordinates);
+    std::unordered_map<uint64_t, int>::iterator indexEntry = cellIndices.find(key);
+    AudioSourceCell *cell;
+    
+    if (indexEntry == cellIndices.end()) {
+        // grab the next cell, re-using one from an earlier frame if there is one
+        if (numCells == cells.size()) {
+            cells.push_back(AudioSourceCell());
+        }
+        
+        cell = &cells[numCells];
+        cellIndices[key] = numCells++;
+        
+        cell->sourceIndices.clear();
+        cell->hasPremix = false;
+        
+        for (int i = 0; i < 3; i++) {
+            cell->positionSum[i] = 0;
+            cell->minCorner[i] = coordinates[i] * cellSize;
+        }
+    } else {
+        cell = &cells[indexEntry->second];
+    }
+    
+    cell->sourceIndices.push_back(sourceIndex);
+    
+    for (int i = 0; i < 3; i++) {
+        cell->positionSum[i] += position[i];
+    }
+}
+
+void AudioSourceGrid::finish() {
+    for (int c = 0; c < numCells; c++) {
+        for (int i = 0; i < 3; i++) {
+            cells[c].centroid[i] = cells[c].positionSum[i] / cells[c].sourceIndices.size();
+        }
+    }
+}
+
+AudioSourceCell *AudioSourceGrid::cellContaining(float *position) {
+    int coordinates[3];
+    cellCoordinates(position, coordinates);
+    
+    std::unordered_map<uint64_t, int>::iterator indexEntry = cellIndices.find(cellKey(coordinates));
+    return indexEntry == cellIndices.end() ? NULL : &cells[indexEntry->second];
+}
+
+float AudioSourceGrid::distanceToCell(float *position, AudioSourceCell *cell) {
+    // distance from the position to the closest point of the cell's cube
+    float distanceSquared = 0;
+    
+    for (int i = 0; i < 3; i++) {
+        float outside = std::max(cell->minCorner[i] - position[i], position[i] - (cell->minCorner[i] + cellSize));
+        
+        if (outside > 0) {
+            distanceSquared += outside * outside;
+        }
+    }
+    
+    return sqrtf(distanceSquared);
+}
+
+void AudioSourceGrid::cellsNear(float *position, float radius, std::vector<AudioSourceCell *> &nearCells) {
+    nearCells.clear();
+    
+    float cellRadius = ceilf(radius / cellSize);
+    float cellsInRange = powf(2 * cellRadius + 1, 3);
+    
+    if (cellsInRange > numCells) {
+        // fewer occupied cells than there are in range, just check each of them
+        for (int c = 0; c < numCells; c++) {
+            if (distanceToCell(position, &cells[c]) <= radius) {
+                nearCells.push_back(&cells[c]);
+            }
+        }
+    } else {
+        int center[3];
+        cellCoordinates(position, center);
+        
+        int range = cellRadius;
+        int coordinates[3];
+        
+        for (coordinates[0] = center[0] - range; coordinates[0] <= center[0] + range; coordinates[0]++) {
+            for (coordinates[1] = center[1] - range; coordinates[1] <= center[1] + range; coordinates[1]++) {
+                for (coordinates[2] = center[2] - range; coordinates[2] <= center[2] + range; coordinates[2]++) {
+                    std::unordered_map<uint64_t, int>::iterator indexEntry = cellIndices.find(cellKey(coordinates));
+                    
+                    if (indexEntry != cellIndices.end() && distanceToCell(position, &cells[indexEntry->second]) <= radius) {
+                        nearCells.push_back(&cells[indexEntry->second]);
+                    }
+                }
+            }
+        }
+    }
+}
@@ -0,0 +1,51 @@
+//
+//  AudioSourceGrid.h
+//  mixer
+//
+//  Copyright (c) 2013 High Fidelity, Inc. All rights reserved.
+//
+
+#ifndef __hifi__AudioSourceGrid__
+#define __hifi__AudioSourceGrid__
+
+#include <iostream>
+#include <vector>
+#include <unordered_map>
+#include <stdint.h>
+
+struct AudioSourceCell {
+    std::vector<int> sourceIndices;
+    float positionSum[3];
+    float centroid[3];
+    float minCorner[3];
+    
+    // the cell's sources mixed together once per frame, shared by every listener that hears them as a cluster
+    std::vector<int16_t> premix;
+    bool hasPremix;
+};
+
+// buckets audio sources into cubic cells by position so a listener only has to visit the cells within earshot
+// the grid is rebuilt every frame, cells and their vectors are kept around so that doesn't allocate
+class AudioSourceGrid {
+    public:
+        AudioSourceGrid();
+        
+        void reset(float cellSize);
+        void addSource(int sourceIndex, float *position);
+        void finish();
+        
+        AudioSourceCell *cellContaining(float *position);
+        void cellsNear(float *position, float radius, std::vector<AudioSourceCell *> &nearCells);
+        int getNumCells() { return numCells; };
+    private:
+        float cellSize;
+        int numCells;
+        std::vector<AudioSourceCell> cells;
+        std::unordered_map<uint64_t, int> cellIndices;
+        
+        void cellCoordinates(float *position, int *coordinates);
+        uint64_t cellKey(int *coordinates);
+        float distanceToCell(float *position, AudioSourceCell *cell);
+};
+
+#endif /* defined(__hifi__AudioSourceGrid__) */
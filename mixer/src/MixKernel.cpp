@@ -0,0 +1,234 @@
+//
+//  MixKernel.cpp
+//  mixer
+//
+//  Copyright (c) 2013 High Fidelity, Inc. All rights reserved.
+//
+
+#include <string.h>
+#include <stdlib.h>
+#include <limits>
+#include "MixKernel.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define MIX_KERNEL_X86
+#include <emmintrin.h>
+#include <immintrin.h>
+#endif
+
+const int32_t MAX_MIX_SAMPLE = std::numeric_limits<int16_t>::max();
+const int32_t MIN_MIX_SAMPLE = std::numeric_limits<int16_t>::min();
+
+void scalarAccumulate(int32_t *mix, const int16_t *source, int numSamples, float coeff) {
+    for (int i = 0; i < numSamples; i++) {
+        mix[i] += (int32_t) (source[i] * coeff);
+    }
+}
+
+void scalarAccumulateAttenuated(int32_t *mix, const int16_t *source, int numSamples, float coeff, float ratio) {
+    for (int i = 0; i < numSamples; i++) {
+        int32_t scaledSample = source[i] * coeff;
+        mix[i] += (int32_t) (scaledSample * ratio);
+    }
+}
+
+void scalarSaturate(int16_t *output, const int32_t *mix, int numSamples) {
+    for (int i = 0; i < numSamples; i++) {
+        output[i] = std::max(MIN_MIX_SAMPLE, std::min(MAX_MIX_SAMPLE, mix[i]));
+    }
+}
+
+const MixKernel SCALAR_MIX_KERNEL = { "scalar", scalarAccumulate, scalarAccumulateAttenuated, scalarSaturate };
+
+#ifdef MIX_KERNEL_X86
+
+// SSE2 has no sign extending int16 load, unpack the samples into the high halves and shift them back down
+__attribute__((target("sse2")))
+static inline __m128i sse2LowSamplesToInt32(__m128i samples) {
+    return _mm_srai_epi32(_mm_unpacklo_epi16(samples, samples), 16);
+}
+
+__attribute__((target("sse2")))
+static inline __m128i sse2HighSamplesToInt32(__m128i samples) {
+    return _mm_srai_epi32(_mm_unpackhi_epi16(samples, samples), 16);
+}
+
+__attribute__((target("sse2")))
+static inline void sse2AddScaled(int32_t *mix, __m128i samples, __m128 coeff) {
+    __m128i scaled = _mm_cvttps_epi32(_mm_mul_ps(_mm_cvtepi32_ps(samples), coeff));
+    _mm_storeu_si128((__m128i *) mix, _mm_add_epi32(_mm_loadu_si128((__m128i *) mix), scaled));
+}
+
+__attribute__((target("sse2")))
+static inline void sse2AddScaledAttenuated(int32_t *mix, __m128i samples, __m128 coeff, __m128 ratio) {
+    __m128i scaled = _mm_cvttps_epi32(_mm_mul_ps(_mm_cvtepi32_ps(samples), coeff));
+    __m128i attenuated = _mm_cvttps_epi32(_mm_mul_ps(_mm_cvtepi32_ps(scaled), ratio));
+    _mm_storeu_si128((__m128i *) mix, _mm_add_epi32(_mm_loadu_si128((__m128i *) mix), attenuated));
+}
+
+__attribute__((target("sse2")))
+void sse2Accumulate(int32_t *mix, const int16_t *source, int numSamples, float coeff) {
+    __m128 coeffs = _mm_set1_ps(coeff);
+    int i = 0;
+    
+    for (; i + 8 <= numSamples; i += 8) {
+        __m128i samples = _mm_loadu_si128((__m128i *) (source + i));
+        sse2AddScaled(mix + i, sse2LowSamplesToInt32(samples), coeffs);
+        sse2AddScaled(mix + i + 4, sse2HighSamplesToInt32(samples), coeffs);
+    }
+    
+    scalarAccumulate(mix + i, source + i, numSamples - i, coeff);
+}
+
+__attribute__((target("sse2")))
+void sse2AccumulateAttenuated(int32_t *mix, const int16_t *source, int numSamples, float coeff, float ratio) {
+    __m128 coeffs = _mm_set1_ps(coeff);
+    __m128 ratios = _mm_set1_ps(ratio);
+    int i = 0;
+    
+    for (; i + 8 <= numSamples; i += 8) {
+        __m128i samples = _mm_loadu_si128((__m128i *) (source + i));
+        sse2AddScaledAttenuated(mix + i, sse2LowSamplesToInt32(samples), coeffs, ratios);
+        sse2AddScaledAttenuated(mix + i + 4, sse2HighSamplesToInt32(samples), coeffs, ratios);
+    }
+    
+    scalarAccumulateAttenuated(mix + i, source + i, numSamples - i, coeff, ratio);
+}
+
+__attribute__((target("sse2")))
+void sse2Saturate(int16_t *output, const int32_t *mix, int numSamples) {
+    int i = 0;
+    
+    for (; i + 8 <= numSamples; i += 8) {
+        __m128i packed = _mm_packs_epi32(_mm_loadu_si128((__m128i *) (mix + i)),
+                                         _mm_loadu_si128((__m128i *) (mix + i + 4)));
+        _mm_storeu_si128((__m128i *) (output + i), packed);
+    }
+    
+    scalarSaturate(output + i, mix + i, numSamples - i);
+}
+
+__attribute__((target("avx2")))
+void avx2Accumulate(int32_t *mix, const int16_t *source, int numSamples, float coeff) {
+    __m256 coeffs = _mm256_set1_ps(coeff);
+    int i = 0;
+    
+    for (; i + 8 <= numSamples; i += 8) {
+        __m256i samples = _mm256_cvtepi16_epi32(_mm_loadu_si128((__m128i *) (source + i)));
+        __m256i scaled = _mm256_cvttps_epi32(_mm256_mul_ps(_mm256_cvtepi32_ps(samples), coeffs));
+        _mm256_storeu_si256((__m256i *) (mix + i), _mm256_add_epi32(_mm256_loadu_si256((__m256i *) (mix + i)), scaled));
+    }
+    
+    scalarAccumulate(mix + i, source + i, numSamples - i, coeff);
+}
+
+__attribute__((target("avx2")))
+void avx2AccumulateAttenuated(int32_t *mix, const int16_t *source, int numSamples, float coeff, float ratio) {
+    __m256 coeffs = _mm256_set1_ps(coeff);
+    __m256 ratios = _mm256_set1_ps(ratio);
+    int i = 0;
+    
+    for (; i + 8 <= numSamples; i += 8) {
+        __m256i samples = _mm256_cvtepi16_epi32(_mm_loadu_si128((__m128i *) (source + i)));
+        __m256i scaled = _mm256_cvttps_epi32(_mm256_mul_ps(_mm256_cvtepi32_ps(samples), coeffs));
+        __m256i attenuated = _mm256_cvttps_epi32(_mm256_mul_ps(_mm256_cvtepi32_ps(scaled), ratios));
+        _mm256_storeu_si256((__m256i *) (mix + i), _mm256_add_epi32(_mm256_loadu_si256((__m256i *) (mix + i)), attenuated));
+    }
+    
+    scalarAccumulateAttenuated(mix + i, source + i, numSamples - i, coeff, ratio);
+}
+
+__attribute__((target("avx2")))
+void avx2Saturate(int16_t *output, const int32_t *mix, int numSamples) {
+    int i = 0;
+    
+    for (; i + 16 <= numSamples; i += 16) {
+        // packs works within each 128 bit lane, put the quarters back in order afterwards
+        __m256i packed = _mm256_packs_epi32(_mm256_loadu_si256((__m256i *) (mix + i)),
+                                            _mm256_loadu_si256((__m256i *) (mix + i + 8)));
+        _mm256_storeu_si256((__m256i *) (output + i), _mm256_permute4x64_epi64(packed, 0xD8));
+    }
+    
+    scalarSaturate(output + i, mix + i, numSamples - i);
+}
+
+const MixKernel SSE2_MIX_KERNEL = { "sse2", sse2Accumulate, sse2AccumulateAttenuated, sse2Saturate };
+const MixKernel AVX2_MIX_KERNEL = { "avx2", avx2Accumulate, avx2AccumulateAttenuated, avx2Saturate };
+
+#endif
+
+int availableMixKernels(const MixKernel **kernels) {
+    int numKernels = 0;
+    
+    kernels[numKernels++] = &SCALAR_MIX_KERNEL;
+
+#ifdef MIX_KERNEL_X86
+    __builtin_cpu_init();
+    
+    if (__builtin_cpu_supports("sse2")) {
+        kernels[numKernels++] = &SSE2_MIX_KERNEL;
+    }
+    
+    if (__builtin_cpu_supports("avx2")) {
+        kernels[numKernels++] = &AVX2_MIX_KERNEL;
+    }
+#endif
+    
+    return numKernels;
+}
+
+const MixKernel *bestMixKernel() {
+    const MixKernel *kernels[MAX_MIX_KERNELS];
+    return kernels[availableMixKernels(kernels) - 1];
+}
+
+const MixKernel *mixKernelNamed(const char *name) {
+    const MixKernel *kernels[MAX_MIX_KERNELS];
+    int numKernels = availableMixKernels(kernels);
+    
+    for (int i = 0; i < numKernels; i++) {
+        if (strcmp(kernels[i]->name, name) == 0) {
+            return kernels[i];
+        }
+    }
+    
+    return NULL;
+}
+
+bool mixKernelMatchesScalar(const MixKernel *kernel) {
+    // odd lengths so the vector loops and their scalar tails both get exercised
+    const int CHECK_SAMPLES = 263;
+    const int CHECK_ROUNDS = 64;
+    
+    int16_t source[CHECK_SAMPLES];
+    int32_t expectedMix[CHECK_SAMPLES], kernelMix[CHECK_SAMPLES];
+    int16_t expectedOutput[CHECK_SAMPLES], kernelOutput[CHECK_SAMPLES];
+    
+    for (int round = 0; round < CHECK_ROUNDS; round++) {
+        for (int i = 0; i < CHECK_SAMPLES; i++) {
+            // include the extremes of the sample range, they're where truncation and clamping differ
+            source[i] = (i % 17 == 0) ? ((i & 1) ? MAX_MIX_SAMPLE : MIN_MIX_SAMPLE) : (rand() % 65536) - 32768;
+            expectedMix[i] = kernelMix[i] = (rand() % 131072) - 65536;
+        }
+        
+        float coeff = (round == 0) ? 1.0f : rand() / (float) RAND_MAX;
+        float ratio = (round == 0) ? 0.5f : rand() / (float) RAND_MAX;
+        int numSamples = CHECK_SAMPLES - (round % 9);
+        
+        SCALAR_MIX_KERNEL.accumulate(expectedMix, source, numSamples, coeff);
+        kernel->accumulate(kernelMix, source, numSamples, coeff);
+        
+        SCALAR_MIX_KERNEL.accumulateAttenuated(expectedMix + 1, source, numSamples - 1, coeff, ratio);
+        kernel->accumulateAttenuated(kernelMix + 1, source, numSamples - 1, coeff, ratio);
+        
+        SCALAR_MIX_KERNEL.saturate(expectedOutput, expectedMix, numSamples);
+        kernel->saturate(kernelOutput, kernelMix, numSamples);
+        
+        if (memcmp(expectedMix, kernelMix, numSamples * sizeof(int32_t)) != 0
+            || memcmp(expectedOutput, kernelOutput, numSamples * sizeof(int16_t)) != 0) {
+            return false;
+        }
+    }
+    
+    return true;
+}
@@ -0,0 +1,45 @@
+//
+//  MixKernel.h
+//  mixer
+//
+//  Copyright (c) 2013 High Fidelity, Inc. All rights reserved.
+//
+
+#ifndef __hifi__MixKernel__
+#define __hifi__MixKernel__
+
+#include <iostream>
+#include <stdint.h>
+
+// the frames the mixer mixes, a channel's worth of a stereo buffer
+const float SAMPLE_RATE = 22050.0;
+const int BUFFER_LENGTH_BYTES = 1024;
+const int BUFFER_LENGTH_SAMPLES_PER_CHANNEL = (BUFFER_LENGTH_BYTES / 2) / sizeof(int16_t);
+
+// sources are accumulated into an int32 mix and only clamped to int16 once, when the mix is written out
+// every kernel truncates each scaled sample exactly like the scalar one so their output is bit-identical
+struct MixKernel {
+    const char *name;
+    
+    // mix[i] += (int) (source[i] * coeff)
+    void (*accumulate)(int32_t *mix, const int16_t *source, int numSamples, float coeff);
+    
+    // mix[i] += (int) ((int) (source[i] * coeff) * ratio), used for the delayed weaker channel
+    void (*accumulateAttenuated)(int32_t *mix, const int16_t *source, int numSamples, float coeff, float ratio);
+    
+    // output[i] = mix[i] clamped to the int16 range
+    void (*saturate)(int16_t *output, const int32_t *mix, int numSamples);
+};
+
+const int MAX_MIX_KERNELS = 3;
+
+extern const MixKernel SCALAR_MIX_KERNEL;
+
+// fills kernels with the ones this CPU can run, slowest first, and returns how many there are
+int availableMixKernels(const MixKernel **kernels);
+const MixKernel *bestMixKernel();
+const MixKernel *mixKernelNamed(const char *name);
+
+bool mixKernelMatchesScalar(const MixKernel *kernel);
+
+#endif /* defined(__hifi__MixKernel__) */
@@ -0,0 +1,155 @@
+//
+//  PanningTable.cpp
+//  mixer
+//
+//  Copyright (c) 2013 High Fidelity, Inc. All rights reserved.
+//
+
+#include <math.h>
+#include <string.h>
+#include <stdint.h>
+#include <algorithm>
+#include "PanningTable.h"
+
+// the distance table is indexed straight from the float bits of the squared distance,
+// the exponent and the top DISTANCE_MANTISSA_BITS of the mantissa, with the rest used to interpolate
+const int DISTANCE_MANTISSA_BITS = 6;
+const int DISTANCE_FRACTION_BITS = 23 - DISTANCE_MANTISSA_BITS;
+
+// coefficients are 1 until 4.2 away, 2^4 squared, and below an int16 sample long before 2^64
+const int DISTANCE_FIRST_EXPONENT = 4;
+const int DISTANCE_LAST_EXPONENT = 64;
+const int DISTANCE_TABLE_SIZE = ((DISTANCE_LAST_EXPONENT - DISTANCE_FIRST_EXPONENT) << DISTANCE_MANTISSA_BITS) + 1;
+const int32_t DISTANCE_INDEX_OFFSET = (127 + DISTANCE_FIRST_EXPONENT) << DISTANCE_MANTISSA_BITS;
+
+// the bearing table is indexed by |sin| / (|sin| + |cos|), which needs no trig to get from a direction
+const int BEARING_BUCKETS = 512;
+
+void poseListener(ListenerPose *pose, float *position, float bearing) {
+    pose->position = position;
+    pose->bearing = bearing;
+    pose->cosBearing = cosf(bearing * (M_PI / 180));
+    pose->sinBearing = sinf(bearing * (M_PI / 180));
+}
+
+float exactDistanceCoefficient(float distance) {
+    return std::min(1.0f, powf(0.5, (logf(DISTANCE_RATIO * distance) / logf(3)) - 1));
+}
+
+float audibleDistance(float threshold) {
+    // the coefficient is 2 * (DISTANCE_RATIO * distance) ^ -log3(2), solved for where it drops to the threshold
+    return powf(2 / threshold, logf(3) / logf(2)) / DISTANCE_RATIO;
+}
+
+PanningTable::PanningTable() {
+    exact = false;
+    
+    distanceCoeffs = new float[DISTANCE_TABLE_SIZE];
+    
+    for (int i = 0; i < DISTANCE_TABLE_SIZE; i++) {
+        float mantissa = 1 + (i & ((1 << DISTANCE_MANTISSA_BITS) - 1)) / (float) (1 << DISTANCE_MANTISSA_BITS);
+        float distanceSquared = ldexpf(mantissa, DISTANCE_FIRST_EXPONENT + (i >> DISTANCE_MANTISSA_BITS));
+        
+        distanceCoeffs[i] = exactDistanceCoefficient(sqrtf(distanceSquared));
+    }
+    
+    delayBySine = new int[BEARING_BUCKETS + 1];
+    weakRatioBySine = new float[BEARING_BUCKETS + 1];
+    
+    for (int i = 0; i <= BEARING_BUCKETS; i++) {
+        float ratio = i / (float) BEARING_BUCKETS;
+        float sinRatio = ratio / sqrtf(ratio * ratio + (1 - ratio) * (1 - ratio));
+        
+        delayBySine[i] = PHASE_DELAY_AT_90 * sinRatio;
+        weakRatioBySine[i] = 1 - (PHASE_AMPLITUDE_RATIO_AT_90 * sinRatio);
+    }
+}
+
+float PanningTable::distanceCoefficient(float distanceSquared) {
+    if (exact) {
+        return exactDistanceCoefficient(sqrtf(distanceSquared));
+    }
+    
+    uint32_t bits;
+    memcpy(&bits, &distanceSquared, sizeof(bits));
+    
+    int32_t index = (int32_t) (bits >> DISTANCE_FRACTION_BITS) - DISTANCE_INDEX_OFFSET;
+    
+    if (index < 0) {
+        return distanceCoeffs[0];
+    } else if (index >= DISTANCE_TABLE_SIZE - 1) {
+        return distanceCoeffs[DISTANCE_TABLE_SIZE - 1];
+    }
+    
+    float fraction = (bits & ((1 << DISTANCE_FRACTION_BITS) - 1)) * (1.0f / (1 << DISTANCE_FRACTION_BITS));
+    return distanceCoeffs[index] + (distanceCoeffs[index + 1] - distanceCoeffs[index]) * fraction;
+}
+
+void PanningTable::panSource(ListenerPose *listener, float *sourcePosition, SourcePanning *panning) {
+    if (exact) {
+        panSourceExactly(listener, sourcePosition, panning);
+        return;
+    }
+    
+    float deltaX = sourcePosition[0] - listener->position[0];
+    float deltaY = sourcePosition[1] - listener->position[1];
+    float deltaZ = sourcePosition[2] - listener->position[2];
+    
+    panning->distanceCoeff = distanceCoefficient(deltaX * deltaX + deltaY * deltaY + deltaZ * deltaZ);
+    
+    if (deltaX == 0 && deltaZ == 0) {
+        // the exact path sees atan2(0, 0) as a source off to the -x side
+        deltaX = -1;
+    }
+    
+    // the direction rotated into the listener's frame, the sine and cosine of the angle to the source scaled alike
+    float sine = -deltaX * listener->cosBearing - deltaZ * listener->sinBearing;
+    float cosine = deltaZ * listener->cosBearing - deltaX * listener->sinBearing;
+    
+    int bucket = (fabsf(sine) / (fabsf(sine) + fabsf(cosine))) * BEARING_BUCKETS + 0.5f;
+    
+    panning->numSamplesDelay = delayBySine[bucket];
+    panning->weakChannelAmplitudeRatio = weakRatioBySine[bucket];
+    panning->sourceOnRight = sine > 0;
+}
+
+void PanningTable::panSourceExactly(ListenerPose *listener, float *sourcePosition, SourcePanning *panning) {
+    float *agentPosition = listener->position;
+    
+    panning->distanceCoeff = exactDistanceCoefficient(sqrtf(powf(agentPosition[0] - sourcePosition[0], 2) +
+                                                            powf(agentPosition[1] - sourcePosition[1], 2) +
+                                                            powf(agentPosition[2] - sourcePosition[2], 2)));
+    
+    // get the angle from the right-angle triangle
+    float triangleAngle = atan2f(fabsf(agentPosition[2] - sourcePosition[2]), fabsf(agentPosition[0] - sourcePosition[0])) * (180 / M_PI);
+    float angleToSource;
+    
+    // find the angle we need for calculation based on the orientation of the triangle
+    if (sourcePosition[0] > agentPosition[0]) {
+        if (sourcePosition[2] > agentPosition[2]) {
+            angleToSource = -90 + triangleAngle - listener->bearing;
+        } else {
+            angleToSource = -90 - triangleAngle - listener->bearing;
+        }
+    } else {
+        if (sourcePosition[2] > agentPosition[2]) {
+            angleToSource = 90 - triangleAngle - listener->bearing;
+        } else {
+            angleToSource = 90 + triangleAngle - listener->bearing;
+        }
+    }
+    
+    if (angleToSource > 180) {
+        angleToSource -= 360;
+    } else if (angleToSource < -180) {
+        angleToSource += 360;
+    }
+    
+    angleToSource *= (M_PI / 180);
+    
+    float sinRatio = fabsf(sinf(angleToSource));
+    
+    panning->numSamplesDelay = PHASE_DELAY_AT_90 * sinRatio;
+    panning->weakChannelAmplitudeRatio = 1 - (PHASE_AMPLITUDE_RATIO_AT_90 * sinRatio);
+    panning->sourceOnRight = angleToSource > 0;
+}
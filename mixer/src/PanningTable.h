@@ -0,0 +1,59 @@
+//
+//  PanningTable.h
+//  mixer
+//
+//  Copyright (c) 2013 High Fidelity, Inc. All rights reserved.
+//
+
+#ifndef __hifi__PanningTable__
+#define __hifi__PanningTable__
+
+#include <iostream>
+
+const float DISTANCE_RATIO = 3.0/4.2;
+const float PHASE_AMPLITUDE_RATIO_AT_90 = 0.5;
+const int PHASE_DELAY_AT_90 = 20;
+
+// the listener's side of every pair, worked out once per listener per frame
+struct ListenerPose {
+    float *position;
+    float bearing;
+    float cosBearing;
+    float sinBearing;
+};
+
+// how one source is heard by one listener
+struct SourcePanning {
+    float distanceCoeff;
+    int numSamplesDelay;
+    float weakChannelAmplitudeRatio;
+    bool sourceOnRight;     // the right channel hears the source first, the left is delayed and weakened
+};
+
+void poseListener(ListenerPose *pose, float *position, float bearing);
+
+float exactDistanceCoefficient(float distance);
+float audibleDistance(float threshold);
+
+// coefficients and panning come from tables built once, quantised by squared distance and by bearing
+// so a pair costs a few multiplies and a divide instead of sqrt, pow, log, atan2 and sin
+// exact mode does the original trig for every pair, for comparison
+class PanningTable {
+    public:
+        PanningTable();
+        
+        bool isExact() { return exact; };
+        void setExact(bool newExact) { exact = newExact; };
+        
+        float distanceCoefficient(float distanceSquared);
+        void panSource(ListenerPose *listener, float *sourcePosition, SourcePanning *panning);
+    private:
+        bool exact;
+        float *distanceCoeffs;
+        int *delayBySine;
+        float *weakRatioBySine;
+        
+        void panSourceExactly(ListenerPose *listener, float *sourcePosition, SourcePanning *panning);
+};
+
+#endif /* defined(__hifi__PanningTable__) */
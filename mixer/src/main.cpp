@@ -16,10 +16,18 @@
 #include <errno.h>
 #include <fstream>
 #include <limits>
+#include <signal.h>
+#include <unordered_map>
 #include <AgentList.h>
 #include <SharedUtil.h>
 #include <StdDev.h>
+#include <EventLoop.h>
+#include <TickScheduler.h>
+#include <AudioCodec.h>
 #include "AudioRingBuffer.h"
+#include "MixKernel.h"
+#include "AudioSourceGrid.h"
+#include "PanningTable.h"
 
 #ifdef _WIN32
 #include "Syssocket.h"
@@ -30,67 +38,233 @@
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
+#include <unistd.h>
 #endif _WIN32
 
 const unsigned short MIXER_LISTEN_PORT = 55443;
 
-const float SAMPLE_RATE = 22050.0;
-
 const short JITTER_BUFFER_MSECS = 12;
 const short JITTER_BUFFER_SAMPLES = JITTER_BUFFER_MSECS * (SAMPLE_RATE / 1000.0);
 
-const int BUFFER_LENGTH_BYTES = 1024;
-const int BUFFER_LENGTH_SAMPLES_PER_CHANNEL = (BUFFER_LENGTH_BYTES / 2) / sizeof(int16_t);
-
 const short RING_BUFFER_FRAMES = 10;
 const short RING_BUFFER_SAMPLES = RING_BUFFER_FRAMES * BUFFER_LENGTH_SAMPLES_PER_CHANNEL;
 
 const float BUFFER_SEND_INTERVAL_USECS = (BUFFER_LENGTH_SAMPLES_PER_CHANNEL / SAMPLE_RATE) * 1000000;
 
-const long MAX_SAMPLE_VALUE = std::numeric_limits<int16_t>::max();
-const long MIN_SAMPLE_VALUE = std::numeric_limits<int16_t>::min();
-
-const float DISTANCE_RATIO = 3.0/4.2;
-const float PHASE_AMPLITUDE_RATIO_AT_90 = 0.5;
-const int PHASE_DELAY_AT_90 = 20;
-
 
 const int AGENT_LOOPBACK_MODIFIER = 307;
 
 const int LOOPBACK_SANITY_CHECK = 0;
 
-AgentList agentList('M', MIXER_LISTEN_PORT);
-StDev stdev;
+// the agent socket joins a SO_REUSEPORT group so receive workers can bind the same port
+AgentList agentList('M', MIXER_LISTEN_PORT, true);
+EventLoop eventLoop;
+
+const char RECEIVE_WORKERS_OPTION[] = "--receiveWorkers";
+const int MAX_RECEIVE_WORKERS = 64;
+
+// each worker owns a socket on MIXER_LISTEN_PORT and the loop that reads it
+// the kernel hashes a sender's address to one socket so an agent is always parsed by the same worker
+// worker 0 reads the agent socket on the main loop, the rest get their own thread
+struct MixerReceiveWorker {
+    UDPSocket *socket;
+    EventLoop *eventLoop;
+    UDPDatagram *receivedDatagrams;
+    StDev stdev;
+    timeval lastReceive;
+    bool firstSample;
+    pthread_t thread;
+};
+
+MixerReceiveWorker *receiveWorkers;
+int numReceiveWorkers = 1;
+
+int16_t *loopbackAudioPacket;
+
+const char MIX_KERNEL_OPTION[] = "--mixKernel";
+
+const MixKernel *mixKernel = &SCALAR_MIX_KERNEL;
+
+const char AUDIBILITY_THRESHOLD_OPTION[] = "--audibilityThreshold";
+const char CLUSTER_DISTANCE_OPTION[] = "--clusterDistance";
+
+// below this coefficient every int16 sample scales to zero, so culling these sources doesn't change the mix
+const float LOSSLESS_AUDIBILITY_THRESHOLD = 1.0f / 32768;
+
+// cells are this fraction of the cluster distance so a cluster is never wide compared to its distance
+const float CLUSTER_CELL_RATIO = 0.25;
+
+const int PAIR_COUNT_REPORT_FRAMES = 500;
+
+float audibilityThreshold = LOSSLESS_AUDIBILITY_THRESHOLD;
+float clusterDistance = 0;
+
+AudioSourceGrid sourceGrid;
+
+const char EXACT_PANNING_OPTION[] = "--exactPanning";
+
+PanningTable panningTable;
+
+const char ADAPTIVE_JITTER_OPTION[] = "--adaptiveJitter";
+bool adaptiveJitter = false;
+
+const char TICK_CATCH_UP_OPTION[] = "--tickCatchUp";
+
+// clients play a mix a frame, so by default a late frame is made up for by sending the next ones straight away
+TickCatchUp mixTickCatchUp = TICK_CATCH_UP_BURST;
+
+const char SILENCE_LOUDNESS_OPTION[] = "--silenceLoudness";
+
+// sources whose frame and the frame before it are no louder than this are left out of every mix
+// the default only skips frames of zeros, which is what a silent frame packet becomes
+float silenceLoudness = 0;
+
+const char SHARED_MIX_SIZE_OPTION[] = "--sharedMixSize";
+const char SHARED_MIX_DEGREES_OPTION[] = "--sharedMixDegrees";
+
+// listeners are mixed from the center of their bucket of this size and bearing, and everyone in a bucket
+// who can't hear themselves in the mix gets the same one, 0 mixes everyone from where they are
+float sharedMixSize = 0;
+float sharedMixDegrees = 10;
+
+// bucket coordinates are packed into 16 bits each for the key, with the bearing and codec after them
+const int MAX_SHARED_MIX_COORDINATE = (1 << 15) - 1;
+
+// a mix built for a bucket this frame, kept to send again to the rest of the bucket
+struct SharedMix {
+    unsigned char data[MAX_BUFFER_LENGTH_BYTES];
+    int byteLength;
+};
+
+// the samples to mix for one source, a single agent or a premixed cluster of far away agents
+struct MixSource {
+    float *position;
+    int16_t *frameSamples;
+    int16_t *historySamples;    // the PHASE_DELAY_AT_90 samples leading up to frameSamples
+    bool isInGrid;              // loud enough to be mixed for anyone
+};
 
-void plateauAdditionOfSamples(int16_t &mixSample, int16_t sampleToAdd) {
-    long sumSample = sampleToAdd + mixSample;
+// quantises a listener to its bucket, moving the position and bearing to the bucket's center
+uint64_t sharedMixKey(float *position, float *bearing, const AudioCodec *codec) {
+    uint64_t key = 0;
     
-    long normalizedSample = std::min(MAX_SAMPLE_VALUE, sumSample);
-    normalizedSample = std::max(MIN_SAMPLE_VALUE, sumSample);
+    for (int i = 0; i < 3; i++) {
+        int coordinate = std::max(-MAX_SHARED_MIX_COORDINATE,
+                                  std::min(MAX_SHARED_MIX_COORDINATE, (int) floorf(position[i] / sharedMixSize)));
+        
+        position[i] = (coordinate + 0.5f) * sharedMixSize;
+        key = (key << 16) | (coordinate & 0xFFFF);
+    }
+    
+    int bearingBucket = floorf((*bearing + 180) / sharedMixDegrees);
+    *bearing = std::min(180.0f, (bearingBucket + 0.5f) * sharedMixDegrees - 180);
+    
+    return (key << 16) | ((bearingBucket & 0xFF) << 8) | (codec ? codec->id : 0xFF);
+}
+
+float distanceSquaredBetween(float *position, float *otherPosition) {
+    float deltaX = position[0] - otherPosition[0];
+    float deltaY = position[1] - otherPosition[1];
+    float deltaZ = position[2] - otherPosition[2];
+    
+    return deltaX * deltaX + deltaY * deltaY + deltaZ * deltaZ;
+}
+
+void mixSourceForListener(int32_t *mixAccumulator, MixSource *source, SourcePanning *panning) {
+    int numSamplesDelay = panning->numSamplesDelay;
+    float distanceCoeff = panning->distanceCoeff;
+    float weakChannelAmplitudeRatio = panning->weakChannelAmplitudeRatio;
+    
+    int32_t *goodChannel = panning->sourceOnRight ? mixAccumulator + BUFFER_LENGTH_SAMPLES_PER_CHANNEL : mixAccumulator;
+    int32_t *delayedChannel = panning->sourceOnRight ? mixAccumulator : mixAccumulator + BUFFER_LENGTH_SAMPLES_PER_CHANNEL;
+    
+    mixKernel->accumulate(goodChannel, source->frameSamples, BUFFER_LENGTH_SAMPLES_PER_CHANNEL, distanceCoeff);
+    
+    // the delayed channel starts with the samples before this frame, then lags the good channel
+    mixKernel->accumulateAttenuated(delayedChannel, source->historySamples + PHASE_DELAY_AT_90 - numSamplesDelay,
+                                    numSamplesDelay, distanceCoeff, weakChannelAmplitudeRatio);
+    mixKernel->accumulateAttenuated(delayedChannel + numSamplesDelay, source->frameSamples,
+                                    BUFFER_LENGTH_SAMPLES_PER_CHANNEL - numSamplesDelay,
+                                    distanceCoeff, weakChannelAmplitudeRatio);
+}
+
+void premixCell(AudioSourceCell *cell, MixSource *sources) {
+    // history and frame are summed back to back so the premix can be used like any other source
+    const int PREMIX_SAMPLES = PHASE_DELAY_AT_90 + BUFFER_LENGTH_SAMPLES_PER_CHANNEL;
+    int32_t premixAccumulator[PREMIX_SAMPLES];
+    memset(premixAccumulator, 0, sizeof(premixAccumulator));
     
-    mixSample = normalizedSample;    
+    for (int s = 0; s < cell->sourceIndices.size(); s++) {
+        MixSource *source = &sources[cell->sourceIndices[s]];
+        
+        mixKernel->accumulate(premixAccumulator, source->historySamples, PHASE_DELAY_AT_90, 1.0f);
+        mixKernel->accumulate(premixAccumulator + PHASE_DELAY_AT_90, source->frameSamples,
+                              BUFFER_LENGTH_SAMPLES_PER_CHANNEL, 1.0f);
+    }
+    
+    cell->premix.resize(PREMIX_SAMPLES);
+    mixKernel->saturate(&cell->premix[0], premixAccumulator, PREMIX_SAMPLES);
+    cell->hasPremix = true;
+}
+
+// addresses the mix to the agent, and sends the batch once it's full
+void sendMixDatagram(UDPDatagram *mixDatagrams, int *numMixDatagrams, Agent *agent, int *sentBytes) {
+    UDPDatagram *mixDatagram = &mixDatagrams[*numMixDatagrams];
+    
+    memcpy(&mixDatagram->address, agent->getPublicSocket(), sizeof(sockaddr_in));
+    *sentBytes += mixDatagram->byteLength;
+    
+    if (++*numMixDatagrams == MAX_BATCH_DATAGRAMS) {
+        agentList.getAgentSocket().sendBatch(mixDatagrams, *numMixDatagrams);
+        *numMixDatagrams = 0;
+    }
 }
 
 void *sendBuffer(void *args)
 {
     int sentBytes;
     int nextFrame = 0;
-    timeval startTime;
+    TickScheduler mixTicks("Mix", BUFFER_SEND_INTERVAL_USECS * 1000, mixTickCatchUp);
+    int32_t mixAccumulator[BUFFER_LENGTH_SAMPLES_PER_CHANNEL * 2];
+    int16_t clientMix[BUFFER_LENGTH_SAMPLES_PER_CHANNEL * 2];
+    unsigned int readEpoch;
+    long reportSentBytes = 0;
     
-    gettimeofday(&startTime, NULL);
-
-    while (true) {
+    std::vector<MixSource> sources;
+    std::vector<AudioSourceCell *> nearCells;
+    
+    float audibleRadius = audibleDistance(audibilityThreshold);
+    float cellSize = clusterDistance > 0 ? clusterDistance * CLUSTER_CELL_RATIO : audibleRadius;
+    
+    int directPairs = 0, clusteredPairs = 0, possiblePairs = 0, silentSources = 0;
+    
+    std::unordered_map<uint64_t, int> sharedMixIndices;
+    std::vector<SharedMix> sharedMixes;
+    int sharedMixHits = 0, sharedMixMisses = 0;
+    double sharedMixBuildUsecs = 0;
+    
+    // mixes are written straight into datagrams so the whole frame goes out in a few batched sends
+    UDPDatagram *mixDatagrams = new UDPDatagram[MAX_BATCH_DATAGRAMS];
+    int numMixDatagrams = 0;
+    
+    while (!eventLoop.isStopped()) {
+        mixTicks.waitForNextTick();
         sentBytes = 0;
         
-        for (int i = 0; i < agentList.getAgents().size(); i++) {
-            AudioRingBuffer *agentBuffer = (AudioRingBuffer *) agentList.getAgents()[i].getLinkedData();
+        // mix against a snapshot of the agents, agents that leave meanwhile stay valid until we're done
+        const AgentSnapshot *agents = agentList.beginSnapshotRead(&readEpoch);
+        
+        for (int i = 0; i < agents->size(); i++) {
+            AudioRingBuffer *agentBuffer = (AudioRingBuffer *) (*agents)[i]->getLinkedData();
             
             if (agentBuffer != NULL && agentBuffer->getEndOfLastWrite() != NULL) {
                 
                 if (!agentBuffer->isStarted()
-                    && agentBuffer->diffLastWriteNextOutput() <= BUFFER_LENGTH_SAMPLES_PER_CHANNEL + JITTER_BUFFER_SAMPLES) {
+                    && agentBuffer->diffLastWriteNextOutput() <= BUFFER_LENGTH_SAMPLES_PER_CHANNEL + agentBuffer->getJitterBufferSamples()) {
                     printf("Held back buffer %d.\n", i);
-                } else if (agentBuffer->diffLastWriteNextOutput() < BUFFER_LENGTH_SAMPLES_PER_CHANNEL) {
+                } else if (agentBuffer->diffLastWriteNextOutput() < BUFFER_LENGTH_SAMPLES_PER_CHANNEL
+                           && !(agentBuffer->isStarted() && agentBuffer->concealNextFrame())) {
+                    // the frame that's due never came and the stand-ins for it have faded out
                     printf("Buffer %d starved.\n", i);
                     agentBuffer->setStarted(false);
                 } else {
@@ -101,14 +275,48 @@ void *sendBuffer(void *args)
             }
         }
         
-        int numAgents = agentList.getAgents().size();
-        float distanceCoeffs[numAgents][numAgents];
-        memset(distanceCoeffs, 0, sizeof(distanceCoeffs));
-
-        for (int i = 0; i < agentList.getAgents().size(); i++) {
-            Agent *agent = &agentList.getAgents()[i];
+        // index every agent with audio by position, sources line up with the snapshot
+        sources.resize(agents->size());
+        sourceGrid.reset(cellSize);
+        
+        for (int i = 0; i < agents->size(); i++) {
+            AudioRingBuffer *agentBuffer = (AudioRingBuffer *) (*agents)[i]->getLinkedData();
+            sources[i].isInGrid = false;
+            
+            if (agentBuffer != NULL) {
+                sources[i].position = agentBuffer->getPosition();
+                sources[i].frameSamples = agentBuffer->getNextOutput();
+                sources[i].historySamples = agentBuffer->getNextOutput() == agentBuffer->getBuffer()
+                    ? agentBuffer->getBuffer() + RING_BUFFER_SAMPLES - PHASE_DELAY_AT_90
+                    : agentBuffer->getNextOutput() - PHASE_DELAY_AT_90;
+                
+                // the delayed channel still needs the end of the previous frame, so that has to be quiet too
+                int16_t *previousFrame = sources[i].historySamples + PHASE_DELAY_AT_90 - BUFFER_LENGTH_SAMPLES_PER_CHANNEL;
+                
+                if (agentBuffer->getFrameLoudness(sources[i].frameSamples) <= silenceLoudness
+                    && agentBuffer->getFrameLoudness(previousFrame) <= silenceLoudness) {
+                    silentSources++;
+                    continue;
+                }
+                
+                sourceGrid.addSource(i, sources[i].position);
+                sources[i].isInGrid = true;
+            }
+        }
+        
+        sourceGrid.finish();
+        sharedMixIndices.clear();
+        
+        for (int i = 0; i < agents->size(); i++) {
+            Agent *agent = (*agents)[i];
             
             AudioRingBuffer *agentRingBuffer = (AudioRingBuffer *) agent->getLinkedData();
+            
+            if (agentRingBuffer == NULL || agentRingBuffer->getEndOfLastWrite() == NULL) {
+                // this agent hasn't sent us any audio yet
+                continue;
+            }
+            
             float agentBearing = agentRingBuffer->getBearing();
             bool agentWantsLoopback = false;
             
@@ -120,116 +328,196 @@ void *sendBuffer(void *args)
                 agentBearing = agentBearing > 0 ? agentBearing - AGENT_LOOPBACK_MODIFIER : agentBearing + AGENT_LOOPBACK_MODIFIER;
             }
             
-            int16_t clientMix[BUFFER_LENGTH_SAMPLES_PER_CHANNEL * 2] = {};
+            UDPDatagram *mixDatagram = &mixDatagrams[numMixDatagrams];
+            const AudioCodec *listenerCodec = agentRingBuffer->getCodec();
             
+            float listenerPosition[3];
+            memcpy(listenerPosition, agentRingBuffer->getPosition(), sizeof(listenerPosition));
             
-            for (int j = 0; j < agentList.getAgents().size(); j++) {
-                if (i != j || ( i == j && agentWantsLoopback)) {
-                    AudioRingBuffer *otherAgentBuffer = (AudioRingBuffer *)agentList.getAgents()[j].getLinkedData();
-                    
-                    float *agentPosition = agentRingBuffer->getPosition();
-                    float *otherAgentPosition = otherAgentBuffer->getPosition();
-                   
-                    // calculate the distance to the other agent
-                    
-                    // use the distance to the other agent to calculate the change in volume for this frame
-                    int lowAgentIndex = std::min(i, j);
-                    int highAgentIndex = std::max(i, j);
-                    
-                    if (distanceCoeffs[lowAgentIndex][highAgentIndex] == 0) {
-                        float distanceToAgent = sqrtf(powf(agentPosition[0] - otherAgentPosition[0], 2) +
-                                                      powf(agentPosition[1] - otherAgentPosition[1], 2) +
-                                                      powf(agentPosition[2] - otherAgentPosition[2], 2));
-                        
-                        distanceCoeffs[lowAgentIndex][highAgentIndex] = std::min(1.0f, powf(0.5, (logf(DISTANCE_RATIO * distanceToAgent) / logf(3)) - 1));
-                    }
-                    
-                    
-                    // get the angle from the right-angle triangle
-                    float triangleAngle = atan2f(fabsf(agentPosition[2] - otherAgentPosition[2]), fabsf(agentPosition[0] - otherAgentPosition[0])) * (180 / M_PI);
-                    float angleToSource;
+            // a listener that isn't in the mix themselves hears the same as anyone else in their bucket
+            bool sharesMix = sharedMixSize > 0 && !agentWantsLoopback && !sources[i].isInGrid;
+            uint64_t mixKey = 0;
+            double buildStartUsecs = 0;
+            
+            if (sharesMix) {
+                mixKey = sharedMixKey(listenerPosition, &agentBearing, listenerCodec);
+                std::unordered_map<uint64_t, int>::iterator sharedMix = sharedMixIndices.find(mixKey);
+                
+                if (sharedMix != sharedMixIndices.end()) {
+                    memcpy(mixDatagram->data, sharedMixes[sharedMix->second].data, sharedMixes[sharedMix->second].byteLength);
+                    mixDatagram->byteLength = sharedMixes[sharedMix->second].byteLength;
+                    sharedMixHits++;
+                    possiblePairs += agents->size() - 1;
                     
+                    sendMixDatagram(mixDatagrams, &numMixDatagrams, agent, &sentBytes);
+                    continue;
+                }
+                
+                buildStartUsecs = usecTimestampNow();
+            }
+            
+            // sources are summed at full precision and clamped once when the mix is written out
+            memset(mixAccumulator, 0, sizeof(mixAccumulator));
+            
+            ListenerPose listener;
+            poseListener(&listener, listenerPosition, agentBearing);
+            
+            SourcePanning panning;
+            float clusterDistanceSquared = clusterDistance * clusterDistance;
+            
+            AudioSourceCell *agentCell = sourceGrid.cellContaining(listenerPosition);
+            
+            // only the cells within earshot can have sources above the audibility threshold
+            sourceGrid.cellsNear(listenerPosition, audibleRadius, nearCells);
+            
+            for (int c = 0; c < nearCells.size(); c++) {
+                AudioSourceCell *cell = nearCells[c];
+                
+                if (clusterDistance > 0 && cell != agentCell && cell->sourceIndices.size() > 1
+                    && distanceSquaredBetween(listenerPosition, cell->centroid) > clusterDistanceSquared) {
+                    // far enough away to hear the whole cell as one source at its centroid
+                    panningTable.panSource(&listener, cell->centroid, &panning);
                     
-                    // find the angle we need for calculation based on the orientation of the triangle
-                    if (otherAgentPosition[0] > agentPosition[0]) {
-                        if (otherAgentPosition[2] > agentPosition[2]) {
-                            angleToSource = -90 + triangleAngle - agentBearing;
-                        } else {
-                            angleToSource = -90 - triangleAngle - agentBearing;
-                        }
-                    } else {
-                        if (otherAgentPosition[2] > agentPosition[2]) {
-                            angleToSource = 90 - triangleAngle - agentBearing;
-                        } else {
-                            angleToSource = 90 + triangleAngle - agentBearing;
+                    if (panning.distanceCoeff >= audibilityThreshold) {
+                        if (!cell->hasPremix) {
+                            premixCell(cell, &sources[0]);
                         }
+                        
+                        MixSource clusterSource;
+                        clusterSource.position = cell->centroid;
+                        clusterSource.frameSamples = &cell->premix[PHASE_DELAY_AT_90];
+                        clusterSource.historySamples = &cell->premix[0];
+                        
+                        mixSourceForListener(mixAccumulator, &clusterSource, &panning);
+                        clusteredPairs++;
                     }
                     
-                    if (angleToSource > 180) {
-                        angleToSource -= 360;
-                    } else if (angleToSource < -180) {
-                        angleToSource += 360;
-                    }
-                    
-                    angleToSource *= (M_PI / 180);
-                    
-                    float sinRatio = fabsf(sinf(angleToSource));
-                    int numSamplesDelay = PHASE_DELAY_AT_90 * sinRatio;
-                    float weakChannelAmplitudeRatio = 1 - (PHASE_AMPLITUDE_RATIO_AT_90 * sinRatio);
-                    
-                    int16_t *goodChannel = angleToSource > 0  ? clientMix + BUFFER_LENGTH_SAMPLES_PER_CHANNEL : clientMix;
-                    int16_t *delayedChannel = angleToSource > 0 ? clientMix : clientMix + BUFFER_LENGTH_SAMPLES_PER_CHANNEL;
-                    
-                    int16_t *delaySamplePointer = otherAgentBuffer->getNextOutput() == otherAgentBuffer->getBuffer()
-                        ? otherAgentBuffer->getBuffer() + RING_BUFFER_SAMPLES - numSamplesDelay
-                        : otherAgentBuffer->getNextOutput() - numSamplesDelay;
-                    
+                    continue;
+                }
+                
+                for (int s = 0; s < cell->sourceIndices.size(); s++) {
+                    int j = cell->sourceIndices[s];
                     
-                    for (int s = 0; s < BUFFER_LENGTH_SAMPLES_PER_CHANNEL; s++) {
-                        
-                        if (s < numSamplesDelay) {
-                            // pull the earlier sample for the delayed channel
-                            
-                            int earlierSample = delaySamplePointer[s] *
-                                                distanceCoeffs[lowAgentIndex][highAgentIndex];
-                            
-                            plateauAdditionOfSamples(delayedChannel[s], earlierSample * weakChannelAmplitudeRatio);
-                        }
+                    if (i != j || agentWantsLoopback) {
+                        panningTable.panSource(&listener, sources[j].position, &panning);
                         
-                        int16_t currentSample = (otherAgentBuffer->getNextOutput()[s] *
-                                                 distanceCoeffs[lowAgentIndex][highAgentIndex]);
-                        plateauAdditionOfSamples(goodChannel[s], currentSample);
-                        
-                        if (s + numSamplesDelay < BUFFER_LENGTH_SAMPLES_PER_CHANNEL) {
-                            plateauAdditionOfSamples(delayedChannel[s + numSamplesDelay], currentSample * weakChannelAmplitudeRatio);
+                        if (panning.distanceCoeff >= audibilityThreshold) {
+                            mixSourceForListener(mixAccumulator, &sources[j], &panning);
+                            directPairs++;
                         }
                     }
                 }
             }
             
-            agentList.getAgentSocket().send(agent->getPublicSocket(), clientMix, BUFFER_LENGTH_BYTES);
-        }
-        
-        for (int i = 0; i < agentList.getAgents().size(); i++) {
-            AudioRingBuffer *agentBuffer = (AudioRingBuffer *)agentList.getAgents()[i].getLinkedData();
-            if (agentBuffer->wasAddedToMix()) {
-                agentBuffer->setNextOutput(agentBuffer->getNextOutput() + BUFFER_LENGTH_SAMPLES_PER_CHANNEL);
-                
-                if (agentBuffer->getNextOutput() >= agentBuffer->getBuffer() + RING_BUFFER_SAMPLES) {
-                    agentBuffer->setNextOutput(agentBuffer->getBuffer());
+            possiblePairs += agents->size() - 1;
+            
+            if (listenerCodec == NULL) {
+                listenerCodec = &PCM_AUDIO_CODEC;
+            }
+            
+            // answer in the codec the listener sends with, each channel is its own block
+            // the tick is the sequence, so a listener we skip a frame for sees it as lost
+            mixKernel->saturate(clientMix, mixAccumulator, BUFFER_LENGTH_SAMPLES_PER_CHANNEL * 2);
+            
+            uint16_t mixSequence = mixTicks.getTickNumber();
+            
+            mixDatagram->data[0] = COMPRESSED_AUDIO_PACKET_HEADER;
+            mixDatagram->data[1] = listenerCodec->id;
+            memcpy(mixDatagram->data + COMPRESSED_AUDIO_HEADER_BYTES, &mixSequence, sizeof(mixSequence));
+            
+            int mixHeaderBytes = COMPRESSED_AUDIO_HEADER_BYTES + AUDIO_SEQUENCE_BYTES;
+            mixDatagram->byteLength = mixHeaderBytes + encodeFrame(listenerCodec, mixDatagram->data + mixHeaderBytes,
+                                                                   clientMix, BUFFER_LENGTH_SAMPLES_PER_CHANNEL * 2);
+            
+            if (sharesMix) {
+                // keep it for the rest of the bucket, sharedMixes only grows so the buffers are re-used frame to frame
+                if (sharedMixIndices.size() == sharedMixes.size()) {
+                    sharedMixes.push_back(SharedMix());
                 }
                 
+                SharedMix *sharedMix = &sharedMixes[sharedMixIndices.size()];
+                memcpy(sharedMix->data, mixDatagram->data, mixDatagram->byteLength);
+                sharedMix->byteLength = mixDatagram->byteLength;
+                
+                sharedMixIndices[mixKey] = sharedMixIndices.size();
+                sharedMixMisses++;
+                sharedMixBuildUsecs += usecTimestampNow() - buildStartUsecs;
+            }
+            
+            sendMixDatagram(mixDatagrams, &numMixDatagrams, agent, &sentBytes);
+        }
+        
+        if (numMixDatagrams > 0) {
+            agentList.getAgentSocket().sendBatch(mixDatagrams, numMixDatagrams);
+            numMixDatagrams = 0;
+        }
+        
+        bool reportDue = (nextFrame + 1) % PAIR_COUNT_REPORT_FRAMES == 0;
+        int underruns = 0, overruns = 0, droppedFrames = 0;
+        int concealedFrames = 0, concealedGaps = 0, longestConcealedGap = 0, recoveredFrames = 0, lateFrames = 0;
+        float jitterBufferSamples = 0;
+        
+        for (int i = 0; i < agents->size(); i++) {
+            AudioRingBuffer *agentBuffer = (AudioRingBuffer *)(*agents)[i]->getLinkedData();
+            if (agentBuffer != NULL && agentBuffer->wasAddedToMix()) {
+                agentBuffer->advanceToNextFrame();
                 agentBuffer->setAddedToMix(false);
             }
+            
+            if (agentBuffer != NULL && reportDue) {
+                underruns += agentBuffer->getUnderruns();
+                overruns += agentBuffer->getOverruns();
+                droppedFrames += agentBuffer->getDroppedFrames();
+                jitterBufferSamples += agentBuffer->getJitterBufferSamples();
+                
+                concealedFrames += agentBuffer->getConcealedFrames();
+                concealedGaps += agentBuffer->getConcealedGaps();
+                longestConcealedGap = std::max(longestConcealedGap, agentBuffer->getLongestConcealedGap());
+                recoveredFrames += agentBuffer->getRecoveredFrames();
+                lateFrames += agentBuffer->getLateFrames();
+            }
+        }
+        
+        if (reportDue && agents->size() > 0) {
+            printf("Jitter buffers average %.1f ms, %d underruns, %d overruns and %d dropped frames so far.\n",
+                   (jitterBufferSamples / agents->size()) * 1000 / SAMPLE_RATE, underruns, overruns, droppedFrames);
+            printf("Concealed %d lost frames in %d gaps, the longest %d frames, %d late frames recovered and %d too late.\n",
+                   concealedFrames, concealedGaps, longestConcealedGap, recoveredFrames, lateFrames);
         }
         
-        double usecToSleep = usecTimestamp(&startTime) + (++nextFrame * BUFFER_SEND_INTERVAL_USECS) - usecTimestampNow();
+        agentList.endSnapshotRead(readEpoch);
+        
+        reportSentBytes += sentBytes;
         
-        if (usecToSleep > 0) {
-            usleep(usecToSleep);
-        } else {
-            std::cout << "Took too much time, not sleeping!\n";
+        if (reportDue) {
+            printf("Mixed %.1f direct and %.1f clustered pairs per frame of %.1f possible, %d cells, %.1f silent sources.\n",
+                   directPairs / (float) PAIR_COUNT_REPORT_FRAMES,
+                   clusteredPairs / (float) PAIR_COUNT_REPORT_FRAMES,
+                   possiblePairs / (float) PAIR_COUNT_REPORT_FRAMES,
+                   sourceGrid.getNumCells(),
+                   silentSources / (float) PAIR_COUNT_REPORT_FRAMES);
+            
+            printf("Sent %.0f bytes of mixes per frame.\n", reportSentBytes / (float) PAIR_COUNT_REPORT_FRAMES);
+            
+            if (sharedMixSize > 0 && sharedMixHits + sharedMixMisses > 0) {
+                // every hit saves building a mix, which costs about what the misses took on average
+                printf("Shared %d of %d bucketed mixes (%.1f%% hit rate), saving about %.2f ms of mixing per frame.\n",
+                       sharedMixHits, sharedMixHits + sharedMixMisses,
+                       100.0f * sharedMixHits / (sharedMixHits + sharedMixMisses),
+                       sharedMixMisses > 0
+                           ? (sharedMixBuildUsecs / sharedMixMisses) * sharedMixHits / (1000.0f * PAIR_COUNT_REPORT_FRAMES)
+                           : 0);
+            }
+            
+            directPairs = clusteredPairs = possiblePairs = silentSources = 0;
+            reportSentBytes = 0;
+            sharedMixHits = sharedMixMisses = 0;
+            sharedMixBuildUsecs = 0;
+            
+            mixTicks.printReport();
         }
+        
+        nextFrame++;
     }  
 
     pthread_exit(0);  
@@ -237,74 +525,204 @@ void *sendBuffer(void *args)
 
 void attachNewBufferToAgent(Agent *newAgent) {
     if (newAgent->getLinkedData() == NULL) {
-        newAgent->setLinkedData(new AudioRingBuffer(RING_BUFFER_SAMPLES, BUFFER_LENGTH_SAMPLES_PER_CHANNEL));
+        AudioRingBuffer *ringBuffer = new AudioRingBuffer(RING_BUFFER_SAMPLES, BUFFER_LENGTH_SAMPLES_PER_CHANNEL);
+        ringBuffer->setJitterBufferSamples(JITTER_BUFFER_SAMPLES);
+        
+        if (adaptiveJitter) {
+            ringBuffer->setAdaptiveJitter(BUFFER_SEND_INTERVAL_USECS);
+        }
+        
+        newAgent->setLinkedData(ringBuffer);
+    }
+}
+
+void receiveAudio(void *args) {
+    MixerReceiveWorker *worker = (MixerReceiveWorker *)args;
+    
+    int numReceived = worker->socket->receiveBatch(worker->receivedDatagrams, MAX_BATCH_DATAGRAMS);
+    
+    for (int d = 0; d < numReceived; d++) {
+        sockaddr *agentAddress = (sockaddr *) &worker->receivedDatagrams[d].address;
+        unsigned char *packetData = worker->receivedDatagrams[d].data;
+        ssize_t receivedBytes = worker->receivedDatagrams[d].byteLength;
+        
+        if (packetData[0] == 'I' || packetData[0] == SILENT_AUDIO_PACKET_HEADER
+            || packetData[0] == COMPRESSED_AUDIO_PACKET_HEADER) {
+                            
+            //  Compute and report standard deviation for jitter calculation
+            if (worker->firstSample) {
+                worker->stdev.reset();
+                worker->firstSample = false;
+            } else {
+                double tDiff = (usecTimestampNow() - usecTimestamp(&worker->lastReceive)) / 1000;
+                worker->stdev.addValue(tDiff);
+                
+                if (worker->stdev.getSamples() > 500) {
+                    printf("Worker %ld Avg: %4.2f, Stdev: %4.2f\n", worker - receiveWorkers,
+                           worker->stdev.getAverage(), worker->stdev.getStDev());
+                    worker->stdev.reset();
+                }
+            }
+            
+            gettimeofday(&worker->lastReceive, NULL);
+            
+            // add or update the existing interface agent
+            if (!LOOPBACK_SANITY_CHECK) {
+                
+                agentList.addOrUpdateAgent(agentAddress, agentAddress, 'I');
+                
+                agentList.updateAgentWithData(agentAddress, (void *)packetData, receivedBytes);
+            } else {
+                memcpy(loopbackAudioPacket, packetData + 1 + AUDIO_SEQUENCE_BYTES + (sizeof(float) * 4), 1024);
+                agentList.getAgentSocket().send(agentAddress, loopbackAudioPacket, 1024);
+            }
+        }
+    }
+}
+
+void *runReceiveWorker(void *args) {
+    MixerReceiveWorker *worker = (MixerReceiveWorker *)args;
+    worker->eventLoop->run();
+    
+    pthread_exit(0);
+}
+
+void stopMixer(int signal) {
+    for (int w = 1; w < numReceiveWorkers; w++) {
+        receiveWorkers[w].eventLoop->stop();
     }
+    
+    eventLoop.stop();
 }
 
 int main(int argc, const char * argv[])
 {
     setvbuf(stdout, NULL, _IOLBF, 0);
     
-    ssize_t receivedBytes = 0;
+    const char *mixKernelOption = getCmdOption(argc, argv, MIX_KERNEL_OPTION);
+    mixKernel = mixKernelOption ? mixKernelNamed(mixKernelOption) : bestMixKernel();
+    
+    if (mixKernel == NULL) {
+        printf("Mix kernel %s is not available on this CPU, using scalar.\n", mixKernelOption);
+        mixKernel = &SCALAR_MIX_KERNEL;
+    } else if (!mixKernelMatchesScalar(mixKernel)) {
+        printf("Mix kernel %s doesn't match the scalar mix, using scalar.\n", mixKernel->name);
+        mixKernel = &SCALAR_MIX_KERNEL;
+    }
+    
+    printf("Mixing with the %s kernel.\n", mixKernel->name);
+    
+    const char *audibilityThresholdOption = getCmdOption(argc, argv, AUDIBILITY_THRESHOLD_OPTION);
+    
+    if (audibilityThresholdOption && atof(audibilityThresholdOption) > 0) {
+        audibilityThreshold = atof(audibilityThresholdOption);
+    }
+    
+    const char *clusterDistanceOption = getCmdOption(argc, argv, CLUSTER_DISTANCE_OPTION);
+    
+    if (clusterDistanceOption) {
+        clusterDistance = std::max(0.0, atof(clusterDistanceOption));
+    }
+    
+    if (cmdOptionExists(argc, argv, EXACT_PANNING_OPTION)) {
+        panningTable.setExact(true);
+        printf("Panning every source with the exact trig path.\n");
+    }
+    
+    if (cmdOptionExists(argc, argv, ADAPTIVE_JITTER_OPTION)) {
+        adaptiveJitter = true;
+        printf("Sizing jitter buffers from measured arrival jitter.\n");
+    }
+    
+    const char *tickCatchUpOption = getCmdOption(argc, argv, TICK_CATCH_UP_OPTION);
+    
+    if (tickCatchUpOption) {
+        mixTickCatchUp = tickCatchUpNamed(tickCatchUpOption, mixTickCatchUp);
+        printf("Catching up on late mix frames with %s.\n", tickCatchUpName(mixTickCatchUp));
+    }
+    
+    const char *silenceLoudnessOption = getCmdOption(argc, argv, SILENCE_LOUDNESS_OPTION);
+    
+    if (silenceLoudnessOption) {
+        silenceLoudness = std::max(0.0, atof(silenceLoudnessOption));
+        printf("Skipping sources no louder than %.1f.\n", silenceLoudness);
+    }
+    
+    const char *sharedMixSizeOption = getCmdOption(argc, argv, SHARED_MIX_SIZE_OPTION);
+    const char *sharedMixDegreesOption = getCmdOption(argc, argv, SHARED_MIX_DEGREES_OPTION);
+    
+    if (sharedMixSizeOption) {
+        sharedMixSize = std::max(0.0, atof(sharedMixSizeOption));
+    }
+    
+    if (sharedMixDegreesOption) {
+        // the bearing bucket has 8 bits of the key
+        sharedMixDegrees = std::max(1.5, std::min(360.0, atof(sharedMixDegreesOption)));
+    }
+    
+    if (sharedMixSize > 0) {
+        printf("Sharing mixes between listeners in the same %.2f wide, %.1f degree bucket.\n", sharedMixSize, sharedMixDegrees);
+    }
+    
+    printf("Culling sources beyond %.1f, clustering sources beyond %.1f.\n",
+           audibleDistance(audibilityThreshold), clusterDistance);
     
     agentList.linkedDataCreateCallback = attachNewBufferToAgent;
     
-    agentList.startSilentAgentRemovalThread();
-    agentList.startDomainServerCheckInThread();
+    agentList.addSilentAgentRemovalTimer(eventLoop);
+    agentList.addDomainServerCheckInTimer(eventLoop);
 
-    unsigned char *packetData = new unsigned char[MAX_PACKET_SIZE];
-
-    pthread_t sendBufferThread;
-    pthread_create(&sendBufferThread, NULL, sendBuffer, NULL);
+    const char *receiveWorkersOption = getCmdOption(argc, argv, RECEIVE_WORKERS_OPTION);
+    
+    if (receiveWorkersOption) {
+        numReceiveWorkers = std::max(1, std::min(MAX_RECEIVE_WORKERS, atoi(receiveWorkersOption)));
+        printf("Receiving audio on %d workers.\n", numReceiveWorkers);
+    }
+    
+    receiveWorkers = new MixerReceiveWorker[numReceiveWorkers];
+    
+    for (int w = 0; w < numReceiveWorkers; w++) {
+        MixerReceiveWorker *worker = &receiveWorkers[w];
+        
+        worker->socket = (w == 0) ? &agentList.getAgentSocket() : new UDPSocket(MIXER_LISTEN_PORT, true);
+        worker->eventLoop = (w == 0) ? &eventLoop : new EventLoop();
+        worker->receivedDatagrams = new UDPDatagram[MAX_BATCH_DATAGRAMS];
+        worker->firstSample = true;
+        gettimeofday(&worker->lastReceive, NULL);
+        
+        worker->eventLoop->addSocket(*worker->socket, receiveAudio, (void *)worker);
+    }
     
-    int16_t *loopbackAudioPacket;
     if (LOOPBACK_SANITY_CHECK) {
         loopbackAudioPacket = new int16_t[1024];
     }
     
-    sockaddr *agentAddress = new sockaddr;
-    timeval lastReceive;
-    gettimeofday(&lastReceive, NULL);
-    
-    bool firstSample = true;
-
-    while (true) {
-        if(agentList.getAgentSocket().receive(agentAddress, packetData, &receivedBytes)) {
-            if (packetData[0] == 'I') {
-                                
-                //  Compute and report standard deviation for jitter calculation
-                if (firstSample) {
-                    stdev.reset();
-                    firstSample = false;
-                } else {
-                    double tDiff = (usecTimestampNow() - usecTimestamp(&lastReceive)) / 1000;
-                    stdev.addValue(tDiff);
-                    
-                    if (stdev.getSamples() > 500) {
-                        printf("Avg: %4.2f, Stdev: %4.2f\n", stdev.getAverage(), stdev.getStDev());
-                        stdev.reset();
-                    }
-                }
-                
-                gettimeofday(&lastReceive, NULL);
-                
-                // add or update the existing interface agent
-                if (!LOOPBACK_SANITY_CHECK) {
-                    
-                    if (agentList.addOrUpdateAgent(agentAddress, agentAddress, packetData[0], agentList.getLastAgentId())) {
-                        agentList.increaseAgentId();
-                    }
-                    
-                    agentList.updateAgentWithData(agentAddress, (void *)packetData, receivedBytes);
-                } else {
-                    memcpy(loopbackAudioPacket, packetData + 1 + (sizeof(float) * 4), 1024);
-                    agentList.getAgentSocket().send(agentAddress, loopbackAudioPacket, 1024);
-                }
-            }
-        }
+    signal(SIGINT, stopMixer);
+    signal(SIGTERM, stopMixer);
+    
+    pthread_t sendBufferThread;
+    pthread_create(&sendBufferThread, NULL, sendBuffer, NULL);
+    
+    for (int w = 1; w < numReceiveWorkers; w++) {
+        pthread_create(&receiveWorkers[w].thread, NULL, runReceiveWorker, (void *)&receiveWorkers[w]);
+    }
+    
+    eventLoop.run();
+    
+    for (int w = 1; w < numReceiveWorkers; w++) {
+        pthread_join(receiveWorkers[w].thread, NULL);
+        
+        delete receiveWorkers[w].eventLoop;
+        delete receiveWorkers[w].socket;
     }
     
     pthread_join(sendBufferThread, NULL);
     
+    for (int w = 0; w < numReceiveWorkers; w++) {
+        delete[] receiveWorkers[w].receivedDatagrams;
+    }
+    
+    delete[] receiveWorkers;
+    
     return 0;
 }
@@ -34,8 +34,6 @@ Agent::Agent(sockaddr *agentPublicSocket, sockaddr *agentLocalSocket, char agent
     
     activeSocket = NULL;
     linkedData = NULL;
-    
-    pthread_mutex_init(&deleteMutex, NULL);
 }
 
 Agent::Agent(const Agent &otherAgent) {
@@ -64,8 +62,6 @@ Agent::Agent(const Agent &otherAgent) {
     } else {
         linkedData = NULL;
     }
-    
-    deleteMutex = otherAgent.deleteMutex;
 }
 
 Agent& Agent::operator=(Agent otherAgent) {
@@ -81,7 +77,6 @@ void Agent::swap(Agent &first, Agent &second) {
     swap(first.type, second.type);
     swap(first.linkedData, second.linkedData);
     swap(first.agentId, second.agentId);
-    swap(first.deleteMutex, second.deleteMutex);
 }
 
 Agent::~Agent() {
@@ -38,8 +38,6 @@ public:
     
     bool matches(sockaddr *otherPublicSocket, sockaddr *otherLocalSocket, char otherAgentType);
     
-    pthread_mutex_t deleteMutex;
-    
     char getType();
     void setType(char newType);
     uint16_t getAgentId();
@@ -14,6 +14,9 @@ class AgentData {
         virtual ~AgentData() = 0;
         virtual void parseData(void * data, int size) = 0;
         virtual AgentData* clone() const = 0;
+        
+        // anything to send straight back to the agent after parsing its data, returns the bytes written
+        virtual int getReplyData(unsigned char *reply) { return 0; };
 };
 
 #endif
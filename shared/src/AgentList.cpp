@@ -9,16 +9,19 @@
 #include <pthread.h>
 #include <cstring>
 #include <stdlib.h>
+#include <algorithm>
 #include "AgentList.h"
 #include "SharedUtil.h"
+#include "TickScheduler.h"
 
 #ifdef _WIN32
 #include "Syssocket.h"
 #else
 #include <arpa/inet.h>
+#include <unistd.h>
 #endif
 
-const char * SOLO_AGENT_TYPES_STRING = "MV";
+const char * SOLO_AGENT_TYPES_STRING = "MVA";
 char DOMAIN_HOSTNAME[] = "highfidelity.below92.com";
 char DOMAIN_IP[100] = "";    //  IP Address will be re-set by lookup on startup
 const int DOMAINSERVER_PORT = 40102;
@@ -28,29 +31,103 @@ bool domainServerCheckinStopFlag = false;
 pthread_mutex_t vectorChangeMutex = PTHREAD_MUTEX_INITIALIZER;
 
 int unpackAgentId(unsigned char *packedData, uint16_t *agentId) {
-    memcpy(packedData, agentId, sizeof(uint16_t));
+    memcpy(agentId, packedData, sizeof(uint16_t));
     return sizeof(uint16_t);
 }
 
 int packAgentId(unsigned char *packStore, uint16_t agentId) {
-    memcpy(&agentId, packStore, sizeof(uint16_t));
+    memcpy(packStore, &agentId, sizeof(uint16_t));
     return sizeof(uint16_t);
 }
 
-AgentList::AgentList(char newOwnerType, unsigned int newSocketListenPort) : agentSocket(newSocketListenPort) {
+int packAgentListEntry(unsigned char *packStore, Agent *agent) {
+    unsigned char *packPtr = packStore;
+    
+    *packPtr++ = agent->getType();
+    packPtr += packAgentId(packPtr, agent->getAgentId());
+    packPtr += packSocket(packPtr, agent->getPublicSocket());
+    packPtr += packSocket(packPtr, agent->getLocalSocket());
+    
+    return packPtr - packStore;
+}
+
+int packRelayedData(unsigned char *packStore, uint16_t agentId, const unsigned char *data, int dataBytes) {
+    unsigned char *packPtr = packStore + packAgentId(packStore, agentId);
+    *packPtr++ = dataBytes;
+    memcpy(packPtr, data, dataBytes);
+    return RELAYED_DATA_ENTRY_HEADER_BYTES + dataBytes;
+}
+
+AgentList::AgentList(char newOwnerType, unsigned int newSocketListenPort, bool reusePort) :
+    agentSocket(newSocketListenPort, reusePort),
+    messageReassembler(AGENT_REASSEMBLY_MAX_MESSAGES, AGENT_REASSEMBLY_MAX_BYTES, AGENT_REASSEMBLY_TIMEOUT_USECS) {
     ownerType = newOwnerType;
     socketListenPort = newSocketListenPort;
     lastAgentId = 0;
+    
+    agentListVersion = NO_AGENT_LIST_VERSION;
+    ownAgentId = UNKNOWN_AGENT_ID;
+    incomingListVersion = NO_AGENT_LIST_VERSION;
+    incomingListPackets = 0;
+    
+    silentAgentRemovalThreadStarted = false;
+    domainServerCheckInThreadStarted = false;
+    domainServerCheckInPrepared = false;
+    
+    currentSnapshot = new AgentSnapshot();
+    snapshotEpoch = 0;
+    snapshotReaders[0] = 0;
+    snapshotReaders[1] = 0;
 }
 
 AgentList::~AgentList() {
     // stop the spawned threads, if they were started
-    stopSilentAgentRemovalThread();
-    stopDomainServerCheckInThread();
+    if (silentAgentRemovalThreadStarted) {
+        stopSilentAgentRemovalThread();
+    }
+    
+    if (domainServerCheckInThreadStarted) {
+        stopDomainServerCheckInThread();
+    }
+    
+    for (int i = 0; i < agents.size(); i++) {
+        delete agents[i];
+    }
+    
+    // the threads are gone so there can't be any readers left, free whatever is still retired
+    for (int i = 0; i < pendingRemovedAgents.size(); i++) {
+        delete pendingRemovedAgents[i];
+    }
+    
+    while (!retiredSnapshots.empty()) {
+        for (int i = 0; i < retiredSnapshots.front().removedAgents.size(); i++) {
+            delete retiredSnapshots.front().removedAgents[i];
+        }
+        
+        delete retiredSnapshots.front().snapshot;
+        retiredSnapshots.pop_front();
+    }
+    
+    delete currentSnapshot.load();
+}
+
+const AgentSnapshot* AgentList::beginSnapshotRead(unsigned int *readEpoch) {
+    // register as a reader of the current epoch, retrying if the epoch moved on underneath us
+    // any agent in the returned snapshot stays allocated until endSnapshotRead is called
+    while (true) {
+        *readEpoch = snapshotEpoch.load();
+        snapshotReaders[*readEpoch & 1]++;
+        
+        if (snapshotEpoch.load() == *readEpoch) {
+            return currentSnapshot.load();
+        }
+        
+        snapshotReaders[*readEpoch & 1]--;
+    }
 }
 
-std::vector<Agent>& AgentList::getAgents() {
-    return agents;
+void AgentList::endSnapshotRead(unsigned int readEpoch) {
+    snapshotReaders[readEpoch & 1]--;
 }
 
 UDPSocket& AgentList::getAgentSocket() {
@@ -72,11 +149,38 @@ void AgentList::processAgentData(sockaddr *senderAddress, void *packetData, size
             updateList((unsigned char *)packetData, dataBytes);
             break;
         }
-        case 'H': {
-            // head data from another agent
+        case AGENT_LIST_PACKET_HEADER: {
+            // one packet of the whole list from the domain server
+            updateListFromFullList((unsigned char *)packetData, dataBytes);
+            break;
+        }
+        case AGENT_LIST_CHANGES_PACKET_HEADER: {
+            // what changed in the list since the version we told the domain server we have
+            updateListFromChanges((unsigned char *)packetData, dataBytes);
+            break;
+        }
+        case 'H':
+        case 'h':
+        case 'a': {
+            // head data from another agent, whole or as a delta, or an ack of ours
             updateAgentWithData(senderAddress, packetData, dataBytes);
             break;
         }
+        case RELAYED_DATA_PACKET_HEADER: {
+            // data from several agents, passed on by a relay
+            updateAgentsWithRelayedData(senderAddress, (unsigned char *)packetData, dataBytes);
+            break;
+        }
+        case MESSAGE_FRAGMENT_PACKET_HEADER: {
+            // part of a message too big for one packet, handled like any other packet once it's all here
+            std::vector<unsigned char> message;
+            
+            if (messageReassembler.addFragment(senderAddress, (unsigned char *)packetData, dataBytes, message) > 0
+                && message[0] != MESSAGE_FRAGMENT_PACKET_HEADER) {
+                processAgentData(senderAddress, &message[0], message.size());
+            }
+            break;
+        }
         case 'P': {
             // ping from another agent
             //std::cout << "Got ping from " << inet_ntoa(((sockaddr_in *)senderAddress)->sin_addr) << "\n";
@@ -94,12 +198,14 @@ void AgentList::processAgentData(sockaddr *senderAddress, void *packetData, size
 }
 
 void AgentList::updateAgentWithData(sockaddr *senderAddress, void *packetData, size_t dataBytes) {
+    // hold a snapshot read so the agent can't be freed while we parse into it
+    unsigned int readEpoch;
+    beginSnapshotRead(&readEpoch);
+    
     // find the agent by the sockaddr
-    int agentIndex = indexOfMatchingAgent(senderAddress);
+    Agent *matchingAgent = agentForHandle(handleOfMatchingAgent(senderAddress));
     
-    if (agentIndex != -1) {
-        Agent *matchingAgent = &agents[agentIndex];
-        
+    if (matchingAgent != NULL) {
         matchingAgent->setLastRecvTimeUsecs(usecTimestampNow());
         
         if (matchingAgent->getLinkedData() == NULL) {
@@ -109,108 +215,525 @@ void AgentList::updateAgentWithData(sockaddr *senderAddress, void *packetData, s
         }
         
         matchingAgent->getLinkedData()->parseData(packetData, dataBytes);
+        
+        unsigned char reply[MAX_PACKET_SIZE];
+        int replyBytes = matchingAgent->getLinkedData()->getReplyData(reply);
+        
+        if (replyBytes > 0) {
+            agentSocket.send(senderAddress, reply, replyBytes);
+        }
     }
+    
+    endSnapshotRead(readEpoch);
+}
 
+void AgentList::updateAgentsWithRelayedData(sockaddr *senderAddress, unsigned char *packetData, size_t dataBytes) {
+    // hold a snapshot read so the agents can't be freed while we parse into them
+    unsigned int readEpoch;
+    beginSnapshotRead(&readEpoch);
+    
+    // replies to the entries are gathered up and go back to the relay together
+    unsigned char replyPacket[MAX_PACKET_SIZE];
+    replyPacket[0] = RELAYED_DATA_PACKET_HEADER;
+    int replyPacketBytes = 1;
+    
+    unsigned char entryReply[MAX_PACKET_SIZE];
+    
+    unsigned char *readPtr = packetData + 1;
+    unsigned char *endPtr = packetData + dataBytes;
+    
+    while (readPtr + RELAYED_DATA_ENTRY_HEADER_BYTES <= endPtr) {
+        uint16_t agentId;
+        readPtr += unpackAgentId(readPtr, &agentId);
+        int entryBytes = *readPtr++;
+        
+        if (readPtr + entryBytes > endPtr) {
+            break;
+        }
+        
+        Agent *matchingAgent = NULL;
+        
+        pthread_mutex_lock(&vectorChangeMutex);
+        
+        AgentIdIndex::iterator idEntry = agentIdIndex.find(agentId);
+        
+        if (idEntry != agentIdIndex.end()) {
+            matchingAgent = lockedAgentForHandle(idEntry->second);
+        }
+        
+        pthread_mutex_unlock(&vectorChangeMutex);
+        
+        if (matchingAgent != NULL) {
+            matchingAgent->setLastRecvTimeUsecs(usecTimestampNow());
+            
+            if (matchingAgent->getLinkedData() == NULL && linkedDataCreateCallback != NULL) {
+                linkedDataCreateCallback(matchingAgent);
+            }
+            
+            if (matchingAgent->getLinkedData() != NULL) {
+                matchingAgent->getLinkedData()->parseData(readPtr, entryBytes);
+                
+                int replyBytes = std::min(matchingAgent->getLinkedData()->getReplyData(entryReply), MAX_RELAYED_DATA_ENTRY_BYTES);
+                
+                if (replyBytes > 0) {
+                    if (replyPacketBytes + RELAYED_DATA_ENTRY_HEADER_BYTES + replyBytes > MAX_PACKET_SIZE) {
+                        agentSocket.send(senderAddress, replyPacket, replyPacketBytes);
+                        replyPacketBytes = 1;
+                    }
+                    
+                    replyPacketBytes += packRelayedData(replyPacket + replyPacketBytes, agentId, entryReply, replyBytes);
+                }
+            }
+        }
+        
+        readPtr += entryBytes;
+    }
+    
+    if (replyPacketBytes > 1) {
+        agentSocket.send(senderAddress, replyPacket, replyPacketBytes);
+    }
+    
+    endSnapshotRead(readEpoch);
 }
 
-int AgentList::indexOfMatchingAgent(sockaddr *senderAddress) {
-    for(std::vector<Agent>::iterator agent = agents.begin(); agent != agents.end(); agent++) {
-        if (agent->getActiveSocket() != NULL && socketMatch(agent->getActiveSocket(), senderAddress)) {
-            return agent - agents.begin();
+AgentHandle AgentList::handleOfMatchingAgent(sockaddr *senderAddress) {
+    uint64_t senderKey = socketHashKey(senderAddress);
+    AgentHandle matchingHandle = NULL_AGENT_HANDLE;
+    Agent *indexedAgent;
+    
+    pthread_mutex_lock(&vectorChangeMutex);
+    
+    // the sender only matches if the indexed socket is the one that is active for that agent
+    AgentSocketIndex::iterator indexEntry = publicSocketIndex.find(senderKey);
+    
+    if (indexEntry != publicSocketIndex.end()
+        && (indexedAgent = lockedAgentForHandle(indexEntry->second)) != NULL
+        && indexedAgent->getActiveSocket() == indexedAgent->getPublicSocket()) {
+        matchingHandle = indexEntry->second;
+    } else {
+        indexEntry = localSocketIndex.find(senderKey);
+        
+        if (indexEntry != localSocketIndex.end()
+            && (indexedAgent = lockedAgentForHandle(indexEntry->second)) != NULL
+            && indexedAgent->getActiveSocket() == indexedAgent->getLocalSocket()) {
+            matchingHandle = indexEntry->second;
         }
     }
     
-    return -1;
+    pthread_mutex_unlock(&vectorChangeMutex);
+    
+    return matchingHandle;
+}
+
+Agent* AgentList::agentForHandle(AgentHandle handle) {
+    pthread_mutex_lock(&vectorChangeMutex);
+    Agent *agent = lockedAgentForHandle(handle);
+    pthread_mutex_unlock(&vectorChangeMutex);
+    
+    return agent;
+}
+
+Agent* AgentList::lockedAgentForHandle(AgentHandle handle) {
+    // the high bits of a handle are the slot, the low bits the generation of that slot
+    unsigned int slot = handle >> 16;
+    
+    if (handle != NULL_AGENT_HANDLE
+        && slot < agentSlots.size()
+        && agentSlots[slot].generation == (handle & 0xFFFF)) {
+        return agentSlots[slot].agent;
+    } else {
+        return NULL;
+    }
+}
+
+AgentHandle AgentList::lockedHandleOfMatchingAgent(sockaddr *publicSocket, sockaddr *localSocket, char agentType) {
+    AgentSocketIndex::iterator indexEntry = publicSocketIndex.find(socketHashKey(publicSocket));
+    
+    if (indexEntry != publicSocketIndex.end()) {
+        Agent *agent = lockedAgentForHandle(indexEntry->second);
+        
+        if (agent != NULL && agent->matches(publicSocket, localSocket, agentType)) {
+            return indexEntry->second;
+        }
+    }
+    
+    return NULL_AGENT_HANDLE;
+}
+
+AgentHandle AgentList::insertAgent(Agent *newAgent) {
+    int slot;
+    
+    // re-use a free slot if we have one, otherwise grow the slots
+    if (!freeAgentSlots.empty()) {
+        slot = freeAgentSlots.back();
+        freeAgentSlots.pop_back();
+    } else {
+        AgentSlot newSlot = {};
+        newSlot.generation = 1;
+        
+        slot = agentSlots.size();
+        agentSlots.push_back(newSlot);
+    }
+    
+    AgentHandle handle = (slot << 16) | agentSlots[slot].generation;
+    
+    agentSlots[slot].agent = newAgent;
+    agentSlots[slot].agentIndex = agents.size();
+    
+    agents.push_back(newAgent);
+    agentHandles.push_back(handle);
+    
+    // the newest agent on a socket wins, an older one will be removed once it goes silent
+    publicSocketIndex[socketHashKey(newAgent->getPublicSocket())] = handle;
+    localSocketIndex[socketHashKey(newAgent->getLocalSocket())] = handle;
+    agentIdIndex[newAgent->getAgentId()] = handle;
+    
+    return handle;
+}
+
+void AgentList::removeAgentAtIndex(int agentIndex) {
+    Agent *removedAgent = agents[agentIndex];
+    AgentHandle removedHandle = agentHandles[agentIndex];
+    AgentSlot *removedSlot = &agentSlots[removedHandle >> 16];
+    
+    unindexSocket(publicSocketIndex, removedAgent->getPublicSocket(), removedHandle);
+    unindexSocket(localSocketIndex, removedAgent->getLocalSocket(), removedHandle);
+    
+    AgentIdIndex::iterator idEntry = agentIdIndex.find(removedAgent->getAgentId());
+    
+    if (idEntry != agentIdIndex.end() && idEntry->second == removedHandle) {
+        agentIdIndex.erase(idEntry);
+    }
+    
+    // bump the generation so outstanding handles go stale, never landing on the null handle
+    if (++removedSlot->generation == 0) {
+        removedSlot->generation = 1;
+    }
+    
+    removedSlot->agent = NULL;
+    freeAgentSlots.push_back(removedHandle >> 16);
+    
+    // move the last agent into the hole so removal doesn't shift the vector
+    int lastIndex = agents.size() - 1;
+    
+    if (agentIndex != lastIndex) {
+        agents[agentIndex] = agents[lastIndex];
+        agentHandles[agentIndex] = agentHandles[lastIndex];
+        agentSlots[agentHandles[agentIndex] >> 16].agentIndex = agentIndex;
+    }
+    
+    agents.pop_back();
+    agentHandles.pop_back();
+    
+    // readers may still be looking at this agent, it is freed once the next snapshot is retired
+    pendingRemovedAgents.push_back(removedAgent);
 }
 
-uint16_t AgentList::getLastAgentId() {
-    return lastAgentId;
+void AgentList::publishSnapshot() {
+    // swap in a copy of the agents for new readers, existing readers keep the old one
+    RetiredAgentSnapshot retiredSnapshot;
+    retiredSnapshot.snapshot = currentSnapshot.exchange(new AgentSnapshot(agents));
+    retiredSnapshot.epoch = snapshotEpoch.load();
+    retiredSnapshot.removedAgents.swap(pendingRemovedAgents);
+    
+    retiredSnapshots.push_back(retiredSnapshot);
+    
+    reclaimRetiredSnapshots();
 }
 
-void AgentList::increaseAgentId() {
-    ++lastAgentId;
+void AgentList::reclaimRetiredSnapshots() {
+    // only writers holding vectorChangeMutex move the epoch forwards
+    // it can move on once every reader from the epoch before the current one has finished
+    for (int i = 0; i < 2; i++) {
+        unsigned int epoch = snapshotEpoch.load();
+        
+        if (snapshotReaders[(epoch + 1) & 1].load() == 0) {
+            snapshotEpoch.store(epoch + 1);
+        }
+    }
+    
+    // a snapshot retired two epochs ago can't be held by any reader
+    while (!retiredSnapshots.empty() && snapshotEpoch.load() - retiredSnapshots.front().epoch >= 2) {
+        for (int i = 0; i < retiredSnapshots.front().removedAgents.size(); i++) {
+            delete retiredSnapshots.front().removedAgents[i];
+        }
+        
+        delete retiredSnapshots.front().snapshot;
+        retiredSnapshots.pop_front();
+    }
+}
+
+void AgentList::unindexSocket(AgentSocketIndex &socketIndex, sockaddr *socket, AgentHandle handle) {
+    // only drop the index entry if it still points at this agent
+    AgentSocketIndex::iterator indexEntry = socketIndex.find(socketHashKey(socket));
+    
+    if (indexEntry != socketIndex.end() && indexEntry->second == handle) {
+        socketIndex.erase(indexEntry);
+    }
 }
 
 int AgentList::updateList(unsigned char *packetData, size_t dataBytes) {
     int readAgents = 0;
-
-    char agentType;
     uint16_t agentId;
     
+    unsigned char *readPtr = packetData + 1;
+    unsigned char *startPtr = packetData;
+    
+    while((readPtr - startPtr) + AGENT_LIST_ENTRY_BYTES <= dataBytes) {
+        readPtr += addAgentFromListEntry(readPtr, &agentId);
+        readAgents++;
+    }
+
+    return readAgents;
+}
+
+int AgentList::addAgentFromListEntry(unsigned char *entry, uint16_t *agentId) {
     // assumes only IPv4 addresses
     sockaddr_in agentPublicSocket;
     agentPublicSocket.sin_family = AF_INET;
     sockaddr_in agentLocalSocket;
     agentLocalSocket.sin_family = AF_INET;
     
+    unsigned char *readPtr = entry;
+    char agentType = *readPtr++;
+    readPtr += unpackAgentId(readPtr, agentId);
+    readPtr += unpackSocket(readPtr, (sockaddr *)&agentPublicSocket);
+    readPtr += unpackSocket(readPtr, (sockaddr *)&agentLocalSocket);
+    
+    // the list the domain server sends everyone has us in it too
+    if (*agentId != ownAgentId) {
+        addOrUpdateAgent((sockaddr *)&agentPublicSocket, (sockaddr *)&agentLocalSocket, agentType, *agentId);
+    }
+    
+    return readPtr - entry;
+}
+
+void AgentList::updateListFromFullList(unsigned char *packetData, size_t dataBytes) {
+    if (dataBytes < AGENT_LIST_HEADER_BYTES) {
+        return;
+    }
+    
+    uint32_t version;
     unsigned char *readPtr = packetData + 1;
-    unsigned char *startPtr = packetData;
     
-    while((readPtr - startPtr) < dataBytes) {
-        agentType = *readPtr++;
-        readPtr += unpackAgentId(readPtr, (uint16_t *)&agentId);
-        readPtr += unpackSocket(readPtr, (sockaddr *)&agentPublicSocket);
-        readPtr += unpackSocket(readPtr, (sockaddr *)&agentLocalSocket);
+    memcpy(&version, readPtr, sizeof(version));
+    readPtr += sizeof(version);
+    readPtr += unpackAgentId(readPtr, &ownAgentId);
+    
+    int packetIndex = *readPtr++;
+    int packetCount = *readPtr++;
+    
+    if (packetIndex >= packetCount || packetCount > MAX_AGENT_LIST_PACKETS) {
+        return;
+    }
+    
+    if (version != incomingListVersion) {
+        // the first we've seen of this version, anything left of another is no good now
+        incomingListVersion = version;
+        incomingListPackets = 0;
+        incomingListIds.clear();
+    }
+    
+    uint16_t agentId;
+    
+    while (readPtr + AGENT_LIST_ENTRY_BYTES <= packetData + dataBytes) {
+        readPtr += addAgentFromListEntry(readPtr, &agentId);
+        incomingListIds.push_back(agentId);
+    }
+    
+    incomingListPackets |= (uint64_t) 1 << packetIndex;
+    
+    uint64_t allPackets = packetCount == 64 ? ~(uint64_t) 0 : ((uint64_t) 1 << packetCount) - 1;
+    
+    if (incomingListPackets == allPackets) {
+        // that's the whole list, anyone not on it has gone
+        removeAgentsWithIds(incomingListIds, true);
         
-        addOrUpdateAgent((sockaddr *)&agentPublicSocket, (sockaddr *)&agentLocalSocket, agentType, agentId);
-    }  
+        agentListVersion = version;
+        incomingListVersion = NO_AGENT_LIST_VERSION;
+        incomingListPackets = 0;
+        incomingListIds.clear();
+    }
+}
 
-    return readAgents;
+void AgentList::updateListFromChanges(unsigned char *packetData, size_t dataBytes) {
+    if (dataBytes < AGENT_LIST_CHANGES_HEADER_BYTES) {
+        return;
+    }
+    
+    uint32_t fromVersion, toVersion;
+    unsigned char *readPtr = packetData + 1;
+    
+    memcpy(&fromVersion, readPtr, sizeof(fromVersion));
+    readPtr += sizeof(fromVersion);
+    memcpy(&toVersion, readPtr, sizeof(toVersion));
+    readPtr += sizeof(toVersion);
+    
+    if (fromVersion != agentListVersion) {
+        // answers an older check-in, the next one will bring us up to date
+        return;
+    }
+    
+    readPtr += unpackAgentId(readPtr, &ownAgentId);
+    
+    std::vector<uint16_t> removedIds;
+    uint16_t agentId;
+    
+    while (readPtr < packetData + dataBytes) {
+        char change = *readPtr++;
+        
+        if (change == AGENT_LIST_ADDED && readPtr + AGENT_LIST_ENTRY_BYTES <= packetData + dataBytes) {
+            readPtr += addAgentFromListEntry(readPtr, &agentId);
+        } else if (change == AGENT_LIST_REMOVED && readPtr + sizeof(uint16_t) <= packetData + dataBytes) {
+            readPtr += unpackAgentId(readPtr, &agentId);
+            removedIds.push_back(agentId);
+        } else {
+            return;
+        }
+    }
+    
+    if (removedIds.size() > 0) {
+        removeAgentsWithIds(removedIds, false);
+    }
+    
+    agentListVersion = toVersion;
+    
+    // the domain server still lists everyone we have, and since it won't send them again
+    // we can't let them go silent the way we could when the whole list came every check-in
+    unsigned int readEpoch;
+    const AgentSnapshot *snapshot = beginSnapshotRead(&readEpoch);
+    
+    for (AgentSnapshot::const_iterator agent = snapshot->begin(); agent != snapshot->end(); agent++) {
+        (*agent)->setLastRecvTimeUsecs(usecTimestampNow());
+    }
+    
+    endSnapshotRead(readEpoch);
 }
 
-bool AgentList::addOrUpdateAgent(sockaddr *publicSocket, sockaddr *localSocket, char agentType, uint16_t agentId) {
-    std::vector<Agent>::iterator agent;
+void AgentList::removeAgentsWithIds(std::vector<uint16_t> &agentIds, bool keepListedInstead) {
+    std::sort(agentIds.begin(), agentIds.end());
     
-    for (agent = agents.begin(); agent != agents.end(); agent++) {
-        if (agent->matches(publicSocket, localSocket, agentType)) {
-            // we already have this agent, stop checking
-            break;
+    pthread_mutex_lock(&vectorChangeMutex);
+    
+    int agentsBeforeRemoval = agents.size();
+    
+    // walk backwards since removal moves the last agent into the removed spot
+    for (int i = agents.size() - 1; i >= 0; i--) {
+        if (std::binary_search(agentIds.begin(), agentIds.end(), agents[i]->getAgentId()) != keepListedInstead) {
+            std::cout << "Removing agent the domain server no longer lists - " << agents[i] << "\n";
+            removeAgentAtIndex(i);
         }
     }
     
-    if (agent == agents.end()) {
+    if (agents.size() != agentsBeforeRemoval) {
+        publishSnapshot();
+    }
+    
+    pthread_mutex_unlock(&vectorChangeMutex);
+}
+
+bool AgentList::addOrUpdateAgent(sockaddr *publicSocket, sockaddr *localSocket, char agentType, uint16_t agentId) {
+    return addOrUpdateAgent(publicSocket, localSocket, agentType, agentId, false, NULL);
+}
+
+bool AgentList::addOrUpdateAgent(sockaddr *publicSocket, sockaddr *localSocket, char agentType, AgentHandle *agentHandle) {
+    return addOrUpdateAgent(publicSocket, localSocket, agentType, 0, true, agentHandle);
+}
+
+bool AgentList::addOrUpdateAgent(sockaddr *publicSocket, sockaddr *localSocket, char agentType,
+                                 uint16_t agentId, bool assignAgentId, AgentHandle *agentHandle) {
+    // hold a snapshot read so a matching agent can't be freed while we update it
+    unsigned int readEpoch;
+    beginSnapshotRead(&readEpoch);
+    
+    pthread_mutex_lock(&vectorChangeMutex);
+    AgentHandle matchingHandle = lockedHandleOfMatchingAgent(publicSocket, localSocket, agentType);
+    Agent *agent = lockedAgentForHandle(matchingHandle);
+    pthread_mutex_unlock(&vectorChangeMutex);
+    
+    if (agent == NULL) {
         // we didn't have this agent, so add them
         
-        Agent newAgent = Agent(publicSocket, localSocket, agentType, agentId);
+        if (assignAgentId) {
+            // only an agent we add uses up an id, however many threads are adding at once
+            agentId = lastAgentId.fetch_add(1);
+        }
+        
+        Agent *newAgent = new Agent(publicSocket, localSocket, agentType, agentId);
         
         if (socketMatch(publicSocket, localSocket)) {
             // likely debugging scenario with DS + agent on local network
             // set the agent active right away
-            newAgent.activatePublicSocket();
+            newAgent->activatePublicSocket();
         }
         
-        if (newAgent.getType() == 'M' && audioMixerSocketUpdate != NULL) {
+        if (newAgent->getType() == 'M' && audioMixerSocketUpdate != NULL) {
             // this is an audio mixer
             // for now that means we need to tell the audio class
             // to use the local socket information the domain server gave us
             sockaddr_in *publicSocketIn = (sockaddr_in *)publicSocket;
             audioMixerSocketUpdate(publicSocketIn->sin_addr.s_addr, publicSocketIn->sin_port);
-        } else if (newAgent.getType() == 'V') {
-            newAgent.activatePublicSocket();
+        } else if (newAgent->getType() == 'V' || newAgent->getType() == 'A') {
+            newAgent->activatePublicSocket();
         }
         
-        std::cout << "Added agent - " << &newAgent << "\n";
+        // give it linked data before anyone else can see it, so we can send to agents we haven't heard from yet
+        if (linkedDataCreateCallback != NULL) {
+            linkedDataCreateCallback(newAgent);
+        }
         
         pthread_mutex_lock(&vectorChangeMutex);
-        agents.push_back(newAgent);
-        pthread_mutex_unlock(&vectorChangeMutex);
         
-        return true;
-    } else {
+        // another thread may have added the same agent while we were building ours
+        matchingHandle = lockedHandleOfMatchingAgent(publicSocket, localSocket, agentType);
+        agent = lockedAgentForHandle(matchingHandle);
         
-        if (agent->getType() == 'M' || agent->getType() == 'V') {
-            // until the Audio class also uses our agentList, we need to update
-            // the lastRecvTimeUsecs for the audio mixer so it doesn't get killed and re-added continously
-            agent->setLastRecvTimeUsecs(usecTimestampNow());
+        if (agent == NULL) {
+            matchingHandle = insertAgent(newAgent);
+            publishSnapshot();
         }
         
-        // we had this agent already, do nothing for now
-        return false;
-    }    
+        pthread_mutex_unlock(&vectorChangeMutex);
+        
+        if (agent == NULL) {
+            std::cout << "Added agent - " << newAgent << "\n";
+            
+            if (agentHandle != NULL) {
+                *agentHandle = matchingHandle;
+            }
+            
+            endSnapshotRead(readEpoch);
+            
+            return true;
+        }
+        
+        // nobody else has seen our copy, so it can go straight away
+        delete newAgent;
+    }
+    
+    if (strchr(SOLO_AGENT_TYPES_STRING, agent->getType()) != NULL) {
+        // until the Audio class also uses our agentList, we need to update
+        // the lastRecvTimeUsecs for the audio mixer so it doesn't get killed and re-added continously
+        agent->setLastRecvTimeUsecs(usecTimestampNow());
+    }
+    
+    if (agentHandle != NULL) {
+        *agentHandle = matchingHandle;
+    }
+    
+    endSnapshotRead(readEpoch);
+    
+    // we had this agent already, do nothing for now
+    return false;
 }
 
 void AgentList::broadcastToAgents(char *broadcastData, size_t dataBytes) {
-    for(std::vector<Agent>::iterator agent = agents.begin(); agent != agents.end(); agent++) {
+    unsigned int readEpoch;
+    const AgentSnapshot *snapshot = beginSnapshotRead(&readEpoch);
+    
+    for(AgentSnapshot::const_iterator agentPointer = snapshot->begin(); agentPointer != snapshot->end(); agentPointer++) {
+        Agent *agent = *agentPointer;
+        
         // for now assume we only want to send to other interface clients
         // until the Audio class uses the AgentList
         if (agent->getActiveSocket() != NULL && (agent->getType() == 'I' || agent->getType() == 'V')) {
@@ -218,12 +741,19 @@ void AgentList::broadcastToAgents(char *broadcastData, size_t dataBytes) {
             agentSocket.send(agent->getActiveSocket(), broadcastData, dataBytes);
         }
     }
+    
+    endSnapshotRead(readEpoch);
 }
 
 void AgentList::pingAgents() {
     char payload[] = "P";
     
-    for(std::vector<Agent>::iterator agent = agents.begin(); agent != agents.end(); agent++) {
+    unsigned int readEpoch;
+    const AgentSnapshot *snapshot = beginSnapshotRead(&readEpoch);
+    
+    for(AgentSnapshot::const_iterator agentPointer = snapshot->begin(); agentPointer != snapshot->end(); agentPointer++) {
+        Agent *agent = *agentPointer;
+        
         if (agent->getType() == 'I') {
             if (agent->getActiveSocket() != NULL) {
                 // we know which socket is good for this agent, send there
@@ -236,51 +766,73 @@ void AgentList::pingAgents() {
             }
         }
     }
+    
+    endSnapshotRead(readEpoch);
 }
 
 void AgentList::handlePingReply(sockaddr *agentAddress) {
-    for(std::vector<Agent>::iterator agent = agents.begin(); agent != agents.end(); agent++) {
-        // check both the public and local addresses for each agent to see if we find a match
-        // prioritize the private address so that we prune erroneous local matches        
-        if (socketMatch(agent->getPublicSocket(), agentAddress)) {
-            agent->activatePublicSocket();
-            break;
-        } else if (socketMatch(agent->getLocalSocket(), agentAddress)) {
-            agent->activateLocalSocket();
-            break;
+    uint64_t replyKey = socketHashKey(agentAddress);
+    
+    pthread_mutex_lock(&vectorChangeMutex);
+    
+    // check both the public and local addresses to see if we find a match
+    AgentSocketIndex::iterator indexEntry = publicSocketIndex.find(replyKey);
+    Agent *replyingAgent;
+    
+    if (indexEntry != publicSocketIndex.end() && (replyingAgent = lockedAgentForHandle(indexEntry->second)) != NULL) {
+        replyingAgent->activatePublicSocket();
+    } else if ((indexEntry = localSocketIndex.find(replyKey)) != localSocketIndex.end()
+               && (replyingAgent = lockedAgentForHandle(indexEntry->second)) != NULL) {
+        replyingAgent->activateLocalSocket();
+    }
+    
+    pthread_mutex_unlock(&vectorChangeMutex);
+}
+
+void AgentList::removeSilentAgents() {
+    double checkTimeUSecs = usecTimestampNow();
+    
+    // make sure the list isn't currently adding an agent
+    pthread_mutex_lock(&vectorChangeMutex);
+    
+    int agentsBeforeSweep = agents.size();
+    
+    // walk backwards since removal moves the last agent into the removed spot
+    for (int i = agents.size() - 1; i >= 0; i--) {
+        Agent *agent = agents[i];
+        
+        if ((checkTimeUSecs - agent->getLastRecvTimeUsecs()) > AGENT_SILENCE_THRESHOLD_USECS && agent->getType() != 'V') {
+            std::cout << "Killing agent " << agent  << "\n";
+            removeAgentAtIndex(i);
         }
     }
+    
+    if (agents.size() != agentsBeforeSweep) {
+        publishSnapshot();
+    } else {
+        // nothing changed, but give agents retired by earlier changes a chance to be freed
+        reclaimRetiredSnapshots();
+    }
+    
+    pthread_mutex_unlock(&vectorChangeMutex);
+}
+
+void removeSilentAgentsTimerFired(void *args) {
+    ((AgentList *)args)->removeSilentAgents();
+}
+
+void AgentList::addSilentAgentRemovalTimer(EventLoop &eventLoop) {
+    eventLoop.addTimer(AGENT_SILENCE_THRESHOLD_USECS, removeSilentAgentsTimerFired, (void *)this);
 }
 
-void *removeSilentAgents(void *args) {
-    std::vector<Agent> *agents = (std::vector<Agent> *)args;
+void *removeSilentAgentsLoop(void *args) {
+    AgentList *agentList = (AgentList *)args;
     double checkTimeUSecs, sleepTime;
     
     while (!silentAgentThreadStopFlag) {
         checkTimeUSecs = usecTimestampNow();
         
-        for(std::vector<Agent>::iterator agent = agents->begin(); agent != agents->end();) {
-            
-            pthread_mutex_t * agentDeleteMutex = &agent->deleteMutex;
-            
-            if ((checkTimeUSecs - agent->getLastRecvTimeUsecs()) > AGENT_SILENCE_THRESHOLD_USECS && agent->getType() != 'V'
-                && pthread_mutex_trylock(agentDeleteMutex) == 0) {
-                
-                std::cout << "Killing agent " << &(*agent)  << "\n";
-                
-                // make sure the vector isn't currently adding an agent
-                pthread_mutex_lock(&vectorChangeMutex);
-                agent = agents->erase(agent);
-                pthread_mutex_unlock(&vectorChangeMutex);
-                
-                // release the delete mutex and destroy it
-                pthread_mutex_unlock(agentDeleteMutex);
-                pthread_mutex_destroy(agentDeleteMutex);
-            } else {
-                agent++;
-            }
-        }
-        
+        agentList->removeSilentAgents();
         
         sleepTime = AGENT_SILENCE_THRESHOLD_USECS - (usecTimestampNow() - checkTimeUSecs);
         #ifdef _WIN32
@@ -295,22 +847,18 @@ void *removeSilentAgents(void *args) {
 }
 
 void AgentList::startSilentAgentRemovalThread() {
-    pthread_create(&removeSilentAgentsThread, NULL, removeSilentAgents, (void *)&agents);
+    silentAgentRemovalThreadStarted = true;
+    pthread_create(&removeSilentAgentsThread, NULL, removeSilentAgentsLoop, (void *)this);
 }
 
 void AgentList::stopSilentAgentRemovalThread() {
     silentAgentThreadStopFlag = true;
     pthread_join(removeSilentAgentsThread, NULL);
+    silentAgentRemovalThreadStarted = false;
 }
 
-void *checkInWithDomainServer(void *args) {
-    
-    AgentList *parentAgentList = (AgentList *)args;
-    
-    timeval lastSend;
-    unsigned char output[7];
-    
-    in_addr_t localAddress = getLocalAddress();
+void AgentList::prepareDomainServerCheckIn() {
+    checkInLocalAddress = getLocalAddress();
     
     //  Lookup the IP address of the domain server if we need to
     if (atoi(DOMAIN_IP) == 0) {
@@ -326,20 +874,48 @@ void *checkInWithDomainServer(void *args) {
         }
     } else printf("Using static domainserver IP: %s\n", DOMAIN_IP);
     
+    domainServerCheckInPrepared = true;
+}
+
+void AgentList::checkInWithDomainServer() {
+    unsigned char output[CHECK_IN_PACKET_BYTES];
+    
+    if (!domainServerCheckInPrepared) {
+        prepareDomainServerCheckIn();
+    }
+    
+    output[0] = ownerType;
+    int outputBytes = 1 + packSocket(output + 1, checkInLocalAddress, htons(socketListenPort));
+    
+    // so the domain server only sends what changed since
+    uint32_t version = agentListVersion;
+    memcpy(output + outputBytes, &version, sizeof(version));
+    outputBytes += sizeof(version);
+    
+    agentSocket.send(DOMAIN_IP, DOMAINSERVER_PORT, output, outputBytes);
+}
+
+void checkInWithDomainServerTimerFired(void *args) {
+    ((AgentList *)args)->checkInWithDomainServer();
+}
+
+void AgentList::addDomainServerCheckInTimer(EventLoop &eventLoop) {
+    // look the domain server up now rather than stalling the loop on the first check-in
+    prepareDomainServerCheckIn();
+    eventLoop.addTimer(DOMAIN_SERVER_CHECK_IN_USECS, checkInWithDomainServerTimerFired, (void *)this);
+}
+
+void *checkInWithDomainServerLoop(void *args) {
+    
+    AgentList *parentAgentList = (AgentList *)args;
+    
+    // a late check-in just pushes the next one back, there's nothing to gain from sending two together
+    TickScheduler checkInTicks("Domain check-in", DOMAIN_SERVER_CHECK_IN_USECS * (int64_t) 1000, TICK_CATCH_UP_RESET);
     
     while (!domainServerCheckinStopFlag) {
-        gettimeofday(&lastSend, NULL);
-        
-        output[0] = parentAgentList->getOwnerType();
-        packSocket(output + 1, localAddress, htons(parentAgentList->getSocketListenPort()));
+        checkInTicks.waitForNextTick();
         
-        parentAgentList->getAgentSocket().send(DOMAIN_IP, DOMAINSERVER_PORT, output, 7);
-        
-        double usecToSleep = 1000000 - (usecTimestampNow() - usecTimestamp(&lastSend));
-        
-        if (usecToSleep > 0) {
-            usleep(usecToSleep);
-        }
+        parentAgentList->checkInWithDomainServer();
     }
     
     pthread_exit(0);
@@ -347,10 +923,12 @@ void *checkInWithDomainServer(void *args) {
 }
 
 void AgentList::startDomainServerCheckInThread() {
-    pthread_create(&checkInWithDomainServerThread, NULL, checkInWithDomainServer, (void *)this);
+    domainServerCheckInThreadStarted = true;
+    pthread_create(&checkInWithDomainServerThread, NULL, checkInWithDomainServerLoop, (void *)this);
 }
 
 void AgentList::stopDomainServerCheckInThread() {
     domainServerCheckinStopFlag = true;
     pthread_join(checkInWithDomainServerThread, NULL);
-}
\ No newline at end of file
+    domainServerCheckInThreadStarted = false;
+}
@@ -11,9 +11,14 @@
 
 #include <iostream>
 #include <vector>
+#include <deque>
+#include <atomic>
+#include <unordered_map>
 #include <stdint.h>
 #include "Agent.h"
 #include "UDPSocket.h"
+#include "EventLoop.h"
+#include "MessageFragments.h"
 
 #ifdef _WIN32
 #include "pthread.h"
@@ -22,45 +27,157 @@
 const int MAX_PACKET_SIZE = 1500;
 const unsigned int AGENT_SOCKET_LISTEN_PORT = 40103;
 const int AGENT_SILENCE_THRESHOLD_USECS = 2 * 1000000;
+const int DOMAIN_SERVER_CHECK_IN_USECS = 1 * 1000000;
 extern const char *SOLO_AGENT_TYPES_STRING;
 
+// check-ins carry the version of the agent list the agent last applied and the domain server answers with
+// the adds and removes since then, or when it no longer has them or they don't fit, the whole list in as many
+// packets as it takes, each marked with its index and the count so the agent knows when it has them all
+// a check-in without a version is from an older agent and gets the old single 'D' packet
+const char AGENT_LIST_PACKET_HEADER = 'L';
+const char AGENT_LIST_CHANGES_PACKET_HEADER = 'l';
+const char AGENT_LIST_ADDED = '+';
+const char AGENT_LIST_REMOVED = '-';
+
+// type, id, public and local socket
+const int AGENT_LIST_ENTRY_BYTES = 1 + sizeof(uint16_t) + 6 + 6;
+
+// header, version, the id of the agent it's for, then packet index and count
+const int AGENT_LIST_HEADER_BYTES = 1 + sizeof(uint32_t) + sizeof(uint16_t) + 2;
+
+// header, the version the changes are from and the one they bring the agent to, then the id of the agent it's for
+const int AGENT_LIST_CHANGES_HEADER_BYTES = 1 + 2 * sizeof(uint32_t) + sizeof(uint16_t);
+
+const int CHECK_IN_PACKET_BYTES = 1 + 6 + sizeof(uint32_t);
+const int MAX_AGENT_LIST_PACKETS = 64;
+
+// the version before any list has been applied, and the id the domain server sends an agent it can't find
+const uint32_t NO_AGENT_LIST_VERSION = 0;
+const uint16_t UNKNOWN_AGENT_ID = 0xFFFF;
+
+// a relay packs several agents' data into one packet, each entry the agent id, the length of its data and the data
+// replies to the entries go back to the relay the same way
+const char RELAYED_DATA_PACKET_HEADER = 'B';
+const int RELAYED_DATA_ENTRY_HEADER_BYTES = sizeof(uint16_t) + 1;
+const int MAX_RELAYED_DATA_ENTRY_BYTES = 255;
+
+// how much of other agents' fragmented messages we hold while waiting on the rest
+const int AGENT_REASSEMBLY_MAX_MESSAGES = 16;
+const int AGENT_REASSEMBLY_MAX_BYTES = 4 * 1024 * 1024;
+const int AGENT_REASSEMBLY_TIMEOUT_USECS = 2 * 1000000;
+
 extern char DOMAIN_HOSTNAME[];
 extern char DOMAIN_IP[100];    //  IP Address will be re-set by lookup on startup
 extern const int DOMAINSERVER_PORT;
 
+// identifies an agent by its slot and the generation of that slot
+// a handle goes stale (agentForHandle returns NULL) once the agent is removed
+typedef uint32_t AgentHandle;
+const AgentHandle NULL_AGENT_HANDLE = 0;
+
+struct AgentSlot {
+    Agent *agent;
+    int agentIndex;         // position of the agent in the dense agents vector
+    uint16_t generation;
+};
+
+// maps a socketHashKey to the handle of the agent using that socket
+typedef std::unordered_map<uint64_t, AgentHandle> AgentSocketIndex;
+
+// maps an agent id to the handle of the agent with that id
+typedef std::unordered_map<uint16_t, AgentHandle> AgentIdIndex;
+
+// an immutable view of the agents, published whenever agents join or leave
+typedef std::vector<Agent *> AgentSnapshot;
+
+// a replaced snapshot and the agents removed with it, freed once no reader can see them
+struct RetiredAgentSnapshot {
+    unsigned int epoch;
+    AgentSnapshot *snapshot;
+    std::vector<Agent *> removedAgents;
+};
+
 class AgentList {
 
     UDPSocket agentSocket;
     char ownerType;
     unsigned int socketListenPort;
-    std::vector<Agent> agents;
-    uint16_t lastAgentId;
+    std::vector<Agent *> agents;
+    std::vector<AgentHandle> agentHandles;
+    std::vector<AgentSlot> agentSlots;
+    std::vector<int> freeAgentSlots;
+    AgentSocketIndex publicSocketIndex;
+    AgentSocketIndex localSocketIndex;
+    AgentIdIndex agentIdIndex;
+    std::atomic<AgentSnapshot *> currentSnapshot;
+    std::atomic<unsigned int> snapshotEpoch;
+    std::atomic<int> snapshotReaders[2];
+    std::vector<Agent *> pendingRemovedAgents;
+    std::deque<RetiredAgentSnapshot> retiredSnapshots;
+    std::atomic<uint16_t> lastAgentId;
     pthread_t removeSilentAgentsThread;
     pthread_t checkInWithDomainServerThread;
+    bool silentAgentRemovalThreadStarted;
+    bool domainServerCheckInThreadStarted;
+    bool domainServerCheckInPrepared;
+    in_addr_t checkInLocalAddress;
+    
+    std::atomic<uint32_t> agentListVersion;
+    uint16_t ownAgentId;
+    uint32_t incomingListVersion;
+    uint64_t incomingListPackets;
+    std::vector<uint16_t> incomingListIds;
+    
+    MessageReassembler messageReassembler;
     
     void handlePingReply(sockaddr *agentAddress);
+    Agent *lockedAgentForHandle(AgentHandle handle);
+    AgentHandle lockedHandleOfMatchingAgent(sockaddr *publicSocket, sockaddr *localSocket, char agentType);
+    AgentHandle insertAgent(Agent *newAgent);
+    bool addOrUpdateAgent(sockaddr *publicSocket, sockaddr *localSocket, char agentType, uint16_t agentId, bool assignAgentId,
+                          AgentHandle *agentHandle);
+    void removeAgentAtIndex(int agentIndex);
+    void unindexSocket(AgentSocketIndex &socketIndex, sockaddr *socket, AgentHandle handle);
+    void publishSnapshot();
+    void reclaimRetiredSnapshots();
+    void prepareDomainServerCheckIn();
+    int addAgentFromListEntry(unsigned char *entry, uint16_t *agentId);
+    void removeAgentsWithIds(std::vector<uint16_t> &agentIds, bool keepListedInstead);
+    void updateListFromFullList(unsigned char *packetData, size_t dataBytes);
+    void updateListFromChanges(unsigned char *packetData, size_t dataBytes);
 public:
-    AgentList(char ownerType, unsigned int socketListenPort = AGENT_SOCKET_LISTEN_PORT);
+    AgentList(char ownerType, unsigned int socketListenPort = AGENT_SOCKET_LISTEN_PORT, bool reusePort = false);
     ~AgentList();
     
     void(*linkedDataCreateCallback)(Agent *);
     void(*audioMixerSocketUpdate)(in_addr_t, in_port_t);
     
-    std::vector<Agent>& getAgents();
+    const AgentSnapshot *beginSnapshotRead(unsigned int *readEpoch);
+    void endSnapshotRead(unsigned int readEpoch);
     UDPSocket& getAgentSocket();
     
     int updateList(unsigned char *packetData, size_t dataBytes);
-    int indexOfMatchingAgent(sockaddr *senderAddress);
-    uint16_t getLastAgentId();
-    void increaseAgentId();
+    AgentHandle handleOfMatchingAgent(sockaddr *senderAddress);
+    Agent *agentForHandle(AgentHandle handle);
     bool addOrUpdateAgent(sockaddr *publicSocket, sockaddr *localSocket, char agentType, uint16_t agentId);
+    // as above, but a new agent gets the next free id, safe to call from several receive threads at once
+    // agentHandle, if given, is set to the handle of the agent added or matched
+    bool addOrUpdateAgent(sockaddr *publicSocket, sockaddr *localSocket, char agentType, AgentHandle *agentHandle = NULL);
     void processAgentData(sockaddr *senderAddress, void *packetData, size_t dataBytes);
     void updateAgentWithData(sockaddr *senderAddress, void *packetData, size_t dataBytes);
+    void updateAgentsWithRelayedData(sockaddr *senderAddress, unsigned char *packetData, size_t dataBytes);
     void broadcastToAgents(char *broadcastData, size_t dataBytes);
     void pingAgents();
     char getOwnerType();
     unsigned int getSocketListenPort();
     
+    void removeSilentAgents();
+    void checkInWithDomainServer();
+    
+    // servers run these off their event loop, clients without one use the threads below
+    void addSilentAgentRemovalTimer(EventLoop &eventLoop);
+    void addDomainServerCheckInTimer(EventLoop &eventLoop);
+    
     void startSilentAgentRemovalThread();
     void stopSilentAgentRemovalThread();
     void startDomainServerCheckInThread();
@@ -70,4 +187,10 @@ public:
 int unpackAgentId(unsigned char *packedData, uint16_t *agentId);
 int packAgentId(unsigned char *packStore, uint16_t agentId);
 
+// the entry an agent gets in the domain server's list, returns AGENT_LIST_ENTRY_BYTES
+int packAgentListEntry(unsigned char *packStore, Agent *agent);
+
+// one entry of a relayed data packet, returns the bytes written
+int packRelayedData(unsigned char *packStore, uint16_t agentId, const unsigned char *data, int dataBytes);
+
 #endif /* defined(__hifi__AgentList__) */
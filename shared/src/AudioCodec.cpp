@@ -0,0 +1,229 @@
+//
+//  AudioCodec.cpp
+//  hifi
+//
+//  Copyright (c) 2013 High Fidelity, Inc. All rights reserved.
+//
+
+#include <string.h>
+#include <stdlib.h>
+#include <algorithm>
+#include "AudioCodec.h"
+
+int pcmEncodedBytes(int numSamples) {
+    return numSamples * sizeof(int16_t);
+}
+
+void pcmEncode(unsigned char *output, const int16_t *samples, int numSamples) {
+    memcpy(output, samples, numSamples * sizeof(int16_t));
+}
+
+void pcmDecode(int16_t *samples, const unsigned char *input, int numSamples) {
+    memcpy(samples, input, numSamples * sizeof(int16_t));
+}
+
+// G.711 mu-law, 8 bits a sample
+const int MU_LAW_BIAS = 0x84;
+const int MU_LAW_CLIP = 32635;
+
+unsigned char linearToMuLaw(int16_t sample) {
+    int sign = (sample < 0) ? 0x80 : 0;
+    int magnitude = std::min(sign ? -sample : (int) sample, MU_LAW_CLIP) + MU_LAW_BIAS;
+    int exponent = 7;
+    
+    for (int mask = 0x4000; (magnitude & mask) == 0 && exponent > 0; mask >>= 1) {
+        exponent--;
+    }
+    
+    int mantissa = (magnitude >> (exponent + 3)) & 0x0F;
+    return ~(sign | (exponent << 4) | mantissa);
+}
+
+int16_t muLawToLinear(unsigned char muLaw) {
+    muLaw = ~muLaw;
+    
+    int exponent = (muLaw >> 4) & 0x07;
+    int magnitude = ((((muLaw & 0x0F) << 3) + MU_LAW_BIAS) << exponent) - MU_LAW_BIAS;
+    
+    return (muLaw & 0x80) ? -magnitude : magnitude;
+}
+
+int muLawEncodedBytes(int numSamples) {
+    return numSamples;
+}
+
+void muLawEncode(unsigned char *output, const int16_t *samples, int numSamples) {
+    for (int i = 0; i < numSamples; i++) {
+        output[i] = linearToMuLaw(samples[i]);
+    }
+}
+
+void muLawDecode(int16_t *samples, const unsigned char *input, int numSamples) {
+    for (int i = 0; i < numSamples; i++) {
+        samples[i] = muLawToLinear(input[i]);
+    }
+}
+
+// IMA-ADPCM, 4 bits a sample after a header of the first sample and the starting step index
+const int IMA_ADPCM_HEADER_BYTES = 4;
+const int IMA_ADPCM_MAX_STEP_INDEX = 88;
+
+const int IMA_ADPCM_STEP_SIZES[IMA_ADPCM_MAX_STEP_INDEX + 1] = {
+    7, 8, 9, 10, 11, 12, 13, 14, 16, 17, 19, 21, 23, 25, 28, 31, 34, 37, 41, 45,
+    50, 55, 60, 66, 73, 80, 88, 97, 107, 118, 130, 143, 157, 173, 190, 209, 230, 253, 279, 307,
+    337, 371, 408, 449, 494, 544, 598, 658, 724, 796, 876, 963, 1060, 1166, 1282, 1411, 1552, 1707, 1878, 2066,
+    2272, 2499, 2749, 3024, 3327, 3660, 4026, 4428, 4871, 5358, 5894, 6484, 7132, 7845, 8630, 9493, 10442, 11487, 12635, 13899,
+    15289, 16818, 18500, 20350, 22385, 24623, 27086, 29794, 32767
+};
+
+const int IMA_ADPCM_INDEX_ADJUSTMENTS[16] = { -1, -1, -1, -1, 2, 4, 6, 8, -1, -1, -1, -1, 2, 4, 6, 8 };
+
+// steps the predictor and step index on by one nibble, the encoder and decoder share this so they stay in lockstep
+static inline void imaAdpcmStep(int nibble, int *predictor, int *stepIndex) {
+    int step = IMA_ADPCM_STEP_SIZES[*stepIndex];
+    int delta = step >> 3;
+    
+    if (nibble & 4) {
+        delta += step;
+    }
+    
+    if (nibble & 2) {
+        delta += step >> 1;
+    }
+    
+    if (nibble & 1) {
+        delta += step >> 2;
+    }
+    
+    *predictor = std::max(-32768, std::min(32767, (nibble & 8) ? *predictor - delta : *predictor + delta));
+    *stepIndex = std::max(0, std::min(IMA_ADPCM_MAX_STEP_INDEX, *stepIndex + IMA_ADPCM_INDEX_ADJUSTMENTS[nibble]));
+}
+
+int imaAdpcmEncodedBytes(int numSamples) {
+    return IMA_ADPCM_HEADER_BYTES + numSamples / 2;
+}
+
+void imaAdpcmEncode(unsigned char *output, const int16_t *samples, int numSamples) {
+    // start the block with the step that fits its average change, rather than adapting up from nothing
+    int totalChange = 0;
+    
+    for (int i = 1; i < numSamples; i++) {
+        totalChange += abs(samples[i] - samples[i - 1]);
+    }
+    
+    int stepIndex = 0;
+    int averageChange = numSamples > 1 ? totalChange / (numSamples - 1) : 0;
+    
+    while (stepIndex < IMA_ADPCM_MAX_STEP_INDEX && IMA_ADPCM_STEP_SIZES[stepIndex] < averageChange) {
+        stepIndex++;
+    }
+    
+    int predictor = samples[0];
+    
+    memcpy(output, &samples[0], sizeof(int16_t));
+    output[2] = stepIndex;
+    output[3] = 0;
+    
+    unsigned char *nibbles = output + IMA_ADPCM_HEADER_BYTES;
+    memset(nibbles, 0, numSamples / 2);
+    
+    for (int i = 1; i < numSamples; i++) {
+        int difference = samples[i] - predictor;
+        int step = IMA_ADPCM_STEP_SIZES[stepIndex];
+        int nibble = 0;
+        
+        if (difference < 0) {
+            nibble = 8;
+            difference = -difference;
+        }
+        
+        for (int bit = 4; bit > 0; bit >>= 1) {
+            if (difference >= step) {
+                nibble |= bit;
+                difference -= step;
+            }
+            
+            step >>= 1;
+        }
+        
+        imaAdpcmStep(nibble, &predictor, &stepIndex);
+        nibbles[(i - 1) / 2] |= ((i - 1) & 1) ? nibble << 4 : nibble;
+    }
+}
+
+void imaAdpcmDecode(int16_t *samples, const unsigned char *input, int numSamples) {
+    int16_t firstSample;
+    memcpy(&firstSample, input, sizeof(int16_t));
+    
+    int predictor = firstSample;
+    int stepIndex = std::min((int) input[2], IMA_ADPCM_MAX_STEP_INDEX);
+    
+    samples[0] = predictor;
+    
+    const unsigned char *nibbles = input + IMA_ADPCM_HEADER_BYTES;
+    
+    for (int i = 1; i < numSamples; i++) {
+        int nibble = ((i - 1) & 1) ? nibbles[(i - 1) / 2] >> 4 : nibbles[(i - 1) / 2] & 0x0F;
+        
+        imaAdpcmStep(nibble, &predictor, &stepIndex);
+        samples[i] = predictor;
+    }
+}
+
+const AudioCodec PCM_AUDIO_CODEC = { "pcm", 0, pcmEncodedBytes, pcmEncode, pcmDecode };
+const AudioCodec MU_LAW_AUDIO_CODEC = { "mulaw", 1, muLawEncodedBytes, muLawEncode, muLawDecode };
+const AudioCodec IMA_ADPCM_AUDIO_CODEC = { "adpcm", 2, imaAdpcmEncodedBytes, imaAdpcmEncode, imaAdpcmDecode };
+
+const AudioCodec *AUDIO_CODECS[NUM_AUDIO_CODECS] = { &PCM_AUDIO_CODEC, &MU_LAW_AUDIO_CODEC, &IMA_ADPCM_AUDIO_CODEC };
+
+const AudioCodec *audioCodecWithId(unsigned char id) {
+    for (int i = 0; i < NUM_AUDIO_CODECS; i++) {
+        if (AUDIO_CODECS[i]->id == id) {
+            return AUDIO_CODECS[i];
+        }
+    }
+    
+    return NULL;
+}
+
+const AudioCodec *audioCodecNamed(const char *name) {
+    for (int i = 0; i < NUM_AUDIO_CODECS; i++) {
+        if (strcmp(AUDIO_CODECS[i]->name, name) == 0) {
+            return AUDIO_CODECS[i];
+        }
+    }
+    
+    return NULL;
+}
+
+int encodedFrameBytes(const AudioCodec *codec, int numSamples) {
+    int bytes = 0;
+    
+    for (int i = 0; i < numSamples; i += AUDIO_CODEC_BLOCK_SAMPLES) {
+        bytes += codec->encodedBytes(std::min(AUDIO_CODEC_BLOCK_SAMPLES, numSamples - i));
+    }
+    
+    return bytes;
+}
+
+int encodeFrame(const AudioCodec *codec, unsigned char *output, const int16_t *samples, int numSamples) {
+    unsigned char *outputStart = output;
+    
+    for (int i = 0; i < numSamples; i += AUDIO_CODEC_BLOCK_SAMPLES) {
+        int blockSamples = std::min(AUDIO_CODEC_BLOCK_SAMPLES, numSamples - i);
+        
+        codec->encode(output, samples + i, blockSamples);
+        output += codec->encodedBytes(blockSamples);
+    }
+    
+    return output - outputStart;
+}
+
+void decodeFrame(const AudioCodec *codec, int16_t *samples, const unsigned char *input, int numSamples) {
+    for (int i = 0; i < numSamples; i += AUDIO_CODEC_BLOCK_SAMPLES) {
+        int blockSamples = std::min(AUDIO_CODEC_BLOCK_SAMPLES, numSamples - i);
+        
+        codec->decode(samples + i, input, blockSamples);
+        input += codec->encodedBytes(blockSamples);
+    }
+}
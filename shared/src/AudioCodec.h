@@ -0,0 +1,47 @@
+//
+//  AudioCodec.h
+//  hifi
+//
+//  Copyright (c) 2013 High Fidelity, Inc. All rights reserved.
+//
+
+#ifndef __hifi__AudioCodec__
+#define __hifi__AudioCodec__
+
+#include <iostream>
+#include <stdint.h>
+
+// compressed audio goes out as the header and the codec id, then position and bearing when it's headed to
+// the mixer, then the frame encoded in blocks of up to AUDIO_CODEC_BLOCK_SAMPLES, one block per mixer channel
+// the mixer answers each agent in whatever codec the agent last sent it
+const char COMPRESSED_AUDIO_PACKET_HEADER = 'C';
+const int COMPRESSED_AUDIO_HEADER_BYTES = 2;
+const int AUDIO_CODEC_BLOCK_SAMPLES = 256;
+
+// blocks are coded on their own so a lost packet never throws off the next one
+// a heavier codec only has to fill this in and be added to the list in AudioCodec.cpp
+struct AudioCodec {
+    const char *name;
+    unsigned char id;
+    
+    int (*encodedBytes)(int numSamples);
+    void (*encode)(unsigned char *output, const int16_t *samples, int numSamples);
+    void (*decode)(int16_t *samples, const unsigned char *input, int numSamples);
+};
+
+extern const AudioCodec PCM_AUDIO_CODEC;
+extern const AudioCodec MU_LAW_AUDIO_CODEC;
+extern const AudioCodec IMA_ADPCM_AUDIO_CODEC;
+
+const int NUM_AUDIO_CODECS = 3;
+extern const AudioCodec *AUDIO_CODECS[NUM_AUDIO_CODECS];
+
+const AudioCodec *audioCodecWithId(unsigned char id);
+const AudioCodec *audioCodecNamed(const char *name);
+
+// a whole frame, split into blocks
+int encodedFrameBytes(const AudioCodec *codec, int numSamples);
+int encodeFrame(const AudioCodec *codec, unsigned char *output, const int16_t *samples, int numSamples);
+void decodeFrame(const AudioCodec *codec, int16_t *samples, const unsigned char *input, int numSamples);
+
+#endif /* defined(__hifi__AudioCodec__) */
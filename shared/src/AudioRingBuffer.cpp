@@ -7,8 +7,33 @@
 //
 
 #include <cstring>
+#include <cstdlib>
+#include <cmath>
+#include <algorithm>
+#include "SharedUtil.h"
 #include "AudioRingBuffer.h"
 
+// the adaptive target is this many times the mean deviation of the time between frames from a frame's length
+const float JITTER_DEVIATIONS = 4;
+
+// the deviation is smoothed over about this many frames, like RTP's interarrival jitter
+const float JITTER_SMOOTHING_FRAMES = 16;
+
+// an underrun adds this many frames of extra headroom, which leaks away a little every frame played
+const float UNDERRUN_HEADROOM_FRAMES = 1;
+const float UNDERRUN_HEADROOM_DECAY = 0.998;
+
+// a buffer a whole frame deeper than its target for this many frames in a row drops one
+const int DEEP_FRAMES_BEFORE_DROP = 32;
+
+// samples at the start of each channel faded from the dropped frame into the one that replaces it
+const int DROP_CROSSFADE_SAMPLES = 32;
+
+// a stand-in for a missing frame repeats the frame before it, fading to this much of it by the end
+// after MAX_CONCEALED_FRAMES in a row the stand-ins are silence
+const float CONCEALMENT_FADE = 0.5;
+const int MAX_CONCEALED_FRAMES = 4;
+
 AudioRingBuffer::AudioRingBuffer(int ringSamples, int bufferSamples) {
     ringBufferLengthSamples = ringSamples;
     bufferLengthSamples = bufferSamples;
@@ -16,10 +41,41 @@ AudioRingBuffer::AudioRingBuffer(int ringSamples, int bufferSamples) {
     started = false;
     addedToMix = false;
     
+    codec = NULL;
     endOfLastWrite = NULL;
     
+    pthread_mutex_init(&writeMutex, NULL);
+    
+    hasSequence = false;
+    lastSequence = 0;
+    concealedRun = 0;
+    
+    jitterBufferSamples = 0;
+    adaptiveJitter = false;
+    frameUsecs = 0;
+    numChannels = 1;
+    lastArrivalUsecs = 0;
+    jitterUsecs = 0;
+    underrunHeadroomSamples = 0;
+    deepFrames = 0;
+    
+    underruns = 0;
+    overruns = 0;
+    droppedFrames = 0;
+    concealedFrames = 0;
+    concealedGaps = 0;
+    longestConcealedGap = 0;
+    recoveredFrames = 0;
+    lateFrames = 0;
+    
     buffer = new int16_t[ringBufferLengthSamples];
     nextOutput = buffer;
+    
+    frameLoudness = new float[ringBufferLengthSamples / bufferLengthSamples];
+    memset(frameLoudness, 0, sizeof(float) * (ringBufferLengthSamples / bufferLengthSamples));
+    
+    frameConcealed = new bool[ringBufferLengthSamples / bufferLengthSamples];
+    memset(frameConcealed, 0, sizeof(bool) * (ringBufferLengthSamples / bufferLengthSamples));
 };
 
 AudioRingBuffer::AudioRingBuffer(const AudioRingBuffer &otherRingBuffer) {
@@ -27,16 +83,51 @@ AudioRingBuffer::AudioRingBuffer(const AudioRingBuffer &otherRingBuffer) {
     bufferLengthSamples = otherRingBuffer.bufferLengthSamples;
     started = otherRingBuffer.started;
     addedToMix = otherRingBuffer.addedToMix;
+    codec = otherRingBuffer.codec;
+    
+    pthread_mutex_init(&writeMutex, NULL);
+    
+    hasSequence = otherRingBuffer.hasSequence;
+    lastSequence = otherRingBuffer.lastSequence;
+    concealedRun = otherRingBuffer.concealedRun;
+    
+    jitterBufferSamples = otherRingBuffer.jitterBufferSamples;
+    adaptiveJitter = otherRingBuffer.adaptiveJitter;
+    frameUsecs = otherRingBuffer.frameUsecs;
+    numChannels = otherRingBuffer.numChannels;
+    lastArrivalUsecs = otherRingBuffer.lastArrivalUsecs;
+    jitterUsecs = otherRingBuffer.jitterUsecs;
+    underrunHeadroomSamples = otherRingBuffer.underrunHeadroomSamples;
+    deepFrames = otherRingBuffer.deepFrames;
+    
+    underruns = otherRingBuffer.underruns;
+    overruns = otherRingBuffer.overruns;
+    droppedFrames = otherRingBuffer.droppedFrames;
+    concealedFrames = otherRingBuffer.concealedFrames;
+    concealedGaps = otherRingBuffer.concealedGaps;
+    longestConcealedGap = otherRingBuffer.longestConcealedGap;
+    recoveredFrames = otherRingBuffer.recoveredFrames;
+    lateFrames = otherRingBuffer.lateFrames;
     
     buffer = new int16_t[ringBufferLengthSamples];
     memcpy(buffer, otherRingBuffer.buffer, sizeof(int16_t) * ringBufferLengthSamples);
     
+    frameLoudness = new float[ringBufferLengthSamples / bufferLengthSamples];
+    memcpy(frameLoudness, otherRingBuffer.frameLoudness, sizeof(float) * (ringBufferLengthSamples / bufferLengthSamples));
+    
+    frameConcealed = new bool[ringBufferLengthSamples / bufferLengthSamples];
+    memcpy(frameConcealed, otherRingBuffer.frameConcealed, sizeof(bool) * (ringBufferLengthSamples / bufferLengthSamples));
+    
     nextOutput = buffer + (otherRingBuffer.nextOutput - otherRingBuffer.buffer);
     endOfLastWrite = buffer + (otherRingBuffer.endOfLastWrite - otherRingBuffer.buffer);
 }
 
 AudioRingBuffer::~AudioRingBuffer() {
     delete[] buffer;
+    delete[] frameLoudness;
+    delete[] frameConcealed;
+    
+    pthread_mutex_destroy(&writeMutex);
 };
 
 AudioRingBuffer* AudioRingBuffer::clone() const {
@@ -68,6 +159,15 @@ bool AudioRingBuffer::isStarted() {
 }
 
 void AudioRingBuffer::setStarted(bool status) {
+    // a playing buffer is only ever stopped because it ran dry
+    if (started && !status) {
+        underruns++;
+        
+        if (adaptiveJitter) {
+            underrunHeadroomSamples += UNDERRUN_HEADROOM_FRAMES * bufferLengthSamples;
+        }
+    }
+    
     started = status;
 }
 
@@ -106,40 +206,224 @@ void AudioRingBuffer::setBearing(float newBearing) {
 }
 
 void AudioRingBuffer::parseData(void *data, int size) {
-    unsigned char *audioDataStart = (unsigned char *) data;
+    pthread_mutex_lock(&writeMutex);
+    parseFrame((unsigned char *) data, size);
+    pthread_mutex_unlock(&writeMutex);
+}
+
+void AudioRingBuffer::parseFrame(unsigned char *packetData, int size) {
+    int frameBytes = bufferLengthSamples * sizeof(int16_t);
     
-    if (size > (bufferLengthSamples * sizeof(int16_t))) {
+    const AudioCodec *frameCodec = NULL;
+    bool silentFrame = false;
+    bool sequenced = false;
+    bool hasPositionHeader = false;
+    int headerBytes = 1;
+    
+    if (packetData[0] == SILENT_AUDIO_PACKET_HEADER && size == SILENT_AUDIO_PACKET_BYTES) {
+        silentFrame = sequenced = hasPositionHeader = true;
+    } else if (packetData[0] == 'I' && size >= 1 + AUDIO_SEQUENCE_BYTES + AUDIO_POSITION_BEARING_BYTES + frameBytes) {
+        sequenced = hasPositionHeader = true;
+    } else if (packetData[0] == COMPRESSED_AUDIO_PACKET_HEADER && (frameCodec = audioCodecWithId(packetData[1]))) {
+        // only the exact lengths are compressed frames, anything else is raw samples that happen to start with the header
+        int compressedBytes = COMPRESSED_AUDIO_HEADER_BYTES + AUDIO_SEQUENCE_BYTES + encodedFrameBytes(frameCodec, bufferLengthSamples);
         
-        unsigned char *dataPtr = audioDataStart + 1;
+        if (size == compressedBytes || size == compressedBytes + AUDIO_POSITION_BEARING_BYTES) {
+            sequenced = true;
+            hasPositionHeader = size != compressedBytes;
+            headerBytes = COMPRESSED_AUDIO_HEADER_BYTES;
+        } else {
+            frameCodec = NULL;
+        }
+    }
+    
+    if (!sequenced) {
+        // an unsequenced frame of raw samples, with a position header if there's room for one
+        if (size < frameBytes) {
+            return;
+        }
         
-        for (int p = 0; p < 3; p ++) {
-            memcpy(&position[p], dataPtr, sizeof(float));
-            dataPtr += sizeof(float);
+        hasPositionHeader = size > frameBytes;
+        headerBytes = hasPositionHeader ? 1 : 0;
+    }
+    
+    unsigned char *dataPtr = packetData + headerBytes;
+    uint16_t sequence = 0;
+    
+    if (sequenced) {
+        memcpy(&sequence, dataPtr, sizeof(sequence));
+        dataPtr += AUDIO_SEQUENCE_BYTES;
+    }
+    
+    unsigned char *positionData = dataPtr;
+    
+    if (hasPositionHeader) {
+        dataPtr += AUDIO_POSITION_BEARING_BYTES;
+    }
+    
+    int missingFrames = 0;
+    
+    if (sequenced && hasSequence && endOfLastWrite != NULL) {
+        int16_t framesAhead = sequence - lastSequence;
+        int ringFrames = ringBufferLengthSamples / bufferLengthSamples;
+        
+        if (framesAhead <= 0 && framesAhead > -ringFrames) {
+            // a frame behind the newest one takes the place of its stand-in, as long as that hasn't started playing
+            int framesBack = 1 - framesAhead;
+            
+            if (framesBack * bufferLengthSamples < diffLastWriteNextOutput()) {
+                int16_t *frameStart = endOfLastWrite;
+                
+                for (int f = 0; f < framesBack; f++) {
+                    frameStart = frameBefore(frameStart);
+                }
+                
+                if (frameConcealed[frameIndex(frameStart)]) {
+                    writeFrame(frameStart, dataPtr, silentFrame, frameCodec);
+                    recoveredFrames++;
+                    return;
+                }
+            }
+            
+            // too late, or one we already have
+            lateFrames++;
+            return;
+        } else if (framesAhead > 1 && framesAhead < ringFrames) {
+            missingFrames = framesAhead - 1;
         }
         
-        memcpy(&bearing, dataPtr, sizeof(float));
-        dataPtr += sizeof(float);
+        // anything further out is a sender that started over, pick up from here
+    }
+    
+    if (hasPositionHeader) {
+        for (int p = 0; p < 3; p ++) {
+            memcpy(&position[p], positionData, sizeof(float));
+            positionData += sizeof(float);
+        }
         
-        audioDataStart = dataPtr;
+        memcpy(&bearing, positionData, sizeof(float));
     }
 
+    if (adaptiveJitter) {
+        double arrivalUsecs = usecTimestampNow();
+        
+        if (lastArrivalUsecs > 0) {
+            float deviationUsecs = fabs((arrivalUsecs - lastArrivalUsecs) - frameUsecs);
+            jitterUsecs += (deviationUsecs - jitterUsecs) / JITTER_SMOOTHING_FRAMES;
+        }
+        
+        lastArrivalUsecs = arrivalUsecs;
+    }
+    
     if (endOfLastWrite == NULL) {
         endOfLastWrite = buffer;
-    } else if (diffLastWriteNextOutput() > ringBufferLengthSamples - bufferLengthSamples) {
+    } else if (diffLastWriteNextOutput() > ringBufferLengthSamples - (missingFrames + 1) * bufferLengthSamples) {
         endOfLastWrite = buffer;
         nextOutput = buffer;
         started = false;
+        overruns++;
+        missingFrames = 0;
+    }
+    
+    // stand in for the frames that were skipped, they'll be replaced if they turn up in time
+    for (int f = 0; f < missingFrames; f++) {
+        concealFrame(endOfLastWrite);
+        endOfLastWrite = frameAfter(endOfLastWrite);
     }
     
-    memcpy(endOfLastWrite, audioDataStart, bufferLengthSamples * sizeof(int16_t));
+    if (concealedRun > 0) {
+        concealedGaps++;
+        longestConcealedGap = std::max(longestConcealedGap, concealedRun);
+        concealedRun = 0;
+    }
+    
+    writeFrame(endOfLastWrite, dataPtr, silentFrame, frameCodec);
+    
+    if (!silentFrame) {
+        // answer in kind, a silent frame doesn't say anything about the codec
+        codec = frameCodec;
+    }
     
-    endOfLastWrite += bufferLengthSamples;
+    endOfLastWrite = frameAfter(endOfLastWrite);
+    hasSequence = sequenced;
+    lastSequence = sequence;
     
     addedToMix = false;
+}
+
+void AudioRingBuffer::writeFrame(int16_t *frameStart, unsigned char *audioData, bool silentFrame, const AudioCodec *frameCodec) {
+    int index = frameIndex(frameStart);
+    frameConcealed[index] = false;
     
-    if (endOfLastWrite >= buffer + ringBufferLengthSamples) {
-        endOfLastWrite = buffer;
-    }    
+    if (silentFrame) {
+        memset(frameStart, 0, bufferLengthSamples * sizeof(int16_t));
+        frameLoudness[index] = 0;
+        return;
+    }
+    
+    if (frameCodec) {
+        decodeFrame(frameCodec, frameStart, audioData, bufferLengthSamples);
+    } else {
+        memcpy(frameStart, audioData, bufferLengthSamples * sizeof(int16_t));
+    }
+    
+    float loudness = 0;
+    
+    for (int i = 0; i < bufferLengthSamples; i++) {
+        loudness += abs(frameStart[i]);
+    }
+    
+    frameLoudness[index] = loudness / bufferLengthSamples;
+}
+
+void AudioRingBuffer::concealFrame(int16_t *frameStart) {
+    int16_t *previousFrame = frameBefore(frameStart);
+    int index = frameIndex(frameStart);
+    
+    frameConcealed[index] = true;
+    concealedFrames++;
+    
+    if (++concealedRun > MAX_CONCEALED_FRAMES) {
+        memset(frameStart, 0, bufferLengthSamples * sizeof(int16_t));
+        frameLoudness[index] = 0;
+        return;
+    }
+    
+    // fade across each channel so a run of stand-ins tapers off instead of buzzing at the frame rate
+    int channelSamples = bufferLengthSamples / numChannels;
+    
+    for (int c = 0; c < numChannels; c++) {
+        for (int i = 0; i < channelSamples; i++) {
+            float gain = 1 - (1 - CONCEALMENT_FADE) * (i + 1) / channelSamples;
+            int s = c * channelSamples + i;
+            
+            frameStart[s] = previousFrame[s] * gain;
+        }
+    }
+    
+    frameLoudness[index] = frameLoudness[frameIndex(previousFrame)];
+}
+
+bool AudioRingBuffer::concealNextFrame() {
+    pthread_mutex_lock(&writeMutex);
+    
+    bool concealed = false;
+    
+    if (endOfLastWrite != NULL && diffLastWriteNextOutput() >= bufferLengthSamples) {
+        // the frame that was due landed while the caller was looking, nothing to stand in for
+        concealed = true;
+    } else if (endOfLastWrite != NULL && concealedRun < MAX_CONCEALED_FRAMES) {
+        concealFrame(endOfLastWrite);
+        endOfLastWrite = frameAfter(endOfLastWrite);
+        
+        // the frame this stands in for is now late if it comes
+        lastSequence++;
+        concealed = true;
+    }
+    
+    pthread_mutex_unlock(&writeMutex);
+    
+    return concealed;
 }
 
 short AudioRingBuffer::diffLastWriteNextOutput()
@@ -156,3 +440,84 @@ short AudioRingBuffer::diffLastWriteNextOutput()
         return sampleDifference;
     }
 }
+
+int AudioRingBuffer::frameIndex(int16_t *frameStart) {
+    return ((frameStart - buffer) / bufferLengthSamples) % (ringBufferLengthSamples / bufferLengthSamples);
+}
+
+const AudioCodec *AudioRingBuffer::getCodec() {
+    return codec;
+}
+
+float AudioRingBuffer::getFrameLoudness(int16_t *frameStart) {
+    return frameLoudness[frameIndex(frameStart)];
+}
+
+int AudioRingBuffer::getJitterBufferSamples() {
+    if (!adaptiveJitter) {
+        return jitterBufferSamples;
+    }
+    
+    float targetSamples = JITTER_DEVIATIONS * jitterUsecs * (bufferLengthSamples / frameUsecs) + underrunHeadroomSamples;
+    
+    // leave room for the frame being played and the one being written
+    return std::min((int) targetSamples, ringBufferLengthSamples - 3 * bufferLengthSamples);
+}
+
+void AudioRingBuffer::setJitterBufferSamples(int samples) {
+    jitterBufferSamples = samples;
+}
+
+void AudioRingBuffer::setAdaptiveJitter(float newFrameUsecs) {
+    adaptiveJitter = true;
+    frameUsecs = newFrameUsecs;
+    
+    // start from the fixed size until there's something measured
+    jitterUsecs = jitterBufferSamples * (frameUsecs / bufferLengthSamples) / JITTER_DEVIATIONS;
+}
+
+int16_t *AudioRingBuffer::frameAfter(int16_t *frameStart) {
+    frameStart += bufferLengthSamples;
+    return frameStart >= buffer + ringBufferLengthSamples ? buffer : frameStart;
+}
+
+int16_t *AudioRingBuffer::frameBefore(int16_t *frameStart) {
+    return frameStart == buffer ? buffer + ringBufferLengthSamples - bufferLengthSamples : frameStart - bufferLengthSamples;
+}
+
+void AudioRingBuffer::advanceToNextFrame() {
+    nextOutput = frameAfter(nextOutput);
+    
+    if (!adaptiveJitter || !started) {
+        return;
+    }
+    
+    underrunHeadroomSamples *= UNDERRUN_HEADROOM_DECAY;
+    
+    // keep the frame about to be played and the target behind it, anything a frame past that is latency we can drop
+    if (diffLastWriteNextOutput() >= 2 * bufferLengthSamples + getJitterBufferSamples()) {
+        deepFrames++;
+    } else {
+        deepFrames = 0;
+    }
+    
+    if (deepFrames >= DEEP_FRAMES_BEFORE_DROP) {
+        // skip the next frame, starting the one after with the dropped one's head so the seam doesn't click
+        int16_t *droppedFrame = nextOutput;
+        int16_t *keptFrame = frameAfter(nextOutput);
+        int channelSamples = bufferLengthSamples / numChannels;
+        
+        for (int c = 0; c < numChannels; c++) {
+            for (int i = 0; i < DROP_CROSSFADE_SAMPLES && i < channelSamples; i++) {
+                float keptWeight = (i + 1) / (float) (DROP_CROSSFADE_SAMPLES + 1);
+                int s = c * channelSamples + i;
+                
+                keptFrame[s] = droppedFrame[s] * (1 - keptWeight) + keptFrame[s] * keptWeight;
+            }
+        }
+        
+        nextOutput = keptFrame;
+        droppedFrames++;
+        deepFrames = 0;
+    }
+}
@@ -11,7 +11,20 @@
 
 #include <iostream>
 #include <stdint.h>
+#include <pthread.h>
 #include "AgentData.h"
+#include "AudioCodec.h"
+
+// frames headed to the mixer carry the sender's position and bearing after the header
+const int AUDIO_POSITION_BEARING_BYTES = sizeof(float) * 4;
+
+// every frame, up or down, carries a sequence number right after its header so it can be put in its place
+// raw frames go up as 'I', mixes come down as compressed frames, pcm when the listener doesn't compress
+const int AUDIO_SEQUENCE_BYTES = sizeof(uint16_t);
+
+// a silent frame is sent as just the header, sequence, position and bearing, the ring buffer fills in the zeros
+const char SILENT_AUDIO_PACKET_HEADER = 'S';
+const int SILENT_AUDIO_PACKET_BYTES = 1 + AUDIO_SEQUENCE_BYTES + AUDIO_POSITION_BEARING_BYTES;
 
 class AudioRingBuffer : public AgentData {
     public:
@@ -39,6 +52,43 @@ class AudioRingBuffer : public AgentData {
         void setBearing(float newBearing);
     
         short diffLastWriteNextOutput();
+    
+        // mean absolute sample of the frame starting at frameStart, measured as it was written
+        float getFrameLoudness(int16_t *frameStart);
+    
+        // the codec of the last frame received, NULL when it came in as raw samples
+        const AudioCodec *getCodec();
+    
+        // samples to hold back on top of the frame being played before starting, fixed unless adaptive
+        int getJitterBufferSamples();
+        void setJitterBufferSamples(int samples);
+    
+        // frames are numChannels blocks of samples one after the other, 1 unless set
+        void setNumChannels(int newNumChannels) { numChannels = newNumChannels; };
+    
+        // size the jitter buffer from how irregularly frames arrive, and drop a frame when it runs too deep
+        void setAdaptiveJitter(float frameUsecs);
+        bool isAdaptiveJitter() { return adaptiveJitter; };
+    
+        // moves nextOutput on one frame, the only place an adaptive buffer drops frames
+        void advanceToNextFrame();
+    
+        int getUnderruns() { return underruns; };
+        int getOverruns() { return overruns; };
+        int getDroppedFrames() { return droppedFrames; };
+    
+        // the next frame is due and hasn't come, fill in for it from the last one
+        // returns false once the stand-ins have faded out and the buffer should be left to starve
+        bool concealNextFrame();
+    
+        // frames filled in for lost or late ones, in how many runs and the longest run
+        int getConcealedFrames() { return concealedFrames; };
+        int getConcealedGaps() { return concealedGaps; };
+        int getLongestConcealedGap() { return longestConcealedGap; };
+    
+        // late frames that replaced their stand-in before it was played, and ones that came too late for that
+        int getRecoveredFrames() { return recoveredFrames; };
+        int getLateFrames() { return lateFrames; };
     private:
         int ringBufferLengthSamples;
         int bufferLengthSamples;
@@ -50,6 +100,42 @@ class AudioRingBuffer : public AgentData {
         int16_t *buffer;
         bool started;
         bool addedToMix;
+        float *frameLoudness;
+        bool *frameConcealed;
+        const AudioCodec *codec;
+    
+        // frames are written by the receive thread and stood in for by playout, this keeps the two apart
+        pthread_mutex_t writeMutex;
+    
+        bool hasSequence;
+        uint16_t lastSequence;      // the sequence of the frame that ends at endOfLastWrite
+        int concealedRun;
+    
+        int jitterBufferSamples;
+        bool adaptiveJitter;
+        float frameUsecs;
+        int numChannels;
+        double lastArrivalUsecs;
+        float jitterUsecs;
+        float underrunHeadroomSamples;
+        int deepFrames;
+    
+        int underruns;
+        int overruns;
+        int droppedFrames;
+        int concealedFrames;
+        int concealedGaps;
+        int longestConcealedGap;
+        int recoveredFrames;
+        int lateFrames;
+    
+        int frameIndex(int16_t *frameStart);
+        int16_t *frameAfter(int16_t *frameStart);
+        int16_t *frameBefore(int16_t *frameStart);
+    
+        void parseFrame(unsigned char *packetData, int size);
+        void writeFrame(int16_t *frameStart, unsigned char *audioData, bool silentFrame, const AudioCodec *frameCodec);
+        void concealFrame(int16_t *frameStart);
 };
 
 #endif /* defined(__interface__AudioRingBuffer__) */
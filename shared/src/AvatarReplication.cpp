@@ -0,0 +1,239 @@
+//
+//  AvatarReplication.cpp
+//  hifi
+//
+//  Copyright (c) 2013 High Fidelity, Inc. All rights reserved.
+//
+
+#include <string.h>
+#include <algorithm>
+#include "SharedUtil.h"
+#include "AvatarReplication.h"
+
+// the fields of the binary form in order, position, pitch yaw and roll, loudness and average loudness, hand position
+const int AVATAR_STATE_FIELD_BYTES[] = { 4, 4, 4, 2, 2, 2, 2, 2, 4, 4, 4 };
+const int NUM_AVATAR_STATE_FIELDS = sizeof(AVATAR_STATE_FIELD_BYTES) / sizeof(AVATAR_STATE_FIELD_BYTES[0]);
+
+// what an update against nothing is a delta against, every field zero
+const unsigned char EMPTY_AVATAR_STATE[AVATAR_STATE_PACKET_BYTES] = { AVATAR_STATE_PACKET_HEADER, AVATAR_STATE_VERSION };
+
+// senders started in the same microsecond still get different epochs
+std::atomic<int> avatarStreamsStarted(0);
+
+int avatarUpdateInterval(float distance) {
+    if (distance > AVATAR_INTEREST_RADIUS) {
+        return 0;
+    }
+    
+    return std::max(1, std::min(AVATAR_KEEPALIVE_FRAMES, (int) (distance / AVATAR_FULL_RATE_DISTANCE)));
+}
+
+AvatarStateSender::AvatarStateSender() {
+    streamEpoch = (uint8_t) ((uint64_t) usecTimestampNow() + avatarStreamsStarted++);
+    nextSequence = 0;
+    ackedSequence = -1;
+    framesSinceUpdate = 0;
+    
+    fullUpdates = 0;
+    deltaUpdates = 0;
+    skippedFrames = 0;
+}
+
+int AvatarStateSender::encodeUpdate(unsigned char *packet, const AvatarState *state, float distance) {
+    framesSinceUpdate++;
+    
+    int updateInterval = avatarUpdateInterval(distance);
+    
+    if (updateInterval == 0) {
+        // out of interest, it goes out as soon as it comes back in since the frames kept counting
+        skippedFrames++;
+        return 0;
+    }
+    
+    unsigned char currentState[AVATAR_STATE_PACKET_BYTES];
+    encodeAvatarState(currentState, state);
+    
+    bool hasSent = fullUpdates + deltaUpdates > 0;
+    
+    if (hasSent && (framesSinceUpdate < updateInterval
+                    || (framesSinceUpdate < AVATAR_KEEPALIVE_FRAMES
+                        && memcmp(currentState, sentStates[(uint16_t) (nextSequence - 1) % AVATAR_STATE_HISTORY],
+                                  AVATAR_STATE_PACKET_BYTES) == 0))) {
+        skippedFrames++;
+        return 0;
+    }
+    
+    // delta against the last acked state if we still have it, otherwise against nothing
+    int acked = ackedSequence;
+    uint16_t baseSequence = nextSequence;
+    const unsigned char *baseState = EMPTY_AVATAR_STATE;
+    
+    if (acked >= 0 && (uint16_t) (nextSequence - acked) < AVATAR_STATE_HISTORY) {
+        baseSequence = acked;
+        baseState = sentStates[baseSequence % AVATAR_STATE_HISTORY];
+        deltaUpdates++;
+    } else {
+        fullUpdates++;
+    }
+    
+    unsigned char *dataPtr = packet;
+    *dataPtr++ = AVATAR_UPDATE_PACKET_HEADER;
+    *dataPtr++ = streamEpoch;
+    
+    memcpy(dataPtr, &nextSequence, sizeof(nextSequence));
+    dataPtr += sizeof(nextSequence);
+    memcpy(dataPtr, &baseSequence, sizeof(baseSequence));
+    dataPtr += sizeof(baseSequence);
+    
+    unsigned char *maskPtr = dataPtr;
+    dataPtr += sizeof(uint16_t);
+    
+    uint16_t changedFields = 0;
+    int offset = AVATAR_STATE_HEADER_BYTES;
+    
+    for (int i = 0; i < NUM_AVATAR_STATE_FIELDS; i++) {
+        if (memcmp(currentState + offset, baseState + offset, AVATAR_STATE_FIELD_BYTES[i]) != 0) {
+            changedFields |= 1 << i;
+            memcpy(dataPtr, currentState + offset, AVATAR_STATE_FIELD_BYTES[i]);
+            dataPtr += AVATAR_STATE_FIELD_BYTES[i];
+        }
+        
+        offset += AVATAR_STATE_FIELD_BYTES[i];
+    }
+    
+    memcpy(maskPtr, &changedFields, sizeof(changedFields));
+    
+    memcpy(sentStates[nextSequence % AVATAR_STATE_HISTORY], currentState, AVATAR_STATE_PACKET_BYTES);
+    nextSequence++;
+    framesSinceUpdate = 0;
+    
+    return dataPtr - packet;
+}
+
+void AvatarStateSender::acknowledge(const unsigned char *packet, int size) {
+    if (size < AVATAR_ACK_PACKET_BYTES || packet[0] != AVATAR_ACK_PACKET_HEADER) {
+        return;
+    }
+    
+    if (packet[1] != streamEpoch) {
+        // for a stream before this one, that sequence isn't one of ours
+        return;
+    }
+    
+    // acks that arrive out of order just make for a bigger delta, and one for a state
+    // we no longer have sends us back to updates against nothing until the next
+    uint16_t sequence;
+    memcpy(&sequence, packet + 2, sizeof(sequence));
+    ackedSequence = sequence;
+}
+
+AvatarStateReceiver::AvatarStateReceiver() {
+    for (int i = 0; i < AVATAR_STATE_HISTORY; i++) {
+        receivedSequences[i] = -1;
+    }
+    
+    streamEpoch = 0;
+    latestSequence = -1;
+    updatesSinceAck = 0;
+    ackDue = false;
+    
+    missingBases = 0;
+}
+
+bool AvatarStateReceiver::decodeUpdate(const unsigned char *packet, int size, AvatarState *state) {
+    if (size < AVATAR_UPDATE_HEADER_BYTES || packet[0] != AVATAR_UPDATE_PACKET_HEADER) {
+        return false;
+    }
+    
+    const unsigned char *dataPtr = packet + 1;
+    uint8_t epoch = *dataPtr++;
+    uint16_t sequence, baseSequence, changedFields;
+    
+    memcpy(&sequence, dataPtr, sizeof(sequence));
+    dataPtr += sizeof(sequence);
+    memcpy(&baseSequence, dataPtr, sizeof(baseSequence));
+    dataPtr += sizeof(baseSequence);
+    memcpy(&changedFields, dataPtr, sizeof(changedFields));
+    dataPtr += sizeof(changedFields);
+    
+    if (latestSequence >= 0 && epoch != streamEpoch) {
+        if (baseSequence != sequence) {
+            // a delta in a stream we haven't started, its base isn't anything we kept
+            missingBases++;
+            return false;
+        }
+        
+        // the stream started over, from a relay taking over or from the sender restarting,
+        // so what we kept is no good as a base and its sequences start again wherever they like
+        for (int i = 0; i < AVATAR_STATE_HISTORY; i++) {
+            receivedSequences[i] = -1;
+        }
+        
+        latestSequence = -1;
+    }
+    
+    if (latestSequence >= 0 && (int16_t) (sequence - latestSequence) <= 0) {
+        // late or repeated, we've already shown something newer
+        return false;
+    }
+    
+    streamEpoch = epoch;
+    
+    const unsigned char *baseState = EMPTY_AVATAR_STATE;
+    
+    if (baseSequence != sequence) {
+        if (receivedSequences[baseSequence % AVATAR_STATE_HISTORY] != baseSequence) {
+            // the sender will drop back to updates against nothing once our acks fall out of its history
+            missingBases++;
+            return false;
+        }
+        
+        baseState = receivedStates[baseSequence % AVATAR_STATE_HISTORY];
+    }
+    
+    // the base can share a slot with this update, so build it on the side
+    unsigned char currentState[AVATAR_STATE_PACKET_BYTES];
+    memcpy(currentState, baseState, AVATAR_STATE_PACKET_BYTES);
+    
+    int offset = AVATAR_STATE_HEADER_BYTES;
+    
+    for (int i = 0; i < NUM_AVATAR_STATE_FIELDS; i++) {
+        if (changedFields & (1 << i)) {
+            if (dataPtr + AVATAR_STATE_FIELD_BYTES[i] > packet + size) {
+                return false;
+            }
+            
+            memcpy(currentState + offset, dataPtr, AVATAR_STATE_FIELD_BYTES[i]);
+            dataPtr += AVATAR_STATE_FIELD_BYTES[i];
+        }
+        
+        offset += AVATAR_STATE_FIELD_BYTES[i];
+    }
+    
+    memcpy(receivedStates[sequence % AVATAR_STATE_HISTORY], currentState, AVATAR_STATE_PACKET_BYTES);
+    receivedSequences[sequence % AVATAR_STATE_HISTORY] = sequence;
+    latestSequence = sequence;
+    
+    if (baseSequence == sequence || ++updatesSinceAck >= AVATAR_ACK_INTERVAL) {
+        ackDue = true;
+    }
+    
+    return decodeAvatarState(currentState, AVATAR_STATE_PACKET_BYTES, state);
+}
+
+int AvatarStateReceiver::encodeAcknowledgement(unsigned char *packet) {
+    if (!ackDue) {
+        return 0;
+    }
+    
+    uint16_t sequence = latestSequence;
+    
+    packet[0] = AVATAR_ACK_PACKET_HEADER;
+    packet[1] = streamEpoch;
+    memcpy(packet + 2, &sequence, sizeof(sequence));
+    
+    ackDue = false;
+    updatesSinceAck = 0;
+    
+    return AVATAR_ACK_PACKET_BYTES;
+}
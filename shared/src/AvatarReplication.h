@@ -0,0 +1,100 @@
+//
+//  AvatarReplication.h
+//  hifi
+//
+//  Copyright (c) 2013 High Fidelity, Inc. All rights reserved.
+//
+
+#ifndef __hifi__AvatarReplication__
+#define __hifi__AvatarReplication__
+
+#include <iostream>
+#include <atomic>
+#include <stdint.h>
+#include "AvatarState.h"
+
+// an update is the header, the epoch of the stream it is in, its sequence, the sequence of the state it is a delta against,
+// a mask of the fields that differ from that state and then just those fields as the binary form packs them
+// an update against its own sequence is against nothing, so the receiver needs no earlier state for it
+// every sender picks a new epoch, so a receiver can tell a stream that started over from one that's arriving late
+const char AVATAR_UPDATE_PACKET_HEADER = 'h';
+const int AVATAR_UPDATE_HEADER_BYTES = 1 + sizeof(uint8_t) + 2 * sizeof(uint16_t) + sizeof(uint16_t);
+const int MAX_AVATAR_UPDATE_PACKET_BYTES = AVATAR_UPDATE_HEADER_BYTES + AVATAR_STATE_PACKET_BYTES - AVATAR_STATE_HEADER_BYTES;
+
+// the receiver acks the newest update it has, the sender only deltas against acked states
+const char AVATAR_ACK_PACKET_HEADER = 'a';
+const int AVATAR_ACK_PACKET_BYTES = 1 + sizeof(uint8_t) + sizeof(uint16_t);
+
+// how many sent and received states are kept to delta against
+// once the last ack is this far behind the sender falls back to updates against nothing
+const int AVATAR_STATE_HISTORY = 32;
+
+// receivers ack every update against nothing and every few deltas after that
+const int AVATAR_ACK_INTERVAL = 4;
+
+// avatars this close get an update every frame, further out the frames between updates grow with distance
+// up to the keepalive, which even an unchanged avatar gets so a receiver that lost the last update catches up
+const float AVATAR_FULL_RATE_DISTANCE = 2.0;
+const int AVATAR_KEEPALIVE_FRAMES = 30;
+
+// avatars further away than this get no updates at all, receivers keep them from the domain server's list
+const float AVATAR_INTEREST_RADIUS = 64.0;
+
+// the frames between updates for an avatar this far from the one receiving them, 0 when it is out of interest
+int avatarUpdateInterval(float distance);
+
+// the sending side of one avatar's state to one receiver
+// encodeUpdate is called from the sending thread and acknowledge from the receiving one
+class AvatarStateSender {
+    public:
+        AvatarStateSender();
+        
+        // called every frame, writes an update if one is due at this distance and returns its bytes, 0 otherwise
+        // an avatar that comes back into interest picks up with a delta against whatever was last acked
+        int encodeUpdate(unsigned char *packet, const AvatarState *state, float distance);
+        
+        // takes an ack packet from the receiver
+        void acknowledge(const unsigned char *packet, int size);
+        
+        int getFullUpdates() { return fullUpdates; };
+        int getDeltaUpdates() { return deltaUpdates; };
+        int getSkippedFrames() { return skippedFrames; };
+    private:
+        uint8_t streamEpoch;
+        uint16_t nextSequence;
+        std::atomic<int> ackedSequence;
+        int framesSinceUpdate;
+        
+        unsigned char sentStates[AVATAR_STATE_HISTORY][AVATAR_STATE_PACKET_BYTES];
+        
+        int fullUpdates;
+        int deltaUpdates;
+        int skippedFrames;
+};
+
+// the receiving side of one avatar's state, from its sender or a relay
+class AvatarStateReceiver {
+    public:
+        AvatarStateReceiver();
+        
+        // fills state from an update, false if the update is older than the last one or its base never arrived
+        // an update against nothing in a new epoch starts the stream over
+        bool decodeUpdate(const unsigned char *packet, int size, AvatarState *state);
+        
+        // writes an ack for the newest update if one is due and returns its bytes, 0 otherwise
+        int encodeAcknowledgement(unsigned char *packet);
+        
+        int getMissingBases() { return missingBases; };
+    private:
+        unsigned char receivedStates[AVATAR_STATE_HISTORY][AVATAR_STATE_PACKET_BYTES];
+        int receivedSequences[AVATAR_STATE_HISTORY];
+        
+        uint8_t streamEpoch;
+        int latestSequence;
+        int updatesSinceAck;
+        bool ackDue;
+        
+        int missingBases;
+};
+
+#endif /* defined(__hifi__AvatarReplication__) */
@@ -0,0 +1,150 @@
+//
+//  AvatarState.cpp
+//  hifi
+//
+//  Copyright (c) 2013 High Fidelity, Inc. All rights reserved.
+//
+
+#include <string.h>
+#include <stdio.h>
+#include <math.h>
+#include <algorithm>
+#include "AvatarState.h"
+
+const float ANGLE_STEPS_PER_DEGREE = 65536 / 360.0f;
+
+static inline unsigned char *packPosition(unsigned char *dataPtr, const float *position) {
+    for (int i = 0; i < 3; i++) {
+        float scaled = std::max(-2147483520.0f, std::min(2147483520.0f, roundf(position[i] * AVATAR_POSITION_SCALE)));
+        int32_t fixed = scaled;
+        
+        memcpy(dataPtr, &fixed, sizeof(fixed));
+        dataPtr += sizeof(fixed);
+    }
+    
+    return dataPtr;
+}
+
+static inline const unsigned char *unpackPosition(const unsigned char *dataPtr, float *position) {
+    for (int i = 0; i < 3; i++) {
+        int32_t fixed;
+        memcpy(&fixed, dataPtr, sizeof(fixed));
+        dataPtr += sizeof(fixed);
+        
+        position[i] = fixed / AVATAR_POSITION_SCALE;
+    }
+    
+    return dataPtr;
+}
+
+static inline unsigned char *packAngle(unsigned char *dataPtr, float degrees) {
+    // wraps, so a yaw that has gone round a few times still fits
+    uint16_t steps = (uint16_t) (int64_t) roundf(degrees * ANGLE_STEPS_PER_DEGREE);
+    memcpy(dataPtr, &steps, sizeof(steps));
+    return dataPtr + sizeof(steps);
+}
+
+static inline const unsigned char *unpackAngle(const unsigned char *dataPtr, float *degrees) {
+    int16_t steps;
+    memcpy(&steps, dataPtr, sizeof(steps));
+    *degrees = steps / ANGLE_STEPS_PER_DEGREE;
+    return dataPtr + sizeof(steps);
+}
+
+static inline unsigned char *packLoudness(unsigned char *dataPtr, float loudness) {
+    // loudness is a mean of int16 samples, so it fits without scaling
+    uint16_t level = std::max(0.0f, std::min(65535.0f, roundf(loudness)));
+    memcpy(dataPtr, &level, sizeof(level));
+    return dataPtr + sizeof(level);
+}
+
+static inline const unsigned char *unpackLoudness(const unsigned char *dataPtr, float *loudness) {
+    uint16_t level;
+    memcpy(&level, dataPtr, sizeof(level));
+    *loudness = level;
+    return dataPtr + sizeof(level);
+}
+
+int encodeAvatarState(unsigned char *packet, const AvatarState *state) {
+    unsigned char *dataPtr = packet;
+    
+    *dataPtr++ = AVATAR_STATE_PACKET_HEADER;
+    *dataPtr++ = AVATAR_STATE_VERSION;
+    
+    dataPtr = packPosition(dataPtr, state->position);
+    dataPtr = packAngle(dataPtr, state->pitch);
+    dataPtr = packAngle(dataPtr, state->yaw);
+    dataPtr = packAngle(dataPtr, state->roll);
+    dataPtr = packLoudness(dataPtr, state->loudness);
+    dataPtr = packLoudness(dataPtr, state->averageLoudness);
+    dataPtr = packPosition(dataPtr, state->handPosition);
+    
+    return dataPtr - packet;
+}
+
+static inline bool isBinaryAvatarState(const unsigned char *packet, int size) {
+    return size == AVATAR_STATE_PACKET_BYTES && packet[0] == AVATAR_STATE_PACKET_HEADER && packet[1] == AVATAR_STATE_VERSION;
+}
+
+bool decodeAvatarStateText(const unsigned char *packet, int size, AvatarState *state) {
+    if (size < 2 || size >= MAX_AVATAR_STATE_TEXT_BYTES || packet[0] != AVATAR_STATE_PACKET_HEADER) {
+        return false;
+    }
+    
+    // the packet isn't terminated, scan a copy that is
+    char text[MAX_AVATAR_STATE_TEXT_BYTES];
+    memcpy(text, packet, size);
+    text[size] = '\0';
+    
+    memset(state, 0, sizeof(AvatarState));
+    
+    return sscanf(text, "H%f,%f,%f,%f,%f,%f,%f,%f,%f,%f,%f",
+                  &state->pitch, &state->yaw, &state->roll,
+                  &state->position[0], &state->position[1], &state->position[2],
+                  &state->loudness, &state->averageLoudness,
+                  &state->handPosition[0], &state->handPosition[1], &state->handPosition[2]) >= 6;
+}
+
+bool decodeAvatarState(const unsigned char *packet, int size, AvatarState *state) {
+    if (!isBinaryAvatarState(packet, size)) {
+        return decodeAvatarStateText(packet, size, state);
+    }
+    
+    const unsigned char *dataPtr = packet + AVATAR_STATE_HEADER_BYTES;
+    
+    dataPtr = unpackPosition(dataPtr, state->position);
+    dataPtr = unpackAngle(dataPtr, &state->pitch);
+    dataPtr = unpackAngle(dataPtr, &state->yaw);
+    dataPtr = unpackAngle(dataPtr, &state->roll);
+    dataPtr = unpackLoudness(dataPtr, &state->loudness);
+    dataPtr = unpackLoudness(dataPtr, &state->averageLoudness);
+    unpackPosition(dataPtr, state->handPosition);
+    
+    return true;
+}
+
+bool decodeAvatarPosition(const unsigned char *packet, int size, float *position) {
+    if (!isBinaryAvatarState(packet, size)) {
+        AvatarState state;
+        
+        if (!decodeAvatarStateText(packet, size, &state)) {
+            return false;
+        }
+        
+        memcpy(position, state.position, sizeof(state.position));
+        return true;
+    }
+    
+    unpackPosition(packet + AVATAR_STATE_HEADER_BYTES, position);
+    return true;
+}
+
+int encodeAvatarStateText(char *packet, const AvatarState *state) {
+    int bytes = snprintf(packet, MAX_AVATAR_STATE_TEXT_BYTES, "H%f,%f,%f,%f,%f,%f,%f,%f,%f,%f,%f",
+                         state->pitch, state->yaw, state->roll,
+                         state->position[0], state->position[1], state->position[2],
+                         state->loudness, state->averageLoudness,
+                         state->handPosition[0], state->handPosition[1], state->handPosition[2]);
+    
+    return std::min(bytes, MAX_AVATAR_STATE_TEXT_BYTES - 1);
+}
@@ -0,0 +1,52 @@
+//
+//  AvatarState.h
+//  hifi
+//
+//  Copyright (c) 2013 High Fidelity, Inc. All rights reserved.
+//
+
+#ifndef __hifi__AvatarState__
+#define __hifi__AvatarState__
+
+#include <iostream>
+#include <stdint.h>
+
+// head state goes out as the header and a version byte, then fixed size fields
+// the old text form put a number straight after the header, so the version byte can't be mistaken for it
+const char AVATAR_STATE_PACKET_HEADER = 'H';
+const unsigned char AVATAR_STATE_VERSION = 1;
+const int AVATAR_STATE_HEADER_BYTES = 2;
+
+// positions are fixed point at this many steps a unit, angles are a full turn over 16 bits
+const float AVATAR_POSITION_SCALE = 1024;
+
+// header, version, position, pitch yaw and roll, loudness and average loudness, hand position
+const int AVATAR_STATE_PACKET_BYTES = AVATAR_STATE_HEADER_BYTES + 3 * sizeof(int32_t) + 3 * sizeof(uint16_t) + 2 * sizeof(uint16_t) + 3 * sizeof(int32_t);
+
+// the longest the old text form gets, eleven floats with commas
+const int MAX_AVATAR_STATE_TEXT_BYTES = 200;
+
+struct AvatarState {
+    float position[3];
+    float pitch;
+    float yaw;
+    float roll;
+    float loudness;
+    float averageLoudness;
+    float handPosition[3];
+};
+
+// returns the bytes written, AVATAR_STATE_PACKET_BYTES
+int encodeAvatarState(unsigned char *packet, const AvatarState *state);
+
+// takes the binary form or the old text form, returns false for anything else
+// angles come back in [-180, 180) and loudness in whole steps
+bool decodeAvatarState(const unsigned char *packet, int size, AvatarState *state);
+
+// just the position, read straight out of the packet for receivers that don't need the rest
+bool decodeAvatarPosition(const unsigned char *packet, int size, float *position);
+
+// the old text form, for receivers that haven't been updated
+int encodeAvatarStateText(char *packet, const AvatarState *state);
+
+#endif /* defined(__hifi__AvatarState__) */
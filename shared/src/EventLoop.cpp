@@ -0,0 +1,181 @@
+//
+//  EventLoop.cpp
+//  hifi
+//
+//  Copyright (c) 2013 High Fidelity, Inc. All rights reserved.
+//
+
+#include <cmath>
+#include <fcntl.h>
+#include <errno.h>
+#include <unistd.h>
+#include "EventLoop.h"
+#include "SharedUtil.h"
+#include "TickScheduler.h"
+
+#ifdef __linux__
+#include <sys/epoll.h>
+#else
+#include <poll.h>
+#endif
+
+const int MAX_EVENTS_PER_WAIT = 16;
+
+// timers run off the monotonic clock so a change to the time of day doesn't stall or rush them
+double timerUsecsNow() {
+    return monotonicNsecsNow() / 1000.0;
+}
+
+// the wake pipe is registered under this index, sockets use their position in the sockets vector
+const unsigned int WAKE_EVENT_INDEX = 0xFFFFFFFF;
+
+EventLoop::EventLoop() {
+    stopFlag = false;
+    
+    // stop() writes a byte to this pipe so a blocked wait returns straight away
+    if (pipe(wakeHandles) < 0) {
+        printf("Failed to create event loop wake pipe.\n");
+        wakeHandles[0] = wakeHandles[1] = -1;
+    } else {
+        fcntl(wakeHandles[0], F_SETFL, O_NONBLOCK);
+        fcntl(wakeHandles[1], F_SETFL, O_NONBLOCK);
+    }
+    
+#ifdef __linux__
+    pollHandle = epoll_create1(0);
+    
+    epoll_event wakeEvent;
+    wakeEvent.events = EPOLLIN;
+    wakeEvent.data.u32 = WAKE_EVENT_INDEX;
+    epoll_ctl(pollHandle, EPOLL_CTL_ADD, wakeHandles[0], &wakeEvent);
+#else
+    pollHandle = -1;
+#endif
+}
+
+EventLoop::~EventLoop() {
+    close(wakeHandles[0]);
+    close(wakeHandles[1]);
+    
+#ifdef __linux__
+    close(pollHandle);
+#endif
+}
+
+void EventLoop::addSocket(UDPSocket &socket, EventCallback callback, void *userData) {
+    EventLoopSocket newSocket;
+    newSocket.handle = socket.getHandle();
+    newSocket.callback = callback;
+    newSocket.userData = userData;
+    
+#ifdef __linux__
+    epoll_event socketEvent;
+    socketEvent.events = EPOLLIN;
+    socketEvent.data.u32 = sockets.size();
+    epoll_ctl(pollHandle, EPOLL_CTL_ADD, newSocket.handle, &socketEvent);
+#endif
+    
+    sockets.push_back(newSocket);
+}
+
+void EventLoop::addTimer(double intervalUsecs, EventCallback callback, void *userData) {
+    EventLoopTimer newTimer;
+    newTimer.intervalUsecs = intervalUsecs;
+    newTimer.callback = callback;
+    newTimer.userData = userData;
+    
+    // timers first fire as soon as the loop starts running
+    newTimer.nextFireUsecs = 0;
+    
+    timers.push_back(newTimer);
+}
+
+void EventLoop::run() {
+    while (!stopFlag) {
+        int timeoutMsecs = msecsUntilNextTimer();
+        
+#ifdef __linux__
+        epoll_event events[MAX_EVENTS_PER_WAIT];
+        int numEvents = epoll_wait(pollHandle, events, MAX_EVENTS_PER_WAIT, timeoutMsecs);
+        
+        for (int i = 0; i < numEvents && !stopFlag; i++) {
+            if (events[i].data.u32 != WAKE_EVENT_INDEX) {
+                EventLoopSocket *readySocket = &sockets[events[i].data.u32];
+                readySocket->callback(readySocket->userData);
+            }
+        }
+#else
+        std::vector<pollfd> pollHandles(sockets.size() + 1);
+        
+        for (int i = 0; i < sockets.size(); i++) {
+            pollHandles[i].fd = sockets[i].handle;
+            pollHandles[i].events = POLLIN;
+            pollHandles[i].revents = 0;
+        }
+        
+        pollHandles[sockets.size()].fd = wakeHandles[0];
+        pollHandles[sockets.size()].events = POLLIN;
+        pollHandles[sockets.size()].revents = 0;
+        
+        if (poll(&pollHandles[0], pollHandles.size(), timeoutMsecs) > 0) {
+            for (int i = 0; i < sockets.size() && !stopFlag; i++) {
+                if (pollHandles[i].revents & POLLIN) {
+                    sockets[i].callback(sockets[i].userData);
+                }
+            }
+        }
+#endif
+        
+        if (!stopFlag) {
+            fireDueTimers();
+        }
+    }
+}
+
+void EventLoop::stop() {
+    // only async-signal-safe calls in here so this can be used from a SIGINT handler
+    stopFlag = true;
+    
+    char wakeByte = 0;
+    ssize_t bytesWritten = write(wakeHandles[1], &wakeByte, 1);
+    (void) bytesWritten;
+}
+
+bool EventLoop::isStopped() {
+    return stopFlag;
+}
+
+int EventLoop::msecsUntilNextTimer() {
+    if (timers.empty()) {
+        // nothing scheduled, wait for a socket or stop()
+        return -1;
+    }
+    
+    double nextFireUsecs = timers[0].nextFireUsecs;
+    
+    for (int i = 1; i < timers.size(); i++) {
+        nextFireUsecs = std::min(nextFireUsecs, timers[i].nextFireUsecs);
+    }
+    
+    double usecsToWait = nextFireUsecs - timerUsecsNow();
+    
+    // round up so we don't wake a fraction of a msec early and spin
+    return usecsToWait > 0 ? (int) ceil(usecsToWait / 1000) : 0;
+}
+
+void EventLoop::fireDueTimers() {
+    double now = timerUsecsNow();
+    
+    for (int i = 0; i < timers.size(); i++) {
+        if (timers[i].nextFireUsecs <= now) {
+            timers[i].callback(timers[i].userData);
+            
+            // keep to the original schedule unless we've fallen a whole interval behind
+            timers[i].nextFireUsecs += timers[i].intervalUsecs;
+            
+            if (timers[i].nextFireUsecs <= now) {
+                timers[i].nextFireUsecs = now + timers[i].intervalUsecs;
+            }
+        }
+    }
+}
@@ -0,0 +1,54 @@
+//
+//  EventLoop.h
+//  hifi
+//
+//  Copyright (c) 2013 High Fidelity, Inc. All rights reserved.
+//
+
+#ifndef __hifi__EventLoop__
+#define __hifi__EventLoop__
+
+#include <iostream>
+#include <vector>
+#include "UDPSocket.h"
+
+typedef void (*EventCallback)(void *userData);
+
+struct EventLoopSocket {
+    int handle;
+    EventCallback callback;
+    void *userData;
+};
+
+struct EventLoopTimer {
+    double intervalUsecs;
+    double nextFireUsecs;
+    EventCallback callback;
+    void *userData;
+};
+
+// single threaded reactor, waits on any number of sockets (epoll on linux, poll elsewhere)
+// and fires periodic timers in between, stop() may be called from any thread or a signal handler
+class EventLoop {
+    public:
+        EventLoop();
+        ~EventLoop();
+        
+        void addSocket(UDPSocket &socket, EventCallback callback, void *userData);
+        void addTimer(double intervalUsecs, EventCallback callback, void *userData);
+        
+        void run();
+        void stop();
+        bool isStopped();
+    private:
+        int pollHandle;
+        int wakeHandles[2];
+        volatile bool stopFlag;
+        std::vector<EventLoopSocket> sockets;
+        std::vector<EventLoopTimer> timers;
+        
+        int msecsUntilNextTimer();
+        void fireDueTimers();
+};
+
+#endif /* defined(__hifi__EventLoop__) */
@@ -0,0 +1,204 @@
+//
+//  MessageFragments.cpp
+//  hifi
+//
+//  Copyright (c) 2013 High Fidelity, Inc. All rights reserved.
+//
+
+#include <string.h>
+#include <algorithm>
+#include "MessageFragments.h"
+#include "TickScheduler.h"
+
+std::atomic<uint16_t> nextMessageId(0);
+
+int sendMessage(UDPSocket &socket, sockaddr *destAddress, const unsigned char *message, int messageBytes) {
+    if (messageBytes <= MAX_BUFFER_LENGTH_BYTES) {
+        socket.send(destAddress, message, messageBytes);
+        return 1;
+    }
+    
+    if (messageBytes > MAX_MESSAGE_BYTES) {
+        return 0;
+    }
+    
+    uint16_t messageId = nextMessageId++;
+    uint16_t numFragments = (messageBytes + MESSAGE_FRAGMENT_PAYLOAD_BYTES - 1) / MESSAGE_FRAGMENT_PAYLOAD_BYTES;
+    
+    UDPDatagram *fragments = new UDPDatagram[std::min((int) numFragments, MAX_BATCH_DATAGRAMS)];
+    int numQueued = 0;
+    
+    for (uint16_t index = 0; index < numFragments; index++) {
+        UDPDatagram *fragment = &fragments[numQueued];
+        memcpy(&fragment->address, destAddress, sizeof(sockaddr_in));
+        
+        unsigned char *dataPtr = fragment->data;
+        *dataPtr++ = MESSAGE_FRAGMENT_PACKET_HEADER;
+        
+        memcpy(dataPtr, &messageId, sizeof(messageId));
+        dataPtr += sizeof(messageId);
+        memcpy(dataPtr, &index, sizeof(index));
+        dataPtr += sizeof(index);
+        memcpy(dataPtr, &numFragments, sizeof(numFragments));
+        dataPtr += sizeof(numFragments);
+        
+        int offset = index * MESSAGE_FRAGMENT_PAYLOAD_BYTES;
+        int sliceBytes = std::min(MESSAGE_FRAGMENT_PAYLOAD_BYTES, messageBytes - offset);
+        memcpy(dataPtr, message + offset, sliceBytes);
+        
+        fragment->byteLength = MESSAGE_FRAGMENT_HEADER_BYTES + sliceBytes;
+        
+        if (++numQueued == MAX_BATCH_DATAGRAMS) {
+            socket.sendBatch(fragments, numQueued);
+            numQueued = 0;
+        }
+    }
+    
+    if (numQueued > 0) {
+        socket.sendBatch(fragments, numQueued);
+    }
+    
+    delete[] fragments;
+    
+    return numFragments;
+}
+
+MessageReassembler::MessageReassembler(int newMaxMessages, int newMaxBufferedBytes, int newTimeoutUsecs) {
+    maxMessages = newMaxMessages;
+    maxBufferedBytes = newMaxBufferedBytes;
+    timeoutUsecs = newTimeoutUsecs;
+    bufferedBytes = 0;
+    
+    completedMessages = 0;
+    timedOutMessages = 0;
+    evictedMessages = 0;
+    droppedFragments = 0;
+    
+    pthread_mutex_init(&partialMessagesMutex, NULL);
+}
+
+MessageReassembler::~MessageReassembler() {
+    while (!partialMessages.empty()) {
+        removePartialMessage(0);
+    }
+    
+    pthread_mutex_destroy(&partialMessagesMutex);
+}
+
+void MessageReassembler::removePartialMessage(int index) {
+    bufferedBytes -= partialMessages[index]->data.size();
+    delete partialMessages[index];
+    partialMessages.erase(partialMessages.begin() + index);
+}
+
+void MessageReassembler::removeTimedOutMessages(int64_t nowUsecs) {
+    for (int i = 0; i < partialMessages.size(); ) {
+        if (nowUsecs - partialMessages[i]->lastFragmentUsecs > timeoutUsecs) {
+            // the rest of it isn't coming, the sender will have to send it again
+            removePartialMessage(i);
+            timedOutMessages++;
+        } else {
+            i++;
+        }
+    }
+}
+
+int MessageReassembler::addFragment(sockaddr *senderAddress, const unsigned char *packet, int packetBytes,
+                                    std::vector<unsigned char> &message) {
+    if (packetBytes <= MESSAGE_FRAGMENT_HEADER_BYTES || packet[0] != MESSAGE_FRAGMENT_PACKET_HEADER) {
+        droppedFragments++;
+        return 0;
+    }
+    
+    const unsigned char *dataPtr = packet + 1;
+    uint16_t messageId, index, numFragments;
+    
+    memcpy(&messageId, dataPtr, sizeof(messageId));
+    dataPtr += sizeof(messageId);
+    memcpy(&index, dataPtr, sizeof(index));
+    dataPtr += sizeof(index);
+    memcpy(&numFragments, dataPtr, sizeof(numFragments));
+    dataPtr += sizeof(numFragments);
+    
+    int sliceBytes = packetBytes - MESSAGE_FRAGMENT_HEADER_BYTES;
+    
+    if (numFragments == 0 || numFragments > MAX_MESSAGE_FRAGMENTS || index >= numFragments
+        || sliceBytes > MESSAGE_FRAGMENT_PAYLOAD_BYTES
+        || (index < numFragments - 1 && sliceBytes != MESSAGE_FRAGMENT_PAYLOAD_BYTES)) {
+        droppedFragments++;
+        return 0;
+    }
+    
+    int64_t nowUsecs = monotonicNsecsNow() / 1000;
+    uint64_t senderKey = socketHashKey(senderAddress);
+    int messageBytes = 0;
+    
+    pthread_mutex_lock(&partialMessagesMutex);
+    
+    removeTimedOutMessages(nowUsecs);
+    
+    int partialIndex = 0;
+    
+    while (partialIndex < partialMessages.size()
+           && (partialMessages[partialIndex]->senderKey != senderKey
+               || partialMessages[partialIndex]->messageId != messageId)) {
+        partialIndex++;
+    }
+    
+    if (partialIndex == partialMessages.size()) {
+        int neededBytes = numFragments * MESSAGE_FRAGMENT_PAYLOAD_BYTES;
+        
+        if (neededBytes > maxBufferedBytes) {
+            pthread_mutex_unlock(&partialMessagesMutex);
+            droppedFragments++;
+            return 0;
+        }
+        
+        // make room by giving up on the messages we've waited on longest
+        while (partialMessages.size() >= maxMessages || bufferedBytes + neededBytes > maxBufferedBytes) {
+            removePartialMessage(0);
+            evictedMessages++;
+        }
+        
+        PartialMessage *partialMessage = new PartialMessage;
+        partialMessage->senderKey = senderKey;
+        partialMessage->messageId = messageId;
+        partialMessage->numFragments = numFragments;
+        partialMessage->receivedFragments = 0;
+        partialMessage->messageBytes = 0;
+        partialMessage->receivedFragment.resize(numFragments, false);
+        partialMessage->data.resize(neededBytes);
+        
+        bufferedBytes += neededBytes;
+        partialMessages.push_back(partialMessage);
+        partialIndex = partialMessages.size() - 1;
+    }
+    
+    PartialMessage *partialMessage = partialMessages[partialIndex];
+    
+    if (partialMessage->numFragments != numFragments || partialMessage->receivedFragment[index]) {
+        // a repeat, or a fragment of an old message whose id has come round again
+        droppedFragments++;
+    } else {
+        memcpy(&partialMessage->data[index * MESSAGE_FRAGMENT_PAYLOAD_BYTES], dataPtr, sliceBytes);
+        partialMessage->receivedFragment[index] = true;
+        partialMessage->receivedFragments++;
+        partialMessage->lastFragmentUsecs = nowUsecs;
+        
+        if (index == numFragments - 1) {
+            partialMessage->messageBytes = index * MESSAGE_FRAGMENT_PAYLOAD_BYTES + sliceBytes;
+        }
+        
+        if (partialMessage->receivedFragments == numFragments) {
+            messageBytes = partialMessage->messageBytes;
+            message.assign(partialMessage->data.begin(), partialMessage->data.begin() + messageBytes);
+            
+            removePartialMessage(partialIndex);
+            completedMessages++;
+        }
+    }
+    
+    pthread_mutex_unlock(&partialMessagesMutex);
+    
+    return messageBytes;
+}
@@ -0,0 +1,79 @@
+//
+//  MessageFragments.h
+//  hifi
+//
+//  Copyright (c) 2013 High Fidelity, Inc. All rights reserved.
+//
+
+#ifndef __hifi__MessageFragments__
+#define __hifi__MessageFragments__
+
+#include <iostream>
+#include <vector>
+#include <deque>
+#include <atomic>
+#include <stdint.h>
+#include <pthread.h>
+#include "UDPSocket.h"
+
+// a message too big for one datagram goes out as fragments, each the header, the id of the message,
+// the index of the fragment and the count of them, then its slice of the message
+// every fragment but the last is full, so the receiver knows where each slice goes before it has them all
+const char MESSAGE_FRAGMENT_PACKET_HEADER = 'F';
+const int MESSAGE_FRAGMENT_HEADER_BYTES = 1 + 3 * sizeof(uint16_t);
+const int MESSAGE_FRAGMENT_PAYLOAD_BYTES = MAX_BUFFER_LENGTH_BYTES - MESSAGE_FRAGMENT_HEADER_BYTES;
+
+const int MAX_MESSAGE_FRAGMENTS = 1024;
+const int MAX_MESSAGE_BYTES = MAX_MESSAGE_FRAGMENTS * MESSAGE_FRAGMENT_PAYLOAD_BYTES;
+
+// sends a message that fits in a datagram as it is and a bigger one as fragments
+// returns the datagrams sent, 0 for a message over MAX_MESSAGE_BYTES
+int sendMessage(UDPSocket &socket, sockaddr *destAddress, const unsigned char *message, int messageBytes);
+
+// puts fragmented messages back together, one partial message per sender and message id
+// holds at most maxMessages partial messages and maxBufferedBytes between them, the oldest makes way
+// for a new one that won't fit, and one that hasn't had a fragment in timeoutUsecs is dropped
+class MessageReassembler {
+    public:
+        MessageReassembler(int maxMessages, int maxBufferedBytes, int timeoutUsecs);
+        ~MessageReassembler();
+        
+        // takes one fragment, when it completes a message copies that into message and returns its bytes, 0 otherwise
+        int addFragment(sockaddr *senderAddress, const unsigned char *packet, int packetBytes, std::vector<unsigned char> &message);
+        
+        int getCompletedMessages() { return completedMessages; };
+        int getTimedOutMessages() { return timedOutMessages; };
+        int getEvictedMessages() { return evictedMessages; };
+        int getDroppedFragments() { return droppedFragments; };
+        int getBufferedBytes() { return bufferedBytes; };
+    private:
+        struct PartialMessage {
+            uint64_t senderKey;
+            uint16_t messageId;
+            int numFragments;
+            int receivedFragments;
+            int messageBytes;
+            int64_t lastFragmentUsecs;
+            std::vector<bool> receivedFragment;
+            std::vector<unsigned char> data;
+        };
+        
+        void removePartialMessage(int index);
+        void removeTimedOutMessages(int64_t nowUsecs);
+        
+        // oldest first, a new message goes on the back
+        std::deque<PartialMessage *> partialMessages;
+        pthread_mutex_t partialMessagesMutex;
+        
+        int maxMessages;
+        int maxBufferedBytes;
+        int timeoutUsecs;
+        int bufferedBytes;
+        
+        std::atomic<int> completedMessages;
+        std::atomic<int> timedOutMessages;
+        std::atomic<int> evictedMessages;
+        std::atomic<int> droppedFragments;
+};
+
+#endif /* defined(__hifi__MessageFragments__) */
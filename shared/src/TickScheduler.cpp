@@ -0,0 +1,165 @@
+//
+//  TickScheduler.cpp
+//  hifi
+//
+//  Copyright (c) 2013 High Fidelity, Inc. All rights reserved.
+//
+
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <stdio.h>
+#include <algorithm>
+#include "SharedUtil.h"
+#include "TickScheduler.h"
+
+#ifdef __APPLE__
+#include <mach/mach_time.h>
+#endif
+
+#ifndef _WIN32
+#include <unistd.h>
+#endif
+
+const int64_t NSECS_PER_SEC = 1000000000;
+const int64_t NSECS_PER_USEC = 1000;
+
+const char *TICK_CATCH_UP_NAMES[] = { "burst", "skip", "reset" };
+
+int64_t monotonicNsecsNow() {
+#ifdef __APPLE__
+    static mach_timebase_info_data_t timebase;
+    
+    if (timebase.denom == 0) {
+        mach_timebase_info(&timebase);
+    }
+    
+    return mach_absolute_time() * timebase.numer / timebase.denom;
+#elif defined(_WIN32)
+    return usecTimestampNow() * NSECS_PER_USEC;
+#else
+    timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * NSECS_PER_SEC + now.tv_nsec;
+#endif
+}
+
+// sleeps until the monotonic clock reads deadlineNsecs
+void sleepUntil(int64_t deadlineNsecs) {
+#ifdef __linux__
+    timespec deadline;
+    deadline.tv_sec = deadlineNsecs / NSECS_PER_SEC;
+    deadline.tv_nsec = deadlineNsecs % NSECS_PER_SEC;
+    
+    // clock_nanosleep hands back the error rather than setting errno
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL) == EINTR);
+#else
+    // no absolute sleeps here, a relative one from a fresh reading is as close as we can get
+    int64_t nsecsToSleep = deadlineNsecs - monotonicNsecsNow();
+    
+    if (nsecsToSleep > 0) {
+        usleep(nsecsToSleep / NSECS_PER_USEC);
+    }
+#endif
+}
+
+TickCatchUp tickCatchUpNamed(const char *name, TickCatchUp defaultCatchUp) {
+    for (int i = 0; name && i < sizeof(TICK_CATCH_UP_NAMES) / sizeof(TICK_CATCH_UP_NAMES[0]); i++) {
+        if (strcmp(TICK_CATCH_UP_NAMES[i], name) == 0) {
+            return (TickCatchUp) i;
+        }
+    }
+    
+    return defaultCatchUp;
+}
+
+const char *tickCatchUpName(TickCatchUp catchUp) {
+    return TICK_CATCH_UP_NAMES[catchUp];
+}
+
+TickScheduler::TickScheduler(const char *name, int64_t intervalNsecs, TickCatchUp catchUp) {
+    this->name = name;
+    this->intervalNsecs = intervalNsecs;
+    this->catchUp = catchUp;
+    
+    nextTickNsecs = 0;
+    tickNumber = -1;
+    
+    overruns = 0;
+    skippedTicks = 0;
+    
+    reportTicks = 0;
+    reportOverruns = 0;
+    reportMaxLatencyNsecs = 0;
+    
+    memset(latencyHistogram, 0, sizeof(latencyHistogram));
+}
+
+void TickScheduler::waitForNextTick() {
+    int64_t now = monotonicNsecsNow();
+    
+    if (tickNumber < 0) {
+        nextTickNsecs = now;
+    } else if (now > nextTickNsecs) {
+        // the last tick ran past the start of this one
+        overruns++;
+        reportOverruns++;
+        
+        int64_t ticksBehind = (now - nextTickNsecs) / intervalNsecs;
+        
+        if (catchUp == TICK_CATCH_UP_SKIP && ticksBehind > 0) {
+            nextTickNsecs += ticksBehind * intervalNsecs;
+            tickNumber += ticksBehind;
+            skippedTicks += ticksBehind;
+        } else if (catchUp == TICK_CATCH_UP_RESET) {
+            nextTickNsecs = now;
+        }
+    } else {
+        sleepUntil(nextTickNsecs);
+        now = monotonicNsecsNow();
+    }
+    
+    int64_t latencyNsecs = std::max((int64_t) 0, now - nextTickNsecs);
+    int bucket = 0;
+    
+    for (int64_t latencyUsecs = latencyNsecs / NSECS_PER_USEC; latencyUsecs > 0 && bucket < LATENCY_HISTOGRAM_BUCKETS - 1; latencyUsecs >>= 1) {
+        bucket++;
+    }
+    
+    latencyHistogram[bucket]++;
+    reportMaxLatencyNsecs = std::max(reportMaxLatencyNsecs, latencyNsecs);
+    reportTicks++;
+    
+    tickNumber++;
+    nextTickNsecs += intervalNsecs;
+}
+
+void TickScheduler::printReport() {
+    if (reportTicks == 0) {
+        return;
+    }
+    
+    // percentiles are the top of the bucket they land in
+    const float PERCENTILES[] = { 0.5, 0.99 };
+    int percentileUsecs[2];
+    
+    for (int p = 0; p < 2; p++) {
+        int ticksBelow = 0;
+        int bucket = 0;
+        
+        while (bucket < LATENCY_HISTOGRAM_BUCKETS - 1 && (ticksBelow += latencyHistogram[bucket]) < PERCENTILES[p] * reportTicks) {
+            bucket++;
+        }
+        
+        percentileUsecs[p] = bucket == 0 ? 1 : 1 << bucket;
+    }
+    
+    printf("%s ticks: %d run, %d overran, %d skipped so far, woke within %d usecs at p50, %d at p99 and %.0f at worst.\n",
+           name, reportTicks, reportOverruns, skippedTicks, percentileUsecs[0], percentileUsecs[1],
+           reportMaxLatencyNsecs / (float) NSECS_PER_USEC);
+    
+    reportTicks = 0;
+    reportOverruns = 0;
+    reportMaxLatencyNsecs = 0;
+    memset(latencyHistogram, 0, sizeof(latencyHistogram));
+}
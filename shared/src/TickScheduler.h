@@ -0,0 +1,64 @@
+//
+//  TickScheduler.h
+//  hifi
+//
+//  Copyright (c) 2013 High Fidelity, Inc. All rights reserved.
+//
+
+#ifndef __hifi__TickScheduler__
+#define __hifi__TickScheduler__
+
+#include <iostream>
+#include <stdint.h>
+
+// nanoseconds on a clock that never jumps, for pacing and measuring rather than telling the time
+int64_t monotonicNsecsNow();
+
+// what to do about the ticks that were due while a tick ran long
+enum TickCatchUp {
+    TICK_CATCH_UP_BURST,    // run them back to back until the schedule is caught up, for streams that must keep their rate
+    TICK_CATCH_UP_SKIP,     // drop them and carry on at the next one due, staying on the original schedule
+    TICK_CATCH_UP_RESET     // start the schedule over from now, an interval between the end of one and the next
+};
+
+// wake latencies are counted in power of two buckets of microseconds, the last takes everything past a second
+const int LATENCY_HISTOGRAM_BUCKETS = 21;
+
+TickCatchUp tickCatchUpNamed(const char *name, TickCatchUp defaultCatchUp);
+const char *tickCatchUpName(TickCatchUp catchUp);
+
+// wakes at ticks a fixed interval apart, on absolute deadlines so the sleeps don't drift
+// and keeps count of the ticks that overran and of how late each wake was
+class TickScheduler {
+    public:
+        TickScheduler(const char *name, int64_t intervalNsecs, TickCatchUp catchUp);
+        
+        // sleeps until the next tick is due, the first call returns straight away
+        void waitForNextTick();
+        
+        // the tick on the schedule being run, skipped ticks are counted so this stays on it
+        int64_t getTickNumber() { return tickNumber; };
+        
+        int getOverruns() { return overruns; };
+        int getSkippedTicks() { return skippedTicks; };
+        
+        // ticks run, overruns and wake latency percentiles since the last report
+        void printReport();
+    private:
+        const char *name;
+        int64_t intervalNsecs;
+        TickCatchUp catchUp;
+        
+        int64_t nextTickNsecs;
+        int64_t tickNumber;
+        
+        int overruns;
+        int skippedTicks;
+        
+        int reportTicks;
+        int reportOverruns;
+        int64_t reportMaxLatencyNsecs;
+        int latencyHistogram[LATENCY_HISTOGRAM_BUCKETS];
+};
+
+#endif /* defined(__hifi__TickScheduler__) */
@@ -11,6 +11,7 @@
 #include <cstdio>
 #include <errno.h>
 #include <string.h>
+#include <algorithm>
 
 #ifdef _WIN32
 #include "Syssocket.h"
@@ -18,6 +19,7 @@
 #include <sys/socket.h>
 #include <arpa/inet.h>
 #include <ifaddrs.h>
+#include <unistd.h>
 #endif
 
 sockaddr_in destSockaddr, senderAddress;
@@ -42,6 +44,16 @@ bool socketMatch(sockaddr *first, sockaddr *second) {
     }
 }
 
+uint64_t socketHashKey(sockaddr *socket) {
+    // packs the family, IPv4 address and port into a single key
+    // so two sockets that pass socketMatch always produce the same key
+    sockaddr_in *socketIn = (sockaddr_in *) socket;
+    
+    return ((uint64_t) socketIn->sin_family << 48)
+        | ((uint64_t) socketIn->sin_addr.s_addr << 16)
+        | socketIn->sin_port;
+}
+
 int packSocket(unsigned char *packStore, in_addr_t inAddress, in_port_t networkOrderPort) {
     packStore[0] = inAddress >> 24;
     packStore[1] = inAddress >> 16;
@@ -87,7 +99,7 @@ int getLocalAddress() {
     return localAddress;
 }
 
-UDPSocket::UDPSocket(int listeningPort) {
+UDPSocket::UDPSocket(int listeningPort, bool reusePort) {
     // create the socket
     handle = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
     
@@ -98,6 +110,14 @@ UDPSocket::UDPSocket(int listeningPort) {
     
     destSockaddr.sin_family = AF_INET;
     
+#ifdef SO_REUSEPORT
+    if (reusePort) {
+        // lets several sockets bind the same port, the kernel spreads senders across them by address
+        int reuse = 1;
+        setsockopt(handle, SOL_SOCKET, SO_REUSEPORT, (char *)&reuse, sizeof(reuse));
+    }
+#endif
+    
     // bind the socket to the passed listeningPort
     sockaddr_in bind_address;
     bind_address.sin_family = AF_INET;
@@ -126,6 +146,20 @@ UDPSocket::~UDPSocket() {
 #endif
 }
 
+int UDPSocket::getHandle() {
+    return handle;
+}
+
+void UDPSocket::setBlocking(bool blocking) {
+#ifdef _WIN32
+    u_long mode = blocking ? 0 : 1;
+    ioctlsocket(handle, FIONBIO, &mode);
+#else
+    int flags = fcntl(handle, F_GETFL, 0);
+    fcntl(handle, F_SETFL, blocking ? (flags & ~O_NONBLOCK) : (flags | O_NONBLOCK));
+#endif
+}
+
 //  Receive data on this socket with retrieving address of sender
 bool UDPSocket::receive(void *receivedData, ssize_t *receivedBytes) {
     
@@ -164,3 +198,113 @@ int UDPSocket::send(char * destAddress, int destPort, const void *data, size_t b
     
     return send((sockaddr *)&destSockaddr, data, byteLength);
 }
+
+//  Receive up to maxDatagrams in one go, waits (up to the socket timeout) only for the first
+//  and returns the number of datagrams that were filled in
+int UDPSocket::receiveBatch(UDPDatagram *datagrams, int maxDatagrams) {
+#ifdef __linux__
+    mmsghdr messages[MAX_BATCH_DATAGRAMS];
+    iovec vectors[MAX_BATCH_DATAGRAMS];
+    
+    if (maxDatagrams > MAX_BATCH_DATAGRAMS) {
+        maxDatagrams = MAX_BATCH_DATAGRAMS;
+    }
+    
+    memset(messages, 0, sizeof(mmsghdr) * maxDatagrams);
+    
+    for (int i = 0; i < maxDatagrams; i++) {
+        vectors[i].iov_base = datagrams[i].data;
+        vectors[i].iov_len = MAX_BUFFER_LENGTH_BYTES;
+        
+        messages[i].msg_hdr.msg_name = &datagrams[i].address;
+        messages[i].msg_hdr.msg_namelen = sizeof(sockaddr_in);
+        messages[i].msg_hdr.msg_iov = &vectors[i];
+        messages[i].msg_hdr.msg_iovlen = 1;
+    }
+    
+    int numReceived = recvmmsg(handle, messages, maxDatagrams, MSG_WAITFORONE, NULL);
+    
+    if (numReceived < 0) {
+        return 0;
+    }
+    
+    for (int i = 0; i < numReceived; i++) {
+        datagrams[i].byteLength = messages[i].msg_len;
+    }
+    
+    return numReceived;
+#else
+    int numReceived = 0;
+    
+    while (numReceived < maxDatagrams) {
+        socklen_t addressSize = sizeof(sockaddr_in);
+        
+        // only the first read is allowed to block
+        ssize_t receivedBytes = recvfrom(handle, (char *) datagrams[numReceived].data, MAX_BUFFER_LENGTH_BYTES,
+                                         numReceived == 0 ? 0 : MSG_DONTWAIT,
+                                         (sockaddr *) &datagrams[numReceived].address, &addressSize);
+        
+        if (receivedBytes <= 0) {
+            break;
+        }
+        
+        datagrams[numReceived++].byteLength = receivedBytes;
+    }
+    
+    return numReceived;
+#endif
+}
+
+//  Send numDatagrams to their addresses, returns the number that went out
+int UDPSocket::sendBatch(UDPDatagram *datagrams, int numDatagrams) {
+    int numSent = 0;
+    
+#ifdef __linux__
+    mmsghdr messages[MAX_BATCH_DATAGRAMS];
+    iovec vectors[MAX_BATCH_DATAGRAMS];
+    
+    int nextDatagram = 0;
+    
+    while (nextDatagram < numDatagrams) {
+        int numInCall = std::min(numDatagrams - nextDatagram, MAX_BATCH_DATAGRAMS);
+        
+        memset(messages, 0, sizeof(mmsghdr) * numInCall);
+        
+        for (int i = 0; i < numInCall; i++) {
+            UDPDatagram *datagram = &datagrams[nextDatagram + i];
+            
+            vectors[i].iov_base = datagram->data;
+            vectors[i].iov_len = datagram->byteLength;
+            
+            messages[i].msg_hdr.msg_name = &datagram->address;
+            messages[i].msg_hdr.msg_namelen = sizeof(sockaddr_in);
+            messages[i].msg_hdr.msg_iov = &vectors[i];
+            messages[i].msg_hdr.msg_iovlen = 1;
+        }
+        
+        int sentInCall = sendmmsg(handle, messages, numInCall, 0);
+        
+        if (sentInCall < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            
+            // the first datagram of this call failed, skip it so it doesn't stall the rest
+            printf("Failed to send packet: %s\n", strerror(errno));
+            nextDatagram++;
+            continue;
+        }
+        
+        nextDatagram += sentInCall;
+        numSent += sentInCall;
+    }
+#else
+    for (int i = 0; i < numDatagrams; i++) {
+        if (send((sockaddr *) &datagrams[i].address, datagrams[i].data, datagrams[i].byteLength) > 0) {
+            numSent++;
+        }
+    }
+#endif
+    
+    return numSent;
+}
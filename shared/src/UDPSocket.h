@@ -10,6 +10,7 @@
 #define __interface__UDPSocket__
 
 #include <iostream>
+#include <stdint.h>
 
 #ifdef _WIN32
 #include "Syssocket.h"
@@ -19,20 +20,33 @@
 #endif
 
 #define MAX_BUFFER_LENGTH_BYTES 1500
+#define MAX_BATCH_DATAGRAMS 64
+
+// one datagram for the batched calls, address is the sender on receive and the destination on send
+struct UDPDatagram {
+    sockaddr_in address;
+    ssize_t byteLength;
+    unsigned char data[MAX_BUFFER_LENGTH_BYTES];
+};
 
 class UDPSocket {    
     public:
-        UDPSocket(int listening_port);
+        UDPSocket(int listening_port, bool reusePort = false);
         ~UDPSocket();
         int send(sockaddr *destAddress, const void *data, size_t byteLength);
         int send(char *destAddress, int destPort, const void *data, size_t byteLength);
         bool receive(void *receivedData, ssize_t *receivedBytes);
         bool receive(sockaddr *recvAddress, void *receivedData, ssize_t *receivedBytes);
+        int receiveBatch(UDPDatagram *datagrams, int maxDatagrams);
+        int sendBatch(UDPDatagram *datagrams, int numDatagrams);
+        int getHandle();
+        void setBlocking(bool blocking);
     private:
         int handle;
 };
 
 bool socketMatch(sockaddr *first, sockaddr *second);
+uint64_t socketHashKey(sockaddr *socket);
 int packSocket(unsigned char *packStore, in_addr_t inAddress, in_port_t networkOrderPort);
 int packSocket(unsigned char *packStore, sockaddr *socketToPack);
 int unpackSocket(unsigned char *packedData, sockaddr *unpackDestSocket);
@@ -0,0 +1,70 @@
+//
+//  ViewFrustum.cpp
+//  hifi
+//
+//  Copyright (c) 2013 High Fidelity, Inc. All rights reserved.
+//
+
+#include <string.h>
+#include <math.h>
+#include "ViewFrustum.h"
+
+const float RADIANS_PER_DEGREE = M_PI / 180.0f;
+
+ViewFrustum::ViewFrustum(const float *newPosition, float yaw, float pitch, float fieldOfViewDegrees, float aspectRatio) {
+    memcpy(position, newPosition, sizeof(position));
+    
+    // the interface turns the camera by 180 less the yaw it sends, and the tree is walked with the rendered space negated
+    float sinYaw = sinf(yaw * RADIANS_PER_DEGREE);
+    float cosYaw = cosf(yaw * RADIANS_PER_DEGREE);
+    float sinPitch = sinf(pitch * RADIANS_PER_DEGREE);
+    float cosPitch = cosf(pitch * RADIANS_PER_DEGREE);
+    
+    float direction[3] = { -sinYaw * cosPitch, sinPitch, -cosYaw * cosPitch };
+    
+    // the sides are symmetric, so which way right and up point doesn't matter
+    float right[3] = { cosYaw, 0, -sinYaw };
+    float up[3] = { direction[1] * right[2] - direction[2] * right[1],
+                    direction[2] * right[0] - direction[0] * right[2],
+                    direction[0] * right[1] - direction[1] * right[0] };
+    
+    float halfHeight = fieldOfViewDegrees * 0.5f * RADIANS_PER_DEGREE;
+    float halfWidth = atanf(tanf(halfHeight) * aspectRatio);
+    
+    for (int i = 0; i < 3; i++) {
+        planeNormals[0][i] = direction[i] * sinf(halfWidth) + right[i] * cosf(halfWidth);
+        planeNormals[1][i] = direction[i] * sinf(halfWidth) - right[i] * cosf(halfWidth);
+        planeNormals[2][i] = direction[i] * sinf(halfHeight) + up[i] * cosf(halfHeight);
+        planeNormals[3][i] = direction[i] * sinf(halfHeight) - up[i] * cosf(halfHeight);
+    }
+}
+
+ViewLocation ViewFrustum::cubeLocation(const float *lowestCorner, float size) const {
+    ViewLocation location = VIEW_INSIDE;
+    
+    for (int p = 0; p < 4; p++) {
+        const float *normal = planeNormals[p];
+        
+        // how far inside this side the corners furthest in and furthest out are
+        float mostInside = 0;
+        float leastInside = 0;
+        
+        for (int i = 0; i < 3; i++) {
+            float low = (lowestCorner[i] - position[i]) * normal[i];
+            float high = (lowestCorner[i] + size - position[i]) * normal[i];
+            
+            mostInside += fmaxf(low, high);
+            leastInside += fminf(low, high);
+        }
+        
+        if (mostInside < 0) {
+            return VIEW_OUTSIDE;
+        }
+        
+        if (leastInside < 0) {
+            location = VIEW_INTERSECTS;
+        }
+    }
+    
+    return location;
+}
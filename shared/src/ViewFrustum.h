@@ -0,0 +1,42 @@
+//
+//  ViewFrustum.h
+//  hifi
+//
+//  Copyright (c) 2013 High Fidelity, Inc. All rights reserved.
+//
+
+#ifndef __hifi__ViewFrustum__
+#define __hifi__ViewFrustum__
+
+#include <iostream>
+
+// the view the interface renders with, 45 degrees up and down on a 4:3 window
+const float DEFAULT_FIELD_OF_VIEW_DEGREES = 45.0f;
+const float DEFAULT_ASPECT_RATIO = 4.0f / 3.0f;
+
+enum ViewLocation {
+    VIEW_OUTSIDE,
+    VIEW_INTERSECTS,
+    VIEW_INSIDE
+};
+
+// the four sides of what an agent can see, from where it is and where it's looking
+// position and boxes are in the space the voxel server walks the tree in, the rendered space negated,
+// and yaw and pitch are in degrees the way AvatarState carries them
+class ViewFrustum {
+    public:
+        ViewFrustum(const float *position, float yaw, float pitch,
+                    float fieldOfViewDegrees = DEFAULT_FIELD_OF_VIEW_DEGREES,
+                    float aspectRatio = DEFAULT_ASPECT_RATIO);
+        
+        // where the cube with this lowest corner and size is, against the frustum
+        // a cube near an edge can come back VIEW_INTERSECTS without reaching inside, never the other way
+        ViewLocation cubeLocation(const float *lowestCorner, float size) const;
+    private:
+        float position[3];
+        
+        // inward normals of the sides, all through position
+        float planeNormals[4][3];
+};
+
+#endif /* defined(__hifi__ViewFrustum__) */
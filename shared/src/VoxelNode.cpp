@@ -13,6 +13,7 @@
 
 VoxelNode::VoxelNode() {
     octalCode = NULL;
+    version = 0;
     
     // default pointers to child nodes to NULL
     for (int i = 0; i < 8; i++) {
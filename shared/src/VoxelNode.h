@@ -24,6 +24,9 @@ public:
     unsigned char *octalCode;
     unsigned char color[4];
     VoxelNode *children[8];
+    
+    // the tree's version when this node or anything under it last changed
+    unsigned long version;
 };
 
 #endif /* defined(__hifi__VoxelNode__) */
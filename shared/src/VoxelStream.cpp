@@ -0,0 +1,133 @@
+//
+//  VoxelStream.cpp
+//  hifi
+//
+//  Copyright (c) 2013 High Fidelity, Inc. All rights reserved.
+//
+
+#include <string.h>
+#include <algorithm>
+#include "VoxelStream.h"
+
+VoxelStreamSender::VoxelStreamSender(int newMaxBytesPerSecond, int newMinBytesPerSecond) {
+    nextSequence = 0;
+    
+    maxBytesPerSecond = newMaxBytesPerSecond;
+    minBytesPerSecond = std::min(newMinBytesPerSecond, newMaxBytesPerSecond);
+    bytesPerSecond = maxBytesPerSecond;
+    lossPermille = 0;
+    
+    receivedSequence = -1;
+    lostPackets = 0;
+    receiptPackets = 0;
+    
+    hasRateReceipt = false;
+    rateReceiptSequence = 0;
+    rateReceiptPackets = 0;
+}
+
+int VoxelStreamSender::encodeHeader(unsigned char *packet) {
+    packet[0] = VOXEL_PACKET_HEADER;
+    memcpy(packet + 1, &nextSequence, sizeof(nextSequence));
+    nextSequence++;
+    
+    return VOXEL_PACKET_HEADER_BYTES;
+}
+
+void VoxelStreamSender::receiveReceipt(const unsigned char *packet, int size) {
+    if (size < VOXEL_RECEIPT_PACKET_BYTES || packet[0] != VOXEL_RECEIPT_PACKET_HEADER) {
+        return;
+    }
+    
+    uint16_t latestSequence, packetsReceived;
+    memcpy(&latestSequence, packet + 1, sizeof(latestSequence));
+    memcpy(&packetsReceived, packet + 1 + sizeof(latestSequence), sizeof(packetsReceived));
+    
+    // sequences start at 0, so before the first receipt it's as if one had covered the sequence before that
+    uint16_t lastReceivedSequence = receivedSequence;
+    int packetsSent = (int16_t) (latestSequence - lastReceivedSequence);
+    int packetsArrived = (uint16_t) (packetsReceived - receiptPackets);
+    
+    if (packetsSent <= 0) {
+        // an old receipt, the newer one already counted what it says
+        return;
+    }
+    
+    lostPackets += std::max(0, packetsSent - packetsArrived);
+    receivedSequence = latestSequence;
+    receiptPackets = packetsReceived;
+    
+    if (hasRateReceipt) {
+        packetsSent = (int16_t) (latestSequence - rateReceiptSequence);
+        packetsArrived = (uint16_t) (packetsReceived - rateReceiptPackets);
+        
+        if (packetsSent < VOXEL_MIN_PACKETS_FOR_LOSS) {
+            // too soon after the last to say much, wait for the next one
+            return;
+        }
+        
+        float loss = 1.0f - std::min(packetsArrived, packetsSent) / (float) packetsSent;
+        lossPermille = loss * 1000;
+        
+        if (loss > VOXEL_LOSS_THRESHOLD) {
+            bytesPerSecond = std::max(minBytesPerSecond, (int) (bytesPerSecond * VOXEL_RATE_DECREASE));
+        } else {
+            bytesPerSecond = std::min(maxBytesPerSecond, bytesPerSecond + maxBytesPerSecond / VOXEL_RATE_INCREASE_STEPS);
+        }
+    }
+    
+    hasRateReceipt = true;
+    rateReceiptSequence = latestSequence;
+    rateReceiptPackets = packetsReceived;
+}
+
+VoxelStreamReceiver::VoxelStreamReceiver() {
+    latestSequence = -1;
+    packetsReceived = 0;
+    
+    reportedPackets = 0;
+    lastReceiptUsecs = 0;
+}
+
+int VoxelStreamReceiver::packetReceived(const unsigned char *packet, int size) {
+    if (size < VOXEL_PACKET_HEADER_BYTES || packet[0] != VOXEL_PACKET_HEADER) {
+        return 0;
+    }
+    
+    uint16_t sequence;
+    memcpy(&sequence, packet + 1, sizeof(sequence));
+    
+    // a late packet still counts as received, it just doesn't move the newest sequence back
+    int latest = latestSequence;
+    
+    if (latest < 0 || (int16_t) (sequence - latest) > 0) {
+        latestSequence = sequence;
+    }
+    
+    packetsReceived++;
+    
+    return VOXEL_PACKET_HEADER_BYTES;
+}
+
+int VoxelStreamReceiver::encodeReceipt(unsigned char *packet, int64_t nowUsecs) {
+    int received = packetsReceived;
+    int latest = latestSequence;
+    
+    if (latest < 0 || received == reportedPackets
+        || (received - reportedPackets < VOXEL_RECEIPT_PACKETS
+            && nowUsecs - lastReceiptUsecs < VOXEL_RECEIPT_INTERVAL_USECS)) {
+        return 0;
+    }
+    
+    uint16_t latestSequence16 = latest;
+    uint16_t received16 = received;
+    
+    packet[0] = VOXEL_RECEIPT_PACKET_HEADER;
+    memcpy(packet + 1, &latestSequence16, sizeof(latestSequence16));
+    memcpy(packet + 1 + sizeof(latestSequence16), &received16, sizeof(received16));
+    
+    reportedPackets = received;
+    lastReceiptUsecs = nowUsecs;
+    
+    return VOXEL_RECEIPT_PACKET_BYTES;
+}
@@ -0,0 +1,99 @@
+//
+//  VoxelStream.h
+//  hifi
+//
+//  Copyright (c) 2013 High Fidelity, Inc. All rights reserved.
+//
+
+#ifndef __hifi__VoxelStream__
+#define __hifi__VoxelStream__
+
+#include <iostream>
+#include <atomic>
+#include <stdint.h>
+
+// a voxel packet is the header, its sequence and then one or more subtrees,
+// each its root's octal code followed by the node data VoxelTree reads
+const char VOXEL_PACKET_HEADER = 'V';
+const int VOXEL_PACKET_HEADER_BYTES = 1 + sizeof(uint16_t);
+
+// the receiver reports the newest sequence it has and how many packets it has had, both wrapping
+const char VOXEL_RECEIPT_PACKET_HEADER = 'v';
+const int VOXEL_RECEIPT_PACKET_BYTES = 1 + 2 * sizeof(uint16_t);
+
+// receipts go out after this many packets, or sooner if packets have arrived and this long has gone by
+const int VOXEL_RECEIPT_PACKETS = 16;
+const int VOXEL_RECEIPT_INTERVAL_USECS = 250 * 1000;
+
+// a receipt covering fewer packets than this says too little about the link to act on
+const int VOXEL_MIN_PACKETS_FOR_LOSS = 8;
+
+// more loss than this and the sender's rate drops by the decrease,
+// otherwise each receipt adds back a step of its budget until it's all there
+const float VOXEL_LOSS_THRESHOLD = 0.05f;
+const float VOXEL_RATE_DECREASE = 0.75f;
+const int VOXEL_RATE_INCREASE_STEPS = 16;
+
+// the sending side of one voxel stream, headers are written from the sending thread
+// and receipts taken on the receiving one
+class VoxelStreamSender {
+    public:
+        VoxelStreamSender(int maxBytesPerSecond, int minBytesPerSecond);
+        
+        // writes the header for the next packet and returns its bytes
+        int encodeHeader(unsigned char *packet);
+        
+        // takes a receipt from the receiver and moves the rate by the loss since the last one
+        void receiveReceipt(const unsigned char *packet, int size);
+        
+        int getBytesPerSecond() { return bytesPerSecond; };
+        int getMaxBytesPerSecond() const { return maxBytesPerSecond; };
+        
+        // the loss the last receipt measured, as a fraction
+        float getLoss() { return lossPermille / 1000.0f; };
+        
+        // the sequence of the last packet written, for telling when a receipt covers it
+        uint16_t getLastSequence() { return nextSequence - 1; };
+        
+        // the newest sequence a receipt has covered, -1 before the first,
+        // and how many packets up to it never arrived, read it first and the count is at least as new
+        int getReceivedSequence() { return receivedSequence; };
+        int getLostPackets() { return lostPackets; };
+    private:
+        uint16_t nextSequence;
+        
+        int maxBytesPerSecond;
+        int minBytesPerSecond;
+        std::atomic<int> bytesPerSecond;
+        std::atomic<int> lossPermille;
+        
+        std::atomic<int> receivedSequence;
+        std::atomic<int> lostPackets;
+        uint16_t receiptPackets;
+        
+        // where the loss the rate moves by is measured from, it waits for enough packets to say something
+        bool hasRateReceipt;
+        uint16_t rateReceiptSequence;
+        uint16_t rateReceiptPackets;
+};
+
+// the receiving side of one voxel stream
+// packets are noted from the network thread and receipts written from whichever sends to the voxel server
+class VoxelStreamReceiver {
+    public:
+        VoxelStreamReceiver();
+        
+        // notes the packet's sequence and returns the bytes of header before its voxel data, 0 if it isn't one
+        int packetReceived(const unsigned char *packet, int size);
+        
+        // writes a receipt if one is due by nowUsecs and returns its bytes, 0 otherwise
+        int encodeReceipt(unsigned char *packet, int64_t nowUsecs);
+    private:
+        std::atomic<int> latestSequence;
+        std::atomic<int> packetsReceived;
+        
+        int reportedPackets;
+        int64_t lastReceiptUsecs;
+};
+
+#endif /* defined(__hifi__VoxelStream__) */
@@ -42,6 +42,8 @@ VoxelTree::VoxelTree() {
     rootNode = new VoxelNode();
     rootNode->octalCode = new unsigned char[1];
     *rootNode->octalCode = 0;
+    
+    version = 0;
 }
 
 VoxelTree::~VoxelTree() {
@@ -87,6 +89,17 @@ VoxelNode * VoxelTree::createMissingNode(VoxelNode *lastParentNode, unsigned cha
     }
 }
 
+void VoxelTree::stampPathToNode(VoxelNode *node) {
+    VoxelNode *pathNode = rootNode;
+    
+    while (pathNode != node) {
+        pathNode->version = version;
+        pathNode = pathNode->children[branchIndexWithDescendant(pathNode->octalCode, node->octalCode)];
+    }
+    
+    node->version = version;
+}
+
 int VoxelTree::readNodeData(VoxelNode *destinationNode,
                             unsigned char * nodeData,
                             int bytesLeftToRead) {
@@ -148,16 +161,29 @@ int VoxelTree::readNodeData(VoxelNode *destinationNode,
 }
 
 void VoxelTree::readBitstreamToTree(unsigned char * bitstream, int bufferSizeBytes) {
-    VoxelNode *bitstreamRootNode = nodeForOctalCode(rootNode, (unsigned char *)bitstream);
+    unsigned char *bitstreamAt = bitstream;
     
-    if (*bitstream != *bitstreamRootNode->octalCode) {
-        // if the octal code returned is not on the same level as
-        // the code being searched for, we have VoxelNodes to create
-        bitstreamRootNode = createMissingNode(bitstreamRootNode, (unsigned char *)bitstream);
+    // one subtree after another, each read exactly as far as its masks say
+    while (bitstreamAt - bitstream < bufferSizeBytes) {
+        VoxelNode *bitstreamRootNode = nodeForOctalCode(rootNode, bitstreamAt);
+        
+        if (*bitstreamAt != *bitstreamRootNode->octalCode) {
+            // if the octal code returned is not on the same level as
+            // the code being searched for, we have VoxelNodes to create
+            // createMissingNode hands back the parent of the node it made, the packet is for the node itself
+            VoxelNode *parentNode = createMissingNode(bitstreamRootNode, bitstreamAt);
+            bitstreamRootNode = parentNode->children[branchIndexWithDescendant(parentNode->octalCode, bitstreamAt)];
+        }
+        
+        int octalCodeBytes = bytesRequiredForCodeLength(*bitstreamAt);
+        int bytesLeft = bufferSizeBytes - (bitstreamAt - bitstream) - octalCodeBytes;
+        
+        if (bytesLeft <= 0) {
+            break;
+        }
+        
+        bitstreamAt += octalCodeBytes + readNodeData(bitstreamRootNode, bitstreamAt + octalCodeBytes, bytesLeft);
     }
-    
-    int octalCodeBytes = bytesRequiredForCodeLength(*bitstream);
-    readNodeData(bitstreamRootNode, bitstream + octalCodeBytes, bufferSizeBytes - octalCodeBytes);
 }
 
 void VoxelTree::readCodeColorBufferToTree(unsigned char *codeColorBuffer) {
@@ -173,25 +199,45 @@ void VoxelTree::readCodeColorBufferToTree(unsigned char *codeColorBuffer) {
     int octalCodeBytes = bytesRequiredForCodeLength(*codeColorBuffer);
     memcpy(lastCreatedNode->color, codeColorBuffer + octalCodeBytes, 3);
     lastCreatedNode->color[3] = 1;
+    
+    version++;
+    stampPathToNode(lastCreatedNode);
 }
 
 unsigned char * VoxelTree::loadBitstreamBuffer(unsigned char *& bitstreamBuffer,
+                                               unsigned char *bitstreamEnd,
                                                VoxelNode *currentVoxelNode,
                                                MarkerNode *currentMarkerNode,
                                                float * agentPosition,
                                                float thisNodePosition[3],
                                                unsigned char * stopOctalCode)
 {
-    static unsigned char *initialBitstreamPos = bitstreamBuffer;
-    
-    unsigned char * childStopOctalCode = NULL;
-    
     if (stopOctalCode == NULL) {
         stopOctalCode = rootNode->octalCode;
     }
     
+    // the recursion needs where the buffer ends to know when it's full
+    return encodeTreeBitstream(bitstreamEnd,
+                               bitstreamBuffer,
+                               currentVoxelNode,
+                               currentMarkerNode,
+                               agentPosition,
+                               thisNodePosition,
+                               stopOctalCode);
+}
+
+unsigned char * VoxelTree::encodeTreeBitstream(unsigned char *bitstreamEnd,
+                                               unsigned char *& bitstreamBuffer,
+                                               VoxelNode *currentVoxelNode,
+                                               MarkerNode *currentMarkerNode,
+                                               float * agentPosition,
+                                               float thisNodePosition[3],
+                                               unsigned char * stopOctalCode)
+{
+    unsigned char * childStopOctalCode = NULL;
+    
     // check if we have any children
-    bool hasAtLeastOneChild;
+    bool hasAtLeastOneChild = false;
     
     for (int i = 0; i < 8; i++) {
         if (currentVoxelNode->children[i] != NULL) {
@@ -219,20 +265,17 @@ unsigned char * VoxelTree::loadBitstreamBuffer(unsigned char *& bitstreamBuffer,
             // or at the same level as the stopOctalCode
             
             if (*currentVoxelNode->octalCode >= *stopOctalCode) {
-                if ((bitstreamBuffer - initialBitstreamPos) + MAX_TREE_SLICE_BYTES > MAX_VOXEL_PACKET_SIZE) {
+                bool isBitstreamRoot = strcmp((char *)stopOctalCode, (char *)currentVoxelNode->octalCode) == 0;
+                int octalCodeBytes = isBitstreamRoot ? bytesRequiredForCodeLength(*currentVoxelNode->octalCode) : 0;
+                
+                if (bitstreamBuffer + octalCodeBytes + MAX_TREE_SLICE_BYTES > bitstreamEnd) {
                     // we can't send this packet, not enough room
                     // return our octal code as the stop
                     return currentVoxelNode->octalCode;
                 }
                 
-                if (strcmp((char *)stopOctalCode, (char *)currentVoxelNode->octalCode) == 0) {
-                    // this is is the root node for this packet
-                    // add the leading V
-                    *(bitstreamBuffer++) = 'V';
-                    
-                    // add its octal code to the packet
-                    int octalCodeBytes = bytesRequiredForCodeLength(*currentVoxelNode->octalCode);
-                    
+                if (isBitstreamRoot) {
+                    // this is is the root node for this packet, add its octal code
                     memcpy(bitstreamBuffer, currentVoxelNode->octalCode, octalCodeBytes);
                     bitstreamBuffer += octalCodeBytes;
                 }
@@ -302,7 +345,8 @@ unsigned char * VoxelTree::loadBitstreamBuffer(unsigned char *& bitstreamBuffer,
                         }
                         
                         // ask the child to load the bitstream buffer with their data
-                        childStopOctalCode = loadBitstreamBuffer(bitstreamBuffer,
+                        childStopOctalCode = encodeTreeBitstream(bitstreamEnd,
+                                                                 bitstreamBuffer,
                                                                  currentVoxelNode->children[i],
                                                                  currentMarkerNode->children[i],
                                                                  agentPosition,
@@ -325,12 +369,20 @@ unsigned char * VoxelTree::loadBitstreamBuffer(unsigned char *& bitstreamBuffer,
                 } else {
                     // this child node has been covered
                     // add the appropriate bit to the childrenVisitedMask for the current marker node
-                    currentMarkerNode->childrenVisitedMask += 1 << (7 - i);
+                    currentMarkerNode->childrenVisitedMask |= 1 << (7 - i);
                     
                     // if we are above the stopOctal and we got a NULL code
-                    // we cannot go to the next child
-                    // so break and return the NULL stop code
+                    // we cannot go to the next child, the packet is rooted below us
+                    // so if we have children left the next packet starts here, otherwise we're covered too
                     if (*currentVoxelNode->octalCode < *stopOctalCode) {
+                        for (int j = i + 1; j < 8; j++) {
+                            if (currentVoxelNode->children[j] != NULL
+                                && !oneAtBit(currentMarkerNode->childrenVisitedMask, j)) {
+                                childStopOctalCode = currentVoxelNode->octalCode;
+                                break;
+                            }
+                        }
+                        
                         break;
                     }
                 }
@@ -385,20 +437,34 @@ void VoxelTree::printTreeForDebugging(VoxelNode *startNode) {
 
 void VoxelTree::reaverageVoxelColors(VoxelNode *startNode) {
     bool hasChildren = false;
+    bool childChanged = false;
+    
+    if (startNode == rootNode) {
+        version++;
+    }
     
     for (int i = 0; i < 8; i++) {
         if (startNode->children[i] != NULL) {
             reaverageVoxelColors(startNode->children[i]);
             hasChildren = true;
+            childChanged = childChanged || startNode->children[i]->version == version;
         }
     }
     
     if (hasChildren) {
+        unsigned char oldColor[4];
+        memcpy(oldColor, startNode->color, sizeof(oldColor));
+        
     	bool childrenCollapsed = startNode->collapseIdenticalLeaves();
         
     	if (!childrenCollapsed) {
 	        startNode->setColorFromAverageOfChildren();
 	    }
+        
+        // anything that moved gets this pass's version, which its ancestors pick up on the way back out
+        if (childChanged || childrenCollapsed || memcmp(oldColor, startNode->color, sizeof(oldColor)) != 0) {
+            startNode->version = version;
+        }
     }
     
 }
@@ -466,7 +532,8 @@ void VoxelTree::loadVoxelsFile(const char* fileName, bool wantColorRandomizer) {
 // Description: Creates a sphere of voxels in the local system at a given location/radius
 // To Do:       Move this function someplace better?
 // Complaints:  Brad :)
-void VoxelTree::createSphere(float r,float xc, float yc, float zc, float s, bool solid, bool wantColorRandomizer) {
+void VoxelTree::createSphere(float r,float xc, float yc, float zc, float s, bool solid, bool wantColorRandomizer,
+                             std::vector<unsigned char> *insertData) {
     // About the color of the sphere... we're going to make this sphere be a gradient
     // between two RGB colors. We will do the gradient along the phi spectrum
     unsigned char dominantColor1 = randIntInRange(1,3); //1=r, 2=g, 3=b dominant
@@ -537,6 +604,10 @@ void VoxelTree::createSphere(float r,float xc, float yc, float zc, float s, bool
 				
 				unsigned char* voxelData = pointToVoxel(x,y,z,s,red,green,blue);
                 this->readCodeColorBufferToTree(voxelData);
+                
+                if (insertData != NULL) {
+                    insertData->insert(insertData->end(), voxelData, voxelData + bytesRequiredForCodeLength(*voxelData) + 3);
+                }
 				//printf("voxel data for x:%f y:%f z:%f s:%f\n",x,y,z,s);
                 //printVoxelCode(voxelData);
                 delete voxelData;
@@ -10,6 +10,7 @@
 #define __hifi__VoxelTree__
 
 #include <iostream>
+#include <vector>
 #include "VoxelNode.h"
 #include "MarkerNode.h"
 
@@ -20,19 +21,35 @@ const int TREE_SCALE = 10;
 class VoxelTree {
     VoxelNode * nodeForOctalCode(VoxelNode *ancestorNode, unsigned char * needleCode);
     VoxelNode * createMissingNode(VoxelNode *lastParentNode, unsigned char *deepestCodeToCreate);
+    void stampPathToNode(VoxelNode *node);
     int readNodeData(VoxelNode *destinationNode, unsigned char * nodeData, int bufferSizeBytes);
+    unsigned char * encodeTreeBitstream(unsigned char *bitstreamEnd,
+                                        unsigned char *& bitstreamBuffer,
+                                        VoxelNode *currentVoxelNode,
+                                        MarkerNode *currentMarkerNode,
+                                        float * agentPosition,
+                                        float thisNodePosition[3],
+                                        unsigned char * stopOctalCode);
 public:
     VoxelTree();
     ~VoxelTree();
     
     VoxelNode *rootNode;
-    int leavesWrittenToBitstream;
+    
+    // goes up by one with every edit, which stamps the nodes it touched and all their ancestors
+    // so a sender can tell which subtrees changed after any version it has sent
+    unsigned long version;
     
     void readBitstreamToTree(unsigned char * bitstream, int bufferSizeBytes);
     void readCodeColorBufferToTree(unsigned char *codeColorBuffer);
     void printTreeForDebugging(VoxelNode *startNode);
     void reaverageVoxelColors(VoxelNode *startNode);
+    
+    // writes a subtree from bitstreamBuffer up to bitstreamEnd, only reads the tree so several threads can encode at once
+    // as long as each passes its own buffer and marker nodes, returns the octal code to start the next packet at
+    // the packet header is the caller's, a packet can hold more than one subtree
     unsigned char * loadBitstreamBuffer(unsigned char *& bitstreamBuffer,
+                                        unsigned char *bitstreamEnd,
                                         VoxelNode *currentVoxelNode,
                                         MarkerNode *currentMarkerNode,
                                         float * agentPosition,
@@ -40,7 +57,9 @@ public:
                                         unsigned char * octalCode = NULL);
     
 	void loadVoxelsFile(const char* fileName, bool wantColorRandomizer);
-	void createSphere(float r,float xc, float yc, float zc, float s, bool solid, bool wantColorRandomizer);
+	// insertData, if given, has the code and color of each voxel added to it, ready to send on as an insert
+	void createSphere(float r,float xc, float yc, float zc, float s, bool solid, bool wantColorRandomizer,
+                      std::vector<unsigned char> *insertData = NULL);
 };
 
 int boundaryDistanceForRenderLevel(unsigned int renderLevel);
@@ -10,9 +10,11 @@
 #include <cstdio>
 #include <stdlib.h>
 #include <string.h>
+#include <signal.h>
 
 #include "TreeNode.h"
 #include "UDPSocket.h"
+#include "EventLoop.h"
 
 const char *CONFIG_FILE = "/Users/birarda/code/worklist/checkouts/hifi/space/example.data.txt";
 const unsigned short SPACE_LISTENING_PORT = 55551;
@@ -30,6 +32,7 @@ char *lastKnownHostname;
 
 TreeNode rootNode;
 UDPSocket spaceSocket(SPACE_LISTENING_PORT);
+EventLoop eventLoop;
 
 TreeNode *findOrCreateNode(int lengthInBits,
                            unsigned char *addressBytes,
@@ -121,13 +124,36 @@ bool loadSpaceData(void) {
     }
 }
 
+void answerSpaceLookup(void *args) {
+    unsigned char packetData[PACKET_LENGTH_BYTES];
+    ssize_t receivedBytes = 0;
+    
+    if (spaceSocket.receive((sockaddr *)&destAddress, &packetData, &receivedBytes)) {
+        unsigned long lengthInBits;
+        lengthInBits = packetData[0] * 3;
+        
+        unsigned char addressData[sizeof(packetData)-1];
+        for (int i = 0; i < sizeof(packetData)-1; ++i) {
+            addressData[i] = packetData[i+1];
+        }
+        
+        TreeNode *thisNode = findOrCreateNode(lengthInBits, addressData, NULL, NULL, 0);
+        char *hostnameToSend = (thisNode->hostname == NULL)
+            ? lastKnownHostname
+            : thisNode->hostname;
+        
+        spaceSocket.send((sockaddr *)&destAddress, &hostnameToSend, sizeof(hostnameToSend));
+    }
+}
+
+void stopSpaceServer(int signal) {
+    eventLoop.stop();
+}
+
 int main (int argc, const char *argv[]) {
     
     setvbuf(stdout, NULL, _IOLBF, 0);
     
-    unsigned char packetData[PACKET_LENGTH_BYTES];
-    ssize_t receivedBytes = 0;
-    
     rootNode.hostname = new char[MAX_NAME_LENGTH];
     rootNode.nickname = new char[MAX_NAME_LENGTH];
     
@@ -138,23 +164,12 @@ int main (int argc, const char *argv[]) {
     
     std::cout << "[DEBUG] Listening for Datagrams" << std::endl;
     
-    while (true) {
-        if (spaceSocket.receive((sockaddr *)&destAddress, &packetData, &receivedBytes)) {
-            unsigned long lengthInBits;
-            lengthInBits = packetData[0] * 3;
-            
-            unsigned char addressData[sizeof(packetData)-1];
-            for (int i = 0; i < sizeof(packetData)-1; ++i) {
-                addressData[i] = packetData[i+1];
-            }
-            
-            TreeNode *thisNode = findOrCreateNode(lengthInBits, addressData, NULL, NULL, 0);
-            char *hostnameToSend = (thisNode->hostname == NULL)
-                ? lastKnownHostname
-                : thisNode->hostname;
-            
-            spaceSocket.send((sockaddr *)&destAddress, &hostnameToSend, sizeof(hostnameToSend));
-        }
-    }
+    eventLoop.addSocket(spaceSocket, answerSpaceLookup, NULL);
+    
+    signal(SIGINT, stopSpaceServer);
+    signal(SIGTERM, stopSpaceServer);
+    
+    eventLoop.run();
+    
+    return 0;
 }
-
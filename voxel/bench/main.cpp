@@ -0,0 +1,824 @@
+//
+//  main.cpp
+//  voxel-bench
+//
+//  Copyright (c) 2013 High Fidelity, Inc. All rights reserved.
+//
+
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <cstdio>
+#include <vector>
+#include <unistd.h>
+#include <OctalCode.h>
+#include <AgentList.h>
+#include <VoxelTree.h>
+#include <SharedUtil.h>
+#include <ViewFrustum.h>
+#include <VoxelStream.h>
+#include "VoxelAgentData.h"
+#include "VoxelSendPool.h"
+#include "VoxelPacketScheduler.h"
+#include "VoxelScene.h"
+
+// the same options the voxel server sends with
+const char NO_VIEW_CULLING_OPTION[] = "--noViewCulling";
+const char VOXEL_BYTES_PER_SECOND_OPTION[] = "--voxelBytesPerSecond";
+
+// the scene the server starts with, which every benchmark sends
+VoxelTree randomTree;
+bool viewCulling = true;
+int voxelBytesPerSecond = VOXEL_DEFAULT_BYTES_PER_SECOND;
+
+const char BENCHMARK_VOXEL_SEND_OPTION[] = "--benchmarkVoxelSend";
+
+void benchmarkVoxelSend() {
+    // rounds of packets for agents scattered through the tree, encoded and dropped, at each pool size
+    const int BENCHMARK_VOXEL_AGENTS = 256;
+    const int BENCHMARK_VOXEL_ROUNDS = 50;
+    const int BENCHMARK_MAX_WORKERS = 8;
+    
+    sockaddr_in agentAddress = {};
+    std::vector<Agent *> agents;
+    
+    for (int i = 0; i < BENCHMARK_VOXEL_AGENTS; i++) {
+        agents.push_back(new Agent((sockaddr *) &agentAddress, (sockaddr *) &agentAddress, 'H', i));
+    }
+    
+    printf("Encoding %d rounds for %d agents on %ld cores.\n",
+           BENCHMARK_VOXEL_ROUNDS, BENCHMARK_VOXEL_AGENTS, sysconf(_SC_NPROCESSORS_ONLN));
+    
+    for (int numWorkers = 1; numWorkers <= BENCHMARK_MAX_WORKERS; numWorkers *= 2) {
+        // every pool size starts the agents at the same places with nothing sent
+        srand(BENCHMARK_VOXEL_AGENTS);
+        
+        for (int i = 0; i < BENCHMARK_VOXEL_AGENTS; i++) {
+            VoxelAgentData *agentData = new VoxelAgentData(voxelBytesPerSecond);
+            
+            for (int j = 0; j < 3; j++) {
+                agentData->position[j] = randFloatInRange(-TREE_SCALE, 0);
+            }
+            agentData->hasState = true;
+            
+            delete agents[i]->getLinkedData();
+            agents[i]->setLinkedData(agentData);
+        }
+        
+        VoxelSendPool sendPool(&randomTree, NULL, numWorkers, viewCulling);
+        double startUsecs = usecTimestampNow();
+        
+        // the rounds come as fast as they can be encoded, each agent's credit runs on the time they would have taken
+        for (int r = 1; r <= BENCHMARK_VOXEL_ROUNDS; r++) {
+            sendPool.runRound(&agents, r * VOXEL_SEND_INTERVAL_USECS);
+        }
+        
+        double elapsedUsecs = usecTimestampNow() - startUsecs;
+        
+        int packetsSent, bytesSent;
+        sendPool.takeSentCounts(&packetsSent, &bytesSent);
+        
+        printf("%2d workers %10.0f packets/s %8.1f MB/s, %d packets %d bytes\n",
+               numWorkers,
+               packetsSent / (elapsedUsecs / 1000000),
+               bytesSent / elapsedUsecs,
+               packetsSent,
+               bytesSent);
+    }
+    
+    for (int i = 0; i < BENCHMARK_VOXEL_AGENTS; i++) {
+        delete agents[i];
+    }
+}
+
+const char BENCHMARK_VOXEL_VIEW_OPTION[] = "--benchmarkVoxelView";
+
+int countNodesInView(VoxelNode *node, float nodePosition[3], const ViewFrustum &viewFrustum) {
+    float size = powf(0.5, *node->octalCode) * TREE_SCALE;
+    float lowestCorner[3] = { nodePosition[0] - size, nodePosition[1] - size, nodePosition[2] - size };
+    
+    if (viewFrustum.cubeLocation(lowestCorner, size) == VIEW_OUTSIDE) {
+        return 0;
+    }
+    
+    int nodesInView = 1;
+    
+    for (int i = 0; i < 8; i++) {
+        if (node->children[i] != NULL) {
+            float childNodePosition[3];
+            
+            for (int j = 0; j < 3; j++) {
+                childNodePosition[j] = nodePosition[j];
+                
+                if (oneAtBit(branchIndexWithDescendant(node->octalCode, node->children[i]->octalCode), (7 - j))) {
+                    childNodePosition[j] -= size / 2;
+                }
+            }
+            
+            nodesInView += countNodesInView(node->children[i], childNodePosition, viewFrustum);
+        }
+    }
+    
+    return nodesInView;
+}
+
+void randomBenchmarkViewpoint(float *position, float *yaw, float *pitch) {
+    // somewhere in the tree, which spans back from the origin, looking roughly at its middle where the scene is
+    float toMiddle[3];
+    
+    for (int j = 0; j < 3; j++) {
+        position[j] = randFloatInRange(-TREE_SCALE, 0);
+        toMiddle[j] = -TREE_SCALE / 2.0f - position[j];
+    }
+    
+    float distanceToMiddle = sqrtf(toMiddle[0] * toMiddle[0] + toMiddle[1] * toMiddle[1] + toMiddle[2] * toMiddle[2]);
+    *yaw = atan2f(-toMiddle[0], -toMiddle[2]) * 180 / M_PI + randFloatInRange(-30, 30);
+    *pitch = asinf(toMiddle[1] / distanceToMiddle) * 180 / M_PI + randFloatInRange(-15, 15);
+}
+
+void benchmarkVoxelView() {
+    // one agent at a time decoding what it's sent, counting the bytes until it has everything in view,
+    // with the tree sent in one pass in tree order and by the scheduler, which ranks what's in view first
+    const int BENCHMARK_VIEWPOINTS = 16;
+    const int MAX_BENCHMARK_PACKETS = 100000;
+    
+    float treeRoot[3] = {0, 0, 0};
+    unsigned char voxelPacket[MAX_VOXEL_PACKET_SIZE];
+    
+    double totalBytesUntilComplete[2] = {};
+    
+    srand(BENCHMARK_VIEWPOINTS);
+    
+    for (int v = 0; v < BENCHMARK_VIEWPOINTS; v++) {
+        float position[3], yaw, pitch;
+        randomBenchmarkViewpoint(position, &yaw, &pitch);
+        
+        ViewFrustum viewFrustum(position, yaw, pitch);
+        
+        // what the pass in tree order delivers in view is what complete means for both
+        int nodesInView = 0;
+        int bytesUntilComplete[2];
+        int packetsUntilComplete[2];
+        
+        for (int scheduled = 0; scheduled < 2; scheduled++) {
+            VoxelTree receivedTree;
+            VoxelStreamReceiver streamReceiver;
+            VoxelPacketScheduler packetScheduler(voxelBytesPerSecond);
+            
+            MarkerNode *rootMarkerNode = new MarkerNode();
+            unsigned char *stopOctal = NULL;
+            
+            std::vector<int> bytesAfterPacket;
+            std::vector<int> nodesInViewAfterPacket;
+            int bytesSent = 0;
+            
+            if (!scheduled) {
+                while (rootMarkerNode->childrenVisitedMask != 255 && bytesAfterPacket.size() < MAX_BENCHMARK_PACKETS) {
+                    unsigned char *voxelPacketEnd = voxelPacket;
+                    stopOctal = randomTree.loadBitstreamBuffer(voxelPacketEnd, voxelPacket + MAX_VOXEL_PACKET_SIZE,
+                                                               randomTree.rootNode, rootMarkerNode,
+                                                               position, treeRoot, stopOctal);
+                    
+                    if (voxelPacketEnd > voxelPacket) {
+                        receivedTree.readBitstreamToTree(voxelPacket, voxelPacketEnd - voxelPacket);
+                    }
+                    
+                    // the header the scheduler's packets carry, so the two are counted the same
+                    bytesSent += VOXEL_PACKET_HEADER_BYTES + voxelPacketEnd - voxelPacket;
+                    bytesAfterPacket.push_back(bytesSent);
+                    nodesInViewAfterPacket.push_back(countNodesInView(receivedTree.rootNode, treeRoot, viewFrustum));
+                }
+            } else {
+                // a round at a time at the budget until a pass is out, its packets counted one by one
+                for (int r = 1; bytesAfterPacket.size() < MAX_BENCHMARK_PACKETS; r++) {
+                    packetScheduler.startRound(&randomTree, position, &viewFrustum, r * VOXEL_SEND_INTERVAL_USECS);
+                    
+                    if (packetScheduler.getQueuedSubtrees() == 0) {
+                        break;
+                    }
+                    
+                    int packetBytes;
+                    
+                    while ((packetBytes = packetScheduler.encodePacket(&randomTree, voxelPacket, position)) > 0) {
+                        int headerBytes = streamReceiver.packetReceived(voxelPacket, packetBytes);
+                        receivedTree.readBitstreamToTree(voxelPacket + headerBytes, packetBytes - headerBytes);
+                        
+                        bytesSent += packetBytes;
+                        bytesAfterPacket.push_back(bytesSent);
+                        nodesInViewAfterPacket.push_back(countNodesInView(receivedTree.rootNode, treeRoot, viewFrustum));
+                    }
+                }
+            }
+            
+            if (!scheduled) {
+                nodesInView = nodesInViewAfterPacket.back();
+            }
+            
+            int p = 0;
+            
+            while (p < nodesInViewAfterPacket.size() - 1 && nodesInViewAfterPacket[p] < nodesInView) {
+                p++;
+            }
+            
+            bytesUntilComplete[scheduled] = bytesAfterPacket[p];
+            packetsUntilComplete[scheduled] = p + 1;
+            totalBytesUntilComplete[scheduled] += bytesAfterPacket[p];
+            
+            delete rootMarkerNode;
+        }
+        
+        printf("viewpoint %2d: %6d nodes in view complete after %8d bytes in %5d packets, %8d bytes in %5d packets scheduled\n",
+               v, nodesInView,
+               bytesUntilComplete[0], packetsUntilComplete[0],
+               bytesUntilComplete[1], packetsUntilComplete[1]);
+    }
+    
+    printf("on average the view is complete after %.0f bytes, %.0f bytes scheduled\n",
+           totalBytesUntilComplete[0] / BENCHMARK_VIEWPOINTS, totalBytesUntilComplete[1] / BENCHMARK_VIEWPOINTS);
+}
+
+const char BENCHMARK_VOXEL_SCHEDULE_OPTION[] = "--benchmarkVoxelSchedule";
+
+// detail in view this close to an agent is what the schedule benchmark waits on
+const float BENCHMARK_NEAR_DISTANCE = 2.0f;
+
+int countNodes(VoxelNode *node) {
+    int nodes = 1;
+    
+    for (int i = 0; i < 8; i++) {
+        if (node->children[i] != NULL) {
+            nodes += countNodes(node->children[i]);
+        }
+    }
+    
+    return nodes;
+}
+
+int countNodesNear(VoxelNode *node, float nodePosition[3], float *agentPosition, const ViewFrustum &viewFrustum) {
+    float size = powf(0.5, *node->octalCode) * TREE_SCALE;
+    float lowestCorner[3];
+    float distanceSquared = 0;
+    
+    for (int j = 0; j < 3; j++) {
+        lowestCorner[j] = nodePosition[j] - size;
+        distanceSquared += powf(agentPosition[j] - (nodePosition[j] - size / 2), 2);
+    }
+    
+    int nodesNear = sqrtf(distanceSquared) < BENCHMARK_NEAR_DISTANCE
+        && viewFrustum.cubeLocation(lowestCorner, size) != VIEW_OUTSIDE ? 1 : 0;
+    
+    for (int i = 0; i < 8; i++) {
+        if (node->children[i] != NULL) {
+            float childNodePosition[3];
+            
+            for (int j = 0; j < 3; j++) {
+                childNodePosition[j] = nodePosition[j];
+                
+                if (oneAtBit(branchIndexWithDescendant(node->octalCode, node->children[i]->octalCode), (7 - j))) {
+                    childNodePosition[j] -= size / 2;
+                }
+            }
+            
+            nodesNear += countNodesNear(node->children[i], childNodePosition, agentPosition, viewFrustum);
+        }
+    }
+    
+    return nodesNear;
+}
+
+void readFullPassToTree(VoxelTree *receivedTree, float *agentPosition) {
+    // all of the tree an agent there is close enough for, in one pass in tree order
+    float treeRoot[3] = {0, 0, 0};
+    unsigned char voxelPacket[MAX_VOXEL_PACKET_SIZE];
+    MarkerNode *rootMarkerNode = new MarkerNode();
+    unsigned char *stopOctal = NULL;
+    
+    while (rootMarkerNode->childrenVisitedMask != 255) {
+        unsigned char *voxelPacketEnd = voxelPacket;
+        stopOctal = randomTree.loadBitstreamBuffer(voxelPacketEnd, voxelPacket + MAX_VOXEL_PACKET_SIZE,
+                                                   randomTree.rootNode, rootMarkerNode,
+                                                   agentPosition, treeRoot, stopOctal);
+        
+        if (voxelPacketEnd > voxelPacket) {
+            receivedTree->readBitstreamToTree(voxelPacket, voxelPacketEnd - voxelPacket);
+        }
+    }
+    
+    delete rootMarkerNode;
+}
+
+void benchmarkVoxelSchedule() {
+    // one agent at a time decoding what it's sent a round at a time, counting the rounds until it has the detail
+    // near it in view and until it has everything, sent in tree order two packets a round the way it used to be,
+    // and by the scheduler at the same bytes a second and at the budget
+    const int BENCHMARK_VIEWPOINTS = 16;
+    const int MAX_BENCHMARK_ROUNDS = 10000;
+    const int TREE_ORDER_PACKETS_PER_ROUND = 2;
+    const int TREE_ORDER_BYTES_PER_SECOND = TREE_ORDER_PACKETS_PER_ROUND * MAX_VOXEL_PACKET_SIZE
+        * (1000000 / VOXEL_SEND_INTERVAL_USECS);
+    const int NUM_SENDERS = 3;
+    const char *SENDER_NAMES[NUM_SENDERS] = { "tree order", "scheduled", "scheduled at budget" };
+    
+    float treeRoot[3] = {0, 0, 0};
+    unsigned char voxelPacket[MAX_VOXEL_PACKET_SIZE];
+    unsigned char receipt[VOXEL_RECEIPT_PACKET_BYTES];
+    
+    double totalSecondsUntilNear[NUM_SENDERS] = {};
+    double totalSecondsUntilComplete[NUM_SENDERS] = {};
+    
+    printf("Near is in view within %.1f of the agent, tree order and scheduled send %d bytes a second, the budget is %d.\n",
+           BENCHMARK_NEAR_DISTANCE, TREE_ORDER_BYTES_PER_SECOND, voxelBytesPerSecond);
+    
+    srand(BENCHMARK_VIEWPOINTS);
+    
+    for (int v = 0; v < BENCHMARK_VIEWPOINTS; v++) {
+        float position[3], yaw, pitch;
+        randomBenchmarkViewpoint(position, &yaw, &pitch);
+        
+        ViewFrustum viewFrustum(position, yaw, pitch);
+        
+        // what one pass over the tree delivers is what complete means for all of them
+        VoxelTree completeTree;
+        readFullPassToTree(&completeTree, position);
+        
+        int nodesNear = countNodesNear(completeTree.rootNode, treeRoot, position, viewFrustum);
+        int nodesComplete = countNodes(completeTree.rootNode);
+        
+        printf("viewpoint %2d:", v);
+        
+        for (int sender = 0; sender < NUM_SENDERS; sender++) {
+            VoxelTree receivedTree;
+            VoxelStreamReceiver streamReceiver;
+            
+            MarkerNode *rootMarkerNode = new MarkerNode();
+            unsigned char *stopOctal = NULL;
+            VoxelPacketScheduler packetScheduler(sender == 2 ? voxelBytesPerSecond : TREE_ORDER_BYTES_PER_SECOND);
+            
+            int roundsUntilNear = 0;
+            int roundsUntilComplete = 0;
+            
+            for (int r = 1; r <= MAX_BENCHMARK_ROUNDS && roundsUntilComplete == 0; r++) {
+                if (sender == 0) {
+                    for (int p = 0; p < TREE_ORDER_PACKETS_PER_ROUND && rootMarkerNode->childrenVisitedMask != 255; p++) {
+                        unsigned char *voxelPacketEnd = voxelPacket;
+                        stopOctal = randomTree.loadBitstreamBuffer(voxelPacketEnd, voxelPacket + MAX_VOXEL_PACKET_SIZE,
+                                                                   randomTree.rootNode, rootMarkerNode,
+                                                                   position, treeRoot, stopOctal);
+                        
+                        if (voxelPacketEnd > voxelPacket) {
+                            receivedTree.readBitstreamToTree(voxelPacket, voxelPacketEnd - voxelPacket);
+                        }
+                    }
+                } else {
+                    packetScheduler.startRound(&randomTree, position, &viewFrustum, r * VOXEL_SEND_INTERVAL_USECS);
+                    int packetBytes;
+                    
+                    while ((packetBytes = packetScheduler.encodePacket(&randomTree, voxelPacket, position)) > 0) {
+                        int headerBytes = streamReceiver.packetReceived(voxelPacket, packetBytes);
+                        receivedTree.readBitstreamToTree(voxelPacket + headerBytes, packetBytes - headerBytes);
+                    }
+                    
+                    if (streamReceiver.encodeReceipt(receipt, r * VOXEL_SEND_INTERVAL_USECS) > 0) {
+                        packetScheduler.receiveReceipt(receipt, VOXEL_RECEIPT_PACKET_BYTES);
+                    }
+                }
+                
+                if (roundsUntilNear == 0 && countNodesNear(receivedTree.rootNode, treeRoot, position, viewFrustum) >= nodesNear) {
+                    roundsUntilNear = r;
+                }
+                
+                if (roundsUntilNear > 0 && countNodes(receivedTree.rootNode) >= nodesComplete) {
+                    roundsUntilComplete = r;
+                }
+            }
+            
+            double secondsPerRound = VOXEL_SEND_INTERVAL_USECS / 1000000.0;
+            totalSecondsUntilNear[sender] += roundsUntilNear * secondsPerRound;
+            totalSecondsUntilComplete[sender] += roundsUntilComplete * secondsPerRound;
+            
+            printf(" %s %5.1fs near %5.1fs all,", SENDER_NAMES[sender],
+                   roundsUntilNear * secondsPerRound, roundsUntilComplete * secondsPerRound);
+            
+            delete rootMarkerNode;
+        }
+        
+        printf(" %d nodes near in view of %d\n", nodesNear, nodesComplete);
+    }
+    
+    for (int sender = 0; sender < NUM_SENDERS; sender++) {
+        printf("%-20s on average has the detail near it in view after %5.1fs and everything after %5.1fs\n",
+               SENDER_NAMES[sender],
+               totalSecondsUntilNear[sender] / BENCHMARK_VIEWPOINTS,
+               totalSecondsUntilComplete[sender] / BENCHMARK_VIEWPOINTS);
+    }
+    
+    // then one agent on a link that drops what doesn't fit in its buffer once it's behind,
+    // sent at the budget without receipts and by what its receipts say
+    const int BENCHMARK_LINK_BYTES_PER_SECOND = 40 * 1000;
+    const int BENCHMARK_LINK_BUFFER_BYTES = 8 * MAX_VOXEL_PACKET_SIZE;
+    const int BENCHMARK_LINK_SECONDS = 20;
+    const int BENCHMARK_LINK_ROUNDS = BENCHMARK_LINK_SECONDS * 1000000 / VOXEL_SEND_INTERVAL_USECS;
+    const int LINK_BYTES_PER_ROUND = (int64_t) BENCHMARK_LINK_BYTES_PER_SECOND * VOXEL_SEND_INTERVAL_USECS / 1000000;
+    
+    float position[3], yaw, pitch;
+    randomBenchmarkViewpoint(position, &yaw, &pitch);
+    ViewFrustum viewFrustum(position, yaw, pitch);
+    
+    VoxelTree completeTree;
+    readFullPassToTree(&completeTree, position);
+    int nodesComplete = countNodes(completeTree.rootNode);
+    
+    printf("A link that carries %d bytes a second:\n", BENCHMARK_LINK_BYTES_PER_SECOND);
+    
+    for (int adapting = 0; adapting < 2; adapting++) {
+        VoxelTree receivedTree;
+        VoxelPacketScheduler packetScheduler(voxelBytesPerSecond);
+        VoxelStreamReceiver streamReceiver;
+        
+        int bytesSent = 0;
+        int bytesArrived = 0;
+        int linkBufferBytes = 0;
+        int roundsUntilComplete = 0;
+        
+        for (int r = 1; r <= BENCHMARK_LINK_ROUNDS; r++) {
+            packetScheduler.startRound(&randomTree, position, &viewFrustum, r * VOXEL_SEND_INTERVAL_USECS);
+            linkBufferBytes = std::max(0, linkBufferBytes - LINK_BYTES_PER_ROUND);
+            
+            int packetBytes;
+            
+            while ((packetBytes = packetScheduler.encodePacket(&randomTree, voxelPacket, position)) > 0) {
+                bytesSent += packetBytes;
+                
+                if (linkBufferBytes + packetBytes <= BENCHMARK_LINK_BUFFER_BYTES) {
+                    linkBufferBytes += packetBytes;
+                    bytesArrived += packetBytes;
+                    
+                    int headerBytes = streamReceiver.packetReceived(voxelPacket, packetBytes);
+                    receivedTree.readBitstreamToTree(voxelPacket + headerBytes, packetBytes - headerBytes);
+                }
+            }
+            
+            if (adapting && streamReceiver.encodeReceipt(receipt, r * VOXEL_SEND_INTERVAL_USECS) > 0) {
+                packetScheduler.receiveReceipt(receipt, VOXEL_RECEIPT_PACKET_BYTES);
+            }
+            
+            if (roundsUntilComplete == 0 && countNodes(receivedTree.rootNode) >= nodesComplete) {
+                roundsUntilComplete = r;
+            }
+        }
+        
+        char completeSeconds[16] = "never";
+        
+        if (roundsUntilComplete > 0) {
+            sprintf(completeSeconds, "%.1fs", roundsUntilComplete * VOXEL_SEND_INTERVAL_USECS / 1000000.0);
+        }
+        
+        printf("%-9s sent %8d bytes, %8d arrived, %4.1f%% lost, everything after %6s, sending %6d bytes a second at the end\n",
+               adapting ? "adapting" : "fixed",
+               bytesSent, bytesArrived,
+               100.0f * (bytesSent - bytesArrived) / bytesSent,
+               completeSeconds,
+               packetScheduler.getBytesPerSecond());
+    }
+}
+
+const char BENCHMARK_VOXEL_EDITS_OPTION[] = "--benchmarkVoxelEdits";
+
+int countMismatchedNodes(VoxelNode *referenceNode, VoxelNode *receivedNode) {
+    if (receivedNode == NULL) {
+        return countNodes(referenceNode);
+    }
+    
+    // only colored leaves are drawn, and the agent still has the finer detail of anything it saw closer up,
+    // what a node above those is colored depends on the order its slices were read
+    int mismatchedNodes = 0;
+    bool isLeaf = true;
+    bool isReceivedLeaf = true;
+    
+    for (int i = 0; i < 8; i++) {
+        if (referenceNode->children[i] != NULL) {
+            mismatchedNodes += countMismatchedNodes(referenceNode->children[i], receivedNode->children[i]);
+            isLeaf = false;
+        }
+        
+        if (receivedNode->children[i] != NULL) {
+            isReceivedLeaf = false;
+        }
+    }
+    
+    if (isLeaf && isReceivedLeaf && referenceNode->color[3] != 0
+        && memcmp(referenceNode->color, receivedNode->color, 4) != 0) {
+        mismatchedNodes++;
+    }
+    
+    return mismatchedNodes;
+}
+
+void benchmarkVoxelEdits() {
+    // agents, half standing still and half walking, sent the tree while it's edited a few voxels a round,
+    // counting what they're sent once they have the first of it against what their budgets would let through,
+    // then with the edits stopped waiting for them all to have everything and checking it against a full pass
+    const int NUM_AGENTS = 16;
+    const int EDITS_PER_ROUND = 2;
+    const float EDIT_VOXEL_SIZE = 1.0f / 256;
+    const float WALKING_SPEED = 0.5f;
+    const int WARMUP_SECONDS = 10;
+    const int MEASURE_SECONDS = 20;
+    const int MAX_SETTLE_SECONDS = 60;
+    const int ROUNDS_PER_SECOND = 1000000 / VOXEL_SEND_INTERVAL_USECS;
+    
+    unsigned char voxelPacket[MAX_VOXEL_PACKET_SIZE];
+    unsigned char receipt[VOXEL_RECEIPT_PACKET_BYTES];
+    
+    float positions[NUM_AGENTS][3], yaws[NUM_AGENTS], pitches[NUM_AGENTS], headings[NUM_AGENTS][3];
+    VoxelPacketScheduler *packetSchedulers[NUM_AGENTS];
+    VoxelStreamReceiver streamReceivers[NUM_AGENTS];
+    VoxelTree receivedTrees[NUM_AGENTS];
+    
+    srand(NUM_AGENTS);
+    
+    for (int a = 0; a < NUM_AGENTS; a++) {
+        randomBenchmarkViewpoint(positions[a], &yaws[a], &pitches[a]);
+        packetSchedulers[a] = new VoxelPacketScheduler(voxelBytesPerSecond);
+        
+        for (int j = 0; j < 3; j++) {
+            headings[a][j] = randFloatInRange(-1, 1);
+        }
+        
+        float headingLength = sqrtf(headings[a][0] * headings[a][0] + headings[a][1] * headings[a][1]
+                                    + headings[a][2] * headings[a][2]);
+        
+        for (int j = 0; j < 3; j++) {
+            headings[a][j] /= headingLength;
+        }
+    }
+    
+    printf("%d agents, every other one walking %.1f a second, while %d voxels a second are edited.\n",
+           NUM_AGENTS, WALKING_SPEED, EDITS_PER_ROUND * ROUNDS_PER_SECOND);
+    
+    // shared the way the send pool shares it, so a subtree cached before an edit under it has to be passed over
+    VoxelSubtreeCache subtreeCache(VOXEL_SUBTREE_CACHE_BYTES);
+    
+    int editRounds = (WARMUP_SECONDS + MEASURE_SECONDS) * ROUNDS_PER_SECOND;
+    int lastRound = editRounds + MAX_SETTLE_SECONDS * ROUNDS_PER_SECOND;
+    int settledRound = 0;
+    int64_t measuredBytes[2] = {};
+    
+    for (int r = 1; r <= lastRound && settledRound == 0; r++) {
+        bool editing = r <= editRounds;
+        
+        if (editing) {
+            for (int e = 0; e < EDITS_PER_ROUND; e++) {
+                unsigned char *voxelData = pointToVoxel(randFloat(), randFloat(), randFloat(), EDIT_VOXEL_SIZE,
+                                                        randIntInRange(0, 255),
+                                                        randIntInRange(0, 255),
+                                                        randIntInRange(0, 255));
+                randomTree.readCodeColorBufferToTree(voxelData);
+                delete[] voxelData;
+            }
+        }
+        
+        bool allIdle = true;
+        
+        for (int a = 0; a < NUM_AGENTS; a++) {
+            if (editing && a % 2 == 1) {
+                for (int j = 0; j < 3; j++) {
+                    positions[a][j] += headings[a][j] * WALKING_SPEED / ROUNDS_PER_SECOND;
+                    
+                    // turn back at the edges of the tree
+                    if (positions[a][j] < -TREE_SCALE || positions[a][j] > 0) {
+                        headings[a][j] = -headings[a][j];
+                        positions[a][j] = std::max((float) -TREE_SCALE, std::min(0.0f, positions[a][j]));
+                    }
+                }
+            }
+            
+            ViewFrustum viewFrustum(positions[a], yaws[a], pitches[a]);
+            packetSchedulers[a]->startRound(&randomTree, positions[a], &viewFrustum, r * VOXEL_SEND_INTERVAL_USECS);
+            
+            int packetBytes;
+            
+            while ((packetBytes = packetSchedulers[a]->encodePacket(&randomTree, voxelPacket, positions[a],
+                                                                    &subtreeCache)) > 0) {
+                if (editing && r > WARMUP_SECONDS * ROUNDS_PER_SECOND) {
+                    measuredBytes[a % 2] += packetBytes;
+                }
+                
+                int headerBytes = streamReceivers[a].packetReceived(voxelPacket, packetBytes);
+                receivedTrees[a].readBitstreamToTree(voxelPacket + headerBytes, packetBytes - headerBytes);
+            }
+            
+            if (streamReceivers[a].encodeReceipt(receipt, r * VOXEL_SEND_INTERVAL_USECS) > 0) {
+                packetSchedulers[a]->receiveReceipt(receipt, VOXEL_RECEIPT_PACKET_BYTES);
+            }
+            
+            allIdle = allIdle && packetSchedulers[a]->isIdle();
+        }
+        
+        if (!editing && allIdle) {
+            settledRound = r;
+        }
+    }
+    
+    const char *AGENT_KINDS[2] = { "standing", "walking" };
+    
+    for (int kind = 0; kind < 2; kind++) {
+        printf("%-8s agents were sent %7.0f bytes a second each of the %d they could have been\n",
+               AGENT_KINDS[kind],
+               measuredBytes[kind] / (NUM_AGENTS / 2.0) / MEASURE_SECONDS,
+               voxelBytesPerSecond);
+    }
+    
+    if (settledRound == 0) {
+        printf("they still had passes going %d seconds after the edits stopped\n", MAX_SETTLE_SECONDS);
+    } else {
+        printf("%.1fs after the edits stopped they all had everything\n",
+               (settledRound - editRounds) * VOXEL_SEND_INTERVAL_USECS / 1000000.0);
+    }
+    
+    int totalMismatchedNodes = 0;
+    
+    for (int a = 0; a < NUM_AGENTS; a++) {
+        VoxelTree completeTree;
+        readFullPassToTree(&completeTree, positions[a]);
+        totalMismatchedNodes += countMismatchedNodes(completeTree.rootNode, receivedTrees[a].rootNode);
+        
+        delete packetSchedulers[a];
+    }
+    
+    int cacheHits, cacheMisses, cacheHitBytes;
+    subtreeCache.takeCounts(&cacheHits, &cacheMisses, &cacheHitBytes);
+    
+    printf("%d nodes of a full pass from where they ended up were missing or a different color, "
+           "%d of %d cacheable subtrees were copied\n",
+           totalMismatchedNodes, cacheHits, cacheHits + cacheMisses);
+}
+
+const char BENCHMARK_VOXEL_CACHE_OPTION[] = "--benchmarkVoxelCache";
+
+void benchmarkVoxelCache() {
+    // agents gathered around one spot all joining at once, sent everything they can see from there
+    // with each subtree encoded for each of them and with the subtrees they share encoded once, timing the encoding
+    // and checking what each decodes against a full pass, for the agents gathered closer and further apart
+    const int NUM_AGENTS = 64;
+    const int NUM_SPREADS = 4;
+    const float AGENT_SPREADS[NUM_SPREADS] = { 0.1f, 0.5f, 2.0f, 5.0f };
+    const int MAX_BENCHMARK_ROUNDS = 1000;
+    
+    unsigned char voxelPacket[MAX_VOXEL_PACKET_SIZE];
+    unsigned char receipt[VOXEL_RECEIPT_PACKET_BYTES];
+    
+    printf("%d agents joining together around the middle of the tree.\n", NUM_AGENTS);
+    
+    for (int spread = 0; spread < NUM_SPREADS; spread++) {
+        for (int cached = 0; cached < 2; cached++) {
+            // both runs put the agents in the same places
+            srand(NUM_AGENTS + spread);
+            
+            float positions[NUM_AGENTS][3];
+            ViewFrustum *viewFrusta[NUM_AGENTS];
+            VoxelPacketScheduler *packetSchedulers[NUM_AGENTS];
+            VoxelStreamReceiver streamReceivers[NUM_AGENTS];
+            VoxelTree receivedTrees[NUM_AGENTS];
+            std::vector<unsigned char> roundPackets[NUM_AGENTS];
+            
+            for (int a = 0; a < NUM_AGENTS; a++) {
+                for (int j = 0; j < 3; j++) {
+                    positions[a][j] = -TREE_SCALE / 2.0f + randFloatInRange(-AGENT_SPREADS[spread], AGENT_SPREADS[spread]) / 2;
+                }
+                
+                viewFrusta[a] = new ViewFrustum(positions[a], randFloatInRange(-180, 180), randFloatInRange(-30, 30));
+                packetSchedulers[a] = new VoxelPacketScheduler(voxelBytesPerSecond);
+            }
+            
+            VoxelSubtreeCache subtreeCache(VOXEL_SUBTREE_CACHE_BYTES);
+            double encodeUsecs = 0;
+            int bytesSent = 0;
+            int rounds = 0;
+            bool allIdle = false;
+            
+            while (!allIdle && rounds < MAX_BENCHMARK_ROUNDS) {
+                rounds++;
+                allIdle = true;
+                
+                // only the encoding is timed, the agents decode their packets after
+                double startUsecs = usecTimestampNow();
+                
+                for (int a = 0; a < NUM_AGENTS; a++) {
+                    packetSchedulers[a]->startRound(&randomTree, positions[a], viewFrusta[a],
+                                                    rounds * VOXEL_SEND_INTERVAL_USECS);
+                    int packetBytes;
+                    
+                    while ((packetBytes = packetSchedulers[a]->encodePacket(&randomTree, voxelPacket, positions[a],
+                                                                            cached ? &subtreeCache : NULL)) > 0) {
+                        roundPackets[a].insert(roundPackets[a].end(), (unsigned char *) &packetBytes,
+                                               (unsigned char *) &packetBytes + sizeof(packetBytes));
+                        roundPackets[a].insert(roundPackets[a].end(), voxelPacket, voxelPacket + packetBytes);
+                    }
+                }
+                
+                encodeUsecs += usecTimestampNow() - startUsecs;
+                
+                for (int a = 0; a < NUM_AGENTS; a++) {
+                    for (int offset = 0; offset < roundPackets[a].size(); ) {
+                        int packetBytes;
+                        memcpy(&packetBytes, &roundPackets[a][offset], sizeof(packetBytes));
+                        unsigned char *packet = &roundPackets[a][offset + sizeof(packetBytes)];
+                        
+                        int headerBytes = streamReceivers[a].packetReceived(packet, packetBytes);
+                        receivedTrees[a].readBitstreamToTree(packet + headerBytes, packetBytes - headerBytes);
+                        
+                        bytesSent += packetBytes;
+                        offset += sizeof(packetBytes) + packetBytes;
+                    }
+                    
+                    roundPackets[a].clear();
+                    
+                    if (streamReceivers[a].encodeReceipt(receipt, rounds * VOXEL_SEND_INTERVAL_USECS) > 0) {
+                        packetSchedulers[a]->receiveReceipt(receipt, VOXEL_RECEIPT_PACKET_BYTES);
+                    }
+                    
+                    allIdle = allIdle && packetSchedulers[a]->isIdle();
+                }
+            }
+            
+            int totalMismatchedNodes = 0;
+            
+            for (int a = 0; a < NUM_AGENTS; a++) {
+                VoxelTree completeTree;
+                readFullPassToTree(&completeTree, positions[a]);
+                totalMismatchedNodes += countMismatchedNodes(completeTree.rootNode, receivedTrees[a].rootNode);
+                
+                delete packetSchedulers[a];
+                delete viewFrusta[a];
+            }
+            
+            int cacheHits, cacheMisses, cacheHitBytes;
+            subtreeCache.takeCounts(&cacheHits, &cacheMisses, &cacheHitBytes);
+            
+            printf("spread %.1f %-8s encoded %10d bytes in %7.1f ms over %3d rounds, %d nodes off",
+                   AGENT_SPREADS[spread], cached ? "cached" : "uncached", bytesSent, encodeUsecs / 1000, rounds,
+                   totalMismatchedNodes);
+            
+            if (cached) {
+                printf(", %.1f%% of %d subtrees and %.1f%% of the bytes copied, %d bytes cached",
+                       100.0f * cacheHits / std::max(1, cacheHits + cacheMisses), cacheHits + cacheMisses,
+                       100.0f * cacheHitBytes / bytesSent, subtreeCache.getBytes());
+            }
+            
+            printf("\n");
+        }
+    }
+}
+
+int main(int argc, const char * argv[])
+{
+    setvbuf(stdout, NULL, _IOLBF, 0);
+    
+    if (cmdOptionExists(argc, argv, NO_VIEW_CULLING_OPTION)) {
+        viewCulling = false;
+        printf("Sending voxels without regard to where agents are looking.\n");
+    }
+    
+    const char *voxelBytesPerSecondOption = getCmdOption(argc, argv, VOXEL_BYTES_PER_SECOND_OPTION);
+    
+    if (voxelBytesPerSecondOption) {
+        voxelBytesPerSecond = std::max(VOXEL_MIN_BYTES_PER_SECOND, atoi(voxelBytesPerSecondOption));
+        printf("Sending each agent up to %d bytes of voxels a second.\n", voxelBytesPerSecond);
+    }
+    
+    addSphereScene(&randomTree, false);
+    
+    if (cmdOptionExists(argc, argv, BENCHMARK_VOXEL_SEND_OPTION)) {
+        benchmarkVoxelSend();
+        return 0;
+    }
+    
+    if (cmdOptionExists(argc, argv, BENCHMARK_VOXEL_VIEW_OPTION)) {
+        benchmarkVoxelView();
+        return 0;
+    }
+    
+    if (cmdOptionExists(argc, argv, BENCHMARK_VOXEL_SCHEDULE_OPTION)) {
+        benchmarkVoxelSchedule();
+        return 0;
+    }
+    
+    if (cmdOptionExists(argc, argv, BENCHMARK_VOXEL_EDITS_OPTION)) {
+        benchmarkVoxelEdits();
+        return 0;
+    }
+    
+    if (cmdOptionExists(argc, argv, BENCHMARK_VOXEL_CACHE_OPTION)) {
+        benchmarkVoxelCache();
+        return 0;
+    }
+    
+    printf("Usage: voxel-bench [%s] [%s bytes] benchmark\n", NO_VIEW_CULLING_OPTION, VOXEL_BYTES_PER_SECOND_OPTION);
+    printf("  %s\n", BENCHMARK_VOXEL_SEND_OPTION);
+    printf("  %s\n", BENCHMARK_VOXEL_VIEW_OPTION);
+    printf("  %s\n", BENCHMARK_VOXEL_SCHEDULE_OPTION);
+    printf("  %s\n", BENCHMARK_VOXEL_EDITS_OPTION);
+    printf("  %s\n", BENCHMARK_VOXEL_CACHE_OPTION);
+    return 1;
+}
@@ -10,17 +10,19 @@
 #include <cstring>
 #include <cstdio>
 
-VoxelAgentData::VoxelAgentData() {
-    rootMarkerNode = new MarkerNode();
+VoxelAgentData::VoxelAgentData(int maxBytesPerSecond) : packetScheduler(maxBytesPerSecond) {
+    memset(position, 0, sizeof(position));
+    yaw = 0;
+    pitch = 0;
+    hasState = false;
 }
 
-VoxelAgentData::~VoxelAgentData() {
-    delete rootMarkerNode;
-}
-
-VoxelAgentData::VoxelAgentData(const VoxelAgentData &otherAgentData) {
+VoxelAgentData::VoxelAgentData(const VoxelAgentData &otherAgentData) :
+    packetScheduler(otherAgentData.packetScheduler.getMaxBytesPerSecond()) {
     memcpy(position, otherAgentData.position, sizeof(float) * 3);
-    rootMarkerNode = new MarkerNode();
+    yaw = otherAgentData.yaw;
+    pitch = otherAgentData.pitch;
+    hasState = otherAgentData.hasState;
 }
 
 VoxelAgentData* VoxelAgentData::clone() const {
@@ -28,8 +30,28 @@ VoxelAgentData* VoxelAgentData::clone() const {
 }
 
 void VoxelAgentData::parseData(void *data, int size) {
-    // pull the position from the interface agent data packet
-    sscanf((char *)data,
-           "H%*f,%*f,%*f,%f,%f,%f",
-           &position[0], &position[1], &position[2]);
+    // pull the position and where it's looking from the interface agent data packet,
+    // a delta against what we last acked or the whole state
+    unsigned char *packet = (unsigned char *)data;
+    
+    if (packet[0] == VOXEL_RECEIPT_PACKET_HEADER) {
+        // how much of what we've been sending it has arrived
+        packetScheduler.receiveReceipt(packet, size);
+        return;
+    }
+    
+    AvatarState state;
+    
+    if (packet[0] == AVATAR_UPDATE_PACKET_HEADER
+        ? stateReceiver.decodeUpdate(packet, size, &state)
+        : decodeAvatarState(packet, size, &state)) {
+        memcpy(position, state.position, sizeof(state.position));
+        yaw = state.yaw;
+        pitch = state.pitch;
+        hasState = true;
+    }
+}
+
+int VoxelAgentData::getReplyData(unsigned char *reply) {
+    return stateReceiver.encodeAcknowledgement(reply);
 }
@@ -11,19 +11,30 @@
 
 #include <iostream>
 #include <AgentData.h>
-#include "MarkerNode.h"
+#include <AvatarReplication.h>
+#include <VoxelTree.h>
+#include "VoxelPacketScheduler.h"
 
 class VoxelAgentData : public AgentData {
 public:
     float position[3];
-    MarkerNode *rootMarkerNode;
+    float yaw;
+    float pitch;
+    
+    // whether it has told us where it is yet, it has linked data from the moment it's added
+    bool hasState;
+    
+    // what of the tree this agent gets next, and how fast
+    VoxelPacketScheduler packetScheduler;
 
-    VoxelAgentData();
-    ~VoxelAgentData();
+    VoxelAgentData(int maxBytesPerSecond);
     VoxelAgentData(const VoxelAgentData &otherAgentData);
     
     void parseData(void *data, int size);
+    int getReplyData(unsigned char *reply);
     VoxelAgentData* clone() const;
+private:
+    AvatarStateReceiver stateReceiver;
 };
 
 #endif /* defined(__hifi__VoxelAgentData__) */
@@ -0,0 +1,443 @@
+//
+//  VoxelPacketScheduler.cpp
+//  voxel
+//
+//  Copyright (c) 2013 High Fidelity, Inc. All rights reserved.
+//
+
+#include <cmath>
+#include <cstring>
+#include <algorithm>
+#include <OctalCode.h>
+#include <SharedUtil.h>
+#include "VoxelPacketScheduler.h"
+
+// the deepest level an octal code can name, every level past the ones with their own distance shares the last
+const int DEEPEST_RENDER_LEVEL = 255;
+
+static bool lowerPriority(const VoxelSendEntry &entry, const VoxelSendEntry &otherEntry) {
+    return entry.priority < otherEntry.priority;
+}
+
+static bool isUnvisited(MarkerNode *markerNode) {
+    if (markerNode->childrenVisitedMask != 0) {
+        return false;
+    }
+    
+    for (int i = 0; i < 8; i++) {
+        if (markerNode->children[i] != NULL) {
+            return false;
+        }
+    }
+    
+    return true;
+}
+
+static void childNodePosition(VoxelNode *node, int childIndex, const float *nodePosition, float *childPosition) {
+    float childSize = powf(0.5, *node->children[childIndex]->octalCode) * TREE_SCALE;
+    
+    for (int j = 0; j < 3; j++) {
+        childPosition[j] = nodePosition[j];
+        
+        if (oneAtBit(branchIndexWithDescendant(node->octalCode, node->children[childIndex]->octalCode), (7 - j))) {
+            childPosition[j] -= childSize;
+        }
+    }
+}
+
+VoxelPacketScheduler::VoxelPacketScheduler(int maxBytesPerSecond) :
+    streamSender(maxBytesPerSecond, VOXEL_MIN_BYTES_PER_SECOND) {
+    rootMarkerNode = new MarkerNode();
+    
+    lastRoundUsecs = 0;
+    byteCredit = 0;
+    roundViewFrustum = NULL;
+    
+    hasSent = false;
+    sentVersion = 0;
+    passRunning = false;
+    passPackets = 0;
+    awaitingConfirmation = false;
+}
+
+VoxelPacketScheduler::~VoxelPacketScheduler() {
+    delete rootMarkerNode;
+}
+
+void VoxelPacketScheduler::queueSubtree(VoxelNode *node, MarkerNode *markerNode, float *position, int64_t queuedUsecs) {
+    VoxelSendEntry entry;
+    entry.node = node;
+    entry.markerNode = markerNode;
+    memcpy(entry.position, position, sizeof(entry.position));
+    entry.queuedUsecs = queuedUsecs;
+    entry.priority = 0;
+    
+    queue.push_back(entry);
+}
+
+float VoxelPacketScheduler::subtreePriority(const VoxelSendEntry &entry, float *agentPosition,
+                                            const ViewFrustum *viewFrustum, int64_t nowUsecs) {
+    // the node spans back from its position by its size on each axis
+    float size = powf(0.5, *entry.node->octalCode) * TREE_SCALE;
+    float lowestCorner[3];
+    float distanceSquared = 0;
+    
+    for (int j = 0; j < 3; j++) {
+        lowestCorner[j] = entry.position[j] - size;
+        distanceSquared += powf(agentPosition[j] - (entry.position[j] - size / 2), 2);
+    }
+    
+    // how big the subtree looks from where the agent is, the most an agent inside it can see is all of it
+    float distance = sqrtf(distanceSquared);
+    float screenSpaceError = size / std::max(distance, size);
+    
+    // and on top of that nearer is sooner, the agent is most likely to go up to what's closest
+    screenSpaceError /= 1 + distance / VOXEL_NEAR_DISTANCE;
+    
+    if (viewFrustum != NULL && viewFrustum->cubeLocation(lowestCorner, size) == VIEW_OUTSIDE) {
+        screenSpaceError *= VOXEL_OUT_OF_VIEW_WEIGHT;
+    }
+    
+    // the longer part of the tree has waited the more it's worth, so even far behind the agent it gets its turn
+    return screenSpaceError * (1 + (nowUsecs - entry.queuedUsecs) / (float) VOXEL_STALENESS_USECS);
+}
+
+bool VoxelPacketScheduler::sendsChildren(float *agentPosition, VoxelNode *node, float *nodePosition) {
+    // exactly the test loadBitstreamBuffer makes, which measures from half a node past its position
+    float halfSize = powf(0.5, *node->octalCode) * (0.5 * TREE_SCALE);
+    float distanceSquared = 0;
+    
+    for (int j = 0; j < 3; j++) {
+        distanceSquared += powf(agentPosition[j] - nodePosition[j] - halfSize, 2);
+    }
+    
+    return sqrtf(distanceSquared) < boundaryDistanceForRenderLevel(*node->octalCode + 1);
+}
+
+int VoxelPacketScheduler::subtreeDetailLevel(VoxelNode *node, float *nodePosition, float *agentPosition) {
+    // every node under this one is tested from a point between its lowest corner and half a node past its position,
+    // so the nearest and farthest of those from the agent bound the distance any of them is tested at
+    float size = powf(0.5, *node->octalCode) * TREE_SCALE;
+    float nearestSquared = 0, farthestSquared = 0;
+    
+    for (int j = 0; j < 3; j++) {
+        float belowLowest = (nodePosition[j] - size) - agentPosition[j];
+        float aboveHighest = agentPosition[j] - (nodePosition[j] + size / 2);
+        
+        nearestSquared += powf(std::max(0.0f, std::max(belowLowest, aboveHighest)), 2);
+        farthestSquared += powf(std::max(fabsf(belowLowest), fabsf(aboveHighest)), 2);
+    }
+    
+    float nearest = sqrtf(nearestSquared);
+    float farthest = sqrtf(farthestSquared);
+    float narrowestDistance = boundaryDistanceForRenderLevel(DEEPEST_RENDER_LEVEL);
+    
+    // the distance a node is sent its children inside only shrinks going down, so the subtree stops at a level
+    // when everything above it is inside and everything at it is outside
+    for (int detailLevel = *node->octalCode;
+         detailLevel == *node->octalCode || farthest < boundaryDistanceForRenderLevel(detailLevel);
+         detailLevel++) {
+        if (nearest >= boundaryDistanceForRenderLevel(detailLevel + 1)) {
+            return detailLevel;
+        }
+        
+        if (boundaryDistanceForRenderLevel(detailLevel + 1) == narrowestDistance && farthest < narrowestDistance) {
+            // every level below has the same distance and all of it is inside
+            return DEEPEST_RENDER_LEVEL;
+        }
+    }
+    
+    return -1;
+}
+
+bool VoxelPacketScheduler::sendsSameChildren(VoxelNode *node, float *nodePosition) {
+    int sentDetailLevel = subtreeDetailLevel(node, nodePosition, sentPosition);
+    return sentDetailLevel >= 0 && sentDetailLevel == subtreeDetailLevel(node, nodePosition, passPosition);
+}
+
+bool VoxelPacketScheduler::markSentChildren(VoxelNode *node, MarkerNode *markerNode, float *nodePosition) {
+    if (!sendsChildren(passPosition, node, nodePosition)) {
+        // nothing under it goes out from here, its own color rides in its parent's
+        return false;
+    }
+    
+    if (!sendsChildren(sentPosition, node, nodePosition)) {
+        // the agent wasn't close enough for any of this before, all of it goes
+        return true;
+    }
+    
+    bool needsAny = node->version > sentVersion;
+    
+    for (int i = 0; i < 8; i++) {
+        if (node->children[i] == NULL) {
+            continue;
+        }
+        
+        float childPosition[3];
+        childNodePosition(node, i, nodePosition, childPosition);
+        
+        if (node->children[i]->version <= sentVersion && sendsSameChildren(node->children[i], childPosition)) {
+            // unchanged, and the agent sees the same of it as it did, skip it without going down
+            markerNode->childrenVisitedMask |= 1 << (7 - i);
+            continue;
+        }
+        
+        if (markerNode->children[i] == NULL) {
+            markerNode->children[i] = new MarkerNode();
+        }
+        
+        if (markSentChildren(node->children[i], markerNode->children[i], childPosition)) {
+            needsAny = true;
+        } else {
+            markerNode->childrenVisitedMask |= 1 << (7 - i);
+        }
+    }
+    
+    return needsAny;
+}
+
+void VoxelPacketScheduler::commitPass() {
+    hasSent = true;
+    sentVersion = passVersion;
+    memcpy(sentPosition, passPosition, sizeof(sentPosition));
+}
+
+void VoxelPacketScheduler::startPass(VoxelTree *tree, float *agentPosition, int64_t nowUsecs) {
+    bool moved = !hasSent || memcmp(sentPosition, agentPosition, sizeof(sentPosition)) != 0;
+    
+    if (hasSent && !moved && tree->rootNode->version <= sentVersion) {
+        // the agent has all of it from where it is
+        return;
+    }
+    
+    passVersion = tree->version;
+    memcpy(passPosition, agentPosition, sizeof(passPosition));
+    passPackets = 0;
+    passLostPackets = streamSender.getLostPackets();
+    
+    delete rootMarkerNode;
+    rootMarkerNode = new MarkerNode();
+    
+    float rootPosition[3] = {0, 0, 0};
+    
+    if (!hasSent || markSentChildren(tree->rootNode, rootMarkerNode, rootPosition)) {
+        queueSubtree(tree->rootNode, rootMarkerNode, rootPosition, nowUsecs);
+        passRunning = true;
+    } else {
+        // it only moved, and not far enough to see anything new
+        commitPass();
+    }
+}
+
+void VoxelPacketScheduler::finishPass() {
+    passRunning = false;
+    
+    if (passPackets == 0) {
+        commitPass();
+        return;
+    }
+    
+    // it counts once a receipt shows its last packet went out and nothing since it started was lost
+    awaitingConfirmation = true;
+    passLastSequence = streamSender.getLastSequence();
+    passSentUsecs = lastRoundUsecs;
+}
+
+void VoxelPacketScheduler::startRound(VoxelTree *tree, float *agentPosition,
+                                      const ViewFrustum *viewFrustum, int64_t nowUsecs) {
+    int bytesPerSecond = streamSender.getBytesPerSecond();
+    int64_t elapsedUsecs = lastRoundUsecs == 0 ? VOXEL_MAX_BURST_USECS : nowUsecs - lastRoundUsecs;
+    
+    byteCredit = std::min((int64_t) bytesPerSecond * VOXEL_MAX_BURST_USECS / 1000000,
+                          byteCredit + (int64_t) bytesPerSecond * elapsedUsecs / 1000000);
+    lastRoundUsecs = nowUsecs;
+    roundViewFrustum = viewFrustum;
+    
+    if (awaitingConfirmation) {
+        int receivedSequence = streamSender.getReceivedSequence();
+        
+        if (receivedSequence >= 0 && (int16_t) (receivedSequence - passLastSequence) >= 0) {
+            awaitingConfirmation = false;
+            
+            // with any of it lost the next pass goes from what the agent had before and sends it all again
+            if (streamSender.getLostPackets() == passLostPackets) {
+                commitPass();
+            }
+        } else if (nowUsecs - passSentUsecs > VOXEL_PASS_CONFIRM_USECS) {
+            awaitingConfirmation = false;
+        }
+    }
+    
+    if (queue.empty() && !awaitingConfirmation) {
+        startPass(tree, agentPosition, nowUsecs);
+    }
+    
+    for (int i = 0; i < queue.size(); i++) {
+        queue[i].priority = subtreePriority(queue[i], agentPosition, viewFrustum, nowUsecs);
+    }
+    
+    std::make_heap(queue.begin(), queue.end(), lowerPriority);
+}
+
+void VoxelPacketScheduler::queueChildren(const VoxelSendEntry &entry, float *agentPosition) {
+    for (int i = 0; i < 8; i++) {
+        if (entry.node->children[i] != NULL && !oneAtBit(entry.markerNode->childrenVisitedMask, i)) {
+            if (entry.markerNode->children[i] == NULL) {
+                entry.markerNode->children[i] = new MarkerNode();
+            }
+            
+            float childPosition[3];
+            childNodePosition(entry.node, i, entry.position, childPosition);
+            
+            // the children have waited as long as the subtree they came from
+            queueSubtree(entry.node->children[i], entry.markerNode->children[i], childPosition, entry.queuedUsecs);
+            queue.back().priority = subtreePriority(queue.back(), agentPosition, roundViewFrustum, lastRoundUsecs);
+            std::push_heap(queue.begin(), queue.end(), lowerPriority);
+        }
+    }
+}
+
+int VoxelPacketScheduler::encodeSubtreeToCache(VoxelTree *tree, VoxelSendEntry &entry, int detailLevel,
+                                               VoxelSubtreeCache *subtreeCache,
+                                               unsigned char *buffer, unsigned char *bufferEnd) {
+    // the first agent to need it encodes all of it on its own, for itself and whoever's next
+    unsigned char subtree[MAX_VOXEL_PACKET_SIZE - VOXEL_PACKET_HEADER_BYTES];
+    unsigned char *subtreeEnd = subtree;
+    MarkerNode subtreeMarkerNode;
+    
+    if (detailLevel == *entry.node->octalCode + 1) {
+        // just its own slice, whether its children are too far away or it's being split
+        subtreeMarkerNode.childrenVisitedMask = 255;
+    }
+    
+    unsigned char *stopOctalCode = tree->loadBitstreamBuffer(subtreeEnd,
+                                                             subtree + sizeof(subtree),
+                                                             entry.node,
+                                                             &subtreeMarkerNode,
+                                                             passPosition,
+                                                             entry.position,
+                                                             entry.node->octalCode);
+    
+    if (stopOctalCode != NULL) {
+        // it won't go in one packet, noted so no one tries again
+        subtreeCache->storeSubtree(entry.node, detailLevel, subtree, 0);
+        return -1;
+    }
+    
+    int subtreeBytes = subtreeEnd - subtree;
+    
+    if (subtreeBytes == 0) {
+        // a leaf, its color went with its parent
+        return 0;
+    }
+    
+    subtreeCache->storeSubtree(entry.node, detailLevel, subtree, subtreeBytes);
+    
+    if (buffer + subtreeBytes <= bufferEnd) {
+        memcpy(buffer, subtree, subtreeBytes);
+    }
+    
+    return subtreeBytes;
+}
+
+int VoxelPacketScheduler::encodePacket(VoxelTree *tree, unsigned char *packet, float *agentPosition,
+                                       VoxelSubtreeCache *subtreeCache) {
+    if (byteCredit <= 0) {
+        return 0;
+    }
+    
+    // the header goes in once we know there's something to send, so an empty packet doesn't use up a sequence
+    unsigned char *packetEnd = packet + VOXEL_PACKET_HEADER_BYTES;
+    
+    while (!queue.empty()) {
+        VoxelSendEntry entry = queue.front();
+        unsigned char *subtreeStart = packetEnd;
+        
+        // none of a subtree sent yet that stops at the same level everywhere in it encodes the same for every agent
+        if (subtreeCache != NULL && isUnvisited(entry.markerNode)) {
+            int detailLevel = subtreeDetailLevel(entry.node, entry.position, passPosition);
+            
+            if (detailLevel > *entry.node->octalCode) {
+                int cachedBytes = subtreeCache->copySubtree(entry.node, detailLevel,
+                                                            packetEnd, packet + MAX_VOXEL_PACKET_SIZE);
+                
+                if (cachedBytes == 0) {
+                    cachedBytes = encodeSubtreeToCache(tree, entry, detailLevel, subtreeCache,
+                                                       packetEnd, packet + MAX_VOXEL_PACKET_SIZE);
+                }
+                
+                bool splitting = cachedBytes < 0;
+                
+                if (splitting) {
+                    // too big to go whole, its own slice goes now and its children are ranked on their own,
+                    // so everything of it any agent is sent can come from the cache
+                    cachedBytes = subtreeCache->copySubtree(entry.node, *entry.node->octalCode + 1,
+                                                            packetEnd, packet + MAX_VOXEL_PACKET_SIZE);
+                    
+                    if (cachedBytes == 0) {
+                        cachedBytes = encodeSubtreeToCache(tree, entry, *entry.node->octalCode + 1, subtreeCache,
+                                                           packetEnd, packet + MAX_VOXEL_PACKET_SIZE);
+                    }
+                }
+                
+                if (packetEnd + cachedBytes > packet + MAX_VOXEL_PACKET_SIZE) {
+                    // it leads the next packet whole rather than being split
+                    break;
+                }
+                
+                packetEnd += cachedBytes;
+                
+                std::pop_heap(queue.begin(), queue.end(), lowerPriority);
+                queue.pop_back();
+                
+                if (splitting) {
+                    queueChildren(entry, agentPosition);
+                }
+                
+                continue;
+            }
+        }
+        
+        unsigned char *stopOctalCode = tree->loadBitstreamBuffer(packetEnd,
+                                                                 packet + MAX_VOXEL_PACKET_SIZE,
+                                                                 entry.node,
+                                                                 entry.markerNode,
+                                                                 passPosition,
+                                                                 entry.position,
+                                                                 entry.node->octalCode);
+        
+        if (stopOctalCode != NULL && packetEnd == subtreeStart) {
+            // not even the top of it fit, it leads the next packet
+            break;
+        }
+        
+        std::pop_heap(queue.begin(), queue.end(), lowerPriority);
+        queue.pop_back();
+        
+        if (stopOctalCode == NULL) {
+            // all of it that the agent is close enough for is in, there may be room for the next
+            continue;
+        }
+        
+        // it ran past the end of the packet, what's left of it goes back as its children so each is ranked on its own
+        queueChildren(entry, agentPosition);
+        
+        break;
+    }
+    
+    int packetBytes = 0;
+    
+    if (packetEnd > packet + VOXEL_PACKET_HEADER_BYTES) {
+        streamSender.encodeHeader(packet);
+        
+        packetBytes = packetEnd - packet;
+        byteCredit -= packetBytes;
+        passPackets++;
+    }
+    
+    if (passRunning && queue.empty()) {
+        finishPass();
+    }
+    
+    return packetBytes;
+}
@@ -0,0 +1,126 @@
+//
+//  VoxelPacketScheduler.h
+//  voxel
+//
+//  Copyright (c) 2013 High Fidelity, Inc. All rights reserved.
+//
+
+#ifndef __voxel__VoxelPacketScheduler__
+#define __voxel__VoxelPacketScheduler__
+
+#include <iostream>
+#include <vector>
+#include <stdint.h>
+#include <VoxelTree.h>
+#include <VoxelStream.h>
+#include <ViewFrustum.h>
+#include "MarkerNode.h"
+#include "VoxelSubtreeCache.h"
+
+// what an agent gets sent a second unless it reports loss, and the least it backs off to when it does
+const int VOXEL_DEFAULT_BYTES_PER_SECOND = 100 * 1000;
+const int VOXEL_MIN_BYTES_PER_SECOND = 4 * MAX_VOXEL_PACKET_SIZE;
+
+// credit left over from quiet rounds only builds up this far
+const int VOXEL_MAX_BURST_USECS = 200 * 1000;
+
+// a subtree that has waited this long is worth twice what it was when it was queued
+const int VOXEL_STALENESS_USECS = 2 * 1000 * 1000;
+
+// a subtree this far away is worth half what the same one right next to the agent is
+const float VOXEL_NEAR_DISTANCE = 1.0f;
+
+// what a subtree entirely out of view is worth against the same one in view
+const float VOXEL_OUT_OF_VIEW_WEIGHT = 0.25f;
+
+// a pass whose last packet no receipt has covered after this long is taken as lost and sent again
+const int VOXEL_PASS_CONFIRM_USECS = 1000 * 1000;
+
+// a subtree of the tree still to be sent, and how far into it we are
+struct VoxelSendEntry {
+    VoxelNode *node;
+    MarkerNode *markerNode;
+    float position[3];
+    int64_t queuedUsecs;
+    float priority;
+};
+
+// decides what of the tree one agent is sent next and how much of it
+// the queue starts as the root, a subtree too big for the packet it leads goes back as its children,
+// so the further a part of the tree is from the agent the bigger the pieces it is ranked in
+// packets are filled from the front of the queue while the agent's byte credit lasts
+// a pass only goes down into subtrees edited since the last pass the agent's receipts showed arrived whole,
+// or that the agent has come close enough to for more detail, so an agent with everything is sent nothing
+class VoxelPacketScheduler {
+    public:
+        VoxelPacketScheduler(int maxBytesPerSecond);
+        ~VoxelPacketScheduler();
+        
+        // tops up the credit for the time since the last round and re-ranks the queue from where the agent is
+        // and, with a view frustum, where it's looking, once a pass is out and confirmed it starts the next
+        void startRound(VoxelTree *tree, float *agentPosition, const ViewFrustum *viewFrustum, int64_t nowUsecs);
+        
+        // fills a packet from the front of the queue and returns its bytes, 0 once the credit or the queue runs out
+        // the view frustum the round started with has to last until its packets are encoded
+        // with a subtree cache, subtrees other agents have been sent are copied from it instead of encoded again
+        int encodePacket(VoxelTree *tree, unsigned char *packet, float *agentPosition,
+                         VoxelSubtreeCache *subtreeCache = NULL);
+        
+        void receiveReceipt(const unsigned char *packet, int size) { streamSender.receiveReceipt(packet, size); };
+        
+        int getBytesPerSecond() { return streamSender.getBytesPerSecond(); };
+        int getMaxBytesPerSecond() const { return streamSender.getMaxBytesPerSecond(); };
+        float getLoss() { return streamSender.getLoss(); };
+        int getQueuedSubtrees() { return queue.size(); };
+        
+        // whether the last pass is out and confirmed and nothing has changed since, as of the last round
+        bool isIdle() { return queue.empty() && !awaitingConfirmation; };
+    private:
+        void startPass(VoxelTree *tree, float *agentPosition, int64_t nowUsecs);
+        void finishPass();
+        void commitPass();
+        bool markSentChildren(VoxelNode *node, MarkerNode *markerNode, float *nodePosition);
+        bool sendsChildren(float *agentPosition, VoxelNode *node, float *nodePosition);
+        bool sendsSameChildren(VoxelNode *node, float *nodePosition);
+        
+        // the level below which all of the subtree is sent to an agent there and at which none of it is,
+        // its own level when it isn't sent its children, -1 when it depends on where in the subtree
+        int subtreeDetailLevel(VoxelNode *node, float *nodePosition, float *agentPosition);
+        
+        // encodes the subtree whole into the cache and copies it into buffer if it fits before bufferEnd,
+        // returns its bytes, 0 when there's nothing under it, -1 when it's too big for a packet and has to be split
+        int encodeSubtreeToCache(VoxelTree *tree, VoxelSendEntry &entry, int detailLevel,
+                                 VoxelSubtreeCache *subtreeCache, unsigned char *buffer, unsigned char *bufferEnd);
+        
+        void queueSubtree(VoxelNode *node, MarkerNode *markerNode, float *position, int64_t queuedUsecs);
+        void queueChildren(const VoxelSendEntry &entry, float *agentPosition);
+        float subtreePriority(const VoxelSendEntry &entry, float *agentPosition,
+                              const ViewFrustum *viewFrustum, int64_t nowUsecs);
+        
+        VoxelStreamSender streamSender;
+        
+        MarkerNode *rootMarkerNode;
+        std::vector<VoxelSendEntry> queue;
+        
+        int64_t lastRoundUsecs;
+        const ViewFrustum *roundViewFrustum;
+        int byteCredit;
+        
+        // what the agent is known to have, the tree as of sentVersion with the detail seen from sentPosition
+        bool hasSent;
+        unsigned long sentVersion;
+        float sentPosition[3];
+        
+        // the pass going out or waiting on a receipt, encoded for where the agent was when it started
+        // so what it sends is exactly what that position sees
+        bool passRunning;
+        unsigned long passVersion;
+        float passPosition[3];
+        int passPackets;
+        uint16_t passLastSequence;
+        int passLostPackets;
+        bool awaitingConfirmation;
+        int64_t passSentUsecs;
+};
+
+#endif /* defined(__voxel__VoxelPacketScheduler__) */
@@ -0,0 +1,83 @@
+//
+//  VoxelScene.cpp
+//  voxel
+//
+//  Copyright (c) 2013 High Fidelity, Inc. All rights reserved.
+//
+
+#include <cstdio>
+#include <OctalCode.h>
+#include <SharedUtil.h>
+#include "VoxelScene.h"
+
+void addSphere(VoxelTree * tree,bool random, bool wantColorRandomizer) {
+	float r  = random ? randFloatInRange(0.05,0.1) : 0.25;
+	float xc = random ? randFloatInRange(r,(1-r)) : 0.5;
+	float yc = random ? randFloatInRange(r,(1-r)) : 0.5;
+	float zc = random ? randFloatInRange(r,(1-r)) : 0.5;
+	float s = (1.0/256); // size of voxels to make up surface of sphere
+	bool solid = true;
+
+	printf("adding sphere:");
+	if (random)
+		printf(" random");
+	printf("\nradius=%f\n",r);
+	printf("xc=%f\n",xc);
+	printf("yc=%f\n",yc);
+	printf("zc=%f\n",zc);
+
+	tree->createSphere(r,xc,yc,zc,s,solid,wantColorRandomizer);
+}
+
+void addSphereScene(VoxelTree * tree, bool wantColorRandomizer) {
+	printf("adding scene of spheres...\n");
+	tree->createSphere(0.25,0.5,0.5,0.5,(1.0/256),true,wantColorRandomizer);
+	tree->createSphere(0.030625,0.5,0.5,(0.25-0.06125),(1.0/512),true,true);
+}
+
+
+void randomlyFillVoxelTree(int levelsToGo, VoxelNode *currentRootNode) {
+    // randomly generate children for this node
+    // the first level of the tree (where levelsToGo = MAX_VOXEL_TREE_DEPTH_LEVELS) has all 8
+    if (levelsToGo > 0) {
+        
+        bool createdChildren = false;
+        int colorArray[4] = {};
+        
+        createdChildren = false;
+        
+        for (int i = 0; i < 8; i++) {
+            if (true) {
+                // create a new VoxelNode to put here
+                currentRootNode->children[i] = new VoxelNode();
+                
+                // give this child it's octal code
+                currentRootNode->children[i]->octalCode = childOctalCode(currentRootNode->octalCode, i);
+                
+                randomlyFillVoxelTree(levelsToGo - 1, currentRootNode->children[i]);
+                
+                if (currentRootNode->children[i]->color[3] == 1) {
+                    for (int c = 0; c < 3; c++) {
+                        colorArray[c] += currentRootNode->children[i]->color[c];
+                    }
+                    
+                    colorArray[3]++;
+                }
+                
+                createdChildren = true;
+            }
+        }
+        
+        if (!createdChildren) {
+            // we didn't create any children for this node, making it a leaf
+            // give it a random color
+            currentRootNode->setRandomColor(MIN_BRIGHTNESS);
+        } else {
+            // set the color value for this node
+            currentRootNode->setColorFromAverageOfChildren(colorArray);
+        }
+    } else {
+        // this is a leaf node, just give it a color
+        currentRootNode->setRandomColor(MIN_BRIGHTNESS);
+    }
+}
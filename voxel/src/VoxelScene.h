@@ -0,0 +1,23 @@
+//
+//  VoxelScene.h
+//  voxel
+//
+//  Copyright (c) 2013 High Fidelity, Inc. All rights reserved.
+//
+
+#ifndef __voxel__VoxelScene__
+#define __voxel__VoxelScene__
+
+#include <iostream>
+#include <VoxelTree.h>
+
+// what the voxel server puts in its tree at startup, also the tree voxel-bench sends
+
+const int MIN_BRIGHTNESS = 64;
+const int MAX_VOXEL_TREE_DEPTH_LEVELS = 4;
+
+void addSphere(VoxelTree * tree,bool random, bool wantColorRandomizer);
+void addSphereScene(VoxelTree * tree, bool wantColorRandomizer);
+void randomlyFillVoxelTree(int levelsToGo, VoxelNode *currentRootNode);
+
+#endif /* defined(__voxel__VoxelScene__) */
@@ -0,0 +1,191 @@
+//
+//  VoxelSendPool.cpp
+//  voxel
+//
+//  Copyright (c) 2013 High Fidelity, Inc. All rights reserved.
+//
+
+#include <string.h>
+#include "VoxelSendPool.h"
+#include "VoxelAgentData.h"
+
+VoxelSendPool::VoxelSendPool(VoxelTree *newTree, UDPSocket *newSocket, int newNumWorkers, bool newViewCulling) :
+    subtreeCache(VOXEL_SUBTREE_CACHE_BYTES) {
+    tree = newTree;
+    socket = newSocket;
+    viewCulling = newViewCulling;
+    numWorkers = newNumWorkers;
+    
+    roundAgents = NULL;
+    roundUsecs = 0;
+    nextRoundAgent = 0;
+    roundNumber = 0;
+    workersRunning = 0;
+    stopped = false;
+    
+    pthread_mutex_init(&roundMutex, NULL);
+    pthread_cond_init(&roundStarted, NULL);
+    pthread_cond_init(&roundFinished, NULL);
+    
+    workers = new VoxelSendWorker[numWorkers];
+    
+    for (int w = 0; w < numWorkers; w++) {
+        workers[w].pool = this;
+        workers[w].voxelDatagrams = new UDPDatagram[MAX_BATCH_DATAGRAMS];
+        workers[w].numVoxelDatagrams = 0;
+        workers[w].packetsSent = 0;
+        workers[w].bytesSent = 0;
+    }
+    
+    // worker 0 is whoever calls runRound
+    for (int w = 1; w < numWorkers; w++) {
+        pthread_create(&workers[w].thread, NULL, runWorker, (void *)&workers[w]);
+    }
+}
+
+VoxelSendPool::~VoxelSendPool() {
+    pthread_mutex_lock(&roundMutex);
+    stopped = true;
+    pthread_cond_broadcast(&roundStarted);
+    pthread_mutex_unlock(&roundMutex);
+    
+    for (int w = 1; w < numWorkers; w++) {
+        pthread_join(workers[w].thread, NULL);
+    }
+    
+    for (int w = 0; w < numWorkers; w++) {
+        delete[] workers[w].voxelDatagrams;
+    }
+    
+    delete[] workers;
+    
+    pthread_cond_destroy(&roundFinished);
+    pthread_cond_destroy(&roundStarted);
+    pthread_mutex_destroy(&roundMutex);
+}
+
+void *VoxelSendPool::runWorker(void *args) {
+    VoxelSendWorker *worker = (VoxelSendWorker *)args;
+    VoxelSendPool *pool = worker->pool;
+    
+    int lastRound = 0;
+    
+    pthread_mutex_lock(&pool->roundMutex);
+    
+    while (true) {
+        while (!pool->stopped && pool->roundNumber == lastRound) {
+            pthread_cond_wait(&pool->roundStarted, &pool->roundMutex);
+        }
+        
+        if (pool->stopped) {
+            break;
+        }
+        
+        lastRound = pool->roundNumber;
+        pthread_mutex_unlock(&pool->roundMutex);
+        
+        pool->encodeRoundShare(worker);
+        
+        pthread_mutex_lock(&pool->roundMutex);
+        
+        if (--pool->workersRunning == 0) {
+            pthread_cond_signal(&pool->roundFinished);
+        }
+    }
+    
+    pthread_mutex_unlock(&pool->roundMutex);
+    
+    pthread_exit(0);
+}
+
+void VoxelSendPool::runRound(const std::vector<Agent *> *agents, int64_t newRoundUsecs) {
+    pthread_mutex_lock(&roundMutex);
+    roundAgents = agents;
+    roundUsecs = newRoundUsecs;
+    nextRoundAgent = 0;
+    workersRunning = numWorkers - 1;
+    roundNumber++;
+    pthread_cond_broadcast(&roundStarted);
+    pthread_mutex_unlock(&roundMutex);
+    
+    encodeRoundShare(&workers[0]);
+    
+    // the agents and the tree have to outlive every worker's share of the round
+    pthread_mutex_lock(&roundMutex);
+    
+    while (workersRunning > 0) {
+        pthread_cond_wait(&roundFinished, &roundMutex);
+    }
+    
+    roundAgents = NULL;
+    pthread_mutex_unlock(&roundMutex);
+}
+
+void VoxelSendPool::takeSentCounts(int *packets, int *bytes) {
+    *packets = 0;
+    *bytes = 0;
+    
+    for (int w = 0; w < numWorkers; w++) {
+        *packets += workers[w].packetsSent;
+        *bytes += workers[w].bytesSent;
+        
+        workers[w].packetsSent = 0;
+        workers[w].bytesSent = 0;
+    }
+}
+
+void VoxelSendPool::encodeRoundShare(VoxelSendWorker *worker) {
+    int numAgents = roundAgents->size();
+    
+    for (int i = nextRoundAgent++; i < numAgents; i = nextRoundAgent++) {
+        encodeVoxelsForAgent(worker, (*roundAgents)[i]);
+    }
+    
+    flushDatagrams(worker);
+}
+
+void VoxelSendPool::encodeVoxelsForAgent(VoxelSendWorker *worker, Agent *agent) {
+    VoxelAgentData *agentData = (VoxelAgentData *)(agent->getLinkedData());
+    
+    if (agentData == NULL || !agentData->hasState) {
+        // we haven't heard from this agent yet, nothing to send it
+        return;
+    }
+    
+    ViewFrustum viewFrustum(agentData->position, agentData->yaw, agentData->pitch);
+    
+    VoxelPacketScheduler *packetScheduler = &agentData->packetScheduler;
+    packetScheduler->startRound(tree, agentData->position, viewCulling ? &viewFrustum : NULL, roundUsecs);
+    
+    while (true) {
+        // encode straight into the datagram the batch will send
+        UDPDatagram *voxelDatagram = &worker->voxelDatagrams[worker->numVoxelDatagrams];
+        int packetBytes = packetScheduler->encodePacket(tree, voxelDatagram->data, agentData->position, &subtreeCache);
+        
+        if (packetBytes == 0) {
+            // it has had what it can take this round, or there's nothing left to send it
+            break;
+        }
+        
+        if (socket != NULL) {
+            memcpy(&voxelDatagram->address, agent->getActiveSocket(), sizeof(sockaddr_in));
+        }
+        
+        voxelDatagram->byteLength = packetBytes;
+        
+        worker->packetsSent++;
+        worker->bytesSent += packetBytes;
+        
+        if (++worker->numVoxelDatagrams == MAX_BATCH_DATAGRAMS) {
+            flushDatagrams(worker);
+        }
+    }
+}
+
+void VoxelSendPool::flushDatagrams(VoxelSendWorker *worker) {
+    if (worker->numVoxelDatagrams > 0 && socket != NULL) {
+        socket->sendBatch(worker->voxelDatagrams, worker->numVoxelDatagrams);
+    }
+    
+    worker->numVoxelDatagrams = 0;
+}
@@ -0,0 +1,86 @@
+//
+//  VoxelSendPool.h
+//  voxel
+//
+//  Copyright (c) 2013 High Fidelity, Inc. All rights reserved.
+//
+
+#ifndef __voxel__VoxelSendPool__
+#define __voxel__VoxelSendPool__
+
+#include <iostream>
+#include <vector>
+#include <atomic>
+#include <pthread.h>
+#include <Agent.h>
+#include <UDPSocket.h>
+#include <VoxelTree.h>
+#include "VoxelSubtreeCache.h"
+
+const int MAX_SEND_WORKERS = 64;
+
+// how often a round of voxel packets goes out to every agent
+const int VOXEL_SEND_INTERVAL_USECS = 100 * 1000;
+
+class VoxelSendPool;
+
+// one thread's share of a round, the packets are encoded straight into its own batch of datagrams
+struct VoxelSendWorker {
+    VoxelSendPool *pool;
+    UDPDatagram *voxelDatagrams;
+    int numVoxelDatagrams;
+    int packetsSent;
+    int bytesSent;
+    pthread_t thread;
+};
+
+// encodes a round of voxel packets for every agent across a pool of threads
+// agents are handed out one at a time so a worker that gets a cheap one moves on to the next,
+// and an agent is only ever encoded by one worker a round so its marker nodes need no lock,
+// the subtrees agents have in common are encoded once into a cache all the workers copy from
+// the tree must not change while a round runs, the caller holds off edits until runRound returns
+class VoxelSendPool {
+    public:
+        // with a NULL socket the packets are encoded and dropped, for benchmarking
+        // with view culling each agent gets what it's looking at ahead of the rest of the tree
+        VoxelSendPool(VoxelTree *tree, UDPSocket *socket, int numWorkers, bool viewCulling);
+        ~VoxelSendPool();
+        
+        // encodes and sends this round's packets for the agents, the calling thread works as worker 0
+        // each agent's scheduler gets credit for the time since its last round, up to roundUsecs
+        void runRound(const std::vector<Agent *> *agents, int64_t roundUsecs);
+        
+        int getNumWorkers() { return numWorkers; };
+        
+        // packets and bytes sent since the last call, summed across the workers
+        void takeSentCounts(int *packets, int *bytes);
+        
+        // what the agents' packets are copied from where they share subtrees
+        VoxelSubtreeCache *getSubtreeCache() { return &subtreeCache; };
+    private:
+        static void *runWorker(void *args);
+        void encodeRoundShare(VoxelSendWorker *worker);
+        void encodeVoxelsForAgent(VoxelSendWorker *worker, Agent *agent);
+        void flushDatagrams(VoxelSendWorker *worker);
+        
+        VoxelTree *tree;
+        UDPSocket *socket;
+        bool viewCulling;
+        VoxelSubtreeCache subtreeCache;
+        
+        VoxelSendWorker *workers;
+        int numWorkers;
+        
+        const std::vector<Agent *> *roundAgents;
+        int64_t roundUsecs;
+        std::atomic<int> nextRoundAgent;
+        
+        pthread_mutex_t roundMutex;
+        pthread_cond_t roundStarted;
+        pthread_cond_t roundFinished;
+        int roundNumber;
+        int workersRunning;
+        bool stopped;
+};
+
+#endif /* defined(__voxel__VoxelSendPool__) */
@@ -0,0 +1,109 @@
+//
+//  VoxelSubtreeCache.cpp
+//  voxel
+//
+//  Copyright (c) 2013 High Fidelity, Inc. All rights reserved.
+//
+
+#include <string.h>
+#include "VoxelSubtreeCache.h"
+
+// a level fits in the low byte, the node's address in the rest
+// nodes only go when reaverageVoxelColors collapses them and any made after that carry a newer version,
+// so a subtree cached for an address that's been reused never matches
+static uint64_t subtreeKey(VoxelNode *node, int detailLevel) {
+    return ((uint64_t) node << 8) | (detailLevel & 0xFF);
+}
+
+VoxelSubtreeCache::VoxelSubtreeCache(int newMaxBytes) {
+    maxBytes = newMaxBytes;
+    cachedBytes = 0;
+    numSubtrees = 0;
+    
+    hits = 0;
+    misses = 0;
+    hitBytes = 0;
+    
+    pthread_mutex_init(&subtreesMutex, NULL);
+}
+
+VoxelSubtreeCache::~VoxelSubtreeCache() {
+    pthread_mutex_destroy(&subtreesMutex);
+}
+
+void VoxelSubtreeCache::removeSubtree(CachedSubtreeList::iterator subtree) {
+    cachedBytes -= sizeof(CachedSubtree) + subtree->data.size();
+    numSubtrees--;
+    
+    subtreeIndex.erase(subtree->key);
+    subtrees.erase(subtree);
+}
+
+int VoxelSubtreeCache::copySubtree(VoxelNode *node, int detailLevel, unsigned char *buffer, unsigned char *bufferEnd) {
+    pthread_mutex_lock(&subtreesMutex);
+    
+    CachedSubtreeIndex::iterator indexed = subtreeIndex.find(subtreeKey(node, detailLevel));
+    
+    if (indexed == subtreeIndex.end() || indexed->second->version != node->version) {
+        // the stale one stays until the new encoding replaces it or it's the least recently used
+        pthread_mutex_unlock(&subtreesMutex);
+        misses++;
+        return 0;
+    }
+    
+    CachedSubtreeList::iterator subtree = indexed->second;
+    int subtreeBytes = subtree->data.size();
+    
+    if (subtreeBytes == 0) {
+        subtrees.splice(subtrees.begin(), subtrees, subtree);
+        pthread_mutex_unlock(&subtreesMutex);
+        misses++;
+        return -1;
+    }
+    
+    if (buffer + subtreeBytes <= bufferEnd) {
+        memcpy(buffer, &subtree->data[0], subtreeBytes);
+        subtrees.splice(subtrees.begin(), subtrees, subtree);
+        
+        hits++;
+        hitBytes += subtreeBytes;
+    }
+    
+    pthread_mutex_unlock(&subtreesMutex);
+    
+    return subtreeBytes;
+}
+
+void VoxelSubtreeCache::storeSubtree(VoxelNode *node, int detailLevel, const unsigned char *subtree, int subtreeBytes) {
+    uint64_t key = subtreeKey(node, detailLevel);
+    
+    pthread_mutex_lock(&subtreesMutex);
+    
+    CachedSubtreeIndex::iterator indexed = subtreeIndex.find(key);
+    
+    if (indexed != subtreeIndex.end()) {
+        // another worker got here first, or this one is newer
+        removeSubtree(indexed->second);
+    }
+    
+    subtrees.push_front(CachedSubtree());
+    subtrees.front().key = key;
+    subtrees.front().version = node->version;
+    subtrees.front().data.assign(subtree, subtree + subtreeBytes);
+    
+    subtreeIndex[key] = subtrees.begin();
+    cachedBytes += sizeof(CachedSubtree) + subtreeBytes;
+    numSubtrees++;
+    
+    while (cachedBytes > maxBytes) {
+        removeSubtree(--subtrees.end());
+    }
+    
+    pthread_mutex_unlock(&subtreesMutex);
+}
+
+void VoxelSubtreeCache::takeCounts(int *takenHits, int *takenMisses, int *takenHitBytes) {
+    *takenHits = hits.exchange(0);
+    *takenMisses = misses.exchange(0);
+    *takenHitBytes = hitBytes.exchange(0);
+}
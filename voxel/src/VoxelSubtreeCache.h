@@ -0,0 +1,73 @@
+//
+//  VoxelSubtreeCache.h
+//  voxel
+//
+//  Copyright (c) 2013 High Fidelity, Inc. All rights reserved.
+//
+
+#ifndef __voxel__VoxelSubtreeCache__
+#define __voxel__VoxelSubtreeCache__
+
+#include <iostream>
+#include <vector>
+#include <list>
+#include <unordered_map>
+#include <atomic>
+#include <stdint.h>
+#include <pthread.h>
+#include <VoxelNode.h>
+
+// how much encoded tree the voxel server keeps around for agents close together
+const int VOXEL_SUBTREE_CACHE_BYTES = 16 * 1024 * 1024;
+
+// encoded subtrees kept for the next agent that needs the same one, agents close together are sent
+// the same subtrees down to the same level, so one encoding serves all of them
+// a subtree is keyed by its node and the level its encoding stops at, and holds the version of the node
+// it was encoded from, so an edit under it makes it stale without anything having to find it
+// shared by every send worker, it holds at most maxBytes between its subtrees and their bookkeeping
+// and lets the least recently used go
+class VoxelSubtreeCache {
+    public:
+        VoxelSubtreeCache(int maxBytes);
+        ~VoxelSubtreeCache();
+        
+        // returns the bytes of the subtree encoded from the node as it is now and copies them into buffer
+        // if they fit before bufferEnd, 0 if it isn't cached and -1 if it's known to be too big to be
+        int copySubtree(VoxelNode *node, int detailLevel, unsigned char *buffer, unsigned char *bufferEnd);
+        
+        // keeps an encoding of the node as it is now, in place of any older one,
+        // no bytes notes that it's too big to keep whole
+        void storeSubtree(VoxelNode *node, int detailLevel, const unsigned char *subtree, int subtreeBytes);
+        
+        int getSubtrees() { return numSubtrees; };
+        int getBytes() { return cachedBytes; };
+        
+        // subtrees copied out, looked up and not there, stale or too big, and the bytes copied out, since the last call
+        void takeCounts(int *hits, int *misses, int *hitBytes);
+    private:
+        struct CachedSubtree {
+            uint64_t key;
+            unsigned long version;
+            std::vector<unsigned char> data;
+        };
+        
+        typedef std::list<CachedSubtree> CachedSubtreeList;
+        typedef std::unordered_map<uint64_t, CachedSubtreeList::iterator> CachedSubtreeIndex;
+        
+        void removeSubtree(CachedSubtreeList::iterator subtree);
+        
+        // most recently used first
+        CachedSubtreeList subtrees;
+        CachedSubtreeIndex subtreeIndex;
+        pthread_mutex_t subtreesMutex;
+        
+        int maxBytes;
+        std::atomic<int> cachedBytes;
+        std::atomic<int> numSubtrees;
+        
+        std::atomic<int> hits;
+        std::atomic<int> misses;
+        std::atomic<int> hitBytes;
+};
+
+#endif /* defined(__voxel__VoxelSubtreeCache__) */
@@ -11,11 +11,17 @@
 #include <cstdlib>
 #include <cstring>
 #include <cstdio>
+#include <signal.h>
 #include <OctalCode.h>
 #include <AgentList.h>
 #include <VoxelTree.h>
 #include "VoxelAgentData.h"
+#include "VoxelSendPool.h"
+#include "VoxelScene.h"
 #include <SharedUtil.h>
+#include <EventLoop.h>
+#include <TickScheduler.h>
+#include <MessageFragments.h>
 
 #ifdef _WIN32
 #include "Syssocket.h"
@@ -35,173 +41,151 @@ const int COLOR_VALUES_PER_VOXEL = 3 * VERTICES_PER_VOXEL;
 const int VOXEL_SIZE_BYTES = 3 + (3 * sizeof(float));
 const int VOXELS_PER_PACKET = (MAX_PACKET_SIZE - 1) / VOXEL_SIZE_BYTES;
 
-const int MIN_BRIGHTNESS = 64;
 const float DEATH_STAR_RADIUS = 4.0;
 const float MAX_CUBE = 0.05f;
 
-const int VOXEL_SEND_INTERVAL_USECS = 100 * 1000;
-const int PACKETS_PER_CLIENT_PER_INTERVAL = 2;
+// a round of packets is as good as the one after it, so a late one just lets the ones it missed go
+const TickCatchUp VOXEL_SEND_CATCH_UP = TICK_CATCH_UP_SKIP;
+const int VOXEL_SEND_REPORT_TICKS = 100;
 
-const int MAX_VOXEL_TREE_DEPTH_LEVELS = 4;
+const char SEND_WORKERS_OPTION[] = "--sendWorkers";
+const char NO_VIEW_CULLING_OPTION[] = "--noViewCulling";
+const char VOXEL_BYTES_PER_SECOND_OPTION[] = "--voxelBytesPerSecond";
 
 AgentList agentList('V', VOXEL_LISTEN_PORT);
+EventLoop eventLoop;
 VoxelTree randomTree;
 
-void addSphere(VoxelTree * tree,bool random, bool wantColorRandomizer) {
-	float r  = random ? randFloatInRange(0.05,0.1) : 0.25;
-	float xc = random ? randFloatInRange(r,(1-r)) : 0.5;
-	float yc = random ? randFloatInRange(r,(1-r)) : 0.5;
-	float zc = random ? randFloatInRange(r,(1-r)) : 0.5;
-	float s = (1.0/256); // size of voxels to make up surface of sphere
-	bool solid = true;
+// the send workers hold this for reading through a round, edits to the tree wait for it
+pthread_rwlock_t treeLock = PTHREAD_RWLOCK_INITIALIZER;
+int numSendWorkers = 1;
+bool viewCulling = true;
+int voxelBytesPerSecond = VOXEL_DEFAULT_BYTES_PER_SECOND;
 
-	printf("adding sphere:");
-	if (random)
-		printf(" random");
-	printf("\nradius=%f\n",r);
-	printf("xc=%f\n",xc);
-	printf("yc=%f\n",yc);
-	printf("zc=%f\n",zc);
+UDPDatagram *receivedDatagrams;
 
-	tree->createSphere(r,xc,yc,zc,s,solid,wantColorRandomizer);
+void *distributeVoxelsToListeners(void *args) {
+    
+    TickScheduler sendTicks("Voxel send", VOXEL_SEND_INTERVAL_USECS * 1000, VOXEL_SEND_CATCH_UP);
+    int ticksSinceReport = 0;
+    
+    VoxelSendPool sendPool(&randomTree, &agentList.getAgentSocket(), numSendWorkers, viewCulling);
+    
+    unsigned int readEpoch;
+    
+    while (!eventLoop.isStopped()) {
+        sendTicks.waitForNextTick();
+        
+        // the snapshot keeps the agents alive while we send, even if they go silent
+        const AgentSnapshot *agents = agentList.beginSnapshotRead(&readEpoch);
+        
+        // edits wait for the round, the workers read the tree without locks of their own
+        pthread_rwlock_rdlock(&treeLock);
+        sendPool.runRound(agents, monotonicNsecsNow() / 1000);
+        pthread_rwlock_unlock(&treeLock);
+        
+        agentList.endSnapshotRead(readEpoch);
+        
+        if (++ticksSinceReport == VOXEL_SEND_REPORT_TICKS) {
+            int packetsSent, bytesSent;
+            sendPool.takeSentCounts(&packetsSent, &bytesSent);
+            
+            printf("Sent %d voxel packets, %d bytes on %d workers.\n", packetsSent, bytesSent, sendPool.getNumWorkers());
+            
+            VoxelSubtreeCache *subtreeCache = sendPool.getSubtreeCache();
+            int cacheHits, cacheMisses, cacheHitBytes;
+            subtreeCache->takeCounts(&cacheHits, &cacheMisses, &cacheHitBytes);
+            
+            printf("Copied %d of %d cacheable subtrees, %d bytes, from the %d cached in %d bytes.\n",
+                   cacheHits, cacheHits + cacheMisses, cacheHitBytes,
+                   subtreeCache->getSubtrees(), subtreeCache->getBytes());
+            sendTicks.printReport();
+            ticksSinceReport = 0;
+        }
+    }
+    
+    pthread_exit(0);
 }
 
-void addSphereScene(VoxelTree * tree, bool wantColorRandomizer) {
-	printf("adding scene of spheres...\n");
-	tree->createSphere(0.25,0.5,0.5,0.5,(1.0/256),true,wantColorRandomizer);
-	tree->createSphere(0.030625,0.5,0.5,(0.25-0.06125),(1.0/512),true,true);
+void attachVoxelAgentDataToAgent(Agent *newAgent) {
+    if (newAgent->getLinkedData() == NULL) {
+        newAgent->setLinkedData(new VoxelAgentData(voxelBytesPerSecond));
+    }
 }
 
 
-void randomlyFillVoxelTree(int levelsToGo, VoxelNode *currentRootNode) {
-    // randomly generate children for this node
-    // the first level of the tree (where levelsToGo = MAX_VOXEL_TREE_DEPTH_LEVELS) has all 8
-    if (levelsToGo > 0) {
+// handle voxel edits and head data sent to us by agents
+// edits too big for one packet come in fragments, we hold a few of them at once while the rest arrive
+const int VOXEL_REASSEMBLY_MAX_MESSAGES = 8;
+const int VOXEL_REASSEMBLY_MAX_BYTES = 8 * 1024 * 1024;
+const int VOXEL_REASSEMBLY_TIMEOUT_USECS = 2 * 1000000;
 
-        bool createdChildren = false;
-        int colorArray[4] = {};
-        
-        createdChildren = false;
-        
-        for (int i = 0; i < 8; i++) {
-            if (true) {
-                // create a new VoxelNode to put here
-                currentRootNode->children[i] = new VoxelNode();
-                
-                // give this child it's octal code
-                currentRootNode->children[i]->octalCode = childOctalCode(currentRootNode->octalCode, i);
-                
-                randomlyFillVoxelTree(levelsToGo - 1, currentRootNode->children[i]);
+MessageReassembler voxelMessageReassembler(VOXEL_REASSEMBLY_MAX_MESSAGES,
+                                           VOXEL_REASSEMBLY_MAX_BYTES,
+                                           VOXEL_REASSEMBLY_TIMEOUT_USECS);
 
-                if (currentRootNode->children[i]->color[3] == 1) {
-                    for (int c = 0; c < 3; c++) {
-                        colorArray[c] += currentRootNode->children[i]->color[c];
-                    }
-                    
-                    colorArray[3]++;
-                }
-                
-                createdChildren = true;
+void processVoxelRequest(sockaddr *agentPublicAddress, char *packetData, ssize_t receivedBytes) {
+	// XXXBHG: Hacked in support for 'I' insert command
+    if (packetData[0] == 'I') {
+        // wait out the send round, it reads the tree without locking each node
+        pthread_rwlock_wrlock(&treeLock);
+    	unsigned short int itemNumber = (*((unsigned short int*)&packetData[1]));
+    	printf("got I command from client receivedBytes=%ld itemNumber=%d\n",receivedBytes,itemNumber);
+    	int atByte = 3;
+    	unsigned char* pVoxelData = (unsigned char*)&packetData[3];
+    	while (atByte < receivedBytes) {
+    		unsigned char octets = (unsigned char)*pVoxelData;
+    		int voxelDataSize = bytesRequiredForCodeLength(octets)+3; // 3 for color!
+            if (atByte + voxelDataSize > receivedBytes) {
+                // a voxel cut short, from a bad packet or one that lost its end
+                printf("voxel at byte %d runs past the end of the %ld byte insert, dropping the rest\n", atByte, receivedBytes);
+                break;
             }
-        }
+		            randomTree.readCodeColorBufferToTree(pVoxelData);
+	            	//printf("readCodeColorBufferToTree() of size=%d  atByte=%d receivedBytes=%ld\n",voxelDataSize,atByte,receivedBytes);
+    		// skip to next
+    		pVoxelData+=voxelDataSize;
+    		atByte+=voxelDataSize;
+    	}
+        pthread_rwlock_unlock(&treeLock);
+    }
+    if (packetData[0] == VOXEL_RECEIPT_PACKET_HEADER) {
+        // what an agent has had of its voxels, its scheduler sends faster or slower by it
+        agentList.updateAgentWithData(agentPublicAddress, (void *)packetData, receivedBytes);
+    }
+    if (packetData[0] == 'H' || packetData[0] == AVATAR_UPDATE_PACKET_HEADER) {
+        // whole or delta, it's the same agent
+        agentList.addOrUpdateAgent(agentPublicAddress, agentPublicAddress, 'H');
         
-        if (!createdChildren) {
-            // we didn't create any children for this node, making it a leaf
-            // give it a random color
-            currentRootNode->setRandomColor(MIN_BRIGHTNESS);
-        } else {
-            // set the color value for this node
-            currentRootNode->setColorFromAverageOfChildren(colorArray);
-        }
-    } else {
-        // this is a leaf node, just give it a color
-        currentRootNode->setRandomColor(MIN_BRIGHTNESS);
+        agentList.updateAgentWithData(agentPublicAddress, (void *)packetData, receivedBytes);
     }
 }
 
-void *distributeVoxelsToListeners(void *args) {
-    
-    timeval lastSendTime;
-    
-    unsigned char *stopOctal;
-    int packetCount;
-    
-    int totalBytesSent;
-    
-    unsigned char *voxelPacket = new unsigned char[MAX_VOXEL_PACKET_SIZE];
-    unsigned char *voxelPacketEnd;
+void receiveVoxelRequests(void *args) {
+    int numReceived = agentList.getAgentSocket().receiveBatch(receivedDatagrams, MAX_BATCH_DATAGRAMS);
     
-    float treeRoot[3] = {0, 0, 0};
-    
-    while (true) {
-        gettimeofday(&lastSendTime, NULL);
+    for (int d = 0; d < numReceived; d++) {
+        sockaddr *agentPublicAddress = (sockaddr *) &receivedDatagrams[d].address;
+        char *packetData = (char *) receivedDatagrams[d].data;
+        ssize_t receivedBytes = receivedDatagrams[d].byteLength;
         
-        // enumerate the agents to send 3 packets to each
-        for (int i = 0; i < agentList.getAgents().size(); i++) {
-            
-            Agent *thisAgent = (Agent *)&agentList.getAgents()[i];
-            VoxelAgentData *agentData = (VoxelAgentData *)(thisAgent->getLinkedData());
-            
-            // lock this agent's delete mutex so that the delete thread doesn't
-            // kill the agent while we are working with it
-            pthread_mutex_lock(&thisAgent->deleteMutex);
+        if (packetData[0] == MESSAGE_FRAGMENT_PACKET_HEADER) {
+            std::vector<unsigned char> message;
             
-            stopOctal = NULL;
-            packetCount = 0;
-            totalBytesSent = 0;
-            randomTree.leavesWrittenToBitstream = 0;
-            
-            for (int j = 0; j < PACKETS_PER_CLIENT_PER_INTERVAL; j++) {
-                voxelPacketEnd = voxelPacket;
-                stopOctal = randomTree.loadBitstreamBuffer(voxelPacketEnd,
-                                                           randomTree.rootNode,
-                                                           agentData->rootMarkerNode,
-                                                           agentData->position,
-                                                           treeRoot,
-                                                           stopOctal);
-                
-                agentList.getAgentSocket().send(thisAgent->getActiveSocket(), voxelPacket, voxelPacketEnd - voxelPacket);
-                
-                packetCount++;
-                totalBytesSent += voxelPacketEnd - voxelPacket;
-                
-                if (agentData->rootMarkerNode->childrenVisitedMask == 255) {
-                    break;
-                }
+            if (voxelMessageReassembler.addFragment(agentPublicAddress, (unsigned char *) packetData, receivedBytes, message) > 0
+                && message[0] != MESSAGE_FRAGMENT_PACKET_HEADER) {
+                processVoxelRequest(agentPublicAddress, (char *) &message[0], message.size());
             }
-            
-            // for any agent that has a root marker node with 8 visited children
-            // recursively delete its marker nodes so we can revisit
-            if (agentData->rootMarkerNode->childrenVisitedMask == 255) {
-                delete agentData->rootMarkerNode;
-                agentData->rootMarkerNode = new MarkerNode();
-            }
-            
-            // unlock the delete mutex so the other thread can
-            // kill the agent if it has dissapeared
-            pthread_mutex_unlock(&thisAgent->deleteMutex);
-        }
-        
-        // dynamically sleep until we need to fire off the next set of voxels
-        double usecToSleep =  VOXEL_SEND_INTERVAL_USECS - (usecTimestampNow() - usecTimestamp(&lastSendTime));
-        
-        if (usecToSleep > 0) {
-            usleep(usecToSleep);
         } else {
-            std::cout << "Last send took too much time, not sleeping!\n";
+            processVoxelRequest(agentPublicAddress, packetData, receivedBytes);
         }
     }
-    
-    pthread_exit(0);
 }
 
-void attachVoxelAgentDataToAgent(Agent *newAgent) {
-    if (newAgent->getLinkedData() == NULL) {
-        newAgent->setLinkedData(new VoxelAgentData());
-    }
+void stopVoxelServer(int signal) {
+    eventLoop.stop();
 }
 
-
 int main(int argc, const char * argv[])
 {
     setvbuf(stdout, NULL, _IOLBF, 0);
@@ -216,8 +200,8 @@ int main(int argc, const char * argv[])
     }
 
     agentList.linkedDataCreateCallback = &attachVoxelAgentDataToAgent;
-    agentList.startSilentAgentRemovalThread();
-    agentList.startDomainServerCheckInThread();
+    agentList.addSilentAgentRemovalTimer(eventLoop);
+    agentList.addDomainServerCheckInTimer(eventLoop);
     
     srand((unsigned)time(0));
     
@@ -255,47 +239,39 @@ int main(int argc, const char * argv[])
 		addSphereScene(&randomTree,wantColorRandomizer);
     }
     
+    if (cmdOptionExists(argc, argv, NO_VIEW_CULLING_OPTION)) {
+        viewCulling = false;
+        printf("Sending voxels without regard to where agents are looking.\n");
+    }
+    
+    const char *voxelBytesPerSecondOption = getCmdOption(argc, argv, VOXEL_BYTES_PER_SECOND_OPTION);
+    
+    if (voxelBytesPerSecondOption) {
+        voxelBytesPerSecond = std::max(VOXEL_MIN_BYTES_PER_SECOND, atoi(voxelBytesPerSecondOption));
+        printf("Sending each agent up to %d bytes of voxels a second.\n", voxelBytesPerSecond);
+    }
+    
+    const char *sendWorkersOption = getCmdOption(argc, argv, SEND_WORKERS_OPTION);
+    
+    if (sendWorkersOption) {
+        numSendWorkers = std::max(1, std::min(MAX_SEND_WORKERS, atoi(sendWorkersOption)));
+        printf("Encoding voxels on %d workers.\n", numSendWorkers);
+    }
+    
     pthread_t sendVoxelThread;
     pthread_create(&sendVoxelThread, NULL, distributeVoxelsToListeners, NULL);
     
-    sockaddr agentPublicAddress;
+    receivedDatagrams = new UDPDatagram[MAX_BATCH_DATAGRAMS];
+    eventLoop.addSocket(agentList.getAgentSocket(), receiveVoxelRequests, NULL);
     
-    char *packetData = new char[MAX_PACKET_SIZE];
-    ssize_t receivedBytes;
-
-    // loop to send to agents requesting data
-    while (true) {
-        if (agentList.getAgentSocket().receive(&agentPublicAddress, packetData, &receivedBytes)) {
-        	// XXXBHG: Hacked in support for 'I' insert command
-            if (packetData[0] == 'I') {
-            	unsigned short int itemNumber = (*((unsigned short int*)&packetData[1]));
-            	printf("got I command from client receivedBytes=%ld itemNumber=%d\n",receivedBytes,itemNumber);
-            	int atByte = 3;
-            	unsigned char* pVoxelData = (unsigned char*)&packetData[3];
-            	while (atByte < receivedBytes) {
-            		unsigned char octets = (unsigned char)*pVoxelData;
-            		int voxelDataSize = bytesRequiredForCodeLength(octets)+3; // 3 for color!
-		            randomTree.readCodeColorBufferToTree(pVoxelData);
-	            	//printf("readCodeColorBufferToTree() of size=%d  atByte=%d receivedBytes=%ld\n",voxelDataSize,atByte,receivedBytes);
-            		// skip to next
-            		pVoxelData+=voxelDataSize;
-            		atByte+=voxelDataSize;
-            	}
-            }
-            if (packetData[0] == 'H') {
-                if (agentList.addOrUpdateAgent(&agentPublicAddress,
-                                               &agentPublicAddress,
-                                               packetData[0],
-                                               agentList.getLastAgentId())) {
-                    agentList.increaseAgentId();
-                }
-                
-                agentList.updateAgentWithData(&agentPublicAddress, (void *)packetData, receivedBytes);
-            }
-        }
-    }
+    signal(SIGINT, stopVoxelServer);
+    signal(SIGTERM, stopVoxelServer);
+    
+    eventLoop.run();
     
     pthread_join(sendVoxelThread, NULL);
+    
+    delete[] receivedDatagrams;
 
     return 0;
 }
\ No newline at end of file